@@ -14,6 +14,7 @@
 #include <sys/queue.h>
 
 #include <kos/fs.h>
+#include <kos/fs_dcache.h>
 #include <kos/mutex.h>
 #include <kos/dbglog.h>
 
@@ -241,7 +242,7 @@ static int fs_ext2_close(void *h) {
     return 0;
 }
 
-static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
+static ssize_t ext2_read_unlocked(void *h, void *buf, size_t cnt) {
     file_t fd = ((file_t)h) - 1;
     ext2_fs_t *fs;
     uint32_t bs, lbs, bo;
@@ -251,11 +252,8 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
     uint64_t sz;
     int mode;
 
-    mutex_lock(&ext2_mutex);
-
     /* Check that the fd is valid */
     if(fd >= MAX_EXT2_FILES || !fh[fd].inode_num) {
-        mutex_unlock(&ext2_mutex);
         errno = EBADF;
         return -1;
     }
@@ -263,20 +261,21 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
     /* Make sure the fd is open for reading */
     mode = fh[fd].mode & O_MODE_MASK;
     if(mode != O_RDONLY && mode != O_RDWR) {
-        mutex_unlock(&ext2_mutex);
         errno = EBADF;
         return -1;
     }
 
     /* Make sure we're not trying to read a directory with read */
     if(fh[fd].mode & O_DIR) {
-        mutex_unlock(&ext2_mutex);
         errno = EISDIR;
         return -1;
     }
 
     /* Do we have enough left? */
     sz = ext2_inode_size(fh[fd].inode);
+    if(fh[fd].ptr >= sz)
+        return 0;
+
     if((fh[fd].ptr + cnt) > sz)
         cnt = sz - fh[fd].ptr;
 
@@ -290,7 +289,6 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
     if(bo) {
         if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
                                            NULL, &errno))) {
-            mutex_unlock(&ext2_mutex);
             return -1;
         }
 
@@ -311,7 +309,6 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
     while(cnt) {
         if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
                                            NULL, &errno))) {
-            mutex_unlock(&ext2_mutex);
             return -1;
         }
 
@@ -328,12 +325,11 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
         }
     }
 
-    /* We're done, clean up and return. */
-    mutex_unlock(&ext2_mutex);
+    /* We're done, return. */
     return rv;
 }
 
-static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
+static ssize_t ext2_write_unlocked(void *h, const void *buf, size_t cnt) {
     file_t fd = ((file_t)h) - 1;
     ext2_fs_t *fs;
     uint32_t bs, lbs, bo, bn;
@@ -343,11 +339,8 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
     uint64_t sz;
     int err, mode;
 
-    mutex_lock(&ext2_mutex);
-
     /* Check that the fd is valid */
     if(fd >= MAX_EXT2_FILES || !fh[fd].inode_num) {
-        mutex_unlock(&ext2_mutex);
         errno = EBADF;
         return -1;
     }
@@ -355,7 +348,6 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
     /* Make sure the fd is open for writing */
     mode = fh[fd].mode & O_MODE_MASK;
     if(mode != O_WRONLY && mode != O_RDWR) {
-        mutex_unlock(&ext2_mutex);
         errno = EBADF;
         return -1;
     }
@@ -379,7 +371,6 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
             if(!(block = ext2_inode_read_block(fs, fh[fd].inode,
                                                (fh[fd].ptr - 1) >> lbs, &bn,
                                                &errno))) {
-                mutex_unlock(&ext2_mutex);
                 return -1;
             }
 
@@ -393,7 +384,6 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
                 if(!(block = ext2_inode_read_block(fs, fh[fd].inode,
                                                    (sz - 1) >> lbs,
                                                    &bn, &errno))) {
-                    mutex_unlock(&ext2_mutex);
                     return -1;
                 }
 
@@ -407,7 +397,6 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
             while(sz < fh[fd].ptr) {
                 if(!(block = ext2_inode_alloc_block(fs, fh[fd].inode,
                                                     sz >> lbs, &errno))) {
-                    mutex_unlock(&ext2_mutex);
                     return -1;
                 }
 
@@ -423,7 +412,6 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
     if((bo = fh[fd].ptr & ((1 << lbs) - 1))) {
         if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
                                            &bn, &errno))) {
-            mutex_unlock(&ext2_mutex);
             return -1;
         }
 
@@ -447,14 +435,12 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
         if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
                                            &bn, &err))) {
             if(err != EINVAL) {
-                mutex_unlock(&ext2_mutex);
                 errno = err;
                 return -1;
             }
 
             if(!(block = ext2_inode_alloc_block(fs, fh[fd].inode,
                                                 fh[fd].ptr >> lbs, &errno))) {
-                mutex_unlock(&ext2_mutex);
                 return -1;
             }
         }
@@ -482,10 +468,124 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
     fh[fd].inode->i_mtime = time(NULL);
     ext2_inode_mark_dirty(fh[fd].inode);
 
+    return rv;
+}
+
+static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
+    ssize_t rv;
+
+    mutex_lock(&ext2_mutex);
+    rv = ext2_read_unlocked(h, buf, cnt);
     mutex_unlock(&ext2_mutex);
+
     return rv;
 }
 
+static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
+    ssize_t rv;
+
+    mutex_lock(&ext2_mutex);
+    rv = ext2_write_unlocked(h, buf, cnt);
+    mutex_unlock(&ext2_mutex);
+
+    return rv;
+}
+
+static ssize_t fs_ext2_readv(void *h, const struct iovec *iov, int iovcnt) {
+    ssize_t rv, total = 0;
+    int i;
+
+    mutex_lock(&ext2_mutex);
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(!iov[i].iov_len)
+            continue;
+
+        if((rv = ext2_read_unlocked(h, iov[i].iov_base, iov[i].iov_len)) < 0) {
+            if(!total)
+                total = -1;
+
+            break;
+        }
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    mutex_unlock(&ext2_mutex);
+    return total;
+}
+
+static ssize_t fs_ext2_writev(void *h, const struct iovec *iov, int iovcnt) {
+    ssize_t rv, total = 0;
+    int i;
+
+    mutex_lock(&ext2_mutex);
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(!iov[i].iov_len)
+            continue;
+
+        if((rv = ext2_write_unlocked(h, iov[i].iov_base,
+                                     iov[i].iov_len)) < 0) {
+            if(!total)
+                total = -1;
+
+            break;
+        }
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    mutex_unlock(&ext2_mutex);
+    return total;
+}
+
+/* Positioned I/O just points the handle at the requested offset for the
+   duration of the call. A file opened with O_APPEND is still written at its
+   end, as with write(). */
+static ssize_t ext2_rw_at(void *h, void *buf, size_t cnt, off_t offset,
+                          int write) {
+    file_t fd = ((file_t)h) - 1;
+    uint64_t ptr;
+    ssize_t rv;
+
+    mutex_lock(&ext2_mutex);
+
+    if(fd >= MAX_EXT2_FILES || !fh[fd].inode_num) {
+        mutex_unlock(&ext2_mutex);
+        errno = EBADF;
+        return -1;
+    }
+
+    ptr = fh[fd].ptr;
+    fh[fd].ptr = (uint64_t)offset;
+
+    if(write)
+        rv = ext2_write_unlocked(h, buf, cnt);
+    else
+        rv = ext2_read_unlocked(h, buf, cnt);
+
+    fh[fd].ptr = ptr;
+
+    mutex_unlock(&ext2_mutex);
+    return rv;
+}
+
+static ssize_t fs_ext2_pread(void *h, void *buf, size_t cnt, off_t offset) {
+    return ext2_rw_at(h, buf, cnt, offset, 0);
+}
+
+static ssize_t fs_ext2_pwrite(void *h, const void *buf, size_t cnt,
+                              off_t offset) {
+    return ext2_rw_at(h, (void *)buf, cnt, offset, 1);
+}
+
 static _off64_t fs_ext2_seek64(void *h, _off64_t offset, int whence) {
     file_t fd = ((file_t)h) - 1;
     off_t rv;
@@ -1882,7 +1982,7 @@ static vfs_handler_t vh = {
         NMMGR_LIST_INIT         /* list */
     },
 
-    0, NULL,                    /* no cacheing, privdata */
+    VFS_CACHE_DENTRIES, NULL,   /* dentry cache, privdata */
 
     fs_ext2_open,               /* open */
     fs_ext2_close,              /* close */
@@ -1909,7 +2009,13 @@ static vfs_handler_t vh = {
     fs_ext2_total64,            /* total64 */
     fs_ext2_readlink,           /* readlink */
     fs_ext2_rewinddir,          /* rewinddir */
-    fs_ext2_fstat               /* fstat */
+    fs_ext2_fstat,              /* fstat */
+    NULL,                       /* aio_submit */
+    NULL,                       /* aio_cancel */
+    fs_ext2_readv,              /* readv */
+    fs_ext2_writev,             /* writev */
+    fs_ext2_pread,              /* pread */
+    fs_ext2_pwrite              /* pwrite */
 };
 
 static int initted = 0;
@@ -1998,6 +2104,7 @@ int fs_ext2_unmount(const char *mp) {
 
         /* XXXX: We should probably do something with open files... */
         nmmgr_handler_remove(&i->vfsh->nmmgr);
+        fs_dcache_invalidate(i->vfsh, NULL);
         ext2_fs_shutdown(i->fs);
         free(i->vfsh);
         free(i);
@@ -2063,6 +2170,7 @@ int fs_ext2_shutdown(void) {
 
         /* XXXX: We should probably do something with open files... */
         nmmgr_handler_remove(&i->vfsh->nmmgr);
+        fs_dcache_invalidate(i->vfsh, NULL);
         ext2_fs_shutdown(i->fs);
         free(i->vfsh);
         free(i);
@@ -952,7 +952,8 @@ static int fat_get_free_dentry(fat_fs_t *fs, uint32_t cluster, uint32_t *rcl,
        Attempt to allocate a new cluster, clear it out, and return a pointer to
        the beginning of it. */
 alloc_another:
-    if((j = fat_allocate_cluster(fs, &err)) == FAT_INVALID_CLUSTER) {
+    if((j = fat_allocate_cluster_near(fs, old + 1, &err)) ==
+       FAT_INVALID_CLUSTER) {
         dbglog(DBG_ERROR, "Error allocating directory cluster: %s\n",
                strerror(err));
         *rv = NULL;
@@ -14,28 +14,31 @@
 #include "fatfs.h"
 #include "fatinternal.h"
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
+/* This is basically the same as bgrad_cache from fs_iso9660. Only used on the
+   FAT cache, which has its own size. */
 static void make_mru(fat_fs_t *fs, fat_cache_t **cache, int block) {
     int i;
     fat_cache_t *tmp;
 
     /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
+    if(block < 0 || block >= fs->fcache_size - 1)
         return;
 
     /* Make a copy and scoot everything down */
     tmp = cache[block];
 
-    for(i = block; i < fs->cache_size - 1; ++i) {
+    for(i = block; i < fs->fcache_size - 1; ++i) {
         cache[i] = cache[i + 1];
     }
 
-    cache[fs->cache_size - 1] = tmp;
+    cache[fs->fcache_size - 1] = tmp;
 }
 
 
+/* bn is the block's number on the device, so the first FAT starts at the end
+   of the reserved sectors. */
 static int fat_fatblock_read_nc(fat_fs_t *fs, uint32_t bn, uint8_t *rv) {
-    if(fs->sb.fat_size <= bn)
+    if(bn - fs->sb.reserved_sectors >= fs->sb.fat_size)
         return -EINVAL;
 
     if(fs->dev->read_blocks(fs->dev, bn, 1, rv))
@@ -46,7 +49,7 @@ static int fat_fatblock_read_nc(fat_fs_t *fs, uint32_t bn, uint8_t *rv) {
 
 static int fat_fatblock_write_nc(fat_fs_t *fs, uint32_t bn,
                                  const uint8_t *blk) {
-    if(fs->sb.fat_size <= bn)
+    if(bn - fs->sb.reserved_sectors >= fs->sb.fat_size)
         return -EINVAL;
 
     if(fs->dev->write_blocks(fs->dev, bn, 1, blk))
@@ -139,6 +142,104 @@ int fat_fatblock_cache_wb(fat_fs_t *fs) {
     return 0;
 }
 
+static int fat_entry_free(fat_fs_t *fs, uint32_t val) {
+    if(fs->sb.fs_type == FAT_FS_FAT32)
+        return !(val & 0x0FFFFFFF);
+    else
+        return !val;
+}
+
+/* Read a FAT entry, returning 0 or an errno value. Unlike with fat_read_fat()
+   on its own, a FAT32 entry that happens to have all 32 bits set isn't taken
+   for an error. */
+static int fat_read_entry(fat_fs_t *fs, uint32_t cl, uint32_t *val) {
+    int err = 0;
+
+    if((*val = fat_read_fat(fs, cl, &err)) == FAT_INVALID_CLUSTER && err)
+        return err;
+
+    return 0;
+}
+
+/* Set up the free cluster counts. The groups line up with the FAT blocks on
+   FAT16 and FAT32, so counting a group reads one block. FAT12 volumes are
+   small enough that their whole FAT is a handful of blocks. */
+static int fat_init_groups(fat_fs_t *fs) {
+    uint32_t i, shift = 0;
+
+    switch(fs->sb.fs_type) {
+        case FAT_FS_FAT32:
+            for(i = fs->sb.bytes_per_sector >> 2; i > 1; i >>= 1)
+                ++shift;
+            break;
+
+        case FAT_FS_FAT16:
+            for(i = fs->sb.bytes_per_sector >> 1; i > 1; i >>= 1)
+                ++shift;
+            break;
+
+        default:
+            shift = 10;
+            break;
+    }
+
+    fs->group_shift = shift;
+    fs->group_count = ((fs->sb.num_clusters + 2) >> shift) + 1;
+
+    if(!(fs->free_groups = (uint16_t *)malloc(fs->group_count *
+                                              sizeof(uint16_t))))
+        return -ENOMEM;
+
+    memset(fs->free_groups, 0xFF, fs->group_count * sizeof(uint16_t));
+    return 0;
+}
+
+/* Count the free clusters in a group that hasn't been counted yet. */
+static int fat_count_group(fat_fs_t *fs, uint32_t g) {
+    uint32_t cl, end, val;
+    uint16_t ct = 0;
+    int err;
+
+    cl = g << fs->group_shift;
+    end = cl + (1 << fs->group_shift);
+
+    if(cl < 2)
+        cl = 2;
+
+    if(end > fs->sb.num_clusters + 2)
+        end = fs->sb.num_clusters + 2;
+
+    for(; cl < end; ++cl) {
+        if((err = fat_read_entry(fs, cl, &val)))
+            return -err;
+
+        if(fat_entry_free(fs, val))
+            ++ct;
+    }
+
+    fs->free_groups[g] = ct;
+    return 0;
+}
+
+/* Keep the free cluster counts up to date as the FAT changes. */
+static void fat_update_groups(fat_fs_t *fs, uint32_t cl, uint32_t old,
+                              uint32_t val) {
+    uint16_t *ct;
+
+    if(cl < 2 || cl >= fs->sb.num_clusters + 2)
+        return;
+
+    ct = &fs->free_groups[cl >> fs->group_shift];
+
+    if(*ct == FAT_GROUP_UNCOUNTED)
+        return;
+
+    if(fat_entry_free(fs, old) && !fat_entry_free(fs, val))
+        --*ct;
+    else if(!fat_entry_free(fs, old) && fat_entry_free(fs, val))
+        ++*ct;
+}
+
 uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err) {
     uint32_t sn, off, val;
     const uint8_t *blk, *blk2;
@@ -156,7 +257,7 @@ uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err) {
                 return FAT_INVALID_CLUSTER;
 
             val = blk[off] | (blk[off + 1] << 8) | (blk[off + 2] << 16) |
-                (blk[off + 3] << 24);
+                ((uint32_t)blk[off + 3] << 24);
             break;
 
         case FAT_FS_FAT16:
@@ -214,7 +315,7 @@ uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err) {
 }
 
 int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
-    uint32_t sn, off;
+    uint32_t sn, off, old;
     uint8_t *blk, *blk2;
     int err;
 
@@ -222,6 +323,14 @@ int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
         return -EROFS;
 
+    /* Once allocations have started, see if this frees or takes a cluster. */
+    if(fs->free_groups) {
+        if((err = fat_read_entry(fs, cl, &old)))
+            return -err;
+
+        fat_update_groups(fs, cl, old, val);
+    }
+
     /* Figure out what sector the value is on... */
     switch(fs->sb.fs_type) {
         case FAT_FS_FAT32:
@@ -327,10 +436,12 @@ int fat_is_eof(fat_fs_t *fs, uint32_t cl) {
 }
 
 uint32_t fat_allocate_cluster(fat_fs_t *fs, int *err) {
-    uint32_t sn, off, val;
-    uint8_t *blk;
-    uint32_t cl, i, cps, last;
-    int tries = 1;
+    return fat_allocate_cluster_near(fs, fs->sb.last_alloc_cluster + 1, err);
+}
+
+uint32_t fat_allocate_cluster_near(fat_fs_t *fs, uint32_t goal, int *err) {
+    uint32_t g, g0, n, cl, end, val, last;
+    int rv;
 
     /* Don't let us write to the FAT if we're on a read-only FS. */
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW)) {
@@ -338,158 +449,66 @@ uint32_t fat_allocate_cluster(fat_fs_t *fs, int *err) {
         return FAT_INVALID_CLUSTER;
     }
 
-    i = fs->sb.last_alloc_cluster + 1;
-    last = fs->sb.num_clusters + 2;
-
-    /* Search for a free cluster in the FAT...
-       There are optimized versions here for FAT32 and FAT16. Perhaps I'll write
-       one for FAT12 at some point too... */
-    switch(fs->sb.fs_type) {
-        case FAT_FS_FAT32:
-retry_fat32:
-            cps = (fs->sb.bytes_per_sector >> 2) - 1;
-            cl = i << 2;
-            sn = fs->sb.reserved_sectors + (cl / fs->sb.bytes_per_sector);
-
-            if(!(blk = fat_read_fatblock(fs, sn, err)))
-                return FAT_INVALID_CLUSTER;
-
-            while(i < last) {
-                off = cl & (fs->sb.bytes_per_sector - 1);
-                val = blk[off] | (blk[off + 1] << 8) | (blk[off + 2] << 16) |
-                    (blk[off + 3] << 24);
-
-                /* Did we find a free cluster? */
-                if(val == 0) {
-                    /* Put an end of chain marker in to allocate it. */
-                    blk[off] = 0xFF;
-                    blk[off + 1] = 0xFF;
-                    blk[off + 2] = 0xFF;
-                    blk[off + 3] = (blk[off + 3] & 0xF0) | 0x0F;
-
-                    /* Mark the block as dirty so it can get flushed to the
-                       backing store at some point. */
-                    fat_fatblock_mark_dirty(fs, sn);
-
-                    fs->sb.last_alloc_cluster = i;
-                    --fs->sb.free_clusters;
-                    return i;
-                }
+    if(!fs->free_groups && (rv = fat_init_groups(fs)) < 0) {
+        *err = -rv;
+        return FAT_INVALID_CLUSTER;
+    }
 
-                ++i;
-                cl += 4;
+    last = fs->sb.num_clusters + 2;
 
-                /* Do we have to read a new block? */
-                if(!(i & cps) && i < fs->sb.num_clusters + 2) {
-                    ++sn;
+    if(goal < 2 || goal >= last)
+        goal = 2;
 
-                    if(!(blk = fat_read_fatblock(fs, sn, err)))
-                        return FAT_INVALID_CLUSTER;
-                }
-            }
+    /* Look from the goal to the end of its group, then through the groups
+       after it that have something free, coming back around to the start of
+       the goal's group last. Only groups that haven't been counted yet cost
+       a read of the FAT, and each of them only once per mount. */
+    g0 = goal >> fs->group_shift;
 
-            /* If we get here, then restart the search and try one more time.
-               If we get here a second time, then there really aren't any
-               clusters left. */
-            if(tries--) {
-                i = 2;
-                last = fs->sb.last_alloc_cluster;
-                goto retry_fat32;
-            }
+    for(n = 0; n <= fs->group_count; ++n) {
+        g = (g0 + n) % fs->group_count;
 
-            *err = ENOSPC;
+        if(fs->free_groups[g] == FAT_GROUP_UNCOUNTED &&
+           (rv = fat_count_group(fs, g)) < 0) {
+            *err = -rv;
             return FAT_INVALID_CLUSTER;
+        }
 
-        case FAT_FS_FAT16:
-retry_fat16:
-            cps = (fs->sb.bytes_per_sector >> 1) - 1;
-            cl = i << 1;
-            sn = fs->sb.reserved_sectors + (cl / fs->sb.bytes_per_sector);
-
-            if(!(blk = fat_read_fatblock(fs, sn, err)))
-                return FAT_INVALID_CLUSTER;
-
-            while(i < last) {
-                off = cl & (fs->sb.bytes_per_sector - 1);
-                val = blk[off] | (blk[off + 1] << 8);
-
-                /* Did we find a free cluster? */
-                if(val == 0) {
-                    /* Put an end of chain marker in to allocate it. */
-                    blk[off] = 0xFF;
-                    blk[off + 1] = 0xFF;
-
-                    /* Mark the block as dirty so it can get flushed to the
-                       backing store at some point. */
-                    fat_fatblock_mark_dirty(fs, sn);
-
-                    fs->sb.last_alloc_cluster = i;
-                    return i;
-                }
+        if(!fs->free_groups[g])
+            continue;
 
-                ++i;
-                cl += 2;
+        cl = n ? g << fs->group_shift : goal;
+        end = (g + 1) << fs->group_shift;
 
-                /* Do we have to read a new block? */
-                if(!(i & cps) && i < fs->sb.num_clusters + 2) {
-                    ++sn;
+        if(cl < 2)
+            cl = 2;
 
-                    if(!(blk = fat_read_fatblock(fs, sn, err)))
-                        return FAT_INVALID_CLUSTER;
-                }
-            }
+        if(end > last)
+            end = last;
 
-            /* If we get here, then restart the search and try one more time.
-               If we get here a second time, then there really aren't any
-               clusters left. */
-            if(tries--) {
-                i = 2;
-                last = fs->sb.last_alloc_cluster;
-                goto retry_fat16;
+        for(; cl < end; ++cl) {
+            if((rv = fat_read_entry(fs, cl, &val))) {
+                *err = rv;
+                return FAT_INVALID_CLUSTER;
             }
 
-            *err = ENOSPC;
-            return FAT_INVALID_CLUSTER;
-
-        case FAT_FS_FAT12:
-            /* Do this twice, so the search can loop around. */
-            for(i = fs->sb.last_alloc_cluster + 1; i < fs->sb.num_clusters + 2;
-                ++i) {
-                if(!(cl = fat_read_fat(fs, i, err))) {
-                    /* Allocate it by adding in an end of chain marker. */
-                    if((*err = fat_write_fat(fs, i, 0x0FFF)) < 0)
-                        return FAT_INVALID_CLUSTER;
-
-                    fs->sb.last_alloc_cluster = i;
-                }
-                else if(cl == FAT_INVALID_CLUSTER) {
-                    return cl;
+            if(fat_entry_free(fs, val)) {
+                /* Put an end of chain marker in to allocate it. This gets
+                   truncated as needed for FAT12/FAT16. */
+                if((rv = fat_write_fat(fs, cl, 0x0FFFFFFF))) {
+                    *err = rv < 0 ? -rv : rv;
+                    return FAT_INVALID_CLUSTER;
                 }
-            }
-
-            for(i = 2; i < fs->sb.last_alloc_cluster + 1; ++i) {
-                if(!(cl = fat_read_fat(fs, i, err))) {
-                    /* Allocate it by adding in an end of chain marker. */
-                    if((*err = fat_write_fat(fs, i, 0x0FFF)) < 0)
-                        return FAT_INVALID_CLUSTER;
 
-                    fs->sb.last_alloc_cluster = i;
-                }
-                else if(cl == FAT_INVALID_CLUSTER) {
-                    return cl;
-                }
+                fs->sb.last_alloc_cluster = cl;
+                --fs->sb.free_clusters;
+                return cl;
             }
-
-            /* If we get here, there really wasn't anything left. */
-            *err = ENOSPC;
-            return FAT_INVALID_CLUSTER;
-
-        default:
-            *err = EBADF;
-            return FAT_INVALID_CLUSTER;
+        }
     }
 
-    return val;
+    *err = ENOSPC;
+    return FAT_INVALID_CLUSTER;
 }
 
 /* This function could be made better/more optimized... However, it takes the
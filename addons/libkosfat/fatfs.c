@@ -345,6 +345,7 @@ fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
     }
 
     rv->fcache_size = fcache_sz;
+    rv->free_groups = NULL;
     return rv;
 
 out_fcache2:
@@ -431,6 +432,9 @@ void fat_fs_shutdown(fat_fs_t *fs) {
         free(fs->fcache[i]);
     }
 
+    free(fs->fcache);
+    free(fs->free_groups);
+
     fs->dev->shutdown(fs->dev);
     free(fs);
 }
@@ -121,6 +121,10 @@ uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err);
 int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val);
 int fat_is_eof(fat_fs_t *fs, uint32_t cl);
 uint32_t fat_allocate_cluster(fat_fs_t *fs, int *err);
+
+/* Allocate a cluster, preferring goal or the first free one after it, so that
+   a file being extended can be given the cluster after its last one. */
+uint32_t fat_allocate_cluster_near(fat_fs_t *fs, uint32_t goal, int *err);
 int fat_erase_chain(fat_fs_t *fs, uint32_t cluster);
 
 __END_DECLS
@@ -31,10 +31,19 @@ struct fatfs_struct {
     fat_cache_t **fcache;
     int fcache_size;
 
+    /* Free clusters in each group of (1 << group_shift) clusters, one FAT
+       block's worth on FAT16/FAT32. Set up by the first allocation, and each
+       group is counted the first time an allocation looks at it. */
+    uint16_t *free_groups;
+    uint32_t group_count;
+    uint32_t group_shift;
+
     uint32_t flags;
     uint32_t mnt_flags;
 };
 
+#define FAT_GROUP_UNCOUNTED     0xFFFF
+
 /* The BPB/FSinfo blocks need to be written back to the block device... */
 #define FAT_FS_FLAG_SB_DIRTY   1
 
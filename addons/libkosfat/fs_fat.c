@@ -15,6 +15,7 @@
 #include <sys/queue.h>
 
 #include <kos/fs.h>
+#include <kos/fs_dcache.h>
 #include <kos/mutex.h>
 #include <kos/dbglog.h>
 
@@ -173,8 +174,8 @@ static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
                 return -EDOM;
             }
             else {
-                /* Allocate a new cluster */
-                cl2 = fat_allocate_cluster(fs, &err);
+                /* Allocate a new cluster, right after this one if we can */
+                cl2 = fat_allocate_cluster_near(fs, cl + 1, &err);
 
                 if(cl2 == FAT_INVALID_CLUSTER) {
                     return -err;
@@ -367,7 +368,7 @@ static int fs_fat_close(void *h) {
     return rv;
 }
 
-static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
+static ssize_t fat_read_unlocked(void *h, void *buf, size_t cnt) {
     file_t fd = ((file_t)h) - 1;
     fat_fs_t *fs;
     uint32_t bs, bo;
@@ -377,11 +378,8 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     uint64_t sz, cl;
     int mode;
 
-    mutex_lock(&fat_mutex);
-
     /* Check that the fd is valid */
     if(fd >= MAX_FAT_FILES || !fh[fd].opened) {
-        mutex_unlock(&fat_mutex);
         errno = EBADF;
         return -1;
     }
@@ -391,14 +389,12 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     /* Make sure the fd is open for reading */
     mode = fh[fd].mode & O_MODE_MASK;
     if(mode != O_RDONLY && mode != O_RDWR) {
-        mutex_unlock(&fat_mutex);
         errno = EBADF;
         return -1;
     }
 
     /* Make sure we're not trying to read a directory with read */
     if(fh[fd].mode & O_DIR) {
-        mutex_unlock(&fat_mutex);
         errno = EISDIR;
         return -1;
     }
@@ -407,7 +403,6 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     sz = fh[fd].dentry.size;
 
     if(fat_is_eof(fs, fh[fd].cluster) || fh[fd].ptr >= sz) {
-        mutex_unlock(&fat_mutex);
         return 0;
     }
 
@@ -424,11 +419,9 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
         mode = advance_cluster(fs, fd, fh[fd].ptr / bs, 0);
 
         if(mode == -EDOM) {
-            mutex_unlock(&fat_mutex);
             return 0;
         }
         else if(mode < 0) {
-            mutex_unlock(&fat_mutex);
             errno = -mode;
             return -1;
         }
@@ -437,7 +430,6 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     /* Handle the first block specially if we are offset within it. */
     if(bo) {
         if(!(block = fat_cluster_read(fs, fh[fd].cluster, &errno))) {
-            mutex_unlock(&fat_mutex);
             return -1;
         }
 
@@ -450,11 +442,9 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
             cl = fat_read_fat(fs, fh[fd].cluster, &errno);
 
             if(cl == FAT_INVALID_CLUSTER) {
-                mutex_unlock(&fat_mutex);
                 return -1;
             }
             else if(fat_is_eof(fs, cl)) {
-                mutex_unlock(&fat_mutex);
                 errno = EIO;
                 return -1;
             }
@@ -471,7 +461,6 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
                 cl = fat_read_fat(fs, fh[fd].cluster, &errno);
 
                 if(cl == FAT_INVALID_CLUSTER) {
-                    mutex_unlock(&fat_mutex);
                     return -1;
                 }
 
@@ -486,7 +475,6 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     /* While we still have more to read, do it. */
     while(cnt) {
         if(!(block = fat_cluster_read(fs, fh[fd].cluster, &errno))) {
-            mutex_unlock(&fat_mutex);
             return -1;
         }
 
@@ -499,11 +487,9 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
             cl = fat_read_fat(fs, fh[fd].cluster, &errno);
 
             if(cl == FAT_INVALID_CLUSTER) {
-                mutex_unlock(&fat_mutex);
                 return -1;
             }
             else if(fat_is_eof(fs, cl)) {
-                mutex_unlock(&fat_mutex);
                 errno = EIO;
                 return -1;
             }
@@ -520,7 +506,6 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
                 cl = fat_read_fat(fs, fh[fd].cluster, &errno);
 
                 if(cl == FAT_INVALID_CLUSTER) {
-                    mutex_unlock(&fat_mutex);
                     return -1;
                 }
 
@@ -532,12 +517,15 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
         }
     }
 
-    /* We're done, clean up and return. */
-    mutex_unlock(&fat_mutex);
+    /* We're done, return. */
     return rv;
 }
 
-static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
+/* Write at the handle's file pointer. A positioned write (at set) only ever
+   grows the file, where a plain write on a write-only handle sets its size
+   to the end of what was written. */
+static ssize_t fat_write_unlocked(void *h, const void *buf, size_t cnt,
+                                  int at) {
     file_t fd = ((file_t)h) - 1;
     fat_fs_t *fs;
     uint32_t bs, bo;
@@ -546,11 +534,8 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
     ssize_t rv;
     int mode, err;
 
-    mutex_lock(&fat_mutex);
-
     /* Check that the fd is valid */
     if(fd >= MAX_FAT_FILES || !fh[fd].opened) {
-        mutex_unlock(&fat_mutex);
         errno = EBADF;
         return -1;
     }
@@ -558,13 +543,11 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
     /* Make sure the fd is open for reading */
     mode = fh[fd].mode & O_MODE_MASK;
     if(mode != O_WRONLY && mode != O_RDWR) {
-        mutex_unlock(&fat_mutex);
         errno = EBADF;
         return -1;
     }
 
     if(!cnt) {
-        mutex_unlock(&fat_mutex);
         return 0;
     }
 
@@ -577,7 +560,6 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
        a cluster boundary)? */
     if((fh[fd].mode & 0x80000000)) {
         if((err = advance_cluster(fs, fd, fh[fd].ptr / bs, 1)) < 0) {
-            mutex_unlock(&fat_mutex);
             errno = -err;
             return -1;
         }
@@ -586,7 +568,6 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
     /* Are we starting our write in the middle of a block? */
     if(bo) {
         if(!(block = fat_cluster_read(fs, fh[fd].cluster, &err))) {
-            mutex_unlock(&fat_mutex);
             errno = err;
             return -1;
         }
@@ -602,7 +583,6 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
 
             if((err = advance_cluster(fs, fd, fh[fd].cluster_order + 1,
                                       1)) < 0) {
-                mutex_unlock(&fat_mutex);
                 errno = -err;
                 return -1;
             }
@@ -624,7 +604,6 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
     /* While we still have more to write, do it. */
     while(cnt) {
         if(!(block = fat_cluster_read(fs, fh[fd].cluster, &err))) {
-            mutex_unlock(&fat_mutex);
             errno = err;
             return -1;
         }
@@ -639,7 +618,6 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
 
             if((err = advance_cluster(fs, fd, fh[fd].cluster_order + 1,
                                       1)) < 0) {
-                mutex_unlock(&fat_mutex);
                 errno = -err;
                 return -1;
             }
@@ -660,7 +638,7 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
 
     /* If the file pointer is past the end of the file as recorded in its
        directory entry, update the directory entry with the new size. */
-    if(fh[fd].ptr > fh[fd].dentry.size || mode == O_WRONLY) {
+    if(fh[fd].ptr > fh[fd].dentry.size || (mode == O_WRONLY && !at)) {
         fh[fd].dentry.size = fh[fd].ptr;
 
         if((err = fat_update_dentry(fs, &fh[fd].dentry,
@@ -674,11 +652,144 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
     /* Update the file's modification timestamp. */
     fat_update_mtime(&fh[fd].dentry);
 
-    /* We're done, clean up and return. */
+    /* We're done, return. */
+    return rv;
+}
+
+static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
+    ssize_t rv;
+
+    mutex_lock(&fat_mutex);
+    rv = fat_read_unlocked(h, buf, cnt);
     mutex_unlock(&fat_mutex);
+
     return rv;
 }
 
+static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
+    ssize_t rv;
+
+    mutex_lock(&fat_mutex);
+    rv = fat_write_unlocked(h, buf, cnt, 0);
+    mutex_unlock(&fat_mutex);
+
+    return rv;
+}
+
+static ssize_t fs_fat_readv(void *h, const struct iovec *iov, int iovcnt) {
+    ssize_t rv, total = 0;
+    int i;
+
+    mutex_lock(&fat_mutex);
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(!iov[i].iov_len)
+            continue;
+
+        if((rv = fat_read_unlocked(h, iov[i].iov_base, iov[i].iov_len)) < 0) {
+            if(!total)
+                total = -1;
+
+            break;
+        }
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    mutex_unlock(&fat_mutex);
+    return total;
+}
+
+static ssize_t fs_fat_writev(void *h, const struct iovec *iov, int iovcnt) {
+    ssize_t rv, total = 0;
+    int i;
+
+    mutex_lock(&fat_mutex);
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(!iov[i].iov_len)
+            continue;
+
+        if((rv = fat_write_unlocked(h, iov[i].iov_base,
+                                    iov[i].iov_len, 0)) < 0) {
+            if(!total)
+                total = -1;
+
+            break;
+        }
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    mutex_unlock(&fat_mutex);
+    return total;
+}
+
+/* Positioned I/O is done by pointing the handle at the requested offset (with
+   the seek flag set, so that the right cluster gets looked up) and putting
+   everything back afterwards. The cluster that the old position was in is
+   still part of the file afterwards, since writes only ever extend the
+   chain. */
+static ssize_t fat_rw_at(void *h, void *buf, size_t cnt, off_t offset,
+                         int write) {
+    file_t fd = ((file_t)h) - 1;
+    uint32_t ptr, cl, clo;
+    ssize_t rv;
+    int seek;
+
+    mutex_lock(&fat_mutex);
+
+    if(fd >= MAX_FAT_FILES || !fh[fd].opened) {
+        mutex_unlock(&fat_mutex);
+        errno = EBADF;
+        return -1;
+    }
+
+    ptr = fh[fd].ptr;
+    cl = fh[fd].cluster;
+    clo = fh[fd].cluster_order;
+    seek = fh[fd].mode & 0x80000000;
+
+    /* If the handle has run off the end of the chain, there's nothing to
+       walk forward from, so start from the top of the file. */
+    if(fat_is_eof(fh[fd].fs->fs, cl)) {
+        fh[fd].cluster = fh[fd].dentry.cluster_low |
+            (fh[fd].dentry.cluster_high << 16);
+        fh[fd].cluster_order = 0;
+    }
+
+    fh[fd].ptr = (uint32_t)offset;
+    fh[fd].mode |= 0x80000000;
+
+    if(write)
+        rv = fat_write_unlocked(h, buf, cnt, 1);
+    else
+        rv = fat_read_unlocked(h, buf, cnt);
+
+    fh[fd].ptr = ptr;
+    fh[fd].cluster = cl;
+    fh[fd].cluster_order = clo;
+    fh[fd].mode = (fh[fd].mode & ~0x80000000) | seek;
+
+    mutex_unlock(&fat_mutex);
+    return rv;
+}
+
+static ssize_t fs_fat_pread(void *h, void *buf, size_t cnt, off_t offset) {
+    return fat_rw_at(h, buf, cnt, offset, 0);
+}
+
+static ssize_t fs_fat_pwrite(void *h, const void *buf, size_t cnt,
+                             off_t offset) {
+    return fat_rw_at(h, (void *)buf, cnt, offset, 1);
+}
+
 static _off64_t fs_fat_seek64(void *h, _off64_t offset, int whence) {
     file_t fd = ((file_t)h) - 1;
     off_t rv;
@@ -1307,7 +1418,7 @@ static vfs_handler_t vh = {
         NMMGR_LIST_INIT         /* list */
     },
 
-    0, NULL,                    /* no cacheing, privdata */
+    VFS_CACHE_DENTRIES, NULL,   /* dentry cache, privdata */
 
     fs_fat_open,                /* open */
     fs_fat_close,               /* close */
@@ -1334,7 +1445,13 @@ static vfs_handler_t vh = {
     fs_fat_total64,             /* total64 */
     NULL,                       /* readlink */
     fs_fat_rewinddir,           /* rewinddir */
-    fs_fat_fstat                /* fstat */
+    fs_fat_fstat,               /* fstat */
+    NULL,                       /* aio_submit */
+    NULL,                       /* aio_cancel */
+    fs_fat_readv,               /* readv */
+    fs_fat_writev,              /* writev */
+    fs_fat_pread,               /* pread */
+    fs_fat_pwrite               /* pwrite */
 };
 
 static int initted = 0;
@@ -1423,6 +1540,7 @@ int fs_fat_unmount(const char *mp) {
 
         /* XXXX: We should probably do something with open files... */
         nmmgr_handler_remove(&i->vfsh->nmmgr);
+        fs_dcache_invalidate(i->vfsh, NULL);
         fat_fs_shutdown(i->fs);
         free(i->vfsh);
         free(i);
@@ -1488,6 +1606,7 @@ int fs_fat_shutdown(void) {
 
         /* XXXX: We should probably do something with open files... */
         nmmgr_handler_remove(&i->vfsh->nmmgr);
+        fs_dcache_invalidate(i->vfsh, NULL);
         fat_fs_shutdown(i->fs);
         free(i->vfsh);
         free(i);
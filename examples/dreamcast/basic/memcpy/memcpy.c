@@ -0,0 +1,151 @@
+/* KallistiOS ##version##
+
+   memcpy.c
+   Copyright (C) 2024 KallistiOS Contributors
+*/
+
+/* This example benchmarks the cache-aware memcpy_fast(), memmove_fast() and
+   memset_fast() functions from <kos/string.h> against the standard library
+   versions, for block sizes from 16 bytes up to 1MB.
+
+   Each size is run a number of times over a buffer larger than the operand
+   cache, so that the larger sizes show steady-state memory bandwidth rather
+   than cache bandwidth. The results are printed in MB/s. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include <kos/string.h>
+#include <arch/timer.h>
+
+#define MIN_SIZE    16
+#define MAX_SIZE    (1024 * 1024)
+
+/* Move this many bytes in total for each size, so every size takes roughly
+   the same amount of time to test. */
+#define TOTAL_BYTES (4 * 1024 * 1024)
+
+typedef void *(*copy_fn)(void *, const void *, size_t);
+typedef void *(*set_fn)(void *, int, size_t);
+
+static uint8_t *src, *dst;
+
+static unsigned int mbps(size_t bytes, uint64_t ns) {
+    if(!ns)
+        return 0;
+
+    return (unsigned int)((uint64_t)bytes * 1000 / ns);
+}
+
+/* Walk through the buffers so that repeated small copies don't keep hitting
+   the same cache lines. */
+static uint64_t run_copy(copy_fn fn, size_t size, int misalign) {
+    size_t iters = TOTAL_BYTES / size, off = 0, i;
+    uint64_t start;
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < iters; ++i) {
+        fn(dst + off, src + off + misalign, size);
+        off += size + 32;
+
+        if(off + size + 32 > MAX_SIZE)
+            off = 0;
+    }
+
+    return timer_ns_gettime64() - start;
+}
+
+static uint64_t run_set(set_fn fn, size_t size) {
+    size_t iters = TOTAL_BYTES / size, off = 0, i;
+    uint64_t start;
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < iters; ++i) {
+        fn(dst + off, (int)i, size);
+        off += size + 32;
+
+        if(off + size + 32 > MAX_SIZE)
+            off = 0;
+    }
+
+    return timer_ns_gettime64() - start;
+}
+
+static uint64_t run_move(copy_fn fn, size_t size) {
+    size_t iters = TOTAL_BYTES / size, i;
+    uint64_t start;
+
+    start = timer_ns_gettime64();
+
+    /* Overlapping move down by 64 bytes, as when compacting a buffer. */
+    for(i = 0; i < iters; ++i)
+        fn(dst, dst + 64, size);
+
+    return timer_ns_gettime64() - start;
+}
+
+static int verify(void) {
+    size_t sizes[] = { 17, 100, 4096 + 3, 65536 + 31 };
+    size_t i;
+    int s, d;
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for(s = 0; s < 4; ++s) {
+            for(d = 0; d < 4; ++d) {
+                memset(dst, 0, sizes[i] + 8);
+                memcpy_fast(dst + d, src + s, sizes[i]);
+
+                if(memcmp(dst + d, src + s, sizes[i]))
+                    return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size, i;
+
+    src = (uint8_t *)memalign(32, MAX_SIZE + 64);
+    dst = (uint8_t *)memalign(32, MAX_SIZE + 64);
+
+    if(!src || !dst) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    for(i = 0; i < MAX_SIZE + 64; ++i)
+        src[i] = (uint8_t)(i * 7);
+
+    if(verify() < 0) {
+        printf("memcpy_fast() produced the wrong result!\n");
+        return 1;
+    }
+
+    printf("All figures in MB/s\n");
+    printf("%8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "size",
+           "memcpy", "fast", "cpy+1", "fast+1", "memset", "fast",
+           "memmove", "fast");
+
+    for(size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+        printf("%8u %8u %8u %8u %8u %8u %8u %8u %8u\n", (unsigned int)size,
+               mbps(TOTAL_BYTES, run_copy(memcpy, size, 0)),
+               mbps(TOTAL_BYTES, run_copy(memcpy_fast, size, 0)),
+               mbps(TOTAL_BYTES, run_copy(memcpy, size, 1)),
+               mbps(TOTAL_BYTES, run_copy(memcpy_fast, size, 1)),
+               mbps(TOTAL_BYTES, run_set(memset, size)),
+               mbps(TOTAL_BYTES, run_set(memset_fast, size)),
+               mbps(TOTAL_BYTES, run_move(memmove, size)),
+               mbps(TOTAL_BYTES, run_move(memmove_fast, size)));
+    }
+
+    free(src);
+    free(dst);
+
+    return 0;
+}
@@ -0,0 +1,252 @@
+/* KallistiOS ##version##
+
+   cdstream.c
+   Copyright (C) 2024 KallistiOS Contributors
+*/
+
+/* This example plays back the biggest file in the root of the disc the way
+   a video or music player would: a piece at a time, spending a fixed amount
+   of CPU time on each piece as if decoding it.
+
+   It does that first with plain blocking fs_read() calls, where the drive
+   and the decoder take turns, and then with CD streams of two, four and
+   eight buffers, where the drive reads ahead while the decoder works. For
+   the streams it prints how often the decoder had to wait for the drive
+   (underruns) and the drive for the decoder (stalls).
+
+   Last, it streams with four buffers while another thread keeps reading
+   small pieces of the other files through fs_iso9660, to show how long
+   those reads take while the drive is shared. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kos/fs.h>
+#include <kos/thread.h>
+#include <dc/cdrom.h>
+#include <dc/fs_iso9660.h>
+#include <arch/timer.h>
+
+/* Sectors in each stream buffer, and bytes per fs_read() */
+#define BUF_SECTORS 32
+#define PIECE       (BUF_SECTORS * 2048)
+
+/* Decoding time, in microseconds per piece: a bit faster than the drive */
+#define DECODE_US   35000
+
+/* Stop after this much of the file */
+#define MAX_BYTES   (8 * 1024 * 1024)
+
+static char path[NAME_MAX + 8];
+static char other[NAME_MAX + 8];
+static size_t file_size;
+
+static volatile int reading;
+static uint32_t other_reads;
+static uint64_t other_us, other_max_us;
+
+/* Pretend to decode a piece */
+static void decode(const void *buf, size_t bytes) {
+    uint64_t until = timer_us_gettime64() + DECODE_US * bytes / PIECE;
+
+    (void)buf;
+
+    while(timer_us_gettime64() < until)
+        ;
+}
+
+/* Find the biggest file in the root of the disc, and another one */
+static int find_files(void) {
+    dirent_t *d;
+    file_t fd;
+
+    if((fd = fs_open("/cd", O_RDONLY | O_DIR)) < 0)
+        return -1;
+
+    while((d = fs_readdir(fd))) {
+        if(d->size < 0)
+            continue;
+
+        if((size_t)d->size > file_size) {
+            if(path[0])
+                strcpy(other, path);
+
+            file_size = d->size;
+            snprintf(path, sizeof(path), "/cd/%s", d->name);
+        }
+        else if(!other[0]) {
+            snprintf(other, sizeof(other), "/cd/%s", d->name);
+        }
+    }
+
+    fs_close(fd);
+
+    if(file_size > MAX_BYTES)
+        file_size = MAX_BYTES;
+
+    return file_size ? 0 : -1;
+}
+
+static uint64_t play_blocking(void) {
+    uint64_t start = timer_us_gettime64();
+    uint8_t *buf = malloc(PIECE);
+    size_t pos;
+    ssize_t r;
+    file_t fd;
+
+    if(!buf || (fd = fs_open(path, O_RDONLY)) < 0) {
+        free(buf);
+        return 0;
+    }
+
+    for(pos = 0; pos < file_size; pos += r) {
+        if((r = fs_read(fd, buf, PIECE)) <= 0)
+            break;
+
+        decode(buf, r);
+    }
+
+    fs_close(fd);
+    free(buf);
+
+    return timer_us_gettime64() - start;
+}
+
+static uint64_t play_stream(int nbufs, cdrom_stream_stats_t *st) {
+    uint64_t start = timer_us_gettime64();
+    cdrom_stream_t *s;
+    uint32 sector;
+    size_t size, bytes;
+    void *buf;
+    file_t fd;
+    int rv;
+
+    if((fd = fs_open(path, O_RDONLY)) < 0)
+        return 0;
+
+    rv = fs_iso9660_get_extent(fd, &sector, &size);
+    fs_close(fd);
+
+    if(rv < 0)
+        return 0;
+
+    if(!(s = cdrom_stream_open(sector, (file_size + 2047) / 2048, BUF_SECTORS,
+                               nbufs, NULL, NULL)))
+        return 0;
+
+    while((rv = cdrom_stream_get(s, &buf, &bytes, 0)) > 0) {
+        decode(buf, bytes);
+        cdrom_stream_release(s, buf);
+    }
+
+    if(rv < 0)
+        printf("stream failed (%d)\n", cdrom_stream_error(s));
+
+    cdrom_stream_get_stats(s, st);
+    cdrom_stream_close(s);
+
+    return timer_us_gettime64() - start;
+}
+
+/* Read 4KB pieces of another file for as long as reading is set */
+static void *other_thd(void *param) {
+    uint8_t buf[4096];
+    uint64_t t;
+    file_t fd;
+    size_t pos = 0;
+
+    (void)param;
+
+    if((fd = fs_open(other, O_RDONLY)) < 0)
+        return NULL;
+
+    while(reading) {
+        /* Jump around so the cache doesn't hide the drive */
+        pos = (pos + 37 * 2048) % (fs_total(fd) + 1);
+        t = timer_us_gettime64();
+
+        fs_seek(fd, pos, SEEK_SET);
+        fs_read(fd, buf, sizeof(buf));
+
+        t = timer_us_gettime64() - t;
+        other_reads++;
+        other_us += t;
+
+        if(t > other_max_us)
+            other_max_us = t;
+
+        thd_sleep(20);
+    }
+
+    fs_close(fd);
+
+    return NULL;
+}
+
+static void print_stream(const char *name, uint64_t us,
+                         const cdrom_stream_stats_t *st) {
+    printf("%-12s %8u %9u %9u %9u %7u\n", name, (unsigned int)(us / 1000),
+           (unsigned int)st->underruns,
+           (unsigned int)(st->underrun_us / 1000),
+           (unsigned int)(st->max_underrun_us / 1000),
+           (unsigned int)st->stalls);
+}
+
+int main(int argc, char **argv) {
+    static const int nbufs[] = { 2, 4, 8 };
+    cdrom_stream_stats_t st;
+    kthread_t *thd;
+    char name[16];
+    uint64_t us;
+    unsigned int i;
+
+    (void)argc;
+    (void)argv;
+
+    if(find_files() < 0) {
+        printf("No files found on the disc\n");
+        return 1;
+    }
+
+    printf("Playing %u KB of %s, %u KB at a time\n\n",
+           (unsigned int)(file_size / 1024), path, PIECE / 1024);
+    printf("%-12s %8s %9s %9s %9s %7s\n", "", "time", "underruns", "waited",
+           "longest", "stalls");
+    printf("%-12s %8s %9s %9s %9s %7s\n", "", "ms", "", "ms", "ms", "");
+
+    us = play_blocking();
+    printf("%-12s %8u\n", "fs_read", (unsigned int)(us / 1000));
+
+    for(i = 0; i < sizeof(nbufs) / sizeof(nbufs[0]); ++i) {
+        memset(&st, 0, sizeof(st));
+        us = play_stream(nbufs[i], &st);
+        sprintf(name, "%d buffers", nbufs[i]);
+        print_stream(name, us, &st);
+    }
+
+    if(!other[0])
+        return 0;
+
+    /* Share the drive with another reader */
+    reading = 1;
+    thd = thd_create(0, other_thd, NULL);
+
+    memset(&st, 0, sizeof(st));
+    us = play_stream(4, &st);
+
+    reading = 0;
+
+    if(thd)
+        thd_join(thd, NULL);
+
+    print_stream("4 + reader", us, &st);
+
+    printf("\nWhile streaming, %u reads of %s took %u us on average and "
+           "%u us at most;\nthe stream had to go ahead of them %u times\n",
+           (unsigned int)other_reads, other,
+           other_reads ? (unsigned int)(other_us / other_reads) : 0,
+           (unsigned int)other_max_us, (unsigned int)st.urgent);
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+/* KallistiOS ##version##
+
+   dcachebench.c
+   Copyright (C) 2024 KallistiOS Contributors
+*/
+
+/* This example measures how long fs_open() and fs_stat() take on each
+   filesystem it can find, with the VFS directory entry cache turned off and
+   then on again. Paths that exist and paths that don't are both timed, since
+   programs probing for optional files (save data, patches, config files) hit
+   the second case a lot.
+
+   The romdisk built into this example always gets tested. /cd, /pc and /sd
+   are tested as well if they're there, using the first file found in their
+   root directory. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kos/fs.h>
+#include <kos/fs_dcache.h>
+#include <arch/timer.h>
+
+#define ITERATIONS  2000
+
+static const char *mounts[] = { "/rd", "/cd", "/pc", "/sd" };
+
+#define MOUNT_COUNT (sizeof(mounts) / sizeof(mounts[0]))
+
+/* Find a file to use on a mount point. */
+static int find_file(const char *mnt, char *out, size_t len) {
+    dirent_t *d;
+    file_t fd;
+
+    if(!strcmp(mnt, "/rd")) {
+        snprintf(out, len, "/rd/data/levels/world1/level2.txt");
+        return 0;
+    }
+
+    if((fd = fs_open(mnt, O_RDONLY | O_DIR)) < 0)
+        return -1;
+
+    while((d = fs_readdir(fd))) {
+        if(d->size >= 0) {
+            snprintf(out, len, "%s/%s", mnt, d->name);
+            fs_close(fd);
+            return 0;
+        }
+    }
+
+    fs_close(fd);
+    return -1;
+}
+
+static unsigned int time_open(const char *path) {
+    uint64_t start = timer_ns_gettime64();
+    file_t fd;
+    int i;
+
+    for(i = 0; i < ITERATIONS; ++i) {
+        if((fd = fs_open(path, O_RDONLY)) >= 0)
+            fs_close(fd);
+    }
+
+    return (unsigned int)((timer_ns_gettime64() - start) / ITERATIONS);
+}
+
+static unsigned int time_stat(const char *path) {
+    uint64_t start = timer_ns_gettime64();
+    struct stat st;
+    int i;
+
+    for(i = 0; i < ITERATIONS; ++i)
+        fs_stat(path, &st, 0);
+
+    return (unsigned int)((timer_ns_gettime64() - start) / ITERATIONS);
+}
+
+static void bench(const char *path) {
+    unsigned int open_ns, stat_ns;
+    size_t size = fs_dcache_get_size();
+
+    /* Off first, then on. */
+    fs_dcache_set_size(0);
+    open_ns = time_open(path);
+    stat_ns = time_stat(path);
+
+    fs_dcache_set_size(size);
+    printf("%-40s %9u %9u %9u %9u\n", path, open_ns, time_open(path),
+           stat_ns, time_stat(path));
+}
+
+int main(int argc, char **argv) {
+    fs_dcache_stats_t st;
+    char path[256];
+    unsigned int i;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Directory entry cache: %u entries, %d iterations per test\n\n",
+           (unsigned int)fs_dcache_get_size(), ITERATIONS);
+    printf("%-40s %9s %9s %9s %9s\n", "path (ns per call)", "open off",
+           "open on", "stat off", "stat on");
+
+    fs_dcache_reset_stats();
+
+    for(i = 0; i < MOUNT_COUNT; ++i) {
+        if(find_file(mounts[i], path, sizeof(path)) < 0) {
+            printf("%-40s (not available)\n", mounts[i]);
+            continue;
+        }
+
+        bench(path);
+
+        snprintf(path, sizeof(path), "%s/no/such/file.txt", mounts[i]);
+        bench(path);
+    }
+
+    fs_dcache_get_stats(&st);
+    printf("\nhits %lu (negative %lu), misses %lu, evictions %lu, "
+           "invalidations %lu, %u/%u entries used\n",
+           (unsigned long)st.hits, (unsigned long)st.negative_hits,
+           (unsigned long)st.misses, (unsigned long)st.evictions,
+           (unsigned long)st.invalidations, (unsigned int)st.used,
+           (unsigned int)st.size);
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+/* KallistiOS ##version##
+
+   pathbench.c
+   Copyright (C) 2024 KallistiOS Contributors
+*/
+
+/* This example measures how long it takes the name manager to find the
+   handler for a path, which every fs_open(), fs_stat(), fs_unlink() and so
+   on has to do. It registers a large number of dummy handlers (including
+   nested names like /pc and /pcx) and times nmmgr_lookup() against a plain
+   scan of the handler list, which is how lookups used to be done.
+
+   The dummy handlers aren't VFS handlers, so they don't show up in the
+   filesystem and are all removed again before exiting. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <kos/nmmgr.h>
+#include <arch/timer.h>
+
+#define MOUNTS      128
+#define LOOKUPS     20000
+
+static nmmgr_handler_t handlers[MOUNTS + 2];
+
+static const char *paths[] = {
+    "/pc/data/level1.bin",
+    "/pcx/data/level1.bin",
+    "/mnt000/file.txt",
+    "/mnt064/some/deeper/path/file.txt",
+    "/mnt127/file.txt",
+    "/nothere/file.txt",
+};
+
+#define PATH_COUNT  (sizeof(paths) / sizeof(paths[0]))
+
+/* The old lookup: the first handler whose name is a prefix of the path. */
+static nmmgr_handler_t *linear_lookup(const char *fn) {
+    nmmgr_handler_t *cur;
+
+    LIST_FOREACH(cur, nmmgr_get_list(), list_ent) {
+        if(!strncasecmp(cur->pathname, fn, strlen(cur->pathname)))
+            return cur;
+    }
+
+    return NULL;
+}
+
+static void add_handler(nmmgr_handler_t *h, const char *name) {
+    strcpy(h->pathname, name);
+    h->type = NMMGR_TYPE_UNKNOWN;
+    nmmgr_handler_add(h);
+}
+
+int main(int argc, char **argv) {
+    nmmgr_handler_t *a, *b;
+    uint64_t start, t_trie, t_linear;
+    char name[NAME_MAX];
+    unsigned int i, j;
+
+    (void)argc;
+    (void)argv;
+
+    /* Register /pcx first and /pc last. The linear scan sees the newest
+       handler first, so it sends /pcx paths to /pc. */
+    add_handler(&handlers[0], "/pcx");
+
+    for(i = 0; i < MOUNTS; ++i) {
+        sprintf(name, "/mnt%03u", i);
+        add_handler(&handlers[i + 2], name);
+    }
+
+    add_handler(&handlers[1], "/pc");
+
+    printf("Path resolution with %d handlers, %d lookups per path\n\n",
+           MOUNTS + 2, LOOKUPS);
+    printf("%-36s %10s %10s  %s\n", "path", "trie ns", "linear ns",
+           "resolved to");
+
+    for(i = 0; i < PATH_COUNT; ++i) {
+        start = timer_ns_gettime64();
+
+        for(j = 0; j < LOOKUPS; ++j)
+            a = nmmgr_lookup(paths[i]);
+
+        t_trie = timer_ns_gettime64() - start;
+
+        start = timer_ns_gettime64();
+
+        for(j = 0; j < LOOKUPS; ++j)
+            b = linear_lookup(paths[i]);
+
+        t_linear = timer_ns_gettime64() - start;
+
+        printf("%-36s %10u %10u  %s", paths[i],
+               (unsigned int)(t_trie / LOOKUPS),
+               (unsigned int)(t_linear / LOOKUPS),
+               a ? a->pathname : "(none)");
+
+        if(a != b)
+            printf(" (linear scan: %s)", b ? b->pathname : "(none)");
+
+        printf("\n");
+    }
+
+    for(i = 0; i < MOUNTS + 2; ++i)
+        nmmgr_handler_remove(&handlers[i]);
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+/* KallistiOS ##version##
+
+   ramdiskbench.c
+   Copyright (C) 2024 KallistiOS Contributors
+*/
+
+/* This example measures streamed writes of multi-megabyte files to the
+   ramdisk, a piece at a time, the way a download or a decompressor would
+   write them. Each file is then read back, checked, and mmapped (which puts
+   it into one block of memory).
+
+   For comparison, the same writes are also done into a plain buffer grown
+   with realloc() by the amount written plus 4KB each time, which is how the
+   ramdisk used to store files.
+
+   After that, it creates, looks up, lists and unlinks 10000 small files, the
+   way a cache of downloaded or decoded assets would. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kos/fs.h>
+#include <kos/fs_ramdisk.h>
+#include <arch/timer.h>
+
+#define PATH    "/ram/bench.bin"
+
+/* Number of files for the directory test */
+#define DIR_FILES   10000
+
+static const size_t file_sizes[] = { 1024 * 1024, 2 * 1024 * 1024,
+                                     4 * 1024 * 1024 };
+static const size_t piece_sizes[] = { 512, 4096, 32768 };
+
+#define FILE_SIZES  (sizeof(file_sizes) / sizeof(file_sizes[0]))
+#define PIECE_SIZES (sizeof(piece_sizes) / sizeof(piece_sizes[0]))
+
+static uint8_t piece[32768];
+
+/* Kilobytes per second, from a size and a time in nanoseconds */
+static unsigned int kbps(size_t size, uint64_t ns) {
+    if(!ns)
+        ns = 1;
+
+    return (unsigned int)((uint64_t)size * 1000000000ULL / 1024 / ns);
+}
+
+/* How the ramdisk grew files before it used extents */
+static uint64_t write_realloc(size_t size, size_t psize) {
+    uint64_t start = timer_ns_gettime64();
+    uint8_t *data = NULL, *np;
+    size_t pos, cap = 0;
+
+    for(pos = 0; pos < size; pos += psize) {
+        if(pos + psize > cap) {
+            if(!(np = realloc(data, pos + psize + 4096))) {
+                free(data);
+                return 0;
+            }
+
+            data = np;
+            cap = pos + psize + 4096;
+        }
+
+        memcpy(data + pos, piece, psize);
+    }
+
+    free(data);
+    return timer_ns_gettime64() - start;
+}
+
+static int bench(size_t size, size_t psize) {
+    uint64_t start, t_write, t_read, t_mmap, t_old;
+    uint8_t *buf;
+    void *map;
+    size_t pos;
+    file_t fd;
+    int bad = 0;
+
+    if(!(buf = malloc(psize)))
+        return -1;
+
+    /* Write it */
+    start = timer_ns_gettime64();
+
+    if((fd = fs_open(PATH, O_WRONLY | O_TRUNC)) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    for(pos = 0; pos < size; pos += psize) {
+        if(fs_write(fd, piece, psize) != (ssize_t)psize) {
+            printf("write failed at %u\n", (unsigned int)pos);
+            bad = 1;
+            break;
+        }
+    }
+
+    fs_close(fd);
+    t_write = timer_ns_gettime64() - start;
+
+    /* Read it back */
+    start = timer_ns_gettime64();
+    fd = fs_open(PATH, O_RDONLY);
+
+    for(pos = 0; !bad && pos < size; pos += psize) {
+        if(fs_read(fd, buf, psize) != (ssize_t)psize ||
+           memcmp(buf, piece, psize)) {
+            printf("read back failed at %u\n", (unsigned int)pos);
+            bad = 1;
+        }
+    }
+
+    t_read = timer_ns_gettime64() - start;
+
+    /* Get it in one piece */
+    start = timer_ns_gettime64();
+
+    if(!(map = fs_mmap(fd))) {
+        printf("mmap failed\n");
+        bad = 1;
+    }
+
+    t_mmap = timer_ns_gettime64() - start;
+
+    if(map && memcmp((uint8_t *)map + size - psize, piece, psize)) {
+        printf("mmapped data is wrong\n");
+        bad = 1;
+    }
+
+    fs_close(fd);
+    fs_unlink(PATH);
+    free(buf);
+
+    t_old = write_realloc(size, psize);
+
+    printf("%5u KB %6u B %9u %9u %9u %9u\n", (unsigned int)(size / 1024),
+           (unsigned int)psize, kbps(size, t_write), kbps(size, t_read),
+           (unsigned int)(t_mmap / 1000), t_old ? kbps(size, t_old) : 0);
+
+    return bad ? -1 : 0;
+}
+
+static void name_file(char *buf, int i) {
+    sprintf(buf, "/ram/asset%05d.bin", i);
+}
+
+static int bench_dir(void) {
+    uint64_t start, t_create, t_lookup, t_list, t_unlink;
+    char name[32];
+    dirent_t *d;
+    file_t fd;
+    int i, n = 0, bad = 0;
+
+    /* Create */
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < DIR_FILES; ++i) {
+        name_file(name, i);
+
+        if((fd = fs_open(name, O_WRONLY | O_TRUNC)) < 0) {
+            printf("can't create %s\n", name);
+            return -1;
+        }
+
+        fs_write(fd, piece, 64);
+        fs_close(fd);
+    }
+
+    t_create = timer_ns_gettime64() - start;
+
+    /* Look up, in a different order than they were made in */
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < DIR_FILES; ++i) {
+        name_file(name, (i * 7919) % DIR_FILES);
+
+        if((fd = fs_open(name, O_RDONLY)) < 0)
+            bad = 1;
+        else
+            fs_close(fd);
+    }
+
+    t_lookup = timer_ns_gettime64() - start;
+
+    if(bad)
+        printf("lookups failed\n");
+
+    /* List them; they should come back in the order they were made */
+    start = timer_ns_gettime64();
+
+    if((fd = fs_open("/ram", O_RDONLY | O_DIR)) >= 0) {
+        while((d = fs_readdir(fd))) {
+            if(strncmp(d->name, "asset", 5))
+                continue;
+
+            name_file(name, n++);
+
+            if(strcmp(d->name, name + 5))
+                bad = 1;
+        }
+
+        fs_close(fd);
+    }
+
+    t_list = timer_ns_gettime64() - start;
+
+    if(n != DIR_FILES || bad) {
+        printf("listing is wrong (%d files)\n", n);
+        bad = 1;
+    }
+
+    /* Unlink */
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < DIR_FILES; ++i) {
+        name_file(name, i);
+
+        if(fs_unlink(name) < 0)
+            bad = 1;
+    }
+
+    t_unlink = timer_ns_gettime64() - start;
+
+    printf("\n%d files, ns per file: create %u, lookup %u, list %u, "
+           "unlink %u\n", DIR_FILES, (unsigned int)(t_create / DIR_FILES),
+           (unsigned int)(t_lookup / DIR_FILES),
+           (unsigned int)(t_list / DIR_FILES),
+           (unsigned int)(t_unlink / DIR_FILES));
+
+    return bad ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int i, j;
+    int bad = 0;
+
+    (void)argc;
+    (void)argv;
+
+    for(i = 0; i < sizeof(piece); ++i)
+        piece[i] = (uint8_t)(i * 131 + (i >> 8));
+
+    printf("%8s %8s %9s %9s %9s %9s\n", "file", "piece", "write", "read",
+           "mmap", "realloc");
+    printf("%8s %8s %9s %9s %9s %9s\n", "", "", "KB/s", "KB/s", "us", "KB/s");
+
+    for(i = 0; i < FILE_SIZES; ++i) {
+        for(j = 0; j < PIECE_SIZES; ++j) {
+            if(bench(file_sizes[i], piece_sizes[j]) < 0)
+                bad = 1;
+        }
+    }
+
+    if(bench_dir() < 0)
+        bad = 1;
+
+    printf("\n%s\n", bad ? "FAILED" : "All data checked out");
+
+    return bad;
+}
@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <sys/select.h>
 #include <netinet/in.h>
 
@@ -231,7 +232,7 @@ void *client_thread(void *p) {
     char * buf, * ext;
     const char * ct;
     file_t f = -1;
-    int r, o, cnt;
+    ssize_t cnt;
 
     printf("httpd: client thread started, sock %d\n", hs->socket);
 
@@ -281,19 +282,10 @@ void *client_thread(void *p) {
 
         send_ok(hs, ct);
 
-        while((cnt = fs_read(f, buf, BUFSIZE)) != 0) {
-            o = 0;
-
-            while(cnt > 0) {
-                r = write(hs->socket, buf + o, cnt);
-
-                if(r <= 0)
-                    goto out;
-
-                cnt -= r;
-                o += r;
-            }
-        }
+        /* Let the kernel move the data; files on the romdisk or ramdisk
+           go straight into the socket without being copied here first. */
+        while((cnt = sendfile(hs->socket, f, NULL, BUFSIZE)) > 0)
+            ;
     }
 
     fs_close(f);
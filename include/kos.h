@@ -33,6 +33,10 @@ __BEGIN_DECLS
 #include <unistd.h>
 
 #include <kos/fs.h>
+#include <kos/fs_aio.h>
+#include <kos/fs_pcache.h>
+#include <kos/fs_dcache.h>
+#include <kos/fs_stats.h>
 #include <kos/fs_romdisk.h>
 #include <kos/fs_ramdisk.h>
 #include <kos/fs_dev.h>
@@ -74,6 +78,7 @@ __BEGIN_DECLS
 #   include <arch/gdb.h>
 #   include <arch/mmu.h>
 #   include <arch/memory.h>
+#   include <arch/ocram.h>
 
 #   include <dc/asic.h>
 #   include <dc/biosfont.h>
@@ -18,6 +18,7 @@ __BEGIN_DECLS
 #include <sys/queue.h>
 #include <stdarg.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <kos/nmmgr.h>
 
@@ -88,6 +89,20 @@ typedef int file_t;
 /** \brief  Invalid file handle constant (for open failure, etc) */
 #define FILEHND_INVALID ((file_t)-1)
 
+struct fs_aio_req;
+
+/** \defgroup vfs_cache_flags       VFS caching flags
+
+    These are for the cache member of vfs_handler_t.
+
+    @{
+*/
+/** \brief Read files through the page cache (see kos/fs_pcache.h) */
+#define VFS_CACHE_PAGES     0x01
+/** \brief Cache path lookups (see kos/fs_dcache.h) */
+#define VFS_CACHE_DENTRIES  0x02
+/** @} */
+
 /** \brief  VFS handler interface.
 
     All VFS handlers must implement this interface.
@@ -99,7 +114,8 @@ typedef struct vfs_handler {
     nmmgr_handler_t nmmgr;
 
     /* Some VFS-specific pieces */
-    /** \brief Allow VFS cacheing; 0=no, 1=yes */
+    /** \brief Caching done by the VFS for this filesystem; any of the
+               \ref vfs_cache_flags, or 0 for none */
     int cache;
     /** \brief Pointer to private data for the handler */
     void *privdata;
@@ -196,21 +212,47 @@ typedef struct vfs_handler {
 
     /** \brief Get status information on an already opened file. */
     int (*fstat)(void *hnd, struct stat *st);
+
+    /** \brief Start an asynchronous read or write (see kos/fs_aio.h). The
+               handler calls fs_aio_complete() once it is done. Returning -1
+               with errno set to ENOSYS hands the request to the generic
+               worker threads instead. */
+    int (*aio_submit)(void *hnd, struct fs_aio_req *req);
+
+    /** \brief Cancel an asynchronous request that hasn't been started yet.
+               Returns 0 if the request was dropped, or -1 if it is already in
+               progress. */
+    int (*aio_cancel)(void *hnd, struct fs_aio_req *req);
+
+    /** \brief Read into several buffers in one call, advancing the file
+               pointer. Optional; fs_readv() falls back to read. */
+    ssize_t (*readv)(void *hnd, const struct iovec *iov, int iovcnt);
+
+    /** \brief Write from several buffers in one call, advancing the file
+               pointer. Optional; fs_writev() falls back to write. */
+    ssize_t (*writev)(void *hnd, const struct iovec *iov, int iovcnt);
+
+    /** \brief Read at the given offset without moving the file pointer.
+               Optional; fs_pread() falls back to seek and read. */
+    ssize_t (*pread)(void *hnd, void *buffer, size_t cnt, off_t offset);
+
+    /** \brief Write at the given offset without moving the file pointer.
+               Optional; fs_pwrite() falls back to seek and write. */
+    ssize_t (*pwrite)(void *hnd, const void *buffer, size_t cnt,
+                      off_t offset);
 } vfs_handler_t;
 
-/** \brief  The number of distinct file descriptors that can be in use at a
-            time.
+/** \brief  The default number of distinct file descriptors that can be in use
+            at a time.
+
+    This is also the size of an fd_set, so select() can only deal with
+    descriptors below this number. The limit on open descriptors can be raised
+    at runtime with fs_fdtbl_set_limit().
 */
 #define FD_SETSIZE  1024
 
-/** \cond */
-/* This is the private struct that will be used as raw file handles
-   underlying descriptors. */
-struct fs_hnd;
-
-/* The kernel-wide file descriptor table. These will reference to open files. */
-extern struct fs_hnd *fd_table[FD_SETSIZE];
-/** \endcond */
+/** \brief  The largest value fs_fdtbl_set_limit() accepts. */
+#define FD_LIMIT_MAX    16384
 
 /* Open modes */
 #include <sys/fcntl.h>
@@ -290,6 +332,74 @@ ssize_t fs_read(file_t hnd, void *buffer, size_t cnt);
 */
 ssize_t fs_write(file_t hnd, const void *buffer, size_t cnt);
 
+/** \brief  Read from a file into several buffers.
+
+    This function fills each of the given buffers in turn, as if by a series of
+    fs_read() calls, but lets the filesystem handle the whole request at once.
+    This is equivalent to the standard POSIX function readv().
+
+    \param  hnd             The file descriptor to read from.
+    \param  iov             The buffers to read into.
+    \param  iovcnt          The number of entries in iov.
+    \return                 The total number of bytes read, or -1 on failure.
+                            A short count means the end of the file was
+                            reached (or no more data was available).
+*/
+ssize_t fs_readv(file_t hnd, const struct iovec *iov, int iovcnt);
+
+/** \brief  Write to a file from several buffers.
+
+    This function writes each of the given buffers in turn, as if by a series of
+    fs_write() calls, but lets the filesystem handle the whole request at once.
+    This is equivalent to the standard POSIX function writev().
+
+    \param  hnd             The file descriptor to write to.
+    \param  iov             The buffers to write from.
+    \param  iovcnt          The number of entries in iov.
+    \return                 The total number of bytes written, or -1 on
+                            failure.
+*/
+ssize_t fs_writev(file_t hnd, const struct iovec *iov, int iovcnt);
+
+/** \brief  Read from a file at a given offset.
+
+    This function reads from the given offset in the file, without using or
+    changing the file pointer. This is equivalent to the standard POSIX
+    function pread().
+
+    \param  hnd             The file descriptor to read from.
+    \param  buffer          The buffer to read into.
+    \param  cnt             The size of the buffer (or the number of bytes
+                            requested).
+    \param  offset          The offset in the file to read from.
+    \return                 The number of bytes read, or -1 on failure.
+
+    \note                   If the filesystem doesn't do this itself, it is
+                            done with a seek, a read and another seek, so it
+                            isn't atomic with respect to other threads using
+                            the same file descriptor.
+*/
+ssize_t fs_pread(file_t hnd, void *buffer, size_t cnt, off_t offset);
+
+/** \brief  Write to a file at a given offset.
+
+    This function writes at the given offset in the file, without using or
+    changing the file pointer. This is equivalent to the standard POSIX
+    function pwrite().
+
+    \param  hnd             The file descriptor to write to.
+    \param  buffer          The data to write.
+    \param  cnt             The number of bytes to write.
+    \param  offset          The offset in the file to write at.
+    \return                 The number of bytes written, or -1 on failure.
+
+    \note                   If the filesystem doesn't do this itself, it is
+                            done with a seek, a write and another seek, so it
+                            isn't atomic with respect to other threads using
+                            the same file descriptor.
+*/
+ssize_t fs_pwrite(file_t hnd, const void *buffer, size_t cnt, off_t offset);
+
 /** \brief  Seek to a new position within a file.
 
     This function moves the file pointer to the specified position within the
@@ -606,6 +716,23 @@ file_t fs_dup(file_t oldfd);
 */
 file_t fs_dup2(file_t oldfd, file_t newfd);
 
+/** \brief  Set the maximum number of open file descriptors.
+
+    The descriptor table grows as needed up to this limit. Lowering the limit
+    doesn't affect descriptors that are already open, but new descriptors will
+    only be handed out below it. The default limit is FD_SETSIZE.
+
+    \param  limit           The new limit, between 1 and FD_LIMIT_MAX.
+    \retval 0               On success.
+    \retval -1              On failure (errno set to EINVAL).
+*/
+int fs_fdtbl_set_limit(int limit);
+
+/** \brief  Get the maximum number of open file descriptors.
+    \return                 The current limit.
+*/
+int fs_fdtbl_get_limit(void);
+
 /** \brief  Create a "transient" file descriptor.
 
     This function creates and opens a new file descriptor that isn't associated
@@ -659,6 +786,56 @@ const char *fs_getwd(void);
 */
 ssize_t fs_copy(const char *src, const char *dst);
 
+/** \brief  Copy data from one file to another.
+
+    This function copies up to len bytes from one open file to another without
+    the caller having to provide a buffer. If the source file can be mapped
+    into memory with fs_mmap() (as romdisk and ramdisk files can), the data is
+    written to the destination straight from there, which for a socket means
+    it goes directly into the send buffer. Otherwise, it is moved through a
+    bounce buffer of up to 64KiB.
+
+    The source and destination must not be the same file.
+
+    \param  fd_in           The file descriptor to copy from.
+    \param  off_in          If non-NULL, the offset to copy from, which is
+                            advanced by the amount copied, and the file
+                            position of fd_in is left alone. If NULL, copying
+                            starts at (and advances) the file position.
+    \param  fd_out          The file descriptor to copy to.
+    \param  off_out         As off_in, for the destination.
+    \param  len             The maximum number of bytes to copy.
+    \return                 The number of bytes copied (which can be less than
+                            len at end of file, or if an error happens part way
+                            through), or -1 on failure, setting errno
+                            appropriately.
+
+    \par   Error Conditions:
+    \em    EBADF - one of the file descriptors is invalid \n
+    \em    EINVAL - an offset is negative \n
+    \em    ENOMEM - no memory for a bounce buffer \n
+    Any error from reading or writing the files.
+*/
+ssize_t fs_copy_range(file_t fd_in, off_t *off_in, file_t fd_out,
+                      off_t *off_out, size_t len);
+
+/** \brief  Send data from a file to a socket (or another file).
+
+    This is the equivalent of the sendfile() call, and is a shorthand for
+    fs_copy_range() that writes at the destination's file position.
+
+    \param  fd_out          The file descriptor to write to.
+    \param  fd_in           The file descriptor to read from.
+    \param  offset          If non-NULL, the offset to read from, which is
+                            advanced by the amount copied. If NULL, reading
+                            starts at (and advances) the file position.
+    \param  count           The maximum number of bytes to copy.
+    \return                 The number of bytes copied, or -1 on failure.
+    \see    fs_copy_range()
+*/
+ssize_t fs_sendfile(file_t fd_out, file_t fd_in, off_t *offset,
+                    size_t count);
+
 /** \brief  Open and read a whole file into RAM.
 
     This function opens the specified file, reads it into memory (allocating the
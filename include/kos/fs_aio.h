@@ -0,0 +1,190 @@
+/* KallistiOS ##version##
+
+   kos/fs_aio.h
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/** \file   kos/fs_aio.h
+    \brief  Asynchronous file I/O.
+
+    This file provides a way to read from and write to files without blocking
+    the calling thread. Requests are submitted against an open file descriptor
+    and an explicit file offset, and their results are delivered to a
+    completion queue, which can be polled or waited on.
+
+    Filesystems that can do asynchronous I/O on their own implement the
+    aio_submit (and optionally aio_cancel) members of their vfs_handler_t, and
+    call fs_aio_complete() when a request is done. Everything else is handled
+    by a small pool of kernel worker threads that simply do the blocking I/O
+    on the caller's behalf.
+
+    A request structure belongs to the caller and must stay valid until it has
+    been returned by fs_aio_poll() or fs_aio_wait(). The file descriptor must
+    not be closed, and the buffer must not be touched, while a request using
+    them is outstanding.
+
+    \author KallistiOS Contributors
+*/
+
+#ifndef __KOS_FS_AIO_H
+#define __KOS_FS_AIO_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <kos/fs.h>
+
+/** \name   Request types
+    @{
+*/
+#define FS_AIO_READ     0   /**< \brief Read into the buffer */
+#define FS_AIO_WRITE    1   /**< \brief Write from the buffer */
+/** @} */
+
+/** \name   Request states
+    @{
+*/
+#define FS_AIO_IDLE     0   /**< \brief Not submitted */
+#define FS_AIO_QUEUED   1   /**< \brief Waiting to be started */
+#define FS_AIO_RUNNING  2   /**< \brief In progress */
+#define FS_AIO_DONE     3   /**< \brief Finished (see result and error) */
+/** @} */
+
+/** \brief  Default number of worker threads. */
+#define FS_AIO_DEFAULT_WORKERS  2
+
+/** \brief  Completion queue type (opaque). */
+typedef struct fs_aio_queue fs_aio_queue_t;
+
+/** \brief  Asynchronous I/O request.
+
+    \headerfile kos/fs_aio.h
+*/
+typedef struct fs_aio_req {
+    file_t fd;                  /**< \brief File descriptor */
+    int op;                     /**< \brief FS_AIO_READ or FS_AIO_WRITE */
+    void *buf;                  /**< \brief Data buffer */
+    size_t cnt;                 /**< \brief Number of bytes to transfer */
+    off_t offset;               /**< \brief File offset */
+    void *user;                 /**< \brief Caller's data, not touched */
+
+    volatile int state;         /**< \brief Request state */
+    ssize_t result;             /**< \brief Bytes transferred, or -1 */
+    int error;                  /**< \brief errno value if result is -1 */
+
+    /** \cond */
+    fs_aio_queue_t *queue;
+    vfs_handler_t *vfs;
+    void *hnd;
+    int native;
+    TAILQ_ENTRY(fs_aio_req) ent;
+    /** \endcond */
+} fs_aio_req_t;
+
+/** \brief  Start the worker pool.
+
+    This is done automatically (with FS_AIO_DEFAULT_WORKERS threads) the first
+    time a request needs a worker, so it only has to be called to choose a
+    different number of threads.
+
+    \param  workers         The number of worker threads to start.
+    \retval 0               On success, or if already initialized.
+    \retval -1              On failure (errno set).
+*/
+int fs_aio_init(int workers);
+
+/** \brief  Stop the worker pool.
+
+    Requests that haven't been started yet are canceled. This waits for the
+    requests being worked on to finish.
+*/
+void fs_aio_shutdown(void);
+
+/** \brief  Create a completion queue.
+    \return                 The new queue, or NULL on failure.
+*/
+fs_aio_queue_t *fs_aio_queue_create(void);
+
+/** \brief  Destroy a completion queue.
+    \param  q               The queue to destroy.
+    \retval 0               On success.
+    \retval -1              If requests are still outstanding (errno set to
+                            EBUSY).
+*/
+int fs_aio_queue_destroy(fs_aio_queue_t *q);
+
+/** \brief  Submit an asynchronous read.
+
+    \param  q               The completion queue for the request.
+    \param  req             The request to fill in and submit.
+    \param  fd              The file to read from.
+    \param  buf             The buffer to read into.
+    \param  cnt             The number of bytes to read.
+    \param  offset          The offset in the file to read from.
+    \param  user            Caller's data, stored in the request.
+    \retval 0               On success.
+    \retval -1              On failure (errno set).
+*/
+int fs_aio_read(fs_aio_queue_t *q, fs_aio_req_t *req, file_t fd, void *buf,
+                size_t cnt, off_t offset, void *user);
+
+/** \brief  Submit an asynchronous write.
+
+    \param  q               The completion queue for the request.
+    \param  req             The request to fill in and submit.
+    \param  fd              The file to write to.
+    \param  buf             The data to write.
+    \param  cnt             The number of bytes to write.
+    \param  offset          The offset in the file to write at.
+    \param  user            Caller's data, stored in the request.
+    \retval 0               On success.
+    \retval -1              On failure (errno set).
+*/
+int fs_aio_write(fs_aio_queue_t *q, fs_aio_req_t *req, file_t fd,
+                 const void *buf, size_t cnt, off_t offset, void *user);
+
+/** \brief  Get a completed request, without blocking.
+    \param  q               The completion queue to check.
+    \return                 A completed request, or NULL if there is none.
+*/
+fs_aio_req_t *fs_aio_poll(fs_aio_queue_t *q);
+
+/** \brief  Wait for a request to complete.
+    \param  q               The completion queue to wait on.
+    \param  timeout         The maximum number of milliseconds to wait, or 0
+                            to wait forever.
+    \return                 A completed request, or NULL on timeout.
+*/
+fs_aio_req_t *fs_aio_wait(fs_aio_queue_t *q, int timeout);
+
+/** \brief  Cancel a request.
+
+    Only requests that haven't been started yet can be canceled. A canceled
+    request is still delivered to its completion queue, with a result of -1
+    and an error of ECANCELED.
+
+    \param  req             The request to cancel.
+    \retval 0               On success.
+    \retval -1              If the request can't be canceled (errno set to
+                            EBUSY if it is in progress or EINVAL if it isn't
+                            outstanding).
+*/
+int fs_aio_cancel(fs_aio_req_t *req);
+
+/** \brief  Complete a request.
+
+    This is for filesystems implementing the aio_submit member of
+    vfs_handler_t, and may be called from an interrupt.
+
+    \param  req             The finished request.
+    \param  result          The number of bytes transferred, or -1.
+    \param  error           The errno value if result is -1.
+*/
+void fs_aio_complete(fs_aio_req_t *req, ssize_t result, int error);
+
+__END_DECLS
+
+#endif  /* __KOS_FS_AIO_H */
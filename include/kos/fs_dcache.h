@@ -0,0 +1,136 @@
+/* KallistiOS ##version##
+
+   kos/fs_dcache.h
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/** \file   kos/fs_dcache.h
+    \brief  VFS directory entry cache.
+
+    This file provides a cache of path lookups, so that opening or stat()ing
+    the same path over and over doesn't make the filesystem walk its
+    directories every time. It is used for filesystems that have
+    VFS_CACHE_DENTRIES set in the cache member of their vfs_handler_t.
+
+    For those filesystems, the VFS remembers the result of fs_stat() (whether
+    it succeeded or failed with ENOENT) and paths that couldn't be opened
+    because they don't exist. Filesystems can also store a value of their
+    own for each path they have found, for instance the location of the
+    file's directory entry, and use it to skip the lookup the next time the
+    file is opened.
+
+    Entries are dropped when the VFS changes the path: when it is opened for
+    writing or created, written to, unlinked, renamed, or made or removed as a
+    directory. Creating, removing or renaming something also drops the entry
+    for the directory that holds it. On a filesystem that supports hard or
+    symbolic links, the same file can be cached under other names, so any of
+    these changes drops everything cached for the filesystem instead. Paths
+    are cached by the name realpath() gives them. A filesystem whose contents
+    can change in other ways (a disc being swapped, or the filesystem being
+    unmounted) must call fs_dcache_invalidate() when that happens.
+
+    The cache holds a fixed number of entries, and throws away the least
+    recently used one when it is full.
+
+    \author KallistiOS Contributors
+*/
+
+#ifndef __KOS_FS_DCACHE_H
+#define __KOS_FS_DCACHE_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <kos/fs.h>
+
+/** \brief  Number of entries if fs_dcache_set_size() isn't used. */
+#define FS_DCACHE_DEFAULT_SIZE  256
+
+/** \brief  Directory entry cache statistics.
+
+    \headerfile kos/fs_dcache.h
+*/
+typedef struct fs_dcache_stats {
+    uint32_t hits;              /**< \brief Lookups answered by an entry */
+    uint32_t negative_hits;     /**< \brief ... that said "doesn't exist" */
+    uint32_t misses;            /**< \brief Lookups that had to be done */
+    uint32_t evictions;         /**< \brief Entries dropped to make room */
+    uint32_t invalidations;     /**< \brief Entries dropped by a change */
+    size_t size;                /**< \brief Capacity, in entries */
+    size_t used;                /**< \brief Entries in use */
+} fs_dcache_stats_t;
+
+/** \brief  Set the capacity of the cache.
+
+    Everything in the cache is dropped.
+
+    \param  entries         The maximum number of entries, or 0 to turn the
+                            cache off.
+    \retval 0               On success.
+    \retval -1              On failure (errno set to ENOMEM, and the cache is
+                            left off).
+*/
+int fs_dcache_set_size(size_t entries);
+
+/** \brief  Get the capacity of the cache.
+    \return                 The maximum number of entries.
+*/
+size_t fs_dcache_get_size(void);
+
+/** \brief  Drop cached entries.
+
+    \param  vfs             The filesystem to drop entries for.
+    \param  path            The path (relative to the mount point, as the
+                            filesystem sees it) to drop, along with everything
+                            below it, or NULL to drop everything cached for the
+                            filesystem.
+*/
+void fs_dcache_invalidate(vfs_handler_t *vfs, const char *path);
+
+/** \brief  Look up a filesystem's value for a path.
+
+    \param  vfs             The filesystem.
+    \param  path            The path, as the filesystem sees it.
+    \param  dir             Nonzero to look for a directory, zero for a file.
+    \param  value           Where to store the value.
+    \retval 1               If the value was found.
+    \retval 0               If there is nothing cached.
+*/
+int fs_dcache_get(vfs_handler_t *vfs, const char *path, int dir,
+                  uint64_t *value);
+
+/** \brief  Store a filesystem's value for a path.
+
+    \param  vfs             The filesystem.
+    \param  path            The path, as the filesystem sees it.
+    \param  dir             Nonzero if the path is a directory.
+    \param  value           The value to store.
+*/
+void fs_dcache_put(vfs_handler_t *vfs, const char *path, int dir,
+                   uint64_t value);
+
+/** \brief  Get the cache statistics.
+    \param  st              Where to store the statistics.
+*/
+void fs_dcache_get_stats(fs_dcache_stats_t *st);
+
+/** \brief  Reset the cache statistics. */
+void fs_dcache_reset_stats(void);
+
+/** \cond */
+/* Used by the VFS. */
+int fs_dcache_stat(vfs_handler_t *vfs, const char *path, struct stat *st);
+void fs_dcache_put_stat(vfs_handler_t *vfs, const char *path,
+                        const struct stat *st);
+int fs_dcache_negative(vfs_handler_t *vfs, const char *path, int dir);
+void fs_dcache_put_negative(vfs_handler_t *vfs, const char *path, int dir);
+void fs_dcache_drop(vfs_handler_t *vfs, const char *path);
+void fs_dcache_shutdown(void);
+/** \endcond */
+
+__END_DECLS
+
+#endif  /* __KOS_FS_DCACHE_H */
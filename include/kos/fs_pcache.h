@@ -0,0 +1,120 @@
+/* KallistiOS ##version##
+
+   kos/fs_pcache.h
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/** \file   kos/fs_pcache.h
+    \brief  Shared VFS page cache.
+
+    This file provides a page cache that sits between the VFS and any
+    filesystem that sets VFS_CACHE_PAGES in the cache member of its
+    vfs_handler_t. Files on such a filesystem that are opened read-only are
+    read in FS_PCACHE_PAGE_SIZE pages, which are kept in a single pool shared
+    by all filesystems and evicted with the CLOCK algorithm when the pool
+    fills up. Pages are keyed by the filesystem, the path of the file and the
+    offset, so they survive the file being closed and reopened.
+
+    When a file is being read sequentially, pages ahead of the read are
+    fetched with the same request, and the amount fetched grows (up to
+    FS_PCACHE_RA_MAX pages) for as long as the pattern continues. Random
+    access turns readahead off again.
+
+    A file's pages are dropped when it is opened for writing, unlinked or
+    renamed through the VFS, and reads bypass the cache while a writer has it
+    open. They are also dropped when the file is reopened with a different
+    size or modification time, or, if the filesystem can't report the time,
+    when the file's last descriptor is closed. Filesystems whose contents can
+    change behind the VFS's back (a disc being swapped, for instance) should
+    call fs_pcache_invalidate() when that happens.
+
+    \author KallistiOS Contributors
+*/
+
+#ifndef __KOS_FS_PCACHE_H
+#define __KOS_FS_PCACHE_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <kos/fs.h>
+
+/** \brief  Size of a cache page, in bytes. */
+#define FS_PCACHE_PAGE_SIZE     4096
+
+/** \brief  Number of pages in the pool if fs_pcache_set_size() isn't used. */
+#define FS_PCACHE_DEFAULT_PAGES 32
+
+/** \brief  Largest number of pages read ahead at once. */
+#define FS_PCACHE_RA_MAX        16
+
+/** \brief  Page cache statistics.
+
+    \headerfile kos/fs_pcache.h
+*/
+typedef struct fs_pcache_stats {
+    uint32_t hits;              /**< \brief Page lookups found in the cache */
+    uint32_t misses;            /**< \brief Page lookups that needed I/O */
+    uint32_t ra_pages;          /**< \brief Pages fetched by readahead */
+    uint32_t ra_hits;           /**< \brief Readahead pages later used */
+    uint32_t evictions;         /**< \brief Pages reused for other data */
+    uint32_t bypassed;          /**< \brief Reads not cached (writer open) */
+    size_t pages;               /**< \brief Size of the pool, in pages */
+    size_t used;                /**< \brief Pages holding data */
+} fs_pcache_stats_t;
+
+/** \brief  Set the size of the page pool.
+
+    Everything in the cache is dropped. The pool is allocated the first time
+    a cached file is opened, so calling this before that avoids allocating
+    the default sized pool at all.
+
+    \param  pages           The number of pages to use, or 0 to turn the cache
+                            off.
+    \retval 0               On success.
+    \retval -1              On failure (errno set to ENOMEM, and the cache is
+                            left off).
+*/
+int fs_pcache_set_size(size_t pages);
+
+/** \brief  Get the size of the page pool.
+    \return                 The number of pages in the pool.
+*/
+size_t fs_pcache_get_size(void);
+
+/** \brief  Drop cached pages.
+
+    \param  vfs             The filesystem to drop pages for.
+    \param  path            The file (relative to the mount point, as the
+                            filesystem sees it) to drop pages for, or NULL to
+                            drop everything cached for the filesystem.
+*/
+void fs_pcache_invalidate(vfs_handler_t *vfs, const char *path);
+
+/** \brief  Get the page cache statistics.
+    \param  st              Where to store the statistics.
+*/
+void fs_pcache_get_stats(fs_pcache_stats_t *st);
+
+/** \brief  Reset the page cache statistics. */
+void fs_pcache_reset_stats(void);
+
+/** \cond */
+/* Used by the VFS. */
+struct fs_pcache_file;
+
+struct fs_pcache_file *fs_pcache_open(vfs_handler_t *vfs, void *hnd,
+                                      const char *path, int mode);
+void fs_pcache_close(struct fs_pcache_file *f);
+ssize_t fs_pcache_read(struct fs_pcache_file *f, void *buf, size_t cnt,
+                       off_t offset);
+off_t fs_pcache_size(struct fs_pcache_file *f);
+void fs_pcache_shutdown(void);
+/** \endcond */
+
+__END_DECLS
+
+#endif  /* __KOS_FS_PCACHE_H */
@@ -62,6 +62,27 @@ int fs_ramdisk_attach(const char * fn, void * obj, size_t size);
 */
 int fs_ramdisk_detach(const char * fn, void ** obj, size_t * size);
 
+/** \brief  Default for fs_ramdisk_set_coalesce_limit(). */
+#define FS_RAMDISK_COALESCE_DEFAULT (64 * 1024)
+
+/** \brief  Set the largest file that is coalesced when it is closed.
+
+    Files on the ramdisk that grow past 16KB are written into fixed size
+    extents, so that writing a big file a piece at a time never has to copy it
+    or find one block of memory big enough for all of it. When a file no
+    bigger than this limit is closed after writing, its data is put into one
+    block of exactly the right size, which saves the memory left over at the
+    end and lets fs_mmap() return that block as it is.
+
+    Bigger files keep their extents. Calling fs_mmap() on such a file (or
+    detaching it) copies it into one block at that point, which needs enough
+    memory for a second copy of the file while it happens.
+
+    \param  size            The size limit, in bytes. 0 leaves every file in
+                            extents until it is mmapped.
+*/
+void fs_ramdisk_set_coalesce_limit(size_t size);
+
 __END_DECLS
 
 #endif  /* __KOS_FS_RAMDISK_H */
@@ -18,6 +18,13 @@
     mount itself on /rd. You can also mount additional images that you load
     from some other source on whatever mountpoint you want.
 
+    Images made with genromfs -z have their files compressed. They are
+    decompressed as they are read, a block at a time, with the last few blocks
+    kept around so that small reads don't decompress the same block over and
+    over. Seeking works as usual. Calling fs_mmap() on a compressed file
+    decompresses all of it into a buffer that lasts until the file is closed,
+    so files that are only ever mmapped are best left uncompressed.
+
     \author Megan Potter
 */
 
@@ -76,6 +83,38 @@ int fs_romdisk_mount(const char * mountpoint, const uint8 *img, int own_buffer);
 */
 int fs_romdisk_unmount(const char * mountpoint);
 
+/** \brief  Get the amount of memory used by mounted ROMFS images.
+
+    This function adds up the sizes of all currently mounted ROMFS images.
+
+    \param  owned           If non-NULL, set to the part of the total that is
+                            held in buffers owned (and freed) by the VFS.
+    \return                 The total size of all mounted images, in bytes.
+*/
+size_t fs_romdisk_mem_usage(size_t *owned);
+
+/** \brief  Default size of the path index of a romdisk, in entries. */
+#define FS_ROMDISK_INDEX_DEFAULT    2048
+
+/** \brief  Set the size of the path index for new mounts.
+
+    Each mounted image gets a hash table that maps the names in a directory
+    to their entries in the image, so that opening a file doesn't have to go
+    through every entry before it in each directory along its path. The root
+    directory is indexed when the image is mounted and every other directory
+    the first time something in it is looked up. Each entry takes 16 bytes,
+    and a directory takes one more entry than it has files and
+    subdirectories. A directory that doesn't fit in what is left of the index
+    takes one entry to say so and is searched entry by entry as before, and
+    smaller directories can still be added after it.
+
+    This only affects images mounted after it is called.
+
+    \param  entries         The most entries to index per image, or 0 to not
+                            use an index.
+*/
+void fs_romdisk_set_index_size(size_t entries);
+
 __END_DECLS
 
 #endif  /* __KOS_FS_ROMDISK_H */
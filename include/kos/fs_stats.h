@@ -0,0 +1,137 @@
+/* KallistiOS ##version##
+
+   kos/fs_stats.h
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/** \file   kos/fs_stats.h
+    \brief  VFS I/O statistics.
+
+    This file provides counters and latency histograms for the operations done
+    through the VFS, kept for each filesystem and for each open file. They are
+    meant for finding out where time goes while loading: which filesystem is
+    slow, which files are read a little at a time, and how bad the worst cases
+    are.
+
+    Collecting statistics costs a couple of timer reads and a mutex per
+    operation, so it is off until fs_stats_enable() is called. Files opened
+    while it is off have no statistics of their own, but the operations done
+    on them are still counted against their filesystem once it is on.
+
+    The same information is available as text under /proc: /proc/vfs has the
+    statistics for each filesystem, /proc/files those of each open file, and
+    writing anything to /proc/reset calls fs_stats_reset().
+
+    \author KallistiOS Contributors
+*/
+
+#ifndef __KOS_FS_STATS_H
+#define __KOS_FS_STATS_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <kos/fs.h>
+
+/** \defgroup fs_stats_ops          VFS statistics operations
+
+    These are the indices into the ops array of fs_stats_t.
+
+    @{
+*/
+#define FS_STATS_OPEN       0   /**< \brief fs_open() */
+#define FS_STATS_READ       1   /**< \brief fs_read() and variants */
+#define FS_STATS_WRITE      2   /**< \brief fs_write() and variants */
+#define FS_STATS_SEEK       3   /**< \brief fs_seek(), fs_seek64() */
+#define FS_STATS_STAT       4   /**< \brief fs_stat(), fs_fstat() */
+#define FS_STATS_OPS        5   /**< \brief Number of operations */
+/** @} */
+
+/** \brief  Number of buckets in a latency histogram.
+
+    Bucket 0 counts operations that took less than a microsecond, and bucket n
+    those that took from 2^(n-1) up to 2^n microseconds. The last bucket
+    counts everything slower than that, which is about a quarter of a
+    second.
+*/
+#define FS_STATS_BUCKETS    20
+
+/** \brief  Statistics for one operation.
+    \headerfile kos/fs_stats.h
+*/
+typedef struct fs_stats_op {
+    uint32_t count;                     /**< \brief Number of calls */
+    uint32_t errors;                    /**< \brief Calls that failed */
+    uint64_t bytes;                     /**< \brief Bytes transferred */
+    uint64_t total_ns;                  /**< \brief Time spent, in total */
+    uint64_t max_ns;                    /**< \brief Slowest call */
+    uint32_t hist[FS_STATS_BUCKETS];    /**< \brief Latency histogram */
+} fs_stats_op_t;
+
+/** \brief  Statistics for a filesystem or a file.
+    \headerfile kos/fs_stats.h
+*/
+typedef struct fs_stats {
+    fs_stats_op_t ops[FS_STATS_OPS];    /**< \brief Per \ref fs_stats_ops */
+} fs_stats_t;
+
+/** \brief  Turn statistics collection on or off.
+    \param  enable          Nonzero to collect statistics.
+    \return                 Whether statistics were being collected before.
+*/
+int fs_stats_enable(int enable);
+
+/** \brief  Get the statistics for a filesystem.
+
+    \param  path            Any path on the filesystem (its mount point, for
+                            instance), or NULL for the totals of all
+                            filesystems.
+    \param  st              Where to store the statistics. If nothing has
+                            been recorded for the filesystem yet, it is
+                            filled with zeros.
+    \retval 0               On success.
+    \retval -1              If no filesystem handles the path (errno set to
+                            ENOENT).
+*/
+int fs_stats_get(const char *path, fs_stats_t *st);
+
+/** \brief  Get the statistics for an open file.
+
+    \param  fd              The file descriptor.
+    \param  st              Where to store the statistics.
+    \retval 0               On success.
+    \retval -1              On failure (errno set to EBADF for an invalid
+                            descriptor, or ENOENT if the file was opened while
+                            statistics were off).
+*/
+int fs_stats_get_fd(file_t fd, fs_stats_t *st);
+
+/** \brief  Reset all statistics to zero.
+
+    This resets the statistics of every filesystem and every open file, so
+    that a phase of a program (loading a level, say) can be measured on its
+    own.
+*/
+void fs_stats_reset(void);
+
+/** \cond */
+/* Used by the VFS. */
+struct fs_stats_file;
+
+uint64_t fs_stats_begin(void);
+void fs_stats_record(vfs_handler_t *vfs, struct fs_stats_file *f, int op,
+                     uint64_t start, ssize_t rv);
+struct fs_stats_file *fs_stats_file_open(vfs_handler_t *vfs,
+                                         const char *path);
+void fs_stats_file_close(struct fs_stats_file *f);
+void fs_stats_file_get(struct fs_stats_file *f, fs_stats_t *st);
+int fs_stats_init(void);
+int fs_stats_shutdown(void);
+/** \endcond */
+
+__END_DECLS
+
+#endif  /* __KOS_FS_STATS_H */
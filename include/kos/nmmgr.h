@@ -90,9 +90,13 @@ typedef struct nmmgr_handler {
 
 /** \brief  Retrieve a name handler by name.
 
-    This function will retrieve a name handler by its pathname.
+    This function will retrieve the handler responsible for a path name. That
+    is the handler with the longest name that is a prefix of the path (ignoring
+    case) and that ends on a path component boundary, so that a handler named
+    "/pc" is not used for "/pcx/file". The lookup takes time proportional to
+    the length of the path, regardless of how many handlers are registered.
 
-    \param  name            The handler to look up
+    \param  name            The path to look up
     \return                 The handler, or NULL on failure.
 */
 nmmgr_handler_t * nmmgr_lookup(const char *name);
@@ -108,10 +112,13 @@ nmmgr_list_t * nmmgr_get_list(void);
 
 /** \brief  Add a name handler.
 
-    This function adds a new name handler to the list in the kernel.
+    This function adds a new name handler to the list in the kernel. If a
+    handler with the same name already exists, the new one takes precedence
+    until it is removed.
 
     \param  hnd             The handler to add
     \retval 0               On success
+    \retval -1              On failure (errno set to ENOMEM)
 */
 int nmmgr_handler_add(nmmgr_handler_t *hnd);
 
@@ -75,6 +75,51 @@ void * memcpy2(void * dest, const void *src, size_t count);
 */
 void * memset2(void * s, unsigned short c, size_t count);
 
+/** \brief  Copy a block of memory, using cache-aware block transfers.
+
+    This function is identical to memcpy(), but is tuned for large copies on
+    the SH4. It prefetches the source a cache line ahead, allocates
+    destination cache lines without reading them from memory first (when the
+    destination is cached), and uses the store queues for large copies to
+    uncached memory. It handles any source and destination alignment, but
+    works best when both are 4-byte aligned.
+
+    Small copies are simply handed to memcpy().
+
+    \param  dest            The destination of the copy.
+    \param  src             The source to copy.
+    \param  count           The number of bytes to copy.
+    \return                 The original value of dest.
+*/
+void * memcpy_fast(void * dest, const void *src, size_t count);
+
+/** \brief  Move a block of memory, using cache-aware block transfers.
+
+    This function is identical to memmove(). Where the regions don't overlap
+    in a way that requires a backwards copy, it uses memcpy_fast(); otherwise
+    it falls back to memmove().
+
+    \param  dest            The destination of the move.
+    \param  src             The source to move.
+    \param  count           The number of bytes to move.
+    \return                 The original value of dest.
+*/
+void * memmove_fast(void * dest, const void *src, size_t count);
+
+/** \brief  Set a block of memory, using cache-aware block transfers.
+
+    This function is identical to memset(), but allocates destination cache
+    lines without reading them from memory first when the destination is
+    cached, and uses the store queues for large uncached destinations.
+
+    \param  s               The destination of the set.
+    \param  c               The value to set to (only the low 8 bits are
+                            used).
+    \param  count           The number of bytes to set.
+    \return                 The original value of s.
+*/
+void * memset_fast(void * s, int c, size_t count);
+
 __END_DECLS
 
 #endif  /* __KOS_STRING_H */
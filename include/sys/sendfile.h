@@ -0,0 +1,39 @@
+/* KallistiOS ##version##
+
+   sys/sendfile.h
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/** \file   sys/sendfile.h
+    \brief  Copying data between file descriptors.
+
+    This file provides the sendfile() call found on Linux, which copies data
+    from one file to another (usually a socket) without passing it through a
+    buffer in the program. It is implemented with fs_sendfile().
+
+    \author KallistiOS Contributors
+*/
+
+#ifndef __SYS_SENDFILE_H
+#define __SYS_SENDFILE_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+/** \brief  Copy data from one file descriptor to another.
+    \param  out_fd          The file descriptor to write to.
+    \param  in_fd           The file descriptor to read from.
+    \param  offset          If non-NULL, the offset in in_fd to read from,
+                            which is updated to just past the data copied. If
+                            NULL, reading starts at the file position of in_fd.
+    \param  count           The maximum number of bytes to copy.
+    \return                 The number of bytes copied, or -1 on failure.
+*/
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+__END_DECLS
+
+#endif /* __SYS_SENDFILE_H */
@@ -9,8 +9,8 @@
     \brief  Header for vector I/O.
 
     This file contains definitions for vector I/O operations, as specified by
-    the POSIX 2008 specification. Full vector-based I/O is not supported for
-    file operations, but the stuff in here is still useful elsewhere.
+    the POSIX 2008 specification. Filesystems can handle vector I/O natively;
+    for those that don't, it is done one buffer at a time.
 
     \author Lawrence Sebald
 */
@@ -36,6 +36,23 @@ struct iovec {
 /** \brief  Old alias for the maximum length of an iovec. */
 #define UIO_MAXIOV IOV_MAX
 
+/** \brief  Read from a file into several buffers.
+    \param  fd              The file descriptor to read from.
+    \param  iov             The buffers to read into.
+    \param  iovcnt          The number of entries in iov.
+    \return                 The total number of bytes read, or -1 on failure.
+*/
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** \brief  Write to a file from several buffers.
+    \param  fd              The file descriptor to write to.
+    \param  iov             The buffers to write from.
+    \param  iovcnt          The number of entries in iov.
+    \return                 The total number of bytes written, or -1 on
+                            failure.
+*/
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+
 __END_DECLS
 
 #endif /* __SYS_UIO_H */
@@ -704,7 +704,7 @@ static vfs_handler_t vh = {
         NMMGR_LIST_INIT
     },
 
-    0, NULL,    /* no cache, privdata */
+    VFS_CACHE_PAGES, NULL,  /* page cache, privdata */
 
     dcls_open,
     dcls_close,
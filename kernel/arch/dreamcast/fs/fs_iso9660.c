@@ -34,9 +34,17 @@ ISO9660 systems, as these were used as references as well.
 
 #include <kos/thread.h>
 #include <kos/mutex.h>
+#include <kos/rwsem.h>
 #include <kos/fs.h>
+#include <kos/fs_aio.h>
+#include <kos/fs_dcache.h>
+#include <kos/sem.h>
 #include <kos/opts.h>
 
+#include <arch/cache.h>
+
+#include <sys/queue.h>
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -47,6 +55,7 @@ ISO9660 systems, as these were used as references as well.
 
 static int init_percd(void);
 static int percd_done;
+static vfs_handler_t vh;
 
 /********************************************************************************/
 /* Low-level Joliet utils */
@@ -187,126 +196,386 @@ static uint32 iso_733(const uint8 *from) {
 
 
 /********************************************************************************/
-/* Low-level block cacheing routines. This implements a simple queue-based
-   LRU/MRU cacheing system. Whenever a block is requested, it will be placed
-   on the MRU end of the queue. As more blocks are loaded than can fit in
-   the cache, blocks are deleted from the LRU end. */
-
-/* Holds the data for one cache block, and a pointer to the next one.
-   As sectors are read from the disc, they are added to the front of
-   this cache. As the cache fills up, sectors are removed from the end
-   of it. */
-typedef struct {
-    uint32  sector;         /* CD sector */
-    uint8   data[2048];     /* Sector data */
+/* Low-level block cacheing routines. There are two caches, one for directory
+   (inode) sectors and one for file data, so that streaming a file doesn't
+   push the directories out. Each one is a fixed set of blocks, found through
+   a hash table on the sector number and kept on an LRU list: the most
+   recently used block is at the head, and the one at the tail is reused when
+   a sector that isn't in the cache is read.
+
+   A miss in the data cache can read several sectors with one command: the
+   rest of the sectors the caller asked for, and more when a file is being
+   read sequentially. They go into a staging buffer and are copied into
+   blocks from there, since the blocks at the end of the LRU list aren't next
+   to each other. */
+
+/* Holds the data for one cache block. The data itself lives in one 32-byte
+   aligned allocation for the whole cache. */
+typedef struct cache_block {
+    TAILQ_ENTRY(cache_block) lru;   /* LRU list */
+    struct cache_block *hnext;      /* Hash chain */
+    uint32  sector;                 /* CD sector, or -1 if unused */
+    uint8   *data;                  /* Sector data */
 } cache_block_t;
 
-/* List of cache blocks (ordered least recently used to most recently) */
-#define NUM_CACHE_BLOCKS 16
-static cache_block_t *icache[NUM_CACHE_BLOCKS];     /* inode cache */
-static cache_block_t *dcache[NUM_CACHE_BLOCKS];     /* data cache */
+typedef struct {
+    TAILQ_HEAD(iso_lru, cache_block) lru;
+    cache_block_t   *blocks;        /* All of the blocks */
+    cache_block_t   **buckets;      /* Hash table */
+    uint8           *data;          /* Data for all of the blocks */
+    size_t          nblocks;        /* Number of blocks */
+    size_t          nbuckets;       /* Number of buckets, a power of two */
+    size_t          want;           /* Size to use, in blocks */
+    uint8           *rabuf;         /* Staging buffer for multi-sector reads */
+    size_t          ramax;          /* Most sectors read with one command */
+    size_t          rawant;         /* Readahead to use, in sectors */
+    fs_iso9660_cache_stats_t stats;
+} iso_cache_t;
+
+static iso_cache_t icache = { .want = FS_ISO9660_CACHE_DEFAULT };   /* inode cache */
+static iso_cache_t dcache = { .want = FS_ISO9660_CACHE_DEFAULT,     /* data cache */
+                              .rawant = FS_ISO9660_READAHEAD_DEFAULT };
+
+/* Smallest readahead window, in sectors, once a file is read sequentially.
+   It doubles with every sequential read after that. */
+#define ISO_RA_MIN      4
+
+/* Fewest whole sectors read straight into the caller's buffer */
+#define ISO_DIRECT_MIN  2
 
 /* Cache modification mutex */
-static mutex_t cache_mutex;
+static mutex_t cache_mutex = MUTEX_INITIALIZER;
+
+/* Held for reading while the data in a cache block is in use, since that
+   happens without the mutex, and for writing while the caches are resized. */
+static rw_semaphore_t resize_sem = RWSEM_INITIALIZER;
+
+static size_t bhash(const iso_cache_t *cache, uint32 sector) {
+    return (sector ^ (sector >> 7)) & (cache->nbuckets - 1);
+}
+
+static cache_block_t *bfind(const iso_cache_t *cache, uint32 sector) {
+    cache_block_t *b;
+
+    for(b = cache->buckets[bhash(cache, sector)]; b; b = b->hnext) {
+        if(b->sector == sector)
+            break;
+    }
+
+    return b;
+}
+
+/* Take a block out of its hash chain. */
+static void bunhash(iso_cache_t *cache, cache_block_t *b) {
+    cache_block_t **pp = &cache->buckets[bhash(cache, b->sector)];
+
+    while(*pp != b)
+        pp = &(*pp)->hnext;
+
+    *pp = b->hnext;
+}
+
+/* Marks all of the blocks unused. Must be called with the mutex held. */
+static void breset_cache(iso_cache_t *cache) {
+    size_t i;
+
+    TAILQ_INIT(&cache->lru);
+
+    for(i = 0; i < cache->nbuckets; i++)
+        cache->buckets[i] = NULL;
+
+    for(i = 0; i < cache->nblocks; i++) {
+        cache->blocks[i].sector = (uint32)-1;
+        cache->blocks[i].hnext = NULL;
+        TAILQ_INSERT_TAIL(&cache->lru, &cache->blocks[i], lru);
+    }
+
+    cache->stats.used = 0;
+}
 
 /* Clears all cache blocks */
-static void bclear_cache(cache_block_t **cache) {
-    int i;
+static void bclear_cache(iso_cache_t *cache) {
+    mutex_lock(&cache_mutex);
+    breset_cache(cache);
+    mutex_unlock(&cache_mutex);
+}
+
+static void bfree_cache(iso_cache_t *cache) {
+    free(cache->blocks);
+    free(cache->buckets);
+    free(cache->data);
+    free(cache->rabuf);
+    cache->blocks = NULL;
+    cache->buckets = NULL;
+    cache->data = NULL;
+    cache->rabuf = NULL;
+    cache->nblocks = cache->nbuckets = 0;
+    cache->ramax = 1;
+    cache->stats.size = cache->stats.used = 0;
+    TAILQ_INIT(&cache->lru);
+}
+
+/* Set up a cache with cache->want blocks, and a staging buffer for up to
+   cache->rawant sectors of readahead. A single read can't fill more than
+   half of the cache. Everything in it is dropped. */
+static int balloc_cache(iso_cache_t *cache) {
+    cache_block_t *blocks, **buckets;
+    uint8 *data, *rabuf = NULL;
+    size_t i, nbuckets, ramax;
+
+    for(nbuckets = 1; nbuckets < cache->want; nbuckets <<= 1)
+        ;
+
+    ramax = cache->rawant < cache->want / 2 ? cache->rawant : cache->want / 2;
+
+    if(ramax < 2)
+        ramax = 1;
+
+    blocks = (cache_block_t *)malloc(cache->want * sizeof(cache_block_t));
+    buckets = (cache_block_t **)malloc(nbuckets * sizeof(cache_block_t *));
+    data = (uint8 *)memalign(32, cache->want * 2048);
+
+    if(ramax > 1)
+        rabuf = (uint8 *)memalign(32, ramax * 2048);
+
+    if(!blocks || !buckets || !data || (ramax > 1 && !rabuf)) {
+        free(blocks);
+        free(buckets);
+        free(data);
+        free(rabuf);
+        errno = ENOMEM;
+        return -1;
+    }
 
     mutex_lock(&cache_mutex);
 
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        cache[i]->sector = (uint32)-1;
+    bfree_cache(cache);
+    cache->blocks = blocks;
+    cache->buckets = buckets;
+    cache->data = data;
+    cache->rabuf = rabuf;
+    cache->ramax = ramax;
+    cache->nblocks = cache->stats.size = cache->want;
+    cache->nbuckets = nbuckets;
+
+    for(i = 0; i < cache->nblocks; i++)
+        blocks[i].data = data + i * 2048;
+
+    breset_cache(cache);
 
     mutex_unlock(&cache_mutex);
-}
 
-/* Graduate a block from its current position to the MRU end of the cache */
-static void bgrad_cache(cache_block_t **cache, int block) {
-    int     i;
-    cache_block_t   *tmp;
+    return 0;
+}
 
-    /* Don't try it with the end block */
-    if(block < 0 || block >= (NUM_CACHE_BLOCKS - 1)) return;
+/* Take the least recently used block to put a new sector in. Unused blocks
+   are kept at the end, so they go first. The block is left unused until it
+   is passed to binsert(). Must be called with the mutex held. */
+static cache_block_t *btake(iso_cache_t *cache) {
+    cache_block_t *b = TAILQ_LAST(&cache->lru, iso_lru);
+
+    if(b->sector != (uint32)-1) {
+        cache->stats.evictions++;
+        cache->stats.used--;
+        bunhash(cache, b);
+        b->sector = (uint32)-1;
+    }
 
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+    return b;
+}
 
-    for(i = block; i < (NUM_CACHE_BLOCKS - 1); i++)
-        cache[i] = cache[i + 1];
+/* Put a block that has been filled in into the hash table, as the most
+   recently used one. Must be called with the mutex held. */
+static void binsert(iso_cache_t *cache, cache_block_t *b, uint32 sector) {
+    cache->stats.used++;
+    b->sector = sector;
+    b->hnext = cache->buckets[bhash(cache, sector)];
+    cache->buckets[bhash(cache, sector)] = b;
 
-    cache[NUM_CACHE_BLOCKS - 1] = tmp;
+    TAILQ_REMOVE(&cache->lru, b, lru);
+    TAILQ_INSERT_HEAD(&cache->lru, b, lru);
 }
 
-/* Pulls the requested sector into a cache block and returns the cache
-   block index. Note that the sector in question may already be in the
-   cache, in which case it just returns the containing block. */
+/* Pulls the requested sector into a cache block and returns the block. Note
+   that the sector in question may already be in the cache, in which case it
+   just returns the containing block. Otherwise, up to count sectors starting
+   with it are read with one command, stopping before the first one that is
+   in the cache already. */
 static void iso_break_all(void);
-static int bread_cache(cache_block_t **cache, uint32 sector) {
-    int i, j, rv;
+static cache_block_t *bread_cache(iso_cache_t *cache, uint32 sector,
+                                  size_t count) {
+    cache_block_t *b;
+    size_t i, n;
+    int j;
 
-    rv = -1;
     mutex_lock(&cache_mutex);
 
     /* Look for a pre-existing cache block */
-    for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
-        if(cache[i]->sector == sector) {
-            bgrad_cache(cache, i);
-            rv = NUM_CACHE_BLOCKS - 1;
-            goto bread_exit;
-        }
+    if((b = bfind(cache, sector))) {
+        cache->stats.hits++;
+        TAILQ_REMOVE(&cache->lru, b, lru);
+        TAILQ_INSERT_HEAD(&cache->lru, b, lru);
+        goto bread_exit;
     }
 
-    /* If not, look for an open cache slot; if we find one, use it */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        if(cache[i]->sector == (uint32)-1) break;
-    }
+    cache->stats.misses++;
+
+    if(count > cache->ramax)
+        count = cache->ramax;
 
-    /* If we didn't find one, kick an LRU block out of cache */
-    if(i >= NUM_CACHE_BLOCKS) {
-        i = 0;
+    for(n = 1; n < count && !bfind(cache, sector + n); n++)
+        ;
+
+    if(n == 1) {
+        /* Load the requested block */
+        b = btake(cache);
+        j = cdrom_read_sectors(b->data, sector + 150, 1);
+
+        /* If it failed, the block stays at the end of the list, unused. */
     }
+    else {
+        /* Load all of them, then fill in blocks last to first so that the
+           requested one ends up most recently used. */
+        dcache_inval_range((uintptr_t)cache->rabuf, n * 2048);
+        j = cdrom_read_sectors_ex(cache->rabuf, sector + 150, n,
+                                  CDROM_READ_DMA);
+
+        if(j == ERR_OK) {
+            for(i = n; i-- > 0;) {
+                b = btake(cache);
+                memcpy(b->data, cache->rabuf + i * 2048, 2048);
+                binsert(cache, b, sector + i);
+            }
 
-    /* Load the requested block */
-    j = cdrom_read_sectors(cache[i]->data, sector + 150, 1);
+            cache->stats.readahead += n - 1;
+            goto bread_exit;
+        }
+    }
 
-    if(j < 0) {
+    if(j != ERR_OK) {
         //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors for %d: %d\n",
         //  sector+150, j);
+        mutex_unlock(&cache_mutex);
+
+        /* This clears the caches, so it can't be done with the mutex held. */
         if(j == ERR_DISC_CHG || j == ERR_NO_DISC) {
             init_percd();
         }
 
-        rv = -1;
-        goto bread_exit;
+        return NULL;
     }
 
-    cache[i]->sector = sector;
-
-    /* Move it to the most-recently-used position */
-    bgrad_cache(cache, i);
-    rv = NUM_CACHE_BLOCKS - 1;
+    binsert(cache, b, sector);
 
-    /* Return the new cache block index */
+    /* Return the new cache block */
 bread_exit:
     mutex_unlock(&cache_mutex);
+    return b;
+}
+
+/* Tell whether a sector is in a cache, without reading it */
+static int bcached(iso_cache_t *cache, uint32 sector) {
+    int rv;
+
+    mutex_lock(&cache_mutex);
+    rv = bfind(cache, sector) != NULL;
+    mutex_unlock(&cache_mutex);
+
     return rv;
 }
 
-/* read data block */
-static int bdread(uint32 sector) {
-    return bread_cache(dcache, sector);
+/* read data block, and up to count - 1 more after it on a miss */
+static cache_block_t *bdread(uint32 sector, size_t count) {
+    return bread_cache(&dcache, sector, count);
 }
 
 /* read inode block */
-static int biread(uint32 sector) {
-    return bread_cache(icache, sector);
+static cache_block_t *biread(uint32 sector) {
+    return bread_cache(&icache, sector, 1);
 }
 
 /* Clear both caches */
 static void bclear(void) {
-    bclear_cache(dcache);
-    bclear_cache(icache);
+    bclear_cache(&dcache);
+    bclear_cache(&icache);
+}
+
+int fs_iso9660_set_cache_size(size_t dir_bytes, size_t data_bytes) {
+    size_t dir_blocks = (dir_bytes + 2047) / 2048;
+    size_t data_blocks = (data_bytes + 2047) / 2048;
+    size_t old_dir, old_data;
+    int rv = 0;
+
+    if(!dir_blocks || !data_blocks) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rwsem_write_lock(&resize_sem);
+
+    old_dir = icache.want;
+    old_data = dcache.want;
+    icache.want = dir_blocks;
+    dcache.want = data_blocks;
+
+    /* If we haven't been initialized yet, this is used when we are. A cache
+       that can't be reallocated keeps the size it had. */
+    if(icache.blocks) {
+        if(icache.nblocks != dir_blocks && balloc_cache(&icache) < 0) {
+            icache.want = old_dir;
+            rv = -1;
+        }
+
+        if(dcache.nblocks != data_blocks && balloc_cache(&dcache) < 0) {
+            dcache.want = old_data;
+            rv = -1;
+        }
+    }
+
+    rwsem_write_unlock(&resize_sem);
+
+    return rv;
+}
+
+int fs_iso9660_set_readahead(size_t bytes) {
+    size_t old;
+    int rv = 0;
+
+    rwsem_write_lock(&resize_sem);
+
+    old = dcache.rawant;
+    dcache.rawant = bytes / 2048;
+
+    /* If we haven't been initialized yet, this is used when we are. */
+    if(dcache.blocks && balloc_cache(&dcache) < 0) {
+        dcache.rawant = old;
+        rv = -1;
+    }
+
+    rwsem_write_unlock(&resize_sem);
+
+    return rv;
+}
+
+void fs_iso9660_get_cache_stats(fs_iso9660_cache_stats_t *dir,
+                                fs_iso9660_cache_stats_t *data) {
+    mutex_lock(&cache_mutex);
+
+    if(dir)
+        *dir = icache.stats;
+
+    if(data)
+        *data = dcache.stats;
+
+    mutex_unlock(&cache_mutex);
+}
+
+void fs_iso9660_reset_cache_stats(void) {
+    mutex_lock(&cache_mutex);
+    icache.stats.hits = icache.stats.misses = icache.stats.evictions = 0;
+    dcache.stats.hits = dcache.stats.misses = dcache.stats.evictions = 0;
+    icache.stats.readahead = dcache.stats.readahead = 0;
+    mutex_unlock(&cache_mutex);
 }
 
 /********************************************************************************/
@@ -325,7 +594,8 @@ static iso_dirent_t root_dirent;
 /* Per-disc initialization; this is done every time it's discovered that
    a new CD has been inserted. */
 static int init_percd(void) {
-    int     i, blk;
+    int     i;
+    cache_block_t *blk;
     CDROM_TOC   toc;
 
     dbglog(DBG_NOTICE, "fs_iso9660: disc change detected\n");
@@ -333,6 +603,9 @@ static int init_percd(void) {
     /* Start off with no cached blocks and no open files*/
     iso_reset();
 
+    /* Anything we looked up on the old disc is meaningless now */
+    fs_dcache_invalidate(&vh, NULL);
+
     /* Locate the root session */
     if((i = cdrom_reinit()) != 0) {
         dbglog(DBG_ERROR, "fs_iso9660:init_percd: cdrom_reinit returned %d\n", i);
@@ -351,10 +624,10 @@ static int init_percd(void) {
     for(i = 1; i <= 3; i++) {
         blk = biread(session_base + i + 16 - 150);
 
-        if(blk < 0) return blk;
+        if(!blk) return -1;
 
-        if(memcmp((char *)icache[blk]->data, "\02CD001", 6) == 0) {
-            joliet = isjoliet((char *)icache[blk]->data + 88);
+        if(memcmp((char *)blk->data, "\02CD001", 6) == 0) {
+            joliet = isjoliet((char *)blk->data + 88);
             dbglog(DBG_NOTICE, "  (joliet level %d extensions detected)\n", joliet);
 
             if(joliet) break;
@@ -366,16 +639,16 @@ static int init_percd(void) {
         /* Grab and check the volume descriptor */
         blk = biread(session_base + 16 - 150);
 
-        if(blk < 0) return i;
+        if(!blk) return -1;
 
-        if(memcmp((char*)icache[blk]->data, "\01CD001", 6)) {
+        if(memcmp((char*)blk->data, "\01CD001", 6)) {
             dbglog(DBG_ERROR, "fs_iso9660: disc is not iso9660\r\n");
             return -1;
         }
     }
 
     /* Locate the root directory */
-    memcpy(&root_dirent, icache[blk]->data + 156, sizeof(iso_dirent_t));
+    memcpy(&root_dirent, blk->data + 156, sizeof(iso_dirent_t));
     root_extent = iso_733(root_dirent.extent);
     root_size = iso_733(root_dirent.size);
 
@@ -424,7 +697,8 @@ static int fncompare(const char *isofn, int isosize, const char *normalfn) {
  */
 static iso_dirent_t *find_object(const char *fn, int dir,
                                  uint32 dir_extent, uint32 dir_size) {
-    int     i, c;
+    int     i;
+    cache_block_t *c;
     iso_dirent_t    *de;
 
     /* RockRidge */
@@ -447,11 +721,11 @@ static iso_dirent_t *find_object(const char *fn, int dir,
     while(size_left > 0) {
         c = biread(dir_extent);
 
-        if(c < 0) return NULL;
+        if(!c) return NULL;
 
         for(i = 0; i < 2048 && i < size_left;) {
             /* Locate the current dirent */
-            de = (iso_dirent_t *)(icache[c]->data + i);
+            de = (iso_dirent_t *)(c->data + i);
 
             if(!de->length) break;
 
@@ -521,46 +795,376 @@ static iso_dirent_t *find_object(const char *fn, int dir,
     return NULL;
 }
 
+/* Helper function for readdir: post-processes an ISO filename to make
+   it a bit prettier. */
+static void fn_postprocess(char *fnin) {
+    char    * fn = fnin;
+
+    while(*fn && *fn != ';') {
+        *fn = tolower((int) * fn);
+        fn++;
+    }
+
+    *fn = 0;
+
+    /* Strip trailing dots */
+    if(fn > fnin && fn[-1] == '.') {
+        fn[-1] = 0;
+    }
+}
+
+/* Get the name of a directory entry the way readdir shows it: the Joliet
+   name in UTF-8, the Rock Ridge name, or the ISO9660 name made prettier. */
+static void iso_dirent_name(const iso_dirent_t *de, char *name) {
+    /* RockRidge */
+    int     len;
+    const uint8 *pnt;
+
+    if(joliet) {
+        ucs2utfn((uint8 *)name, (const uint8 *)de->name, de->name_len);
+        return;
+    }
+
+    strncpy(name, de->name, de->name_len);
+    name[de->name_len] = 0;
+    fn_postprocess(name);
+
+    /* Check for Rock Ridge NM extension */
+    len = de->length - sizeof(iso_dirent_t) + sizeof(de->name) - de->name_len;
+    pnt = (const uint8 *)de + sizeof(iso_dirent_t) - sizeof(de->name) +
+          de->name_len;
+
+    if((de->name_len & 1) == 0) {
+        pnt++;
+        len--;
+    }
+
+    while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
+        if(strncmp((const char *)pnt, "NM", 2) == 0) {
+            strncpy(name, (const char *)(pnt + 5), pnt[2] - 5);
+            name[pnt[2] - 5] = 0;
+        }
+
+        len -= pnt[2];
+        pnt += pnt[2];
+    }
+}
+
+/********************************************************************************/
+/* Directory tables. The first time a directory is searched, all of its
+   entries are read into a table with a hash on their names, so that looking
+   something else up in it later doesn't read and scan its sectors again.
+   Tables are kept on an LRU list up to a total size, and all of them are
+   dropped when the disc changes. */
+
+/* One entry of a directory table */
+typedef struct {
+    uint32  extent;         /* First sector */
+    uint32  size;           /* Size in bytes */
+    uint32  name;           /* Offset of the name in the name pool */
+    uint32  next;           /* Next entry in the hash chain, or -1 */
+    uint8   flags;          /* ISO9660 file flags */
+} iso_dent_t;
+
+typedef struct iso_dirtab {
+    TAILQ_ENTRY(iso_dirtab) lru;    /* LRU list */
+    struct iso_dirtab *hnext;       /* Hash chain */
+    uint32      extent;     /* First sector of the directory */
+    uint32      count;      /* Number of entries */
+    uint32      nbuckets;   /* Number of name hash buckets, a power of two */
+    uint32      *buckets;   /* First entry in each hash chain, or -1 */
+    iso_dent_t  *ents;      /* Entries, in directory order */
+    char        *names;     /* Name pool */
+    size_t      bytes;      /* Memory used by all of the above */
+} iso_dirtab_t;
+
+/* Tables by the extent of their directory */
+#define DIRTAB_BUCKETS  64
+
+static TAILQ_HEAD(iso_dirtab_list, iso_dirtab) dirtabs =
+    TAILQ_HEAD_INITIALIZER(dirtabs);
+static iso_dirtab_t *dirtab_buckets[DIRTAB_BUCKETS];
+static size_t dirtab_bytes, dirtab_max = FS_ISO9660_DIR_TABLE_DEFAULT;
+static uint32 dirtab_gen;
+static mutex_t dirtab_mutex = MUTEX_INITIALIZER;
+
+/* Hash a name without regard to case */
+static uint32 dirtab_hash(const char *name, size_t len) {
+    uint32 h = 2166136261U;
+
+    while(len--)
+        h = (h ^ (uint8)tolower((int)(uint8)*name++)) * 16777619U;
+
+    return h;
+}
+
+static void dirtab_free(iso_dirtab_t *d) {
+    free(d->buckets);
+    free(d->ents);
+    free(d->names);
+    free(d);
+}
+
+/* Find the table of a directory. Must be called with the mutex held. */
+static iso_dirtab_t *dirtab_find(uint32 extent) {
+    iso_dirtab_t *d;
+
+    for(d = dirtab_buckets[extent % DIRTAB_BUCKETS]; d; d = d->hnext) {
+        if(d->extent == extent)
+            break;
+    }
+
+    return d;
+}
+
+/* Drop a table. Must be called with the mutex held. */
+static void dirtab_drop(iso_dirtab_t *d) {
+    iso_dirtab_t **pp = &dirtab_buckets[d->extent % DIRTAB_BUCKETS];
+
+    while(*pp != d)
+        pp = &(*pp)->hnext;
+
+    *pp = d->hnext;
+    TAILQ_REMOVE(&dirtabs, d, lru);
+    dirtab_bytes -= d->bytes;
+    dirtab_free(d);
+}
+
+/* Drop tables until they fit in max bytes. Must be called with the mutex
+   held. */
+static void dirtab_trim(size_t max) {
+    while(dirtab_bytes > max)
+        dirtab_drop(TAILQ_LAST(&dirtabs, iso_dirtab_list));
+}
+
+/* Drop all of the tables */
+static void dirtab_clear(void) {
+    mutex_lock(&dirtab_mutex);
+    dirtab_trim(0);
+    dirtab_gen++;
+    mutex_unlock(&dirtab_mutex);
+}
+
+/* Read a directory into a new table. Returns NULL if it can't be read or
+   there isn't enough memory. */
+static iso_dirtab_t *dirtab_load(uint32 extent, uint32 size) {
+    iso_dirtab_t *d;
+    cache_block_t *c;
+    iso_dirent_t *de;
+    iso_dent_t *ents;
+    char name[NAME_MAX * 2], *names;   /* Joliet names can be 381 bytes */
+    uint32 ecap = 0, ncap = 0, nlen = 0, h;
+    int i, size_left = (int)size;
+    size_t len;
+
+    if(!(d = (iso_dirtab_t *)calloc(1, sizeof(iso_dirtab_t))))
+        return NULL;
+
+    d->extent = extent;
+
+    while(size_left > 0) {
+        if(!(c = biread(extent)))
+            goto fail;
+
+        for(i = 0; i < 2048 && i < size_left;) {
+            de = (iso_dirent_t *)(c->data + i);
+
+            if(!de->length) break;
+
+            i += de->length;
+
+            /* Skip . and .. */
+            if(de->name_len == 1 && (uint8)de->name[0] <= 1)
+                continue;
+
+            iso_dirent_name(de, name);
+            len = strlen(name) + 1;
+
+            if(d->count == ecap) {
+                ecap = ecap ? ecap * 2 : 16;
+
+                if(!(ents = (iso_dent_t *)realloc(d->ents,
+                                                  ecap * sizeof(iso_dent_t))))
+                    goto fail;
+
+                d->ents = ents;
+            }
+
+            if(nlen + len > ncap) {
+                while(nlen + len > ncap)
+                    ncap = ncap ? ncap * 2 : 256;
+
+                if(!(names = (char *)realloc(d->names, ncap)))
+                    goto fail;
+
+                d->names = names;
+            }
+
+            memcpy(d->names + nlen, name, len);
+            d->ents[d->count].extent = iso_733(de->extent);
+            d->ents[d->count].size = iso_733(de->size);
+            d->ents[d->count].flags = de->flags;
+            d->ents[d->count].name = nlen;
+            d->count++;
+            nlen += len;
+        }
+
+        extent++;
+        size_left -= 2048;
+    }
+
+    for(d->nbuckets = 1; d->nbuckets < d->count; d->nbuckets <<= 1)
+        ;
+
+    if(!(d->buckets = (uint32 *)malloc(d->nbuckets * sizeof(uint32))))
+        goto fail;
+
+    memset(d->buckets, 0xff, d->nbuckets * sizeof(uint32));
+
+    /* Chains are built from the end so that they're in directory order, and
+       the first match is the same one a scan would find. */
+    for(h = d->count; h-- > 0;) {
+        i = dirtab_hash(d->names + d->ents[h].name,
+                        strlen(d->names + d->ents[h].name)) &
+            (d->nbuckets - 1);
+        d->ents[h].next = d->buckets[i];
+        d->buckets[i] = h;
+    }
+
+    d->bytes = sizeof(iso_dirtab_t) + ecap * sizeof(iso_dent_t) + ncap +
+               d->nbuckets * sizeof(uint32);
+
+    return d;
+
+fail:
+    dirtab_free(d);
+    return NULL;
+}
+
+/* Look a name up in a table, the same way find_object does. */
+static int dirtab_search(const iso_dirtab_t *d, const char *fn, size_t len,
+                         int dir, uint32 *extent, uint32 *size) {
+    const iso_dent_t *e;
+    uint32 i;
+
+    for(i = d->buckets[dirtab_hash(fn, len) & (d->nbuckets - 1)];
+        i != (uint32)-1; i = e->next) {
+        e = &d->ents[i];
+
+        if(!strncasecmp(d->names + e->name, fn, len) &&
+           !d->names[e->name + len] && !((dir << 1) ^ e->flags)) {
+            *extent = e->extent;
+            *size = e->size;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Keep a new table, unless another thread beat us to it, the disc changed
+   while it was being read, or it's too big. */
+static void dirtab_add(iso_dirtab_t *d, uint32 gen) {
+    mutex_lock(&dirtab_mutex);
+
+    if(gen != dirtab_gen || d->bytes > dirtab_max || dirtab_find(d->extent)) {
+        mutex_unlock(&dirtab_mutex);
+        dirtab_free(d);
+        return;
+    }
+
+    dirtab_trim(dirtab_max - d->bytes);
+
+    d->hnext = dirtab_buckets[d->extent % DIRTAB_BUCKETS];
+    dirtab_buckets[d->extent % DIRTAB_BUCKETS] = d;
+    TAILQ_INSERT_HEAD(&dirtabs, d, lru);
+    dirtab_bytes += d->bytes;
+
+    mutex_unlock(&dirtab_mutex);
+}
+
+void fs_iso9660_set_dir_table_size(size_t bytes) {
+    mutex_lock(&dirtab_mutex);
+    dirtab_max = bytes;
+    dirtab_trim(bytes);
+    mutex_unlock(&dirtab_mutex);
+}
+
+/* Look up one part of a path in a directory, given by its extent and size.
+   On success, they are replaced by those of what was found. */
+static int find_entry(const char *fn, int dir, uint32 *extent, uint32 *size) {
+    iso_dirtab_t *d;
+    iso_dirent_t *de;
+    size_t len = strcspn(fn, "/");
+    uint32 gen;
+    int rv;
+
+    mutex_lock(&dirtab_mutex);
+
+    if((d = dirtab_find(*extent))) {
+        TAILQ_REMOVE(&dirtabs, d, lru);
+        TAILQ_INSERT_HEAD(&dirtabs, d, lru);
+        rv = dirtab_search(d, fn, len, dir, extent, size);
+        mutex_unlock(&dirtab_mutex);
+        return rv;
+    }
+
+    gen = dirtab_gen;
+    mutex_unlock(&dirtab_mutex);
+
+    /* The directory is read without the mutex held, since a read error can
+       reset everything. */
+    if(dirtab_max && (d = dirtab_load(*extent, *size))) {
+        rv = dirtab_search(d, fn, len, dir, extent, size);
+        dirtab_add(d, gen);
+        return rv;
+    }
+
+    /* If there's no table, scan the directory instead */
+    if(!(de = find_object(fn, dir, *extent, *size)))
+        return -1;
+
+    *extent = iso_733(de->extent);
+    *size = iso_733(de->size);
+    return 0;
+}
+
 /* Locate an ISO9660 object anywhere on the disc, starting at the root,
    and expecting a fully qualified path name. This is analogous to find_object
    but it searches with the path in mind.
 
-   fn:      object filename (relative to the passed directory)
+   fn:      object filename (relative to the root directory)
    dir:     0 if looking for a file, 1 if looking for a dir
-   dir_extent:  directory extent to start with
-   dir_size:    directory size (in bytes)
+   extent:  where to store the object's extent
+   size:    where to store the object's size (in bytes)
 
-   It will return a pointer to a transient dirent buffer (i.e., don't
-   expect this buffer to stay around much longer than the call itself).
+   It will return 0 if the object was found, or -1 if not.
  */
-static iso_dirent_t *find_object_path(const char *fn, int dir, iso_dirent_t *start) {
+static int find_object_path(const char *fn, int dir, uint32 *extent,
+                            uint32 *size) {
     char        *cur;
 
+    *extent = root_extent;
+    *size = root_size;
+
     /* If the object is in a sub-tree, traverse the trees looking
        for the right directory */
     while((cur = strchr(fn, '/'))) {
         if(cur != fn) {
-            /* Note: trailing path parts don't matter since find_object
-               only compares based on the FN length on the disc. */
-            start = find_object(fn, 1, iso_733(start->extent), iso_733(start->size));
-
-            if(start == NULL) return NULL;
+            /* Note: trailing path parts don't matter since find_entry
+               only compares the first part of the name. */
+            if(find_entry(fn, 1, extent, size) < 0)
+                return -1;
         }
 
         fn = cur + 1;
     }
 
     /* Locate the file in the resulting directory */
-    if(*fn) {
-        start = find_object(fn, dir, iso_733(start->extent), iso_733(start->size));
-        return start;
-    }
-    else {
-        if(!dir)
-            return NULL;
-        else
-            return start;
-    }
+    if(*fn)
+        return find_entry(fn, dir, extent, size);
+    else
+        return dir ? 0 : -1;
 }
 
 /********************************************************************************/
@@ -575,6 +1179,8 @@ static struct {
     uint32      size;       /* Length of file in bytes */
     dirent_t    dirent;     /* A static dirent to pass back to clients */
     int     broken;     /* >0 if the CD has been swapped out since open */
+    uint32      ra_next;    /* Sector after the end of the last read */
+    uint32      ra_win;     /* Readahead window, in sectors */
 } fh[FS_CD_MAX_FILES];
 
 /* Mutex for file handles */
@@ -598,24 +1204,42 @@ static void iso_break_all(void) {
 /* Open a file or directory */
 static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
     file_t      fd;
-    iso_dirent_t    *de;
-
-    (void)vfs;
+    uint64_t    cached;
+    uint32      extent, size;
+    int         dir = (mode & O_DIR) ? 1 : 0;
 
     /* Make sure they don't want to open things as writeable */
     if((mode & O_MODE_MASK) != O_RDONLY)
         return 0;
 
+    /* The directory lookups below use cache blocks in place */
+    rwsem_read_lock(&resize_sem);
+
     /* Do this only when we need to (this is still imperfect) */
-    if(!percd_done && init_percd() < 0)
+    if(!percd_done && init_percd() < 0) {
+        rwsem_read_unlock(&resize_sem);
         return 0;
+    }
 
     percd_done = 1;
 
-    /* Find the file we want */
-    de = find_object_path(fn, (mode & O_DIR) ? 1 : 0, &root_dirent);
+    /* Find the file we want, unless we've already found it on this disc.
+       The VFS doesn't do any caching for us (it can't see disc changes), so
+       the extent and size are remembered here instead. */
+    if(fs_dcache_get(vfs, fn, dir, &cached)) {
+        extent = (uint32)(cached >> 32);
+        size = (uint32)cached;
+    }
+    else {
+        if(find_object_path(fn, dir, &extent, &size) < 0) {
+            rwsem_read_unlock(&resize_sem);
+            return 0;
+        }
+
+        fs_dcache_put(vfs, fn, dir, ((uint64_t)extent << 32) | size);
+    }
 
-    if(!de) return 0;
+    rwsem_read_unlock(&resize_sem);
 
     /* Find a free file handle */
     mutex_lock(&fh_mutex);
@@ -632,11 +1256,13 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
         return 0;
 
     /* Fill in the file handle and return the fd */
-    fh[fd].first_extent = iso_733(de->extent);
-    fh[fd].dir = (mode & O_DIR) ? 1 : 0;
+    fh[fd].first_extent = extent;
+    fh[fd].dir = dir;
     fh[fd].ptr = 0;
-    fh[fd].size = iso_733(de->size);
+    fh[fd].size = size;
     fh[fd].broken = 0;
+    fh[fd].ra_next = 0;
+    fh[fd].ra_win = 0;
 
     return (void *)fd;
 }
@@ -653,72 +1279,269 @@ static int iso_close(void * h) {
     return 0;
 }
 
-/* Read from a file */
-static ssize_t iso_read(void * h, void *buf, size_t bytes) {
+/* Read from a file at the given position. Runs of whole sectors at least as
+   long as the readahead window are read straight into the caller's buffer
+   with a single command, and so is any whole sector if direct is set. The
+   rest goes through the cache, where a miss reads the rest of the sectors
+   this call needs and the readahead window with one command.
+
+   The window opens when a read starts where the last one stopped, doubles
+   with each read that does so (up to what the cache allows), and closes
+   when one doesn't. */
+static ssize_t iso_read_at(file_t fd, void *buf, size_t bytes, uint32 pos,
+                           int direct) {
     int rv, toread, thissect, c;
+    uint32 sector, want, left;
+    cache_block_t *b;
     uint8 * outbuf;
-    file_t fd = (file_t)h;
 
     /* Check that the fd is valid */
-    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken)
+    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken) {
+        errno = EBADF;
         return -1;
+    }
 
     rv = 0;
     outbuf = (uint8 *)buf;
 
-    /* Read zero or more sectors into the buffer from the current pos */
-    while(bytes > 0) {
-        /* Figure out how much we still need to read */
-        toread = (bytes > (fh[fd].size - fh[fd].ptr)) ?
-                 fh[fd].size - fh[fd].ptr : bytes;
+    /* Adjust the readahead window */
+    if(pos / 2048 != fh[fd].ra_next && pos / 2048 + 1 != fh[fd].ra_next)
+        fh[fd].ra_win = 0;
+    else if(!fh[fd].ra_win)
+        fh[fd].ra_win = ISO_RA_MIN;
+    else if(fh[fd].ra_win < dcache.ramax)
+        fh[fd].ra_win <<= 1;
+
+    if(fh[fd].ra_win > dcache.ramax)
+        fh[fd].ra_win = dcache.ramax;
 
-        if(toread == 0) break;
+    /* Read zero or more sectors into the buffer from the given pos */
+    while(bytes > 0 && pos < fh[fd].size) {
+        /* Figure out how much we still need to read */
+        toread = (bytes > (fh[fd].size - pos)) ? fh[fd].size - pos : bytes;
 
         /* How much more can we read in the current sector? */
-        thissect = 2048 - (fh[fd].ptr % 2048);
-
-        /* If we're on a sector boundary and we have more than one
-           full sector to read, then short-circuit the cache here
-           and use the multi-sector reads from the CD unit (this
-           should theoretically be a lot faster) */
-        /* XXX This code isn't actually faster, but I'm leaving it
-           here commented out in case we could find a better use
-           for it later than speed (i.e., preventing thread context
-           switches). */
-        /* if(thissect == 2048 && toread >= 2048) {
-            // Round it off to an even sector count
+        thissect = 2048 - (pos % 2048);
+        sector = fh[fd].first_extent + pos / 2048;
+
+        if(thissect == 2048 && toread >= 2048 && !((uintptr_t)outbuf & 1) &&
+           (direct || (toread / 2048 >= ISO_DIRECT_MIN &&
+                       (uint32)toread / 2048 >= fh[fd].ra_win &&
+                       !bcached(&dcache, sector)))) {
+            /* Round it off to an even sector count */
             thissect = toread / 2048;
             toread = thissect * 2048;
 
-            printf("cdrom: short-circuit read for %d sectors\n",
-                thissect);
+            /* DMA needs a 32-byte aligned buffer; anything else is read
+               with PIO. */
+            if(!((uintptr_t)outbuf & 31)) {
+                dcache_inval_range((uintptr_t)outbuf, toread);
+                c = cdrom_read_sectors_ex(outbuf, sector + 150, thissect,
+                                          CDROM_READ_DMA);
+            }
+            else {
+                c = cdrom_read_sectors(outbuf, sector + 150, thissect);
+            }
+
+            if(c != ERR_OK) {
+                if(c == ERR_DISC_CHG || c == ERR_NO_DISC) {
+                    rwsem_read_lock(&resize_sem);
+                    init_percd();
+                    rwsem_read_unlock(&resize_sem);
+                }
 
-            // Do the read
-            if(cdrom_read_sectors(outbuf,
-                fh[fd].first_extent + fh[fd].ptr/2048 + 150,
-                thissect) < 0)
-            {
-                // Something went wrong...
+                errno = EIO;
                 return -1;
             }
-        } else { */
-        toread = (toread > thissect) ? thissect : toread;
+        }
+        else {
+            /* Sectors the rest of this read covers, and sectors left in the
+               file */
+            want = (pos % 2048 + toread + 2047) / 2048;
+            left = (fh[fd].size + 2047) / 2048 - pos / 2048;
 
-        /* Do the read */
-        c = bdread(fh[fd].first_extent + fh[fd].ptr / 2048);
+            if(want < fh[fd].ra_win)
+                want = fh[fd].ra_win < left ? fh[fd].ra_win : left;
 
-        if(c < 0) return -1;
+            toread = (toread > thissect) ? thissect : toread;
 
-        memcpy(outbuf, dcache[c]->data + (fh[fd].ptr % 2048), toread);
-        /* } */
+            /* Do the read */
+            rwsem_read_lock(&resize_sem);
+            b = bdread(sector, want);
+
+            if(!b) {
+                rwsem_read_unlock(&resize_sem);
+                errno = EIO;
+                return -1;
+            }
+
+            memcpy(outbuf, b->data + (pos % 2048), toread);
+            rwsem_read_unlock(&resize_sem);
+        }
 
         /* Adjust pointers */
         outbuf += toread;
-        fh[fd].ptr += toread;
+        pos += toread;
         bytes -= toread;
         rv += toread;
     }
 
+    fh[fd].ra_next = (pos + 2047) / 2048;
+
+    return rv;
+}
+
+/* Read from a file */
+static ssize_t iso_read(void * h, void *buf, size_t bytes) {
+    file_t fd = (file_t)h;
+    ssize_t rv;
+
+    if(fd >= FS_CD_MAX_FILES) {
+        errno = EBADF;
+        return -1;
+    }
+
+    rv = iso_read_at(fd, buf, bytes, fh[fd].ptr, 0);
+
+    if(rv > 0)
+        fh[fd].ptr += rv;
+
+    return rv;
+}
+
+/* Read into several buffers */
+static ssize_t iso_readv(void * h, const struct iovec *iov, int iovcnt) {
+    file_t fd = (file_t)h;
+    ssize_t rv, total = 0;
+    int i;
+
+    if(fd >= FS_CD_MAX_FILES) {
+        errno = EBADF;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; ++i) {
+        rv = iso_read_at(fd, iov[i].iov_base, iov[i].iov_len,
+                         fh[fd].ptr, 0);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        fh[fd].ptr += rv;
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+/* Read from a given offset, leaving the file pointer alone */
+static ssize_t iso_pread(void * h, void *buf, size_t bytes, off_t offset) {
+    return iso_read_at((file_t)h, buf, bytes, (uint32)offset, 0);
+}
+
+/* Asynchronous reads. The drive can only do one thing at a time anyway, so
+   requests are queued up and run in order by a single thread, which reads
+   whole sectors straight into the caller's buffer. */
+static TAILQ_HEAD(iso_aio_queue, fs_aio_req) aio_queue =
+    TAILQ_HEAD_INITIALIZER(aio_queue);
+static mutex_t aio_mutex = MUTEX_INITIALIZER;
+static semaphore_t aio_sem = SEM_INITIALIZER(0);
+static kthread_t *aio_thd;
+static volatile int aio_quitting;
+
+static void *iso_aio_thd(void *param) {
+    fs_aio_req_t *req;
+    ssize_t rv;
+
+    (void)param;
+
+    for(;;) {
+        sem_wait(&aio_sem);
+
+        mutex_lock(&aio_mutex);
+
+        if((req = TAILQ_FIRST(&aio_queue))) {
+            TAILQ_REMOVE(&aio_queue, req, ent);
+            req->state = FS_AIO_RUNNING;
+        }
+
+        mutex_unlock(&aio_mutex);
+
+        if(!req) {
+            if(aio_quitting)
+                break;
+
+            continue;
+        }
+
+        rv = iso_read_at((file_t)req->hnd, req->buf, req->cnt,
+                         (uint32)req->offset, 1);
+        fs_aio_complete(req, rv, rv < 0 ? errno : 0);
+    }
+
+    return NULL;
+}
+
+static int iso_aio_submit(void *h, fs_aio_req_t *req) {
+    file_t fd = (file_t)h;
+    kthread_attr_t attr = { 0 };
+
+    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken ||
+       fh[fd].dir) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(req->op != FS_AIO_READ) {
+        errno = EROFS;
+        return -1;
+    }
+
+    mutex_lock(&aio_mutex);
+
+    if(aio_quitting) {
+        mutex_unlock(&aio_mutex);
+        errno = ENXIO;
+        return -1;
+    }
+
+    if(!aio_thd) {
+        attr.label = "iso9660-aio";
+
+        if(!(aio_thd = thd_create_ex(&attr, iso_aio_thd, NULL))) {
+            mutex_unlock(&aio_mutex);
+            errno = ENOSYS;
+            return -1;
+        }
+    }
+
+    TAILQ_INSERT_TAIL(&aio_queue, req, ent);
+    mutex_unlock(&aio_mutex);
+
+    sem_signal(&aio_sem);
+
+    return 0;
+}
+
+static int iso_aio_cancel(void *h, fs_aio_req_t *req) {
+    int rv = 0;
+
+    (void)h;
+
+    mutex_lock(&aio_mutex);
+
+    if(req->state == FS_AIO_QUEUED)
+        TAILQ_REMOVE(&aio_queue, req, ent);
+    else {
+        errno = EBUSY;
+        rv = -1;
+    }
+
+    mutex_unlock(&aio_mutex);
+
     return rv;
 }
 
@@ -792,33 +1615,11 @@ static size_t iso_total(void * h) {
     return fh[fd].size;
 }
 
-/* Helper function for readdir: post-processes an ISO filename to make
-   it a bit prettier. */
-static void fn_postprocess(char *fnin) {
-    char    * fn = fnin;
-
-    while(*fn && *fn != ';') {
-        *fn = tolower((int) * fn);
-        fn++;
-    }
-
-    *fn = 0;
-
-    /* Strip trailing dots */
-    if(fn > fnin && fn[-1] == '.') {
-        fn[-1] = 0;
-    }
-}
-
 /* Read a directory entry */
-static dirent_t *iso_readdir(void * h) {
-    int     c;
+static dirent_t *readdir_unlocked(void * h) {
+    cache_block_t *c;
     iso_dirent_t    *de;
 
-    /* RockRidge */
-    int     len;
-    uint8       *pnt;
-
     file_t fd = (file_t)h;
 
     if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || !fh[fd].dir ||
@@ -829,16 +1630,16 @@ static dirent_t *iso_readdir(void * h) {
 
     /* Scan forwards until we find the next valid entry, an
        end-of-entry mark, or run out of dir size. */
-    c = -1;
+    c = NULL;
     de = NULL;
 
     while(fh[fd].ptr < fh[fd].size) {
         /* Get the current dirent block */
         c = biread(fh[fd].first_extent + fh[fd].ptr / 2048);
 
-        if(c < 0) return NULL;
+        if(!c) return NULL;
 
-        de = (iso_dirent_t *)(icache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
 
         if(de->length) break;
 
@@ -851,41 +1652,15 @@ static dirent_t *iso_readdir(void * h) {
     /* If we're at the first, skip the two blank entries */
     if(!de->name[0] && de->name_len == 1) {
         fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
         fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
 
         if(!de->length) return NULL;
     }
 
-    if(joliet) {
-        ucs2utfn((uint8 *)fh[fd].dirent.name, (uint8 *)de->name, de->name_len);
-    }
-    else {
-        /* Fill out the VFS dirent */
-        strncpy(fh[fd].dirent.name, de->name, de->name_len);
-        fh[fd].dirent.name[de->name_len] = 0;
-        fn_postprocess(fh[fd].dirent.name);
-
-        /* Check for Rock Ridge NM extension */
-        len = de->length - sizeof(iso_dirent_t) + sizeof(de->name) - de->name_len;
-        pnt = (uint8*)de + sizeof(iso_dirent_t) - sizeof(de->name) + de->name_len;
-
-        if((de->name_len & 1) == 0) {
-            pnt++;
-            len--;
-        }
-
-        while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
-            if(strncmp((char *)pnt, "NM", 2) == 0) {
-                strncpy(fh[fd].dirent.name, (char *)(pnt + 5), pnt[2] - 5);
-                fh[fd].dirent.name[pnt[2] - 5] = 0;
-            }
-
-            len -= pnt[2];
-            pnt += pnt[2];
-        }
-    }
+    /* Fill out the VFS dirent */
+    iso_dirent_name(de, fh[fd].dirent.name);
 
     if(de->flags & 2) {
         fh[fd].dirent.size = -1;
@@ -901,6 +1676,16 @@ static dirent_t *iso_readdir(void * h) {
     return &fh[fd].dirent;
 }
 
+static dirent_t *iso_readdir(void * h) {
+    dirent_t *rv;
+
+    rwsem_read_lock(&resize_sem);
+    rv = readdir_unlocked(h);
+    rwsem_read_unlock(&resize_sem);
+
+    return rv;
+}
+
 static int iso_rewinddir(void * h) {
     file_t fd = (file_t)h;
 
@@ -918,6 +1703,7 @@ static int iso_rewinddir(void * h) {
 int iso_reset(void) {
     iso_break_all();
     bclear();
+    dirtab_clear();
     percd_done = 0;
     return 0;
 }
@@ -1009,6 +1795,29 @@ static int iso_fstat(void *h, struct stat *st) {
     return 0;
 }
 
+int fs_iso9660_get_extent(file_t fd, uint32 *sector, size_t *size) {
+    file_t h;
+
+    if(fs_get_handler(fd) != &vh) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    h = (file_t)fs_get_handle(fd);
+
+    if(h >= FS_CD_MAX_FILES || !fh[h].first_extent || fh[h].broken ||
+       fh[h].dir) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Files are contiguous, so this is all it takes to stream one */
+    *sector = fh[h].first_extent + 150;
+    *size = fh[h].size;
+
+    return 0;
+}
+
 /* Put everything together */
 static vfs_handler_t vh = {
     /* Name handler */
@@ -1048,13 +1857,17 @@ static vfs_handler_t vh = {
     NULL,               /* total64 */
     NULL,               /* readlink */
     iso_rewinddir,
-    iso_fstat
+    iso_fstat,
+    iso_aio_submit,
+    iso_aio_cancel,
+    iso_readv,
+    NULL,               /* writev */
+    iso_pread,
+    NULL                /* pwrite */
 };
 
 /* Initialize the file system */
 int fs_iso9660_init(void) {
-    int i;
-
     /* Reset fd's */
     memset(fh, 0, sizeof(fh));
 
@@ -1066,15 +1879,14 @@ int fs_iso9660_init(void) {
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
 
     /* Allocate cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        icache[i] = malloc(sizeof(cache_block_t));
-        icache[i]->sector = -1;
-        dcache[i] = malloc(sizeof(cache_block_t));
-        dcache[i]->sector = -1;
+    if(balloc_cache(&icache) < 0 || balloc_cache(&dcache) < 0) {
+        bfree_cache(&icache);
+        return -1;
     }
 
     percd_done = 0;
     iso_last_status = -1;
+    aio_quitting = 0;
 
     /* Register with the vblank */
     iso_vblank_hnd = vblank_handler_add(iso_vblank);
@@ -1083,18 +1895,40 @@ int fs_iso9660_init(void) {
     return nmmgr_handler_add(&vh.nmmgr);
 }
 
+/* Stop the asynchronous I/O thread, failing anything it hasn't started */
+static void iso_aio_shutdown(void) {
+    fs_aio_req_t *req;
+
+    mutex_lock(&aio_mutex);
+
+    aio_quitting = 1;
+
+    while((req = TAILQ_FIRST(&aio_queue))) {
+        TAILQ_REMOVE(&aio_queue, req, ent);
+        fs_aio_complete(req, -1, ECANCELED);
+    }
+
+    mutex_unlock(&aio_mutex);
+
+    if(aio_thd) {
+        sem_signal(&aio_sem);
+        thd_join(aio_thd, NULL);
+        aio_thd = NULL;
+    }
+}
+
 /* De-init the file system */
 int fs_iso9660_shutdown(void) {
-    int i;
+    /* Finish up with any asynchronous reads */
+    iso_aio_shutdown();
 
     /* De-register with vblank */
     vblank_handler_remove(iso_vblank_hnd);
 
     /* Dealloc cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        free(icache[i]);
-        free(dcache[i]);
-    }
+    bfree_cache(&icache);
+    bfree_cache(&dcache);
+    dirtab_clear();
 
     /* Free muteces */
     mutex_destroy(&cache_mutex);
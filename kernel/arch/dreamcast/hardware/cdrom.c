@@ -9,15 +9,23 @@
 
  */
 #include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#include <sys/queue.h>
 
 #include <arch/timer.h>
 #include <arch/memory.h>
+#include <arch/cache.h>
+#include <arch/irq.h>
 
 #include <dc/cdrom.h>
 #include <dc/g1ata.h>
 
 #include <kos/thread.h>
 #include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/sem.h>
 #include <kos/dbglog.h>
 
 /*
@@ -45,6 +53,14 @@ just needs to eventually be checked by cmd_stat. A non-blocking version
 of all functions would simply require manual calls to check the status.
 Doing this would probably allow data reading while cdda is playing without
 hiccups (by severely reducing the number of gd commands being sent).
+
+Streams (cdrom_stream_open()) get most of that benefit without it: a thread
+of their own keeps a ring of buffers filled, one DMA read per buffer, so the
+thread using the data only waits if it catches up with the drive.
+
+Sector reads from all threads, streams included, go through a queue that a
+scheduler thread works through in an order that keeps seeking down (see the
+comment above cdrom_read_sectors_sched).
 */
 
 
@@ -133,6 +149,9 @@ static int gdc_check_pio_transfer(gdc_cmd_hnd_t hnd, int *size) {
 /* The G1 ATA access mutex */
 mutex_t _g1_ata_mutex = MUTEX_INITIALIZER;
 
+/* Size of the sectors reads return, as last set by cdrom_change_datatype */
+static int cur_sector_size = 2048;
+
 /* Shortcut to cdrom_reinit_ex. Typically this is the only thing changed. */
 int cdrom_set_sector_size(int size) {
     return cdrom_reinit_ex(-1, -1, size);
@@ -303,6 +322,10 @@ int cdrom_change_datatype(int sector_part, int cdxa, int sector_size) {
     params[2] = cdxa;           /* CD-XA mode 1/2 */
     params[3] = sector_size;    /* sector size */
     rv = gdc_change_data_type(params);
+
+    if(rv == ERR_OK)
+        cur_sector_size = sector_size;
+
     mutex_unlock(&_g1_ata_mutex);
     return rv;
 }
@@ -343,8 +366,8 @@ int cdrom_read_toc(CDROM_TOC *toc_buffer, int session) {
     return rv;
 }
 
-/* Enhanced Sector reading: Choose mode to read in. */
-int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode) {
+/* Send a sector read to the drive */
+static int read_sectors(void *buffer, int sector, int cnt, int mode) {
     struct {
         int sec, num;
         void *buffer;
@@ -370,12 +393,685 @@ int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode) {
     return rv;
 }
 
+/* Request scheduling
+
+Sector reads from every thread go into one queue, and a scheduler thread
+hands them to the drive one command at a time. A seek costs far more than
+reading, so it picks the next one like this:
+
+ - A request whose deadline has passed goes first, earliest deadline first.
+ - Otherwise, of the requests with the highest priority, the first one going
+   up the disc from where the last read ended, or the lowest one if there is
+   nothing further up (C-LOOK). Low priority requests count as normal once
+   they have waited CDROM_SCHED_MAX_WAIT ms, so they aren't held up forever
+   by a busy drive. Normal ones never go up: high priority is for reads that
+   can't wait, like a stream about to run dry, and a busy drive's normal
+   reads all wait that long.
+ - Right after a read, if only other threads are waiting, nothing queued
+   carries on from it and nothing more urgent is there, the drive is held
+   where it is for SCHED_ANTICIPATE ms. The thread that asked for the read
+   is usually about to ask for what comes next (streams and fs_iso9660
+   readahead both do), but its request only arrives once it has had a chance
+   to run, and by then the drive would have seeked away for somebody else.
+   If that thread's next request is already queued, there's nothing to wait
+   for.
+ - Requests of any priority that overlap the chosen one or carry on from it
+   are read along with it in the same command, through a bounce buffer, up to
+   SCHED_MERGE_MAX sectors. Requests that lie inside it (the same sectors
+   asked for twice, say) are copied from its buffer instead.
+*/
+
+/* Most sectors read in one merged command */
+#define SCHED_MERGE_MAX 64
+
+/* How long to hold the drive after a read, in milliseconds */
+#define SCHED_ANTICIPATE    2
+
+typedef struct cdrom_req {
+    TAILQ_ENTRY(cdrom_req) ent;
+    uint32      sector;     /* First sector */
+    uint32      cnt;        /* Number of sectors */
+    void        *buffer;
+    int         mode;       /* CDROM_READ_DMA or CDROM_READ_PIO */
+    int         prio;       /* CDROM_PRIO_* */
+    int         has_deadline;   /* Set if the caller gave a deadline */
+    kthread_t   *thd;       /* Thread that asked for it */
+    uint64      submitted;  /* When it was queued, in us */
+    uint64      deadline;   /* When it must be started by, in us */
+    int         rv;
+    semaphore_t done;
+} cdrom_req_t;
+
+TAILQ_HEAD(cdrom_req_list, cdrom_req);
+
+static struct cdrom_req_list sched_queue = TAILQ_HEAD_INITIALIZER(sched_queue);
+static uint32 sched_head;   /* Sector after the last one read */
+static int sched_last_prio; /* Priority of the last read */
+static kthread_t *sched_last_thd;   /* Thread that asked for it */
+static uint64 sched_last_done;  /* When it finished, in us */
+static cdrom_sched_stats_t sched_stats;
+
+/* A request's priority, counting the time it has waited */
+static int sched_prio(const cdrom_req_t *r, uint64 now) {
+    if(r->prio == CDROM_PRIO_LOW &&
+       now - r->submitted >= CDROM_SCHED_MAX_WAIT * 1000ULL)
+        return CDROM_PRIO_NORMAL;
+
+    return r->prio;
+}
+
+/* Whether to keep the drive where it is for now, in case the last read's
+   thread goes on with the sectors after it. Must be called with the mutex
+   held. */
+static int sched_anticipate(uint64 now) {
+    cdrom_req_t *r;
+
+    if(now >= sched_last_done + SCHED_ANTICIPATE * 1000)
+        return 0;
+
+    TAILQ_FOREACH(r, &sched_queue, ent) {
+        if(r->thd == sched_last_thd || r->sector == sched_head ||
+           sched_prio(r, now) > sched_last_prio ||
+           (r->has_deadline && r->deadline <= now))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Pick the next request to read, and move it and the requests that can be
+   read with it from the queue to run. Returns the number of sectors to read,
+   starting at the first request's sector. Must be called with the mutex
+   held, and with something in the queue. */
+static uint32 sched_take(struct cdrom_req_list *run, uint64 now) {
+    cdrom_req_t *r, *next, *pick = NULL, *wrap = NULL;
+    uint32 start, end, rend;
+    int top = CDROM_PRIO_LOW, prio, found;
+
+    /* Anything late goes first */
+    TAILQ_FOREACH(r, &sched_queue, ent) {
+        if(r->has_deadline && r->deadline <= now &&
+           (!pick || r->deadline < pick->deadline))
+            pick = r;
+
+        if((prio = sched_prio(r, now)) > top)
+            top = prio;
+    }
+
+    /* If nothing is, go up the disc */
+    if(!pick) {
+        TAILQ_FOREACH(r, &sched_queue, ent) {
+            if(sched_prio(r, now) != top)
+                continue;
+
+            if(r->sector >= sched_head && (!pick || r->sector < pick->sector))
+                pick = r;
+
+            if(!wrap || r->sector < wrap->sector)
+                wrap = r;
+        }
+
+        if(!pick)
+            pick = wrap;
+    }
+
+    TAILQ_REMOVE(&sched_queue, pick, ent);
+    TAILQ_INSERT_TAIL(run, pick, ent);
+    sched_last_prio = sched_prio(pick, now);
+    sched_last_thd = pick->thd;
+    start = pick->sector;
+    end = start + pick->cnt;
+
+    /* Bring along whatever overlaps it or carries on from it. Each one that
+       joins can let others in, so go round until nothing does. */
+    do {
+        found = 0;
+
+        for(r = TAILQ_FIRST(&sched_queue); r; r = next) {
+            next = TAILQ_NEXT(r, ent);
+            rend = r->sector + r->cnt;
+
+            if(r->sector < start || r->sector > end)
+                continue;
+
+            if(rend > end && rend - start > SCHED_MERGE_MAX)
+                continue;
+
+            TAILQ_REMOVE(&sched_queue, r, ent);
+            TAILQ_INSERT_TAIL(run, r, ent);
+            found = 1;
+
+            if(rend > end)
+                end = rend;
+        }
+    } while(found);
+
+    return end - start;
+}
+
+static mutex_t sched_mutex = MUTEX_INITIALIZER;
+static condvar_t sched_cv = COND_INITIALIZER;
+static kthread_t *sched_thd;
+static uint8_t *sched_buf;
+static int sched_quit;
+
+static void *sched_thd_fn(void *param) {
+    struct cdrom_req_list run;
+    cdrom_req_t *r, *first;
+    uint32 start, cnt;
+    uint8_t *src;
+    uint64 now, wait;
+    int rv, ss;
+
+    (void)param;
+
+    for(;;) {
+        mutex_lock(&sched_mutex);
+
+        while(TAILQ_EMPTY(&sched_queue) && !sched_quit)
+            cond_wait(&sched_cv, &sched_mutex);
+
+        if(TAILQ_EMPTY(&sched_queue)) {
+            mutex_unlock(&sched_mutex);
+            break;
+        }
+
+        while(!sched_quit && sched_anticipate(now = timer_us_gettime64()))
+            cond_wait_timed(&sched_cv, &sched_mutex, SCHED_ANTICIPATE);
+
+        TAILQ_INIT(&run);
+        cnt = sched_take(&run, timer_us_gettime64());
+        first = TAILQ_FIRST(&run);
+        start = first->sector;
+
+        sched_stats.commands++;
+        sched_stats.sectors += cnt;
+
+        if(start != sched_head)
+            sched_stats.seeks++;
+
+        sched_head = start + cnt;
+        ss = cur_sector_size;
+        mutex_unlock(&sched_mutex);
+
+        /* Read straight into the first request's buffer if it covers all of
+           them, or else into the bounce buffer */
+        if(cnt == first->cnt) {
+            src = (uint8_t *)first->buffer;
+            rv = read_sectors(src, start, cnt, first->mode);
+        }
+        else {
+            src = sched_buf;
+            dcache_inval_range((uintptr_t)src, cnt * ss);
+            rv = read_sectors(src, start, cnt, CDROM_READ_DMA);
+        }
+
+        now = timer_us_gettime64();
+
+        /* Copy everything out before anyone is told, since the source can
+           be the first request's buffer. A DMA mode caller expects the data
+           to be in RAM, ready to be handed on to other DMA, so push it out
+           of the cache. */
+        if(rv == ERR_OK) {
+            TAILQ_FOREACH(r, &run, ent) {
+                if(r->buffer == src)
+                    continue;
+
+                memcpy(r->buffer, src + (r->sector - start) * ss,
+                       r->cnt * ss);
+
+                if(r->mode == CDROM_READ_DMA)
+                    dcache_flush_range((uintptr_t)r->buffer, r->cnt * ss);
+            }
+        }
+
+        while((r = TAILQ_FIRST(&run))) {
+            TAILQ_REMOVE(&run, r, ent);
+            wait = now - r->submitted;
+
+            mutex_lock(&sched_mutex);
+            sched_last_done = now;
+
+            if(r != first)
+                sched_stats.merged++;
+
+            if(r->has_deadline && now > r->deadline)
+                sched_stats.late++;
+
+            sched_stats.total_us += wait;
+
+            if(wait > sched_stats.max_us)
+                sched_stats.max_us = wait;
+
+            mutex_unlock(&sched_mutex);
+
+            /* The request is gone once it's been signaled */
+            r->rv = rv;
+            sem_signal(&r->done);
+        }
+    }
+
+    return NULL;
+}
+
+/* Start the scheduler thread if it isn't running. Must be called with the
+   mutex held. */
+static int sched_start(void) {
+    kthread_attr_t attr = { 0 };
+
+    if(sched_thd)
+        return 0;
+
+    /* Big enough for raw sectors */
+    if(!sched_buf && !(sched_buf = (uint8_t *)memalign(32,
+                                                        SCHED_MERGE_MAX * 2352)))
+        return -1;
+
+    attr.label = "cdrom-sched";
+
+    if(!(sched_thd = thd_create_ex(&attr, sched_thd_fn, NULL)))
+        return -1;
+
+    return 0;
+}
+
+static void sched_stop(void) {
+    kthread_t *thd;
+
+    mutex_lock(&sched_mutex);
+    thd = sched_thd;
+    sched_quit = 1;
+    cond_broadcast(&sched_cv);
+    mutex_unlock(&sched_mutex);
+
+    /* The thread finishes what's queued first */
+    if(thd)
+        thd_join(thd, NULL);
+
+    mutex_lock(&sched_mutex);
+    sched_thd = NULL;
+    free(sched_buf);
+    sched_buf = NULL;
+    mutex_unlock(&sched_mutex);
+}
+
+int cdrom_read_sectors_sched(void *buffer, int sector, int cnt, int mode,
+                             int prio, int deadline) {
+    cdrom_req_t req;
+
+    if(cnt <= 0 || (mode != CDROM_READ_DMA && mode != CDROM_READ_PIO))
+        return ERR_SYS;
+
+    if(prio < CDROM_PRIO_LOW)
+        prio = CDROM_PRIO_LOW;
+    else if(prio > CDROM_PRIO_HIGH)
+        prio = CDROM_PRIO_HIGH;
+
+    req.sector = sector;
+    req.cnt = cnt;
+    req.buffer = buffer;
+    req.mode = mode;
+    req.prio = prio;
+    req.has_deadline = deadline > 0;
+    req.thd = thd_get_current();
+    req.submitted = timer_us_gettime64();
+    req.deadline = deadline > 0 ? req.submitted + (uint64)deadline * 1000 : 0;
+    req.rv = ERR_SYS;
+
+    /* Without the scheduler thread, just do the read here */
+    if(irq_inside_int())
+        return read_sectors(buffer, sector, cnt, mode);
+
+    mutex_lock(&sched_mutex);
+
+    if(sched_quit || sched_start() < 0) {
+        mutex_unlock(&sched_mutex);
+        return read_sectors(buffer, sector, cnt, mode);
+    }
+
+    sem_init(&req.done, 0);
+    TAILQ_INSERT_TAIL(&sched_queue, &req, ent);
+    sched_stats.requests++;
+    cond_signal(&sched_cv);
+    mutex_unlock(&sched_mutex);
+
+    sem_wait(&req.done);
+    sem_destroy(&req.done);
+
+    return req.rv;
+}
+
+void cdrom_sched_get_stats(cdrom_sched_stats_t *stats) {
+    mutex_lock(&sched_mutex);
+    *stats = sched_stats;
+    mutex_unlock(&sched_mutex);
+}
+
+void cdrom_sched_reset_stats(void) {
+    mutex_lock(&sched_mutex);
+    memset(&sched_stats, 0, sizeof(sched_stats));
+    mutex_unlock(&sched_mutex);
+}
+
+/* Enhanced Sector reading: Choose mode to read in. */
+int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode) {
+    return cdrom_read_sectors_sched(buffer, sector, cnt, mode,
+                                    CDROM_PRIO_NORMAL, 0);
+}
+
 /* Basic old sector read */
 int cdrom_read_sectors(void *buffer, int sector, int cnt) {
     return cdrom_read_sectors_ex(buffer, sector, cnt, CDROM_READ_PIO);
 }
 
 
+/* Streaming */
+
+#define STREAM_FREE     0   /* Waiting to be filled */
+#define STREAM_READY    1   /* Filled, waiting for cdrom_stream_get */
+#define STREAM_HELD     2   /* With the consumer until released */
+
+typedef struct {
+    uint8_t     *data;
+    size_t      bytes;      /* Bytes read into it */
+    int         state;
+} stream_buf_t;
+
+struct cdrom_stream {
+    uint32      next;       /* Next sector to read */
+    uint32      end;        /* Sector after the last one */
+    size_t      buf_sectors;
+    int         sector_size;
+    int         nbufs;
+    stream_buf_t *bufs;
+    uint8_t     *data;      /* Memory for all the buffers */
+    int         fill;       /* Next buffer to fill */
+    int         take;       /* Next buffer for cdrom_stream_get */
+    int         done;       /* Set when the reader has stopped */
+    int         error;      /* Why it stopped early, or ERR_OK */
+    int         closing;
+    cdrom_stream_cb_t cb;
+    void        *user;
+    kthread_t   *thd;
+    mutex_t     mutex;
+    condvar_t   cv;
+    cdrom_stream_stats_t stats;
+};
+
+/* Read the next buffer of a stream. How soon it needs to be read depends on
+   how much the consumer has left: with half the buffers full or more it
+   takes its turn with everything else (each read carries on from the last,
+   so the scheduler keeps the drive on it while there's room), with less it
+   goes ahead of other reads, and with none it goes ahead of everything. */
+static int stream_read(cdrom_stream_t *s, void *buffer, uint32 sector,
+                       size_t cnt, int queued) {
+    int prio = CDROM_PRIO_NORMAL, deadline = 0;
+
+    if(!queued) {
+        prio = CDROM_PRIO_HIGH;
+        deadline = 1;
+    }
+    else if(queued < s->nbufs / 2) {
+        prio = CDROM_PRIO_HIGH;
+    }
+
+    dcache_inval_range((uintptr_t)buffer, cnt * s->sector_size);
+
+    return cdrom_read_sectors_sched(buffer, sector, cnt, CDROM_READ_DMA, prio,
+                                    deadline);
+}
+
+static void *stream_thd(void *param) {
+    cdrom_stream_t *s = (cdrom_stream_t *)param;
+    stream_buf_t *b;
+    uint32 sector;
+    size_t cnt;
+    int i, rv, queued;
+
+    for(;;) {
+        mutex_lock(&s->mutex);
+        b = &s->bufs[s->fill];
+
+        /* Wait for the consumer to give the next buffer back */
+        if(b->state != STREAM_FREE && !s->closing) {
+            s->stats.stalls++;
+
+            while(b->state != STREAM_FREE && !s->closing)
+                cond_wait(&s->cv, &s->mutex);
+        }
+
+        if(s->closing || s->next >= s->end) {
+            mutex_unlock(&s->mutex);
+            break;
+        }
+
+        sector = s->next;
+        cnt = s->end - sector;
+
+        if(cnt > s->buf_sectors)
+            cnt = s->buf_sectors;
+
+        s->next += cnt;
+
+        /* Buffers the consumer has yet to finish with */
+        for(i = queued = 0; i < s->nbufs; ++i)
+            queued += s->bufs[i].state != STREAM_FREE;
+
+        if(!queued)
+            s->stats.urgent++;
+
+        mutex_unlock(&s->mutex);
+
+        rv = stream_read(s, b->data, sector, cnt, queued);
+
+        mutex_lock(&s->mutex);
+
+        if(rv != ERR_OK) {
+            dbglog(DBG_ERROR, "cdrom_stream: read of %lu sectors at %lu "
+                   "failed (%d)\n", (unsigned long)cnt,
+                   (unsigned long)sector, rv);
+            s->error = rv;
+            mutex_unlock(&s->mutex);
+            break;
+        }
+
+        b->bytes = cnt * s->sector_size;
+        b->state = s->cb ? STREAM_HELD : STREAM_READY;
+        s->fill = (s->fill + 1) % s->nbufs;
+        s->stats.buffers++;
+        s->stats.sectors += cnt;
+        cond_broadcast(&s->cv);
+        mutex_unlock(&s->mutex);
+
+        if(s->cb)
+            s->cb(s, b->data, b->bytes, s->user);
+    }
+
+    mutex_lock(&s->mutex);
+    s->done = 1;
+    cond_broadcast(&s->cv);
+    mutex_unlock(&s->mutex);
+
+    if(s->cb && !s->closing)
+        s->cb(s, NULL, 0, s->user);
+
+    return NULL;
+}
+
+cdrom_stream_t *cdrom_stream_open(uint32 sector, uint32 cnt,
+                                  size_t buf_sectors, int nbufs,
+                                  cdrom_stream_cb_t cb, void *user) {
+    kthread_attr_t attr = { 0 };
+    cdrom_stream_t *s;
+    size_t stride;
+    int i;
+
+    if(!cnt || !buf_sectors || nbufs < 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!(s = (cdrom_stream_t *)calloc(1, sizeof(cdrom_stream_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    s->next = sector;
+    s->end = sector + cnt;
+    s->buf_sectors = buf_sectors;
+    s->sector_size = cur_sector_size;
+    s->nbufs = nbufs;
+    s->cb = cb;
+    s->user = user;
+    s->error = ERR_OK;
+
+    /* Each buffer starts on a cache line, for the DMA */
+    stride = (buf_sectors * s->sector_size + 31) & ~31;
+    s->bufs = (stream_buf_t *)calloc(nbufs, sizeof(stream_buf_t));
+    s->data = (uint8_t *)memalign(32, stride * nbufs);
+
+    if(!s->bufs || !s->data) {
+        free(s->bufs);
+        free(s->data);
+        free(s);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for(i = 0; i < nbufs; ++i)
+        s->bufs[i].data = s->data + stride * i;
+
+    mutex_init(&s->mutex, MUTEX_TYPE_NORMAL);
+    cond_init(&s->cv);
+
+    attr.label = "cdrom-stream";
+
+    if(!(s->thd = thd_create_ex(&attr, stream_thd, s))) {
+        cond_destroy(&s->cv);
+        mutex_destroy(&s->mutex);
+        free(s->bufs);
+        free(s->data);
+        free(s);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    return s;
+}
+
+int cdrom_stream_get(cdrom_stream_t *s, void **buf, size_t *bytes,
+                     int timeout) {
+    stream_buf_t *b;
+    uint64_t start = 0, waited;
+    int rv = 0;
+
+    if(s->cb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&s->mutex);
+    b = &s->bufs[s->take];
+
+    if(b->state != STREAM_READY && !s->done) {
+        s->stats.underruns++;
+        start = timer_us_gettime64();
+
+        while(b->state != STREAM_READY && !s->done) {
+            if(timeout) {
+                if(cond_wait_timed(&s->cv, &s->mutex, timeout) < 0 &&
+                   errno == ETIMEDOUT)
+                    break;
+            }
+            else {
+                cond_wait(&s->cv, &s->mutex);
+            }
+        }
+
+        waited = timer_us_gettime64() - start;
+        s->stats.underrun_us += waited;
+
+        if(waited > s->stats.max_underrun_us)
+            s->stats.max_underrun_us = (uint32)waited;
+    }
+
+    if(b->state == STREAM_READY) {
+        b->state = STREAM_HELD;
+        s->take = (s->take + 1) % s->nbufs;
+        *buf = b->data;
+        *bytes = b->bytes;
+        rv = 1;
+    }
+    else if(!s->done) {
+        errno = ETIMEDOUT;
+        rv = -1;
+    }
+    else if(s->error != ERR_OK) {
+        errno = EIO;
+        rv = -1;
+    }
+
+    mutex_unlock(&s->mutex);
+
+    return rv;
+}
+
+int cdrom_stream_release(cdrom_stream_t *s, void *buf) {
+    int i, rv = -1;
+
+    mutex_lock(&s->mutex);
+
+    for(i = 0; i < s->nbufs; ++i) {
+        if(s->bufs[i].data == buf && s->bufs[i].state == STREAM_HELD) {
+            s->bufs[i].state = STREAM_FREE;
+            cond_broadcast(&s->cv);
+            rv = 0;
+            break;
+        }
+    }
+
+    mutex_unlock(&s->mutex);
+
+    if(rv < 0)
+        errno = EINVAL;
+
+    return rv;
+}
+
+int cdrom_stream_error(cdrom_stream_t *s) {
+    int rv;
+
+    mutex_lock(&s->mutex);
+    rv = s->error;
+    mutex_unlock(&s->mutex);
+
+    return rv;
+}
+
+void cdrom_stream_get_stats(cdrom_stream_t *s, cdrom_stream_stats_t *stats) {
+    mutex_lock(&s->mutex);
+    *stats = s->stats;
+    mutex_unlock(&s->mutex);
+}
+
+int cdrom_stream_close(cdrom_stream_t *s) {
+    mutex_lock(&s->mutex);
+    s->closing = 1;
+    cond_broadcast(&s->cv);
+    mutex_unlock(&s->mutex);
+
+    /* This waits for the read in progress, if any */
+    thd_join(s->thd, NULL);
+
+    cond_destroy(&s->cv);
+    mutex_destroy(&s->mutex);
+    free(s->bufs);
+    free(s->data);
+    free(s);
+
+    return 0;
+}
+
 /* Read a piece of or all of the Q byte of the subcode of the last sector read.
    If you need the subcode from every sector, you cannot read more than one at 
    a time. */
@@ -498,6 +1194,11 @@ int cdrom_init(void) {
     gdc_init_system();
     mutex_unlock(&_g1_ata_mutex);
 
+    /* Reads are scheduled again after a shutdown */
+    mutex_lock(&sched_mutex);
+    sched_quit = 0;
+    mutex_unlock(&sched_mutex);
+
     cdrom_get_status(&status, &disc_type);
 
     if(status < CD_STATUS_OPEN && disc_type > CD_CDDA && disc_type < CD_FAIL) {
@@ -511,6 +1212,5 @@ int cdrom_init(void) {
 }
 
 void cdrom_shutdown(void) {
-
-    /* What would you want done here? */
+    sched_stop();
 }
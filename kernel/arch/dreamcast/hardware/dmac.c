@@ -0,0 +1,310 @@
+/* KallistiOS ##version##
+
+   dmac.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+#include <errno.h>
+#include <sys/queue.h>
+
+#include <kos/thread.h>
+#include <kos/sem.h>
+#include <kos/dbglog.h>
+
+#include <arch/irq.h>
+#include <arch/cache.h>
+
+#include <dc/dmac.h>
+
+/*
+
+Memory-to-memory copy engine on DMAC channel 1.
+
+Requests are kept in a FIFO. The head of the queue is the transfer that is
+currently programmed into the channel; when its transfer-end interrupt fires,
+it is removed, the next one is started right away, and only then is the
+finished request's owner notified. That way the channel never sits idle while
+a callback runs.
+
+*/
+
+/* CHCR bits */
+#define CHCR_DE         0x00000001  /* DMA enable */
+#define CHCR_TE         0x00000002  /* Transfer end */
+#define CHCR_IE         0x00000004  /* Interrupt enable */
+#define CHCR_TS_32      0x00000040  /* 32-byte transfer units */
+#define CHCR_RS_AUTO    0x00000400  /* Auto-request, memory to memory */
+#define CHCR_SM_INC     0x00001000  /* Increment source address */
+#define CHCR_DM_INC     0x00004000  /* Increment destination address */
+
+/* Cycle steal mode, so that the CPU still gets the bus between units. */
+#define CHCR_COPY       (CHCR_DM_INC | CHCR_SM_INC | CHCR_RS_AUTO | \
+                         CHCR_TS_32 | CHCR_IE | CHCR_DE)
+
+/* Interrupt priority for the DMAC (IPRC bits 8-11). */
+#define IPRC            (*((vuint16 *)0xffd0000c))
+#define IPRC_DMAC_SHIFT 8
+#define IPRC_DMAC_MASK  0xf
+#define IPRC_DMAC_PRIO  9
+
+#define UNIT            32
+
+static TAILQ_HEAD(copy_queue, dmac_copy_req) queue;
+static size_t queued;
+static int initted;
+static uint16_t old_prio;
+
+/* Is the address in one of the cached areas (P0, P1 or P3)? */
+static inline int cached_addr(uintptr_t addr) {
+    return (addr & 0xe0000000) != 0xa0000000;
+}
+
+/* Can the DMAC reach this range? OCRAM and everything in P4 (including the
+   store queues) is internal to the CPU. */
+static int dma_reachable(uintptr_t addr, size_t len) {
+    if(addr + len < addr)
+        return 0;
+
+    if((addr & 0xfc000000) == 0x7c000000)
+        return 0;
+
+    return addr + len <= 0xe0000000;
+}
+
+static inline uint32_t phys_addr(uintptr_t addr) {
+    return addr & 0x1fffffff;
+}
+
+static void finish(dmac_copy_req_t *req, dmac_copy_state_t state) {
+    dmac_copy_callback_t cb = req->callback;
+    void *d = req->cbdata;
+
+    /* Signal before running the callback, since the callback is allowed to
+       resubmit the same request. */
+    req->state = state;
+    sem_signal(&req->done);
+
+    if(cb)
+        cb(d);
+}
+
+/* Program the channel with the request at the head of the queue. Requests
+   that can't be started are failed. Must be called with interrupts off. */
+static void start_next(void) {
+    dmac_copy_req_t *req;
+
+    while((req = TAILQ_FIRST(&queue))) {
+        DMAC_CHCR1 = 0;
+        DMAC_SAR1 = phys_addr(req->src);
+        DMAC_DAR1 = phys_addr(req->dest);
+        DMAC_DMATCR1 = req->len / UNIT;
+        req->state = DMAC_COPY_ACTIVE;
+        DMAC_CHCR1 = CHCR_COPY;
+
+        if((DMAC_DMAOR & DMAOR_STATUS_MASK) == DMAOR_NORMAL_OPERATION)
+            return;
+
+        dbglog(DBG_ERROR, "dmac_copy: Failed DMAOR check\n");
+        DMAC_CHCR1 = 0;
+        TAILQ_REMOVE(&queue, req, qent);
+        --queued;
+        finish(req, DMAC_COPY_ERROR);
+    }
+}
+
+static void dmac_copy_irq(irq_t src, irq_context_t *cxt) {
+    dmac_copy_req_t *req;
+    int ok;
+
+    (void)src;
+    (void)cxt;
+
+    ok = DMAC_DMATCR1 == 0;
+    DMAC_CHCR1 = 0;
+
+    if(!(req = TAILQ_FIRST(&queue)))
+        return;
+
+    TAILQ_REMOVE(&queue, req, qent);
+    --queued;
+
+    if(!ok)
+        dbglog(DBG_ERROR, "dmac_copy: transfer did not complete\n");
+
+    start_next();
+    finish(req, ok ? DMAC_COPY_DONE : DMAC_COPY_ERROR);
+
+    /* Let a waiting thread pick up the result right away. */
+    thd_schedule(1, 0);
+}
+
+int dmac_copy_init(void) {
+    int old;
+
+    if(initted)
+        return 0;
+
+    old = irq_disable();
+
+    TAILQ_INIT(&queue);
+    queued = 0;
+    DMAC_CHCR1 = 0;
+
+    irq_set_handler(EXC_DMAC_DMTE1, dmac_copy_irq);
+
+    /* The DMAC interrupts are masked unless they've been given a priority. */
+    old_prio = (IPRC >> IPRC_DMAC_SHIFT) & IPRC_DMAC_MASK;
+
+    if(!old_prio)
+        IPRC |= IPRC_DMAC_PRIO << IPRC_DMAC_SHIFT;
+
+    initted = 1;
+    irq_restore(old);
+
+    return 0;
+}
+
+void dmac_copy_shutdown(void) {
+    dmac_copy_req_t *req;
+    int old;
+
+    if(!initted)
+        return;
+
+    old = irq_disable();
+
+    DMAC_CHCR1 = 0;
+
+    while((req = TAILQ_FIRST(&queue))) {
+        TAILQ_REMOVE(&queue, req, qent);
+        req->state = DMAC_COPY_CANCELED;
+        sem_signal(&req->done);
+    }
+
+    queued = 0;
+
+    if(!old_prio)
+        IPRC &= ~(IPRC_DMAC_MASK << IPRC_DMAC_SHIFT);
+
+    irq_set_handler(EXC_DMAC_DMTE1, NULL);
+    initted = 0;
+
+    irq_restore(old);
+}
+
+int dmac_copy_submit(dmac_copy_req_t *req, void *dest, const void *src,
+                     size_t len, dmac_copy_callback_t callback, void *cbdata) {
+    uintptr_t d = (uintptr_t)dest, s = (uintptr_t)src;
+    int old;
+
+    if(!len || (len & (UNIT - 1)) || (d & (UNIT - 1)) || (s & (UNIT - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!dma_reachable(d, len) || !dma_reachable(s, len)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(req->state == DMAC_COPY_PENDING || req->state == DMAC_COPY_ACTIVE) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    dmac_copy_init();
+
+    /* Write the source out to RAM, and get rid of any destination lines so
+       that they can neither be written back over the new data later nor be
+       read instead of it. */
+    if(cached_addr(s))
+        dcache_flush_range(s, len);
+
+    if(cached_addr(d))
+        dcache_purge_range(d, len);
+
+    req->dest = d;
+    req->src = s;
+    req->len = len;
+    req->callback = callback;
+    req->cbdata = cbdata;
+    req->state = DMAC_COPY_PENDING;
+    sem_init(&req->done, 0);
+
+    old = irq_disable();
+
+    TAILQ_INSERT_TAIL(&queue, req, qent);
+
+    if(++queued == 1)
+        start_next();
+
+    irq_restore(old);
+
+    return 0;
+}
+
+int dmac_copy_wait(dmac_copy_req_t *req) {
+    if(req->state == DMAC_COPY_IDLE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(req->state == DMAC_COPY_PENDING || req->state == DMAC_COPY_ACTIVE)
+        sem_wait(&req->done);
+
+    switch(req->state) {
+        case DMAC_COPY_DONE:
+            return 0;
+
+        case DMAC_COPY_CANCELED:
+            errno = ECANCELED;
+            return -1;
+
+        default:
+            errno = EIO;
+            return -1;
+    }
+}
+
+int dmac_copy_poll(const dmac_copy_req_t *req) {
+    return req->state != DMAC_COPY_PENDING && req->state != DMAC_COPY_ACTIVE;
+}
+
+int dmac_copy_cancel(dmac_copy_req_t *req) {
+    int old, rv = 0;
+
+    old = irq_disable();
+
+    if(req->state == DMAC_COPY_ACTIVE) {
+        errno = EBUSY;
+        rv = -1;
+    }
+    else if(req->state != DMAC_COPY_PENDING) {
+        errno = EINVAL;
+        rv = -1;
+    }
+    else {
+        TAILQ_REMOVE(&queue, req, qent);
+        --queued;
+        req->state = DMAC_COPY_CANCELED;
+        sem_signal(&req->done);
+    }
+
+    irq_restore(old);
+
+    return rv;
+}
+
+int dmac_copy(void *dest, const void *src, size_t len) {
+    dmac_copy_req_t req = { 0 };
+
+    if(dmac_copy_submit(&req, dest, src, len, NULL, NULL) < 0)
+        return -1;
+
+    return dmac_copy_wait(&req);
+}
+
+size_t dmac_copy_pending(void) {
+    return queued;
+}
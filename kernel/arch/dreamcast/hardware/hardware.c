@@ -16,6 +16,7 @@
 #include <dc/net/broadband_adapter.h>
 #include <dc/net/lan_adapter.h>
 #include <dc/vblank.h>
+#include <dc/dmac.h>
 
 static int initted = 0;
 
@@ -96,6 +97,7 @@ void hardware_shutdown(void) {
             cdrom_shutdown();
 #endif
             g2_dma_shutdown();
+            dmac_copy_shutdown();
             spu_shutdown();
             vid_shutdown();
             /* fallthru */
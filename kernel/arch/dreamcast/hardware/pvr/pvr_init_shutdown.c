@@ -243,6 +243,9 @@ int pvr_shutdown(void) {
     /* Shut down PVR DMA */
     pvr_dma_shutdown();
 
+    /* Drop any cached textures before the pool goes away */
+    pvr_txr_cache_shutdown();
+
     /* Invalidate our memory pool */
     pvr_mem_reset();
 
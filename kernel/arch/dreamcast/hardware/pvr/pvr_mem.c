@@ -35,6 +35,7 @@ extern void pvr_int_free(void *ptr);
 extern struct mallinfo pvr_int_mallinfo();
 extern void pvr_int_mem_reset();
 extern void pvr_int_malloc_stats();
+extern size_t pvr_int_largest_free(void);
 
 
 #ifdef PVR_KM_DBG
@@ -185,6 +186,38 @@ uint32 pvr_mem_available(void) {
         (PVR_RAM_INT_TOP - (uint32)pvr_mem_base);
 }
 
+/* Report used/free bytes and the largest free block without asserting, so
+   that it can be polled by monitoring code before the PVR is set up. */
+int pvr_mem_get_usage(uint32_t *used, uint32_t *avail, uint32_t *largest) {
+    struct mallinfo mi;
+    uint32 unsbrk, top;
+
+    if(pvr_mem_base == NULL)
+        return -1;
+
+    mi = pvr_int_mallinfo();
+    unsbrk = PVR_RAM_INT_TOP - (uint32)pvr_mem_base;
+
+    if(used)
+        *used = mi.uordblks;
+
+    if(avail)
+        *avail = (mi.arena - mi.uordblks) + unsbrk;
+
+    if(largest) {
+        /* The top chunk borders the unallocated part of the pool, so the
+           two together can be handed out as one block. */
+        top = pvr_int_largest_free();
+
+        if(mi.keepcost + unsbrk > top)
+            top = mi.keepcost + unsbrk;
+
+        *largest = top;
+    }
+
+    return 0;
+}
+
 /* Reset the memory pool, equivalent to freeing all textures currently
    residing in RAM. This _must_ be done on a mode change, configuration
    change, etc. */
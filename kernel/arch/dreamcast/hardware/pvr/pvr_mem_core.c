@@ -3278,6 +3278,41 @@ struct mallinfo mALLINFo(void) {
     return mi;
 }
 
+/*
+  KOS addition: size of the largest free chunk, used by pvr_mem_get_usage()
+  to report fragmentation of the pool.
+*/
+
+size_t pvr_int_largest_free(void) {
+    mstate av = get_malloc_state();
+    unsigned int i;
+    mbinptr b;
+    mchunkptr p;
+    INTERNAL_SIZE_T largest;
+
+    if(av->top == 0)  malloc_consolidate(av);
+
+    largest = chunksize(av->top);
+
+    for(i = 0; i < NFASTBINS; ++i) {
+        for(p = av->fastbins[i]; p != 0; p = p->fd) {
+            if(chunksize(p) > largest)
+                largest = chunksize(p);
+        }
+    }
+
+    for(i = 1; i < NBINS; ++i) {
+        b = bin_at(av, i);
+
+        for(p = last(b); p != b; p = p->bk) {
+            if(chunksize(p) > largest)
+                largest = chunksize(p);
+        }
+    }
+
+    return largest;
+}
+
 /*
   ------------------------------ malloc_stats ------------------------------
 */
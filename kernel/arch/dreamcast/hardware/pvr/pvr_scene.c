@@ -92,6 +92,9 @@ void pvr_scene_begin(void) {
     // Get general stuff ready.
     pvr_state.list_reg_open = -1;
 
+    // Start a new frame for the texture cache's upload budget and LRU.
+    pvr_txr_cache_frame();
+
     // Clear these out in case we're using DMA.
     if(pvr_state.dma_mode) {
         for(i = 0; i < PVR_OPB_COUNT; i++) {
@@ -0,0 +1,485 @@
+/* KallistiOS ##version##
+
+   pvr_txr_cache.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <sys/queue.h>
+
+#include <dc/pvr.h>
+#include <arch/cache.h>
+#include <kos/fs.h>
+#include <kos/mutex.h>
+#include <kos/dbglog.h>
+
+#include "pvr_internal.h"
+
+/*
+
+Texture residency manager.
+
+Textures are registered by ID along with a place to reload them from (a range
+of a file, or a buffer in main RAM). The first pvr_txr_cache_get() of a
+texture uploads it into PVR RAM; after that it stays resident until PVR RAM
+(or the configured limit) runs short, at which point the least recently used
+textures are evicted to make room.
+
+The PVR renders one frame while the next is being registered, so a texture
+that was used in the previous frame may still be read by the hardware. Those
+textures, and the ones used in the current frame, are never evicted.
+
+*/
+
+#define TXR_HASH_SIZE   256
+#define TXR_HASH(id)    (((id) ^ ((id) >> 8) ^ ((id) >> 16)) & (TXR_HASH_SIZE - 1))
+
+#define TXR_SRC_RAM     0
+#define TXR_SRC_FILE    1
+
+typedef struct txr_ent {
+    uint32_t    id;
+    int         src_type;
+    const void  *src;           /* RAM source */
+    char        *fn;            /* File source */
+    uint32_t    offset;
+    size_t      size;
+
+    pvr_ptr_t   vram;           /* NULL if not resident */
+    size_t      vram_size;
+    uint32_t    last_frame;
+
+    SLIST_ENTRY(txr_ent)    hash_ent;
+    TAILQ_ENTRY(txr_ent)    lru_ent;    /* Only valid while resident */
+} txr_ent_t;
+
+SLIST_HEAD(txr_hash, txr_ent);
+TAILQ_HEAD(txr_lru, txr_ent);
+
+static struct {
+    int             inited;
+    mutex_t         mutex;
+
+    txr_ent_t       *ents;
+    SLIST_HEAD(, txr_ent) free_ents;
+    struct txr_hash hash[TXR_HASH_SIZE];
+
+    /* Least recently used at the head, most recently used at the tail. */
+    struct txr_lru  lru;
+
+    size_t          vram_limit;
+    size_t          frame_budget;
+    uint32_t        frame;
+    int             frame_uploads;
+
+    pvr_txr_cache_stats_t stats;
+} cache;
+
+static txr_ent_t *txr_find(uint32_t id) {
+    txr_ent_t *e;
+
+    SLIST_FOREACH(e, &cache.hash[TXR_HASH(id)], hash_ent) {
+        if(e->id == id)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void txr_unload(txr_ent_t *e) {
+    if(!e->vram)
+        return;
+
+    pvr_mem_free(e->vram);
+    TAILQ_REMOVE(&cache.lru, e, lru_ent);
+    cache.stats.resident_bytes -= e->vram_size;
+    cache.stats.resident_count--;
+    e->vram = NULL;
+    e->vram_size = 0;
+}
+
+/* Can this texture still be referenced by a scene in flight? */
+static inline int txr_in_use(const txr_ent_t *e) {
+    return e->last_frame + 1 >= cache.frame;
+}
+
+/* Evict the least recently used texture that isn't in use. */
+static int txr_evict_one(void) {
+    txr_ent_t *e = TAILQ_FIRST(&cache.lru);
+
+    /* If the oldest one is in use, everything after it is too. */
+    if(!e || txr_in_use(e))
+        return -1;
+
+    txr_unload(e);
+    cache.stats.evictions++;
+    return 0;
+}
+
+static pvr_ptr_t txr_alloc(size_t size) {
+    pvr_ptr_t rv;
+
+    for(;;) {
+        if(!cache.vram_limit ||
+           cache.stats.resident_bytes + size <= cache.vram_limit) {
+            if((rv = pvr_mem_malloc(size)) != NULL)
+                return rv;
+        }
+
+        if(txr_evict_one() < 0)
+            return NULL;
+    }
+}
+
+static int txr_read_file(txr_ent_t *e, void *buf) {
+    file_t fd;
+    ssize_t rv;
+
+    if((fd = fs_open(e->fn, O_RDONLY)) == FILEHND_INVALID)
+        return -1;
+
+    if(fs_seek(fd, e->offset, SEEK_SET) != (off_t)e->offset) {
+        fs_close(fd);
+        return -1;
+    }
+
+    rv = fs_read(fd, buf, e->size);
+    fs_close(fd);
+
+    return rv == (ssize_t)e->size ? 0 : -1;
+}
+
+/* Copy the staged data into PVR RAM, preferring DMA when we can use it. */
+static void txr_copy(pvr_ptr_t dst, const void *src, size_t size) {
+    int rv = -1;
+
+    if(!((uintptr_t)src & 31) && !(size & 31)) {
+        dcache_flush_range((uintptr_t)src, size);
+
+        mutex_lock((mutex_t *)&pvr_state.dma_lock);
+        rv = pvr_txr_load_dma((void *)src, dst, size, 1, NULL, NULL);
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+    }
+
+    /* Fall back to the store queues if the DMA was unusable or busy. */
+    if(rv < 0)
+        pvr_txr_load((void *)src, dst, size);
+}
+
+static int txr_upload(txr_ent_t *e) {
+    size_t asize = (e->size + 31) & ~31;
+    void *buf = NULL;
+    pvr_ptr_t dst;
+
+    if(!(dst = txr_alloc(asize))) {
+        dbglog(DBG_WARNING, "pvr_txr_cache: no room for texture %08lx "
+               "(%u bytes)\n", (unsigned long)e->id, (unsigned int)asize);
+        return -1;
+    }
+
+    if(e->src_type == TXR_SRC_FILE) {
+        if(!(buf = memalign(32, asize)) || txr_read_file(e, buf) < 0) {
+            dbglog(DBG_WARNING, "pvr_txr_cache: can't load texture %08lx "
+                   "from %s\n", (unsigned long)e->id, e->fn);
+            free(buf);
+            pvr_mem_free(dst);
+            return -1;
+        }
+
+        txr_copy(dst, buf, asize);
+        free(buf);
+    }
+    else if(((uintptr_t)e->src & 31) || (e->size & 31)) {
+        /* DMA needs an aligned source made of whole 32-byte blocks, so stage
+           anything that isn't. */
+        if(!(buf = memalign(32, asize))) {
+            dbglog(DBG_WARNING, "pvr_txr_cache: can't stage texture %08lx\n",
+                   (unsigned long)e->id);
+            pvr_mem_free(dst);
+            return -1;
+        }
+
+        memcpy(buf, e->src, e->size);
+        memset((uint8_t *)buf + e->size, 0, asize - e->size);
+        txr_copy(dst, buf, asize);
+        free(buf);
+    }
+    else {
+        txr_copy(dst, e->src, asize);
+    }
+
+    e->vram = dst;
+    e->vram_size = asize;
+    TAILQ_INSERT_TAIL(&cache.lru, e, lru_ent);
+
+    cache.stats.uploads++;
+    cache.stats.upload_bytes += e->size;
+    cache.stats.frame_upload_bytes += e->size;
+    cache.stats.resident_bytes += asize;
+    cache.stats.resident_count++;
+    cache.frame_uploads++;
+
+    return 0;
+}
+
+static txr_ent_t *txr_new_ent(uint32_t id) {
+    txr_ent_t *e;
+
+    if(txr_find(id))
+        return NULL;
+
+    if(!(e = SLIST_FIRST(&cache.free_ents)))
+        return NULL;
+
+    SLIST_REMOVE_HEAD(&cache.free_ents, hash_ent);
+    memset(e, 0, sizeof(txr_ent_t));
+    e->id = id;
+    return e;
+}
+
+static void txr_insert_ent(txr_ent_t *e) {
+    SLIST_INSERT_HEAD(&cache.hash[TXR_HASH(e->id)], e, hash_ent);
+    cache.stats.registered_count++;
+}
+
+int pvr_txr_cache_init(size_t max_textures, size_t vram_limit,
+                       size_t frame_budget) {
+    size_t i;
+
+    if(cache.inited || !max_textures)
+        return -1;
+
+    if(!(cache.ents = calloc(max_textures, sizeof(txr_ent_t))))
+        return -1;
+
+    SLIST_INIT(&cache.free_ents);
+
+    for(i = max_textures; i > 0; i--)
+        SLIST_INSERT_HEAD(&cache.free_ents, &cache.ents[i - 1], hash_ent);
+
+    for(i = 0; i < TXR_HASH_SIZE; i++)
+        SLIST_INIT(&cache.hash[i]);
+
+    TAILQ_INIT(&cache.lru);
+    mutex_init(&cache.mutex, MUTEX_TYPE_NORMAL);
+
+    cache.vram_limit = vram_limit;
+    cache.frame_budget = frame_budget;
+    cache.frame = 1;
+    cache.frame_uploads = 0;
+    memset(&cache.stats, 0, sizeof(cache.stats));
+    cache.inited = 1;
+
+    return 0;
+}
+
+void pvr_txr_cache_shutdown(void) {
+    txr_ent_t *e;
+    int i;
+
+    if(!cache.inited)
+        return;
+
+    mutex_lock(&cache.mutex);
+
+    for(i = 0; i < TXR_HASH_SIZE; i++) {
+        while((e = SLIST_FIRST(&cache.hash[i]))) {
+            SLIST_REMOVE_HEAD(&cache.hash[i], hash_ent);
+            txr_unload(e);
+            free(e->fn);
+        }
+    }
+
+    free(cache.ents);
+    cache.ents = NULL;
+    cache.inited = 0;
+
+    mutex_unlock(&cache.mutex);
+    mutex_destroy(&cache.mutex);
+}
+
+int pvr_txr_cache_add_file(uint32_t id, const char *fn, uint32_t offset,
+                           size_t size) {
+    txr_ent_t *e;
+    char *name;
+
+    if(!cache.inited || !size)
+        return -1;
+
+    if(!(name = strdup(fn)))
+        return -1;
+
+    mutex_lock(&cache.mutex);
+
+    if(!(e = txr_new_ent(id))) {
+        mutex_unlock(&cache.mutex);
+        free(name);
+        return -1;
+    }
+
+    e->src_type = TXR_SRC_FILE;
+    e->fn = name;
+    e->offset = offset;
+    e->size = size;
+    txr_insert_ent(e);
+
+    mutex_unlock(&cache.mutex);
+    return 0;
+}
+
+int pvr_txr_cache_add_ram(uint32_t id, const void *src, size_t size) {
+    txr_ent_t *e;
+
+    if(!cache.inited || !src || !size)
+        return -1;
+
+    mutex_lock(&cache.mutex);
+
+    if(!(e = txr_new_ent(id))) {
+        mutex_unlock(&cache.mutex);
+        return -1;
+    }
+
+    e->src_type = TXR_SRC_RAM;
+    e->src = src;
+    e->size = size;
+    txr_insert_ent(e);
+
+    mutex_unlock(&cache.mutex);
+    return 0;
+}
+
+int pvr_txr_cache_remove(uint32_t id) {
+    txr_ent_t *e;
+
+    if(!cache.inited)
+        return -1;
+
+    mutex_lock(&cache.mutex);
+
+    if(!(e = txr_find(id))) {
+        mutex_unlock(&cache.mutex);
+        return -1;
+    }
+
+    SLIST_REMOVE(&cache.hash[TXR_HASH(id)], e, txr_ent, hash_ent);
+    txr_unload(e);
+    free(e->fn);
+    e->fn = NULL;
+    SLIST_INSERT_HEAD(&cache.free_ents, e, hash_ent);
+    cache.stats.registered_count--;
+
+    mutex_unlock(&cache.mutex);
+    return 0;
+}
+
+pvr_ptr_t pvr_txr_cache_get(uint32_t id) {
+    txr_ent_t *e;
+    pvr_ptr_t rv = NULL;
+
+    if(!cache.inited)
+        return NULL;
+
+    mutex_lock(&cache.mutex);
+
+    if(!(e = txr_find(id)))
+        goto out;
+
+    if(e->vram) {
+        cache.stats.hits++;
+        TAILQ_REMOVE(&cache.lru, e, lru_ent);
+        TAILQ_INSERT_TAIL(&cache.lru, e, lru_ent);
+    }
+    else {
+        cache.stats.misses++;
+
+        /* Always allow one upload per frame, so that a texture bigger than
+           the whole budget can still make it in eventually. */
+        if(cache.frame_budget && cache.frame_uploads &&
+           cache.stats.frame_upload_bytes + e->size > cache.frame_budget) {
+            cache.stats.deferred++;
+            goto out;
+        }
+
+        if(txr_upload(e) < 0) {
+            cache.stats.failures++;
+            goto out;
+        }
+    }
+
+    e->last_frame = cache.frame;
+    rv = e->vram;
+
+out:
+    mutex_unlock(&cache.mutex);
+    return rv;
+}
+
+pvr_ptr_t pvr_txr_cache_peek(uint32_t id) {
+    txr_ent_t *e;
+    pvr_ptr_t rv = NULL;
+
+    if(!cache.inited)
+        return NULL;
+
+    mutex_lock(&cache.mutex);
+
+    if((e = txr_find(id)))
+        rv = e->vram;
+
+    mutex_unlock(&cache.mutex);
+    return rv;
+}
+
+void pvr_txr_cache_evict_unused(void) {
+    if(!cache.inited)
+        return;
+
+    mutex_lock(&cache.mutex);
+
+    while(txr_evict_one() == 0)
+        ;
+
+    mutex_unlock(&cache.mutex);
+}
+
+void pvr_txr_cache_frame(void) {
+    if(!cache.inited)
+        return;
+
+    mutex_lock(&cache.mutex);
+    cache.frame++;
+    cache.frame_uploads = 0;
+    cache.stats.frame_upload_bytes = 0;
+    mutex_unlock(&cache.mutex);
+}
+
+int pvr_txr_cache_get_stats(pvr_txr_cache_stats_t *stats) {
+    if(!cache.inited || !stats)
+        return -1;
+
+    mutex_lock(&cache.mutex);
+    memcpy(stats, &cache.stats, sizeof(pvr_txr_cache_stats_t));
+    mutex_unlock(&cache.mutex);
+
+    return 0;
+}
+
+void pvr_txr_cache_reset_stats(void) {
+    if(!cache.inited)
+        return;
+
+    mutex_lock(&cache.mutex);
+    cache.stats.hits = 0;
+    cache.stats.misses = 0;
+    cache.stats.uploads = 0;
+    cache.stats.evictions = 0;
+    cache.stats.deferred = 0;
+    cache.stats.failures = 0;
+    cache.stats.upload_bytes = 0;
+    mutex_unlock(&cache.mutex);
+}
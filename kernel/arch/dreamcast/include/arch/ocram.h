@@ -0,0 +1,109 @@
+/* KallistiOS ##version##
+
+   arch/dreamcast/include/arch/ocram.h
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/** \file   arch/ocram.h
+    \brief  Operand cache RAM scratchpad.
+
+    When the INIT_OCRAM flag is passed to KOS_INIT_FLAGS(), half of the SH4's
+    16KB operand cache is set up as 8KB of on-chip RAM. Accesses to it take a
+    single cycle and never miss, which makes it a good home for small, hot,
+    per-frame data such as matrices, vertex staging buffers and audio mixing
+    buffers. The other half of the operand cache continues to act as a normal
+    cache.
+
+    With the index mode KOS uses, the RAM shows up as two separate 4KB banks.
+    This file provides a tiny scratchpad allocator on top of them. It is a
+    bump allocator: there is no way to free an individual allocation, but the
+    whole scratchpad (or everything allocated after a given mark) can be
+    released at once, which matches the usual per-frame usage pattern.
+
+    The allocator is not thread-safe; it is meant to be owned by one thread
+    (usually the one driving the renderer).
+
+    \note   DMA engines cannot access OCRAM. Data destined for DMA must be
+            copied out to main RAM first.
+*/
+
+#ifndef __ARCH_OCRAM_H
+#define __ARCH_OCRAM_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** \brief  Base address of the first OCRAM bank. */
+#define OCRAM_BANK0_BASE    0x7c001000
+
+/** \brief  Base address of the second OCRAM bank. */
+#define OCRAM_BANK1_BASE    0x7c003000
+
+/** \brief  Size of each OCRAM bank, in bytes. */
+#define OCRAM_BANK_SIZE     4096
+
+/** \brief  Number of OCRAM banks. */
+#define OCRAM_BANK_COUNT    2
+
+/** \brief  Scratchpad allocator position.
+
+    Returned by ocram_mark() and passed back to ocram_release() to free
+    everything allocated in between.
+
+    \headerfile arch/ocram.h
+*/
+typedef struct ocram_mark {
+    uint16_t used[OCRAM_BANK_COUNT];    /**< \brief Bytes used in each bank */
+} ocram_mark_t;
+
+/** \brief  Is OCRAM enabled?
+    \return                 Non-zero if KOS was started with INIT_OCRAM.
+*/
+int ocram_enabled(void);
+
+/** \brief  Allocate a block of OCRAM.
+
+    Allocations can't span the two banks, so the largest possible allocation
+    is OCRAM_BANK_SIZE bytes.
+
+    \param  size            The number of bytes to allocate.
+    \param  align           The required alignment (a power of two, or 0 for
+                            the default of 32 bytes, one cache line).
+    \return                 The allocated block, or NULL if OCRAM isn't
+                            enabled or there is not enough room.
+*/
+void *ocram_alloc(size_t size, size_t align);
+
+/** \brief  Record the current allocator position.
+    \param  mark            Where to store the position.
+*/
+void ocram_mark(ocram_mark_t *mark);
+
+/** \brief  Release everything allocated since a mark was taken.
+    \param  mark            A position previously returned by ocram_mark().
+*/
+void ocram_release(const ocram_mark_t *mark);
+
+/** \brief  Release all OCRAM allocations. */
+void ocram_reset(void);
+
+/** \brief  Get the amount of free OCRAM.
+    \param  largest         If non-NULL, set to the largest allocation that
+                            could currently succeed.
+    \return                 The total number of free bytes.
+*/
+size_t ocram_free(size_t *largest);
+
+/** \brief  Check if a pointer points into OCRAM.
+    \param  ptr             The pointer to check.
+    \return                 Non-zero if ptr is inside one of the OCRAM banks.
+*/
+int ocram_contains(const void *ptr);
+
+__END_DECLS
+
+#endif  /* __ARCH_OCRAM_H */
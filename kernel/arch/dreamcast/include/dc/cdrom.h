@@ -29,6 +29,11 @@ __BEGIN_DECLS
     level things with CDs. If you're looking for higher-level stuff, like 
     normal file reading, consult with the stuff for the fs and for fs_iso9660.
 
+    For video and music that are played straight off the disc, a stream
+    (cdrom_stream_open()) reads a range of sectors ahead of time into a ring of
+    buffers, from a thread of its own, so that the thread playing them doesn't
+    have to wait for the drive.
+
     \author Megan Potter
     \author Ruslan Rostovtsev
     \see    kos/fs.h
@@ -369,6 +374,72 @@ int cdrom_read_toc(CDROM_TOC *toc_buffer, int session);
 */
 int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode);
 
+/** \defgroup cd_read_prio         CD-ROM read priorities
+
+    Priorities for cdrom_read_sectors_sched().
+    @{
+*/
+#define CDROM_PRIO_LOW      0   /**< \brief Background reads */
+#define CDROM_PRIO_NORMAL   1   /**< \brief cdrom_read_sectors_ex() */
+#define CDROM_PRIO_HIGH     2   /**< \brief Reads that can't wait */
+/** @} */
+
+/** \brief  Milliseconds before a low priority read counts as normal. */
+#define CDROM_SCHED_MAX_WAIT    500
+
+/** \brief  CD-ROM read scheduler statistics.
+    \headerfile dc/cdrom.h
+*/
+typedef struct cdrom_sched_stats {
+    uint32  requests;           /**< \brief Reads asked for */
+    uint32  commands;           /**< \brief Reads sent to the drive */
+    uint32  merged;             /**< \brief Reads done as part of another */
+    uint32  sectors;            /**< \brief Sectors read from the drive */
+    uint32  seeks;              /**< \brief Reads that didn't carry on from
+                                             the one before */
+    uint32  late;               /**< \brief Reads with a deadline that were
+                                             finished after it */
+    uint64  total_us;           /**< \brief Time from asking to done, in
+                                             total */
+    uint64  max_us;             /**< \brief Longest of those */
+} cdrom_sched_stats_t;
+
+/** \brief  Read one or more sectors, with a priority and a deadline.
+
+    All sector reads go into a queue, and are sent to the drive in the order
+    that seeks least: the highest priority requests first, in order of
+    sector going up the disc from where the drive is and then starting over
+    from the lowest (C-LOOK). Requests that carry on from each other are
+    merged into one read. A request that is still waiting when its deadline
+    comes goes ahead of everything else. Low priority requests count as
+    normal once they have waited CDROM_SCHED_MAX_WAIT ms, so that they
+    aren't held up forever; high priority ones go ahead of both, and are
+    meant for reads that can't wait.
+
+    This blocks until the read is done. cdrom_read_sectors_ex() is the same
+    with CDROM_PRIO_NORMAL and no deadline.
+
+    \param  buffer          Space to store the read sectors.
+    \param  sector          The sector to start reading from.
+    \param  cnt             The number of sectors to read.
+    \param  mode            DMA or PIO
+    \param  prio            The priority (see \ref cd_read_prio).
+    \param  deadline        Milliseconds until it should be started, or 0 for
+                            none.
+    \return                 \ref cd_cmd_response
+    \see    cd_read_sector_mode
+*/
+int cdrom_read_sectors_sched(void *buffer, int sector, int cnt, int mode,
+                             int prio, int deadline);
+
+/** \brief  Get the read scheduler statistics.
+    \param  stats           Where to store them.
+*/
+void cdrom_sched_get_stats(cdrom_sched_stats_t *stats);
+
+/** \brief  Reset the read scheduler statistics. */
+void cdrom_sched_reset_stats(void);
+
 /** \brief  Read one or more sector from a CD-ROM in PIO mode.
 
     Default version of cdrom_read_sectors_ex, which forces PIO mode.
@@ -438,6 +509,121 @@ int cdrom_cdda_resume(void);
 */
 int cdrom_spin_down(void);
 
+/** \brief  CD-ROM stream type (opaque). */
+typedef struct cdrom_stream cdrom_stream_t;
+
+/** \brief  Stream callback type.
+
+    \param  s               The stream.
+    \param  buf             A buffer that has been filled, or NULL once the
+                            stream has ended (see cdrom_stream_error()).
+    \param  bytes           The number of bytes in the buffer.
+    \param  user            The user pointer given to cdrom_stream_open().
+*/
+typedef void (*cdrom_stream_cb_t)(cdrom_stream_t *s, void *buf, size_t bytes,
+                                  void *user);
+
+/** \brief  CD-ROM stream statistics.
+    \headerfile dc/cdrom.h
+*/
+typedef struct cdrom_stream_stats {
+    uint32  buffers;            /**< \brief Buffers filled */
+    uint32  sectors;            /**< \brief Sectors read */
+    uint32  underruns;          /**< \brief Times cdrom_stream_get() had to
+                                             wait for the drive */
+    uint64  underrun_us;        /**< \brief Time spent waiting in those */
+    uint32  max_underrun_us;    /**< \brief Longest of those waits */
+    uint32  stalls;             /**< \brief Times the drive sat idle because
+                                             every buffer was full */
+    uint32  urgent;             /**< \brief Buffers read ahead of all other
+                                             requests, because the consumer
+                                             had nothing left */
+} cdrom_stream_stats_t;
+
+/** \brief  Start streaming a range of sectors.
+
+    This starts a thread that reads the sectors into a ring of buffers, one
+    DMA read of up to buf_sectors sectors per buffer, staying as far ahead of
+    the consumer as the buffers allow. Filled buffers are passed to the
+    callback if there is one, or else are taken with cdrom_stream_get(). In
+    both cases, a buffer belongs to the consumer until it is given back with
+    cdrom_stream_release().
+
+    The stream's reads go through cdrom_read_sectors_sched() like all others,
+    so other reads (through fs_iso9660, for instance) can be done at the same
+    time. While at least half of the buffers are full, the stream reads at
+    CDROM_PRIO_NORMAL, taking turns with other reads. With fewer than that it
+    reads at CDROM_PRIO_HIGH, and once the consumer has nothing left, ahead of
+    everything else.
+
+    Sectors are numbered as for cdrom_read_sectors(), and are the size set by
+    cdrom_change_datatype() when the stream is opened.
+
+    \param  sector          The first sector to read.
+    \param  cnt             The number of sectors to read.
+    \param  buf_sectors     The number of sectors in each buffer.
+    \param  nbufs           The number of buffers (at least 2).
+    \param  cb              The callback, or NULL to use cdrom_stream_get().
+                            It is called from the stream's thread, and must not
+                            wait for the stream.
+    \param  user            Passed to the callback.
+    \return                 The new stream, or NULL on failure (errno set to
+                            EINVAL, ENOMEM or EAGAIN).
+*/
+cdrom_stream_t *cdrom_stream_open(uint32 sector, uint32 cnt,
+                                  size_t buf_sectors, int nbufs,
+                                  cdrom_stream_cb_t cb, void *user);
+
+/** \brief  Take the next filled buffer of a stream.
+
+    Buffers come back in the order of the disc. If the next one isn't filled
+    yet, this waits for it and counts an underrun.
+
+    \param  s               The stream, which must not have a callback.
+    \param  buf             Where to store the buffer.
+    \param  bytes           Where to store the number of bytes in it.
+    \param  timeout         The most milliseconds to wait, or 0 to wait as
+                            long as it takes.
+    \retval 1               If a buffer was taken.
+    \retval 0               At the end of the stream.
+    \retval -1              On failure (errno set to ETIMEDOUT, EIO if a read
+                            failed, or EINVAL if the stream has a callback).
+*/
+int cdrom_stream_get(cdrom_stream_t *s, void **buf, size_t *bytes,
+                     int timeout);
+
+/** \brief  Give a buffer back to a stream to be filled again.
+    \param  s               The stream.
+    \param  buf             The buffer.
+    \retval 0               On success.
+    \retval -1              If the buffer isn't the consumer's (errno set to
+                            EINVAL).
+*/
+int cdrom_stream_release(cdrom_stream_t *s, void *buf);
+
+/** \brief  Tell why a stream stopped early.
+    \param  s               The stream.
+    \return                 The \ref cd_cmd_response of the read that failed,
+                            or ERR_OK.
+*/
+int cdrom_stream_error(cdrom_stream_t *s);
+
+/** \brief  Get the statistics of a stream.
+    \param  s               The stream.
+    \param  stats           Where to store the statistics.
+*/
+void cdrom_stream_get_stats(cdrom_stream_t *s, cdrom_stream_stats_t *stats);
+
+/** \brief  Stop a stream and free it.
+
+    This waits for the read in progress, if there is one. Buffers the consumer
+    still has are freed as well.
+
+    \param  s               The stream.
+    \retval 0               On success.
+*/
+int cdrom_stream_close(cdrom_stream_t *s);
+
 /** \brief  Initialize the GD-ROM for reading CDs.
 
     This initializes the CD-ROM reading system, reactivating the drive and
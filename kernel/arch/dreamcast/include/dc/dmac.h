@@ -18,7 +18,8 @@
 
     DMA channel 2 is strictly used to transfer data to the PVR/TA.
 
-    DMA channel 1 & 3 are free to use.
+    DMA channel 1 is used by the memory-to-memory copy engine declared at the
+    end of this file. DMA channel 3 is free to use.
     
     \author Andy Barajas
 */
@@ -29,6 +30,12 @@
 #include <sys/cdefs.h>
 __BEGIN_DECLS
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <arch/types.h>
+#include <kos/sem.h>
+
 #define DMAC_BASE     0xffa00000
 
 /** \name DMA Source Address Registers (SAR0-SAR3)
@@ -124,6 +131,152 @@ __BEGIN_DECLS
 
 /** @} */
 
+/** \name  Memory-to-memory copy engine
+
+    These functions use DMA channel 1 to copy blocks of memory in the
+    background while the CPU keeps working. Requests are queued and run one
+    after the other; each one can either be waited on or signal completion
+    through a callback.
+
+    Both the source and destination must be 32-byte aligned and the length
+    must be a multiple of 32 bytes. Cache coherency is handled when a request
+    is submitted: the source range is flushed from the data cache and the
+    destination range is purged, so that neither stale cache lines nor later
+    write-backs can corrupt the transferred data. The caller must not touch
+    either buffer until the request has completed.
+
+    Typical users are texture uploads (the destination may be a texture
+    pointer returned by pvr_mem_malloc()) and decompressors, which can fill
+    one output block while the previous one is moved into place.
+
+    The DMA engine cannot reach OCRAM or the store queues.
+
+    @{
+*/
+
+/** \brief  Copy engine completion callback.
+
+    Called from interrupt context when a request finishes. It may submit new
+    requests, but must not block.
+
+    \param  data            The user data passed to dmac_copy_submit().
+*/
+typedef void (*dmac_copy_callback_t)(void *data);
+
+/** \brief  Copy request states. */
+typedef enum dmac_copy_state {
+    DMAC_COPY_IDLE = 0,         /**< \brief Never submitted */
+    DMAC_COPY_PENDING,          /**< \brief Waiting in the queue */
+    DMAC_COPY_ACTIVE,           /**< \brief Being transferred */
+    DMAC_COPY_DONE,             /**< \brief Completed successfully */
+    DMAC_COPY_ERROR,            /**< \brief The DMAC reported an error */
+    DMAC_COPY_CANCELED          /**< \brief Removed from the queue */
+} dmac_copy_state_t;
+
+/** \brief  Copy request.
+
+    Owned by the caller, and must stay valid until the request has completed
+    or been canceled. It should be zero-initialized before its first use. The
+    fields are private to the copy engine, except that the state may be read
+    at any time.
+
+    \headerfile dc/dmac.h
+*/
+typedef struct dmac_copy_req {
+    uintptr_t dest;                         /**< \brief Destination */
+    uintptr_t src;                          /**< \brief Source */
+    size_t len;                             /**< \brief Length, in bytes */
+    dmac_copy_callback_t callback;          /**< \brief Completion callback */
+    void *cbdata;                           /**< \brief Callback data */
+    volatile dmac_copy_state_t state;       /**< \brief Request state */
+    semaphore_t done;                       /**< \brief Signaled on completion */
+    TAILQ_ENTRY(dmac_copy_req) qent;        /**< \brief Queue entry */
+} dmac_copy_req_t;
+
+/** \brief  Initialize the copy engine.
+
+    This is called automatically by the first submitted request, but may be
+    called earlier to avoid the setup cost later on.
+
+    \retval 0               On success (or if already initialized).
+*/
+int dmac_copy_init(void);
+
+/** \brief  Shut down the copy engine.
+
+    Any transfer in progress is stopped, and all queued requests are marked
+    as canceled and their waiters woken up.
+*/
+void dmac_copy_shutdown(void);
+
+/** \brief  Queue an asynchronous copy.
+
+    \param  req             The request to fill in and queue.
+    \param  dest            The destination (32-byte aligned).
+    \param  src             The source (32-byte aligned).
+    \param  len             The number of bytes to copy (a multiple of 32).
+    \param  callback        Function to call on completion, or NULL.
+    \param  cbdata          Data to pass to the callback.
+
+    \retval 0               On success.
+    \retval -1              On error, with errno set.
+
+    \par   Error Conditions:
+    \em    EINVAL - the addresses or length are misaligned, or len is 0 \n
+    \em    EFAULT - one of the buffers isn't reachable by the DMAC \n
+    \em    EBUSY - the request is already queued
+*/
+int dmac_copy_submit(dmac_copy_req_t *req, void *dest, const void *src,
+                     size_t len, dmac_copy_callback_t callback, void *cbdata);
+
+/** \brief  Wait for a copy to complete.
+
+    Must not be called from an interrupt.
+
+    \param  req             The request to wait on.
+    \retval 0               If the copy completed successfully.
+    \retval -1              If the copy failed or was canceled (errno is set to
+                            EIO or ECANCELED respectively).
+*/
+int dmac_copy_wait(dmac_copy_req_t *req);
+
+/** \brief  Check if a copy has finished.
+    \param  req             The request to check.
+    \return                 Non-zero if the request is no longer queued or
+                            running.
+*/
+int dmac_copy_poll(const dmac_copy_req_t *req);
+
+/** \brief  Cancel a queued copy.
+
+    Only requests that haven't been started yet can be canceled.
+
+    \param  req             The request to cancel.
+    \retval 0               On success.
+    \retval -1              If the request is running or not queued, with
+                            errno set to EBUSY or EINVAL.
+*/
+int dmac_copy_cancel(dmac_copy_req_t *req);
+
+/** \brief  Copy a block of memory and wait for the copy to finish.
+
+    The same restrictions as dmac_copy_submit() apply.
+
+    \param  dest            The destination (32-byte aligned).
+    \param  src             The source (32-byte aligned).
+    \param  len             The number of bytes to copy (a multiple of 32).
+    \retval 0               On success.
+    \retval -1              On error, with errno set.
+*/
+int dmac_copy(void *dest, const void *src, size_t len);
+
+/** \brief  Get the number of requests queued or running.
+    \return                 The number of outstanding requests.
+*/
+size_t dmac_copy_pending(void);
+
+/** @} */
+
 __END_DECLS
 
 #endif  /* __DC_DMAC_H */
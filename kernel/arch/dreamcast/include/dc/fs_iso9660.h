@@ -17,6 +17,20 @@
     The implementation was originally based on a simple ISO9660 implementation
     by Marcus Comstedt.
 
+    Sectors read from the disc are kept in two caches: one for directories and
+    one for file data. Their sizes can be set with fs_iso9660_set_cache_size(),
+    and fs_iso9660_get_cache_stats() tells how well they are working.
+
+    Files that are read sequentially get readahead: the data cache is filled
+    several sectors at a time, with a window that grows as long as the reads
+    keep following each other (see fs_iso9660_set_readahead()). Reads of
+    whole sectors that are larger than the window skip the cache and go
+    straight to the caller's buffer in one command.
+
+    The entries of each directory that is searched are also kept in a table,
+    so that opening more files in it doesn't have to read and scan it again
+    (see fs_iso9660_set_dir_table_size()).
+
     \author Megan Potter
     \author Andrew Kieschnick
     \author Bero
@@ -42,6 +56,109 @@ __BEGIN_DECLS
 */
 int iso_reset(void);
 
+/** \brief  Sectors in each cache if fs_iso9660_set_cache_size() isn't used. */
+#define FS_ISO9660_CACHE_DEFAULT    16
+
+/** \brief  Most sectors of readahead if fs_iso9660_set_readahead() isn't
+            used. */
+#define FS_ISO9660_READAHEAD_DEFAULT    32
+
+/** \brief  Bytes of directory tables if fs_iso9660_set_dir_table_size() isn't
+            used. */
+#define FS_ISO9660_DIR_TABLE_DEFAULT    (64 * 1024)
+
+/** \brief  ISO9660 sector cache statistics.
+    \headerfile dc/fs_iso9660.h
+*/
+typedef struct fs_iso9660_cache_stats {
+    uint32_t hits;              /**< \brief Reads found in the cache */
+    uint32_t misses;            /**< \brief Reads that went to the disc */
+    uint32_t evictions;         /**< \brief Sectors dropped to make room */
+    uint32_t readahead;         /**< \brief Sectors read along with a miss */
+    size_t size;                /**< \brief Capacity, in sectors */
+    size_t used;                /**< \brief Sectors in use */
+} fs_iso9660_cache_stats_t;
+
+/** \brief  Set the sizes of the sector caches.
+
+    The directory cache holds the sectors of directories that have been
+    searched or listed, and the data cache those of files read a little at a
+    time (large aligned reads go straight to the caller's buffer). Sizes are
+    rounded up to whole 2048 byte sectors.
+
+    This can be called before fs_iso9660_init(), in which case the sizes are
+    used when it runs, or later, in which case everything in the caches is
+    dropped. Reads already going on in other threads are finished first, and
+    any that start meanwhile wait for the new caches.
+
+    \param  dir_bytes       Size of the directory cache, in bytes.
+    \param  data_bytes      Size of the data cache, in bytes.
+    \retval 0               On success.
+    \retval -1              On failure (errno set to EINVAL if either size is
+                            0, or ENOMEM, in which case a cache that couldn't
+                            be resized keeps its old size).
+*/
+int fs_iso9660_set_cache_size(size_t dir_bytes, size_t data_bytes);
+
+/** \brief  Set the most data to read ahead of a sequential read.
+
+    The readahead window of a file starts at a few sectors when a read
+    follows on from the one before, and doubles with every such read up to
+    this size, or half the size of the data cache if that is smaller. It
+    closes again as soon as a read goes somewhere else. The size is rounded
+    down to whole 2048 byte sectors, and less than two turns readahead off.
+
+    Like fs_iso9660_set_cache_size(), this can be called before or after
+    fs_iso9660_init(), and drops everything in the data cache if called
+    after.
+
+    \param  bytes           Largest readahead window, in bytes.
+    \retval 0               On success.
+    \retval -1              On failure (errno set to ENOMEM, in which case the
+                            old setting is kept).
+*/
+int fs_iso9660_set_readahead(size_t bytes);
+
+/** \brief  Set the memory used for directory tables.
+
+    When a directory is first searched for a file, all of its entries are
+    read into a table with their names (Joliet or Rock Ridge names if the disc
+    has them) and where they are, so that later lookups in it take no reads.
+    The tables of the directories used least recently are dropped to stay
+    within this size, and all of them are dropped by iso_reset().
+
+    \param  bytes           Memory for the tables, in bytes. 0 turns them off,
+                            so that every lookup scans the directory again.
+*/
+void fs_iso9660_set_dir_table_size(size_t bytes);
+
+/** \brief  Find where a file is on the disc.
+
+    This is meant for streaming a file with cdrom_stream_open(), which reads
+    the disc directly and doesn't go through the caches.
+
+    \param  fd              A file opened on /cd.
+    \param  sector          Where to store its first sector, numbered as for
+                            cdrom_read_sectors().
+    \param  size            Where to store its size in bytes.
+    \retval 0               On success.
+    \retval -1              On failure (errno set to EINVAL if the file isn't
+                            on /cd, or EBADF if it's a directory or the disc
+                            has been changed).
+*/
+int fs_iso9660_get_extent(file_t fd, uint32 *sector, size_t *size);
+
+/** \brief  Get the sector cache statistics.
+    \param  dir             Where to store the directory cache statistics, or
+                            NULL.
+    \param  data            Where to store the data cache statistics, or NULL.
+*/
+void fs_iso9660_get_cache_stats(fs_iso9660_cache_stats_t *dir,
+                                fs_iso9660_cache_stats_t *data);
+
+/** \brief  Reset the hit, miss and eviction counts of both caches. */
+void fs_iso9660_reset_cache_stats(void);
+
 /* \cond */
 int fs_iso9660_init(void);
 int fs_iso9660_shutdown(void);
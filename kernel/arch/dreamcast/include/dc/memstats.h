@@ -0,0 +1,110 @@
+/* KallistiOS ##version##
+
+   dc/memstats.h
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/** \file   dc/memstats.h
+    \brief  Unified memory usage telemetry.
+
+    This file provides a single interface for sampling the usage of every
+    memory pool in the system: the main RAM heap, the PVR texture RAM pool, the
+    SPU RAM pool, thread stacks, and mounted romdisk images. Each sample
+    contains the current usage along with the peak seen since the last reset,
+    the largest free block (as a measure of fragmentation) and the rate at
+    which usage is changing.
+
+    Samples can be taken on demand with memstats_sample(), or logged
+    periodically by calling memstats_frame() once per frame after enabling
+    logging with memstats_set_log_interval().
+*/
+
+#ifndef __DC_MEMSTATS_H
+#define __DC_MEMSTATS_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** \defgroup memstats_pools    Memory pools tracked by memstats
+    @{
+*/
+#define MEMSTATS_MAIN       0   /**< \brief Main RAM heap (malloc) */
+#define MEMSTATS_VRAM       1   /**< \brief PVR texture RAM pool */
+#define MEMSTATS_SOUND      2   /**< \brief SPU RAM pool */
+#define MEMSTATS_STACKS     3   /**< \brief Thread stacks */
+#define MEMSTATS_ROMDISK    4   /**< \brief Mounted romdisk images */
+#define MEMSTATS_POOL_COUNT 5   /**< \brief Number of tracked pools */
+/** @} */
+
+/** \brief  Usage figures for a single memory pool.
+
+    For the thread stack pool, used is the amount of stack currently in use
+    by all threads and total is the amount reserved for them; free and
+    largest_free are the unused remainder. For romdisks, total and used are
+    both the size of all mounted images.
+
+    \headerfile dc/memstats.h
+*/
+typedef struct memstats_pool {
+    int         valid;          /**< \brief Non-zero if the pool was sampled */
+    size_t      total;          /**< \brief Size of the pool in bytes */
+    size_t      used;           /**< \brief Bytes currently in use */
+    size_t      free;           /**< \brief Bytes currently free */
+    size_t      largest_free;   /**< \brief Largest free contiguous block */
+    size_t      peak;           /**< \brief Highest used value seen */
+    int         frag;           /**< \brief Fragmentation, in percent */
+    int32_t     delta;          /**< \brief Change in used bytes since the
+                                            previous sample */
+    int32_t     rate;           /**< \brief delta divided by the time since
+                                            the previous sample, in bytes
+                                            per second */
+} memstats_pool_t;
+
+/** \brief  A full memory telemetry sample.
+    \headerfile dc/memstats.h
+*/
+typedef struct memstats {
+    uint64_t        timestamp;  /**< \brief When the sample was taken (ms) */
+    memstats_pool_t pools[MEMSTATS_POOL_COUNT]; /**< \brief Per-pool figures */
+} memstats_t;
+
+/** \brief  Take a memory telemetry sample.
+
+    This samples every pool, updating the peak, delta and rate figures along
+    the way. The previous sample is the last one taken by any thread,
+    including those taken by memstats_frame(). Pools that are not currently set up (for instance the PVR RAM pool
+    before pvr_init()) are marked as not valid. Do not call this from an
+    interrupt.
+
+    \param  out             Where to store the sample (may be NULL to only
+                            update the peak figures).
+*/
+void memstats_sample(memstats_t *out);
+
+/** \brief  Reset the peak usage figures to the current usage. */
+void memstats_reset_peaks(void);
+
+/** \brief  Print a memory telemetry sample to the debug log.
+    \param  stats           The sample to print.
+*/
+void memstats_print(const memstats_t *stats);
+
+/** \brief  Set how often memstats_frame() logs a sample.
+    \param  frames          Log every this many frames, or 0 to disable.
+*/
+void memstats_set_log_interval(unsigned int frames);
+
+/** \brief  Per-frame hook for periodic logging.
+
+    Call this once per frame from your main loop. Every N frames (as set by
+    memstats_set_log_interval()) it takes a sample and prints it.
+*/
+void memstats_frame(void);
+
+__END_DECLS
+
+#endif  /* __DC_MEMSTATS_H */
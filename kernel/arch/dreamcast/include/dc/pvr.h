@@ -1458,6 +1458,21 @@ void pvr_mem_free(pvr_ptr_t chunk);
 */
 uint32_t pvr_mem_available(void);
 
+/** \brief  Get usage figures for the PVR RAM pool.
+
+    This reports how much of the PVR RAM pool is allocated, how much is free,
+    and the size of the largest block that pvr_mem_malloc() could currently
+    hand out. Unlike pvr_mem_available(), this may be called before the PVR
+    has been initialized, in which case it simply fails.
+
+    \param  used            Set to the number of bytes allocated (may be NULL).
+    \param  avail           Set to the number of free bytes (may be NULL).
+    \param  largest         Set to the largest free block size (may be NULL).
+    \retval 0               On success.
+    \retval -1              If the PVR is not initialized.
+*/
+int pvr_mem_get_usage(uint32_t *used, uint32_t *avail, uint32_t *largest);
+
 /** \brief  Reset the PVR RAM pool.
 
     This will essentially free any blocks allocated within the pool. There's
@@ -2131,6 +2146,154 @@ void pvr_dma_init(void);
 /** \brief  Shut down PVR DMA. */
 void pvr_dma_shutdown(void);
 
+/* Texture cache *****************************************************/
+
+/* The texture cache keeps a working set of textures resident in PVR RAM,
+   uploading them on first use and evicting the least recently used ones when
+   texture memory runs short. Textures are registered by a caller-chosen ID
+   together with a backing source (a file in the VFS or a buffer in main RAM)
+   that they can be reloaded from at any time. */
+
+/** \brief  PVR texture cache statistics.
+
+    This structure is filled in by pvr_txr_cache_get_stats(). All counters
+    are cumulative since pvr_txr_cache_init() or the last call to
+    pvr_txr_cache_reset_stats(), except where noted.
+
+    \headerfile dc/pvr.h
+*/
+typedef struct pvr_txr_cache_stats {
+    uint32_t hits;              /**< \brief Lookups that found the texture resident */
+    uint32_t misses;            /**< \brief Lookups that required an upload */
+    uint32_t uploads;           /**< \brief Textures successfully uploaded */
+    uint32_t evictions;         /**< \brief Textures evicted to make room */
+    uint32_t deferred;          /**< \brief Uploads pushed back by the frame budget */
+    uint32_t failures;          /**< \brief Uploads that failed (I/O or no room) */
+    uint64_t upload_bytes;      /**< \brief Total bytes uploaded to PVR RAM */
+    uint32_t frame_upload_bytes;/**< \brief Bytes uploaded in the current frame */
+    uint32_t resident_bytes;    /**< \brief PVR RAM currently held (not cumulative) */
+    uint32_t resident_count;    /**< \brief Textures currently resident (not cumulative) */
+    uint32_t registered_count;  /**< \brief Textures registered (not cumulative) */
+} pvr_txr_cache_stats_t;
+
+/** \brief  Initialize the PVR texture cache.
+
+    This function sets up the texture cache. The PVR must already have been
+    initialized with pvr_init() before calling this. The cache is shut down
+    automatically by pvr_shutdown().
+
+    \param  max_textures    The maximum number of textures that can be
+                            registered at once.
+    \param  vram_limit      The maximum number of bytes of PVR RAM the cache
+                            may hold, or 0 to allow it to use whatever
+                            pvr_mem_malloc() will give it.
+    \param  frame_budget    The maximum number of bytes to upload in a single
+                            frame, or 0 for no limit. At least one texture is
+                            always uploaded per frame even if it alone is
+                            larger than the budget.
+    \retval 0               On success.
+    \retval -1              On failure (already initialized or out of memory).
+*/
+int pvr_txr_cache_init(size_t max_textures, size_t vram_limit,
+                       size_t frame_budget);
+
+/** \brief  Shut down the PVR texture cache.
+
+    This frees all resident textures and forgets all registrations.
+*/
+void pvr_txr_cache_shutdown(void);
+
+/** \brief  Register a texture backed by a file.
+
+    The texture data is read from the given range of the file each time it
+    needs to be uploaded. The data must already be in the final PVR layout
+    (twiddled, VQ compressed, etc. as appropriate).
+
+    \param  id              The ID to register the texture under.
+    \param  fn              The path of the file holding the texture data.
+    \param  offset          The offset of the texture data in the file.
+    \param  size            The size of the texture data in bytes.
+    \retval 0               On success.
+    \retval -1              On failure (duplicate ID, table full or no
+                            memory).
+*/
+int pvr_txr_cache_add_file(uint32_t id, const char *fn, uint32_t offset,
+                           size_t size);
+
+/** \brief  Register a texture backed by a buffer in main RAM.
+
+    The buffer must remain valid until the texture is removed from the cache.
+    Uploads are done with PVR DMA. If the buffer isn't 32-byte aligned or its
+    size isn't a multiple of 32, each upload first copies it into a temporary
+    aligned buffer, padded out to a whole 32-byte block. The store queues are
+    only used if the DMA is busy or fails.
+
+    \param  id              The ID to register the texture under.
+    \param  src             The texture data, already in final PVR layout.
+    \param  size            The size of the texture data in bytes.
+    \retval 0               On success.
+    \retval -1              On failure (duplicate ID, table full).
+*/
+int pvr_txr_cache_add_ram(uint32_t id, const void *src, size_t size);
+
+/** \brief  Remove a texture from the cache.
+
+    This frees the texture's PVR RAM if it is resident and forgets its
+    registration. Do not remove a texture that is used by a scene that is
+    still being rendered.
+
+    \param  id              The ID of the texture to remove.
+    \retval 0               On success.
+    \retval -1              If no texture is registered with that ID.
+*/
+int pvr_txr_cache_remove(uint32_t id);
+
+/** \brief  Look up a texture, uploading it if needed.
+
+    This function returns the location of the texture in PVR RAM, uploading
+    it first if it is not resident. The texture is marked as used in the
+    current frame, which protects it from eviction until the frame after next
+    (so that it cannot be freed while the PVR may still be rendering with it).
+
+    \param  id              The ID of the texture to look up.
+    \return                 The texture in PVR RAM, or NULL if it is not
+                            registered, could not be uploaded, or the upload
+                            was deferred by the per-frame upload budget.
+*/
+pvr_ptr_t pvr_txr_cache_get(uint32_t id);
+
+/** \brief  Check if a texture is resident without uploading it.
+    \param  id              The ID of the texture to check.
+    \return                 The texture in PVR RAM, or NULL if it is not
+                            currently resident.
+*/
+pvr_ptr_t pvr_txr_cache_peek(uint32_t id);
+
+/** \brief  Evict every texture not in use by the current or previous frame.
+
+    This can be used to release PVR RAM for some other purpose. Textures stay
+    registered and are reloaded on next use.
+*/
+void pvr_txr_cache_evict_unused(void);
+
+/** \brief  Start a new texture cache frame.
+
+    This resets the per-frame upload budget and advances the frame counter
+    used for LRU eviction. It is called automatically by pvr_scene_begin(), so
+    there is usually no reason to call it directly.
+*/
+void pvr_txr_cache_frame(void);
+
+/** \brief  Retrieve texture cache statistics.
+    \param  stats           Buffer to fill in with the current statistics.
+    \retval 0               On success.
+    \retval -1              If the cache is not initialized.
+*/
+int pvr_txr_cache_get_stats(pvr_txr_cache_stats_t *stats);
+
+/** \brief  Reset the cumulative texture cache statistics. */
+void pvr_txr_cache_reset_stats(void);
+
 /*********************************************************************/
 
 
@@ -59,6 +59,22 @@ void snd_mem_free(uint32 addr);
 */
 uint32 snd_mem_available(void);
 
+/** \brief  Get usage figures for the SPU RAM pool.
+
+    This function walks the SPU RAM pool and reports how much of it is in use,
+    how much is free in total, and how big the largest free block is. Unlike
+    snd_mem_available(), this is safe to call before snd_mem_init().
+
+    \param  used            Set to the number of bytes allocated (may be NULL).
+    \param  total_free      Set to the number of free bytes (may be NULL).
+    \param  largest_free    Set to the size of the largest free block (may be
+                            NULL).
+    \retval 0               On success.
+    \retval -1              If the pool isn't initialized, or the pool lock
+                            couldn't be taken inside an interrupt.
+*/
+int snd_mem_get_usage(uint32 *used, uint32 *total_free, uint32 *largest_free);
+
 /** \brief  Reinitialize the SPU RAM pool.
 
     This function reinitializes the SPU RAM pool with the given base offset
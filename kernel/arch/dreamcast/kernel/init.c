@@ -207,6 +207,10 @@ int  __weak arch_auto_init(void) {
 }
 
 void  __weak arch_auto_shutdown(void) {
+    /* The asynchronous I/O workers call into the filesystems, so they have
+       to stop before any of those do. */
+    fs_aio_shutdown();
+
 #ifndef _arch_sub_naomi
     fs_dclsocket_shutdown();
     KOS_INIT_FLAG_CALL(net_shutdown);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <kos/fs.h>
+#include <kos/fs_aio.h>
 #include <kos/thread.h>
 #include <kos/fs_pty.h>
 #include <kos/fs_dev.h>
@@ -0,0 +1,107 @@
+/* KallistiOS ##version##
+
+   ocram.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+#include <string.h>
+#include <kos/init.h>
+#include <arch/ocram.h>
+
+/*
+
+Scratchpad allocator for the operand cache RAM. startup.s sets CCR.ORA when
+INIT_OCRAM is given, which turns half of the operand cache into two 4KB banks
+of RAM. Each bank is managed as a simple bump allocator.
+
+*/
+
+static const uintptr_t banks[OCRAM_BANK_COUNT] = {
+    OCRAM_BANK0_BASE, OCRAM_BANK1_BASE
+};
+
+static size_t used[OCRAM_BANK_COUNT];
+
+int ocram_enabled(void) {
+    return !!(__kos_init_flags & INIT_OCRAM);
+}
+
+void *ocram_alloc(size_t size, size_t align) {
+    size_t start;
+    int i;
+
+    if(!ocram_enabled() || !size || size > OCRAM_BANK_SIZE)
+        return NULL;
+
+    if(!align)
+        align = 32;
+
+    /* Alignment must be a power of two. */
+    if(align & (align - 1))
+        return NULL;
+
+    for(i = 0; i < OCRAM_BANK_COUNT; ++i) {
+        start = (banks[i] + used[i] + align - 1) & ~(align - 1);
+        start -= banks[i];
+
+        if(start + size <= OCRAM_BANK_SIZE) {
+            used[i] = start + size;
+            return (void *)(banks[i] + start);
+        }
+    }
+
+    return NULL;
+}
+
+void ocram_mark(ocram_mark_t *mark) {
+    int i;
+
+    for(i = 0; i < OCRAM_BANK_COUNT; ++i)
+        mark->used[i] = (uint16_t)used[i];
+}
+
+void ocram_release(const ocram_mark_t *mark) {
+    int i;
+
+    for(i = 0; i < OCRAM_BANK_COUNT; ++i) {
+        if(mark->used[i] < used[i])
+            used[i] = mark->used[i];
+    }
+}
+
+void ocram_reset(void) {
+    memset(used, 0, sizeof(used));
+}
+
+size_t ocram_free(size_t *largest) {
+    size_t total = 0, big = 0, left;
+    int i;
+
+    if(ocram_enabled()) {
+        for(i = 0; i < OCRAM_BANK_COUNT; ++i) {
+            left = OCRAM_BANK_SIZE - used[i];
+            total += left;
+
+            if(left > big)
+                big = left;
+        }
+    }
+
+    if(largest)
+        *largest = big;
+
+    return total;
+}
+
+int ocram_contains(const void *ptr) {
+    uintptr_t p = (uintptr_t)ptr;
+    int i;
+
+    for(i = 0; i < OCRAM_BANK_COUNT; ++i) {
+        if(p >= banks[i] && p < banks[i] + OCRAM_BANK_SIZE)
+            return 1;
+    }
+
+    return 0;
+}
@@ -300,3 +300,46 @@ uint32 snd_mem_available(void) {
     spinlock_unlock(&snd_mem_mutex);
     return (uint32)largest;
 }
+
+int snd_mem_get_usage(uint32 *used, uint32 *total_free, uint32 *largest_free) {
+    snd_block_t *e;
+    size_t inuse = 0, avail = 0, largest = 0;
+
+    if(!initted)
+        return -1;
+
+    if(irq_inside_int()) {
+        if(!spinlock_trylock(&snd_mem_mutex)) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    else {
+        spinlock_lock(&snd_mem_mutex);
+    }
+
+    TAILQ_FOREACH(e, &pool, qent) {
+        if(e->inuse) {
+            inuse += e->size;
+        }
+        else {
+            avail += e->size;
+
+            if(e->size > largest)
+                largest = e->size;
+        }
+    }
+
+    spinlock_unlock(&snd_mem_mutex);
+
+    if(used)
+        *used = inuse;
+
+    if(total_free)
+        *total_free = avail;
+
+    if(largest_free)
+        *largest_free = largest;
+
+    return 0;
+}
@@ -0,0 +1,241 @@
+/* KallistiOS ##version##
+
+   util/memstats.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+#include <string.h>
+#include <malloc.h>
+
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/dbglog.h>
+#include <kos/fs_romdisk.h>
+
+#include <arch/arch.h>
+#include <arch/irq.h>
+#include <arch/timer.h>
+
+#include <dc/pvr.h>
+#include <dc/sound/sound.h>
+#include <dc/memstats.h>
+
+/*
+
+Each of the memory pools in the system has its own way of reporting how much
+of it is in use. This module gathers all of them into one place and tracks
+the peak usage and growth rate of each over time, so that an application can
+keep an eye on all of them from one call.
+
+*/
+
+/* The end of the program image, where the heap starts. */
+extern unsigned long end;
+
+/* mm_sbrk() refuses to grow within this many bytes of the top of RAM. */
+#define SBRK_RESERVE    65536
+
+/* Guards last and peaks, which every sampling thread updates. */
+static mutex_t stats_mutex = MUTEX_INITIALIZER;
+static memstats_t last;
+static size_t peaks[MEMSTATS_POOL_COUNT];
+static unsigned int log_interval, log_count;
+
+static void sample_main(memstats_pool_t *p) {
+    struct mallinfo mi = mallinfo();
+    uintptr_t brk = (uintptr_t)mm_sbrk(0);
+    size_t unsbrk = 0;
+
+    if(brk < _arch_mem_top - SBRK_RESERVE)
+        unsbrk = (_arch_mem_top - SBRK_RESERVE) - brk;
+
+    p->total = (_arch_mem_top - SBRK_RESERVE) - (uintptr_t)&end;
+    p->used = mi.uordblks;
+    p->free = mi.fordblks + unsbrk;
+
+    /* The top chunk of the heap can be extended by the space that hasn't
+       been handed to malloc yet, so together they're the biggest block that
+       we know of. There may be a bigger free chunk inside the heap, but
+       newlib doesn't tell us about those. */
+    p->largest_free = mi.keepcost + unsbrk;
+    p->valid = 1;
+}
+
+static void sample_vram(memstats_pool_t *p) {
+    uint32_t used, avail, largest;
+
+    if(pvr_mem_get_usage(&used, &avail, &largest) < 0)
+        return;
+
+    p->total = used + avail;
+    p->used = used;
+    p->free = avail;
+    p->largest_free = largest;
+    p->valid = 1;
+}
+
+static void sample_sound(memstats_pool_t *p) {
+    uint32 used, avail, largest;
+
+    if(snd_mem_get_usage(&used, &avail, &largest) < 0)
+        return;
+
+    p->total = used + avail;
+    p->used = used;
+    p->free = avail;
+    p->largest_free = largest;
+    p->valid = 1;
+}
+
+static int stack_cb(kthread_t *thd, void *data) {
+    memstats_pool_t *p = (memstats_pool_t *)data;
+    uintptr_t top, sp;
+    size_t depth;
+
+    /* Threads running on the startup stack don't have one of their own. */
+    if(!thd->stack || !thd->stack_size)
+        return 0;
+
+    top = (uintptr_t)thd->stack + thd->stack_size;
+
+    if(thd == thd_current)
+        sp = (uintptr_t)&top;
+    else
+        sp = CONTEXT_SP(thd->context);
+
+    depth = (sp < top) ? top - sp : 0;
+
+    if(depth > thd->stack_size)
+        depth = thd->stack_size;
+
+    p->total += thd->stack_size;
+    p->used += depth;
+
+    if(thd->stack_size - depth > p->largest_free)
+        p->largest_free = thd->stack_size - depth;
+
+    return 0;
+}
+
+static void sample_stacks(memstats_pool_t *p) {
+    int old = irq_disable();
+
+    thd_each(stack_cb, p);
+    irq_restore(old);
+
+    p->free = p->total - p->used;
+    p->valid = 1;
+}
+
+static void sample_romdisk(memstats_pool_t *p) {
+    p->total = p->used = fs_romdisk_mem_usage(NULL);
+    p->valid = 1;
+}
+
+void memstats_sample(memstats_t *out) {
+    memstats_t cur;
+    memstats_pool_t *p;
+    uint64_t elapsed;
+    int i;
+
+    /* Samples are compared with the one before, so take them in order. */
+    mutex_lock(&stats_mutex);
+
+    memset(&cur, 0, sizeof(cur));
+    cur.timestamp = timer_ms_gettime64();
+
+    sample_main(&cur.pools[MEMSTATS_MAIN]);
+    sample_vram(&cur.pools[MEMSTATS_VRAM]);
+    sample_sound(&cur.pools[MEMSTATS_SOUND]);
+    sample_stacks(&cur.pools[MEMSTATS_STACKS]);
+    sample_romdisk(&cur.pools[MEMSTATS_ROMDISK]);
+
+    elapsed = cur.timestamp - last.timestamp;
+
+    for(i = 0; i < MEMSTATS_POOL_COUNT; ++i) {
+        p = &cur.pools[i];
+
+        if(!p->valid) {
+            peaks[i] = 0;
+            continue;
+        }
+
+        if(p->used > peaks[i])
+            peaks[i] = p->used;
+
+        p->peak = peaks[i];
+
+        if(p->free)
+            p->frag = 100 - (int)((uint64_t)p->largest_free * 100 / p->free);
+
+        if(!last.timestamp || !last.pools[i].valid)
+            continue;
+
+        p->delta = (int32_t)((int64_t)p->used - (int64_t)last.pools[i].used);
+
+        if(elapsed)
+            p->rate = (int32_t)((int64_t)p->delta * 1000 / (int64_t)elapsed);
+    }
+
+    last = cur;
+
+    mutex_unlock(&stats_mutex);
+
+    if(out)
+        *out = cur;
+}
+
+void memstats_reset_peaks(void) {
+    int i;
+
+    mutex_lock(&stats_mutex);
+
+    for(i = 0; i < MEMSTATS_POOL_COUNT; ++i)
+        peaks[i] = 0;
+
+    mutex_unlock(&stats_mutex);
+
+    memstats_sample(NULL);
+}
+
+void memstats_print(const memstats_t *stats) {
+    static const char * const names[MEMSTATS_POOL_COUNT] = {
+        "main", "vram", "sound", "stacks", "romdisk"
+    };
+    const memstats_pool_t *p;
+    int i;
+
+    dbglog(DBG_INFO, "memstats @ %llu ms:\n",
+           (unsigned long long)stats->timestamp);
+    dbglog(DBG_INFO, "  %-8s %9s %9s %9s %9s %9s %5s %9s\n", "pool",
+           "total", "used", "peak", "free", "largest", "frag%", "B/s");
+
+    for(i = 0; i < MEMSTATS_POOL_COUNT; ++i) {
+        p = &stats->pools[i];
+
+        if(!p->valid)
+            continue;
+
+        dbglog(DBG_INFO, "  %-8s %9u %9u %9u %9u %9u %5d %9ld\n", names[i],
+               (unsigned int)p->total, (unsigned int)p->used,
+               (unsigned int)p->peak, (unsigned int)p->free,
+               (unsigned int)p->largest_free, p->frag, (long)p->rate);
+    }
+}
+
+void memstats_set_log_interval(unsigned int frames) {
+    log_interval = frames;
+    log_count = 0;
+}
+
+void memstats_frame(void) {
+    memstats_t s;
+
+    if(!log_interval || ++log_count < log_interval)
+        return;
+
+    log_count = 0;
+    memstats_sample(&s);
+    memstats_print(&s);
+}
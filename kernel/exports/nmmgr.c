@@ -17,6 +17,7 @@ interface at the front of their struct.
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <errno.h>
 #include <malloc.h>
 #include <string.h>
 #include <strings.h>
@@ -32,22 +33,90 @@ static mutex_t mutex = MUTEX_INITIALIZER;
    describe how to handle a given path name. */
 static nmmgr_list_t nmmgr_handlers;
 
-/* Locate a name handler for a given path name */
-nmmgr_handler_t * nmmgr_lookup(const char *fn) {
-    nmmgr_handler_t *cur;
+/* Lookups go through a trie of the handler names, so that finding the
+   handler for a path takes time proportional to the length of the path
+   rather than to the number of handlers. Each node holds one (lowercased)
+   character; children are kept in a sibling list. Nodes are never freed
+   while the system is running, so lookups can walk the trie without taking
+   the mutex even if a handler is being added or removed at the same time. */
+typedef struct nmmgr_node {
+    struct nmmgr_node   *child;     /* First child */
+    struct nmmgr_node   *next;      /* Next sibling */
+    nmmgr_handler_t     *hnd;       /* Handler whose name ends here */
+    char                c;          /* Character for this node */
+} nmmgr_node_t;
+
+static nmmgr_node_t trie_root;
+
+static inline char lc(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
 
-    /* Scan the handler table and look for a path match */
-    LIST_FOREACH(cur, &nmmgr_handlers, list_ent) {
-        if(!strncasecmp(cur->pathname, fn, strlen(cur->pathname)))
-            break;
+static nmmgr_node_t *trie_child(const nmmgr_node_t *n, char c) {
+    nmmgr_node_t *i;
+
+    for(i = n->child; i; i = i->next) {
+        if(i->c == c)
+            return i;
     }
 
-    if(cur == NULL) {
-        /* Couldn't find a handler */
-        return NULL;
+    return NULL;
+}
+
+/* Find the node for a name, optionally creating it. */
+static nmmgr_node_t *trie_find(const char *name, bool create) {
+    nmmgr_node_t *n = &trie_root, *ch;
+    char c;
+
+    for(; *name; ++name) {
+        c = lc(*name);
+
+        if(!(ch = trie_child(n, c))) {
+            if(!create || !(ch = (nmmgr_node_t *)calloc(1, sizeof(*ch))))
+                return NULL;
+
+            /* Fill in the node before linking it in, for the benefit of any
+               concurrent lookups. */
+            ch->c = c;
+            ch->next = n->child;
+            n->child = ch;
+        }
+
+        n = ch;
     }
-    else
-        return cur;
+
+    return n;
+}
+
+static void trie_free(nmmgr_node_t *n) {
+    nmmgr_node_t *c, *nx;
+
+    for(c = n->child; c; c = nx) {
+        nx = c->next;
+        trie_free(c);
+        free(c);
+    }
+
+    n->child = NULL;
+    n->hnd = NULL;
+}
+
+/* Locate a name handler for a given path name. This finds the handler with
+   the longest name that is a prefix of the path and ends on a path component
+   boundary, so that "/pcx/foo" goes to "/pcx" rather than "/pc". */
+nmmgr_handler_t * nmmgr_lookup(const char *fn) {
+    const nmmgr_node_t *n = &trie_root;
+    nmmgr_handler_t *best = NULL;
+    const char *p = fn;
+
+    while(*p && (n = trie_child(n, lc(*p)))) {
+        ++p;
+
+        if(n->hnd && (*p == '/' || *p == '\0' || p[-1] == '/'))
+            best = n->hnd;
+    }
+
+    return best;
 }
 
 nmmgr_list_t * nmmgr_get_list(void) {
@@ -56,10 +125,21 @@ nmmgr_list_t * nmmgr_get_list(void) {
 
 /* Add a name handler */
 int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    nmmgr_node_t *n;
+
     mutex_lock(&mutex);
 
+    if(!(n = trie_find(hnd->pathname, true))) {
+        mutex_unlock(&mutex);
+        errno = ENOMEM;
+        return -1;
+    }
+
     LIST_INSERT_HEAD(&nmmgr_handlers, hnd, list_ent);
 
+    /* As with the old list search, the newest handler for a name wins. */
+    n->hnd = hnd;
+
     mutex_unlock(&mutex);
 
     return 0;
@@ -68,6 +148,7 @@ int nmmgr_handler_add(nmmgr_handler_t *hnd) {
 /* Remove a name handler */
 int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
     nmmgr_handler_t *c;
+    nmmgr_node_t *n;
     int rv = -1;
 
     /* If we're in an int, lets do the trylock */
@@ -85,6 +166,19 @@ int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
         }
     }
 
+    /* If it was the active handler for its name, fall back to the newest
+       remaining one with the same name, if any. */
+    if(!rv && (n = trie_find(hnd->pathname, false)) && n->hnd == hnd) {
+        n->hnd = NULL;
+
+        LIST_FOREACH(c, &nmmgr_handlers, list_ent) {
+            if(!strcasecmp(c->pathname, hnd->pathname)) {
+                n->hnd = c;
+                break;
+            }
+        }
+    }
+
     mutex_unlock(&mutex);
 
     return rv;
@@ -114,4 +208,6 @@ void nmmgr_shutdown(void) {
 
         c = n;
     }
+
+    trie_free(&trie_root);
 }
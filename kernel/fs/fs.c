@@ -34,7 +34,12 @@ something like this:
 #include <errno.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdint.h>
 #include <kos/fs.h>
+#include <kos/fs_pcache.h>
+#include <kos/fs_dcache.h>
+#include <kos/fs_stats.h>
+#include <kos/fs_aio.h>
 #include <kos/thread.h>
 #include <kos/mutex.h>
 #include <kos/nmmgr.h>
@@ -46,10 +51,33 @@ typedef struct fs_hnd {
     vfs_handler_t   *handler;   /* Handler */
     void *      hnd;        /* Handler-internal */
     int     refcnt;     /* Reference count */
+    struct fs_pcache_file *pc;  /* Page cache state, if any */
+    int     cached;     /* Reads go through the page cache */
+    off_t   pos;        /* File pointer, if cached */
+    char    *dc_path;   /* Path to drop from the dentry cache on writes */
+    struct fs_stats_file *stats;    /* I/O statistics, if any */
 } fs_hnd_t;
 
-/* The global file descriptor table */
-fs_hnd_t * fd_table[FD_SETSIZE] = { NULL };
+/* The global file descriptor table. It is split into fixed-size chunks that
+   are allocated as descriptors are needed and never move once allocated, so
+   mapping a descriptor to its handle doesn't need any locking. Each chunk
+   keeps a bitmap of its used slots, and fd_full has a bit set for each chunk
+   that has no free slots left, so finding the lowest free descriptor only
+   takes a handful of word tests. */
+#define FD_CHUNK_SHIFT  5
+#define FD_CHUNK        (1 << FD_CHUNK_SHIFT)
+#define FD_CHUNKS       (FD_LIMIT_MAX / FD_CHUNK)
+#define FD_FULL_WORDS   (FD_CHUNKS / 32)
+
+typedef struct fd_chunk {
+    uint32_t    used;               /* Bitmap of used slots */
+    fs_hnd_t    *hnd[FD_CHUNK];     /* Handles */
+} fd_chunk_t;
+
+static fd_chunk_t *fd_chunks[FD_CHUNKS];
+static uint32_t fd_full[FD_FULL_WORDS];
+static int fd_limit = FD_SETSIZE;
+static mutex_t fd_mutex = MUTEX_INITIALIZER;
 
 /* For some reason, Newlib doesn't seem to define this function in stdlib.h. */
 extern char *realpath(const char *, char[PATH_MAX]);
@@ -95,6 +123,54 @@ static dirent_t *fs_root_readdir(fs_hnd_t * handle) {
     return &root_readdir_dirent;
 }
 
+/* Drop the cached entry for the directory holding path, since adding or
+   removing something in it changes its size, times and link count. */
+static void fs_drop_parent(vfs_handler_t *vfs, const char *path) {
+    char parent[PATH_MAX];
+    const char *s;
+
+    if(!(s = strrchr(path, '/')))
+        return;
+
+    memcpy(parent, path, s - path);
+    parent[s - path] = '\0';
+    fs_dcache_drop(vfs, parent);
+}
+
+/* On a filesystem with links, a file can be cached under names other than
+   the one it is changed through, and there's no telling which, so everything
+   cached for the filesystem has to go. */
+static int fs_has_links(vfs_handler_t *vfs) {
+    return vfs->link || vfs->symlink;
+}
+
+/* Forget what the dentry cache knows about a file that has been written. */
+static void fs_dentry_written(vfs_handler_t *vfs, const char *path) {
+    if(fs_has_links(vfs))
+        fs_dcache_invalidate(vfs, NULL);
+    else
+        fs_dcache_drop(vfs, path);
+}
+
+/* Forget what the dentry cache knows about a path that a filesystem call
+   changes, along with its parent directory and, with tree set, everything
+   below it. This has to be done both before and after the call, since a
+   stat that runs while the call is in progress can cache the old entry
+   again. */
+static void fs_dentry_forget(vfs_handler_t *vfs, const char *path, int tree) {
+    if(!(vfs->cache & VFS_CACHE_DENTRIES))
+        return;
+
+    if(fs_has_links(vfs))
+        fs_dcache_invalidate(vfs, NULL);
+    else if(tree)
+        fs_dcache_invalidate(vfs, path);
+    else
+        fs_dcache_drop(vfs, path);
+
+    fs_drop_parent(vfs, path);
+}
+
 /* This version of open deals with raw handles only. This is below the level
    of file descriptors. It is used by the standard fs_open below. The
    returned handle will have no references attached to it. */
@@ -105,6 +181,8 @@ static fs_hnd_t * fs_hnd_open(const char *fn, int mode) {
     void        *h;
     fs_hnd_t    *hnd;
     char        rfn[PATH_MAX];
+    int         dcache, writer;
+    uint64_t    start;
 
     if(!realpath(fn, rfn))
         return NULL;
@@ -138,9 +216,42 @@ static fs_hnd_t * fs_hnd_open(const char *fn, int mode) {
         return NULL;
     }
 
+    /* Don't bother the filesystem about things we know aren't there, and
+       forget what we know about anything that is about to change. */
+    dcache = cur->cache & VFS_CACHE_DENTRIES;
+    writer = (mode & O_MODE_MASK) != O_RDONLY || (mode & (O_CREAT | O_TRUNC));
+    start = fs_stats_begin();
+
+    if(dcache) {
+        if(writer) {
+            fs_dentry_written(cur, cname);
+
+            if(mode & O_CREAT)
+                fs_drop_parent(cur, cname);
+        }
+        else if(fs_dcache_negative(cur, cname, mode & O_DIR)) {
+            fs_stats_record(cur, NULL, FS_STATS_OPEN, start, -1);
+            errno = ENOENT;
+            return NULL;
+        }
+    }
+
     h = cur->open(cur, cname, mode);
 
-    if(h == NULL) return NULL;
+    if(dcache && writer) {
+        fs_dentry_written(cur, cname);
+
+        if(mode & O_CREAT)
+            fs_drop_parent(cur, cname);
+    }
+
+    if(h == NULL) {
+        if(dcache && !writer && errno == ENOENT)
+            fs_dcache_put_negative(cur, cname, mode & O_DIR);
+
+        fs_stats_record(cur, NULL, FS_STATS_OPEN, start, -1);
+        return NULL;
+    }
 
     /* Wrap it up in a structure */
     hnd = malloc(sizeof(fs_hnd_t));
@@ -154,6 +265,17 @@ static fs_hnd_t * fs_hnd_open(const char *fn, int mode) {
     hnd->handler = cur;
     hnd->hnd = h;
     hnd->refcnt = 0;
+    hnd->pos = 0;
+    hnd->dc_path = (dcache && writer) ? strdup(cname) : NULL;
+
+    /* Filesystems that allow it get the page cache. Writers are tracked too,
+       so that what they change doesn't stay in the cache. */
+    hnd->pc = (cur->cache & VFS_CACHE_PAGES) ?
+              fs_pcache_open(cur, h, cname, mode) : NULL;
+    hnd->cached = hnd->pc && (mode & O_MODE_MASK) == O_RDONLY;
+
+    hnd->stats = fs_stats_file_open(cur, rfn);
+    fs_stats_record(cur, hnd->stats, FS_STATS_OPEN, start, 0);
 
     return hnd;
 }
@@ -177,53 +299,155 @@ static int fs_hnd_unref(fs_hnd_t * ref) {
     ref->refcnt--;
 
     if(ref->refcnt == 0) {
+        if(ref->pc)
+            fs_pcache_close(ref->pc);
+
+        if(ref->stats)
+            fs_stats_file_close(ref->stats);
+
         if(ref->handler != NULL) {
             if(ref->handler->close == NULL) return retval;
 
             retval = ref->handler->close(ref->hnd);
         }
 
+        /* Some filesystems only update the entry once the file is closed. */
+        if(ref->dc_path) {
+            fs_dentry_written(ref->handler, ref->dc_path);
+            free(ref->dc_path);
+        }
+
         free(ref);
     }
     return retval;
 }
 
+/* Returns the chunk holding a descriptor, allocating it if needed. Must be
+   called with fd_mutex held. */
+static fd_chunk_t * fd_get_chunk(int c) {
+    fd_chunk_t *chunk = fd_chunks[c];
+
+    if(!chunk) {
+        chunk = (fd_chunk_t *)calloc(1, sizeof(fd_chunk_t));
+
+        if(!chunk) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        fd_chunks[c] = chunk;
+    }
+
+    return chunk;
+}
+
+/* Put a handle into a descriptor slot and mark it as used. Returns the handle
+   that was there before, if any. Must be called with fd_mutex held. */
+static fs_hnd_t * fd_set_slot(fd_chunk_t *chunk, int fd, fs_hnd_t *hnd) {
+    int i = fd & (FD_CHUNK - 1), c = fd >> FD_CHUNK_SHIFT;
+    fs_hnd_t *old = chunk->hnd[i];
+
+    chunk->hnd[i] = hnd;
+
+    if(hnd) {
+        chunk->used |= 1u << i;
+
+        if(chunk->used == 0xffffffff)
+            fd_full[c >> 5] |= 1u << (c & 31);
+    }
+    else {
+        chunk->used &= ~(1u << i);
+        fd_full[c >> 5] &= ~(1u << (c & 31));
+    }
+
+    return old;
+}
+
 /* Assigns a file descriptor (index) to a file handle (pointer). Will auto-
-   reference the handle, and unrefs on error. */
+   reference the handle, and unrefs on error. The lowest free descriptor is
+   always used, as POSIX requires. */
 static int fs_hnd_assign(fs_hnd_t * hnd) {
-    int i;
+    fd_chunk_t *chunk = NULL;
+    int w, c, fd = -1;
 
     fs_hnd_ref(hnd);
 
-    /* XXX Not thread-safe! */
-    for(i = 0; i < FD_SETSIZE; i++)
-        if(!fd_table[i])
+    mutex_lock(&fd_mutex);
+
+    /* Find the first chunk with room in it. */
+    for(w = 0; w < FD_FULL_WORDS; w++)
+        if(fd_full[w] != 0xffffffff)
             break;
 
-    if(i >= FD_SETSIZE) {
-        fs_hnd_unref(hnd);
+    if(w < FD_FULL_WORDS) {
+        c = (w << 5) + __builtin_ctz(~fd_full[w]);
+
+        if((c << FD_CHUNK_SHIFT) >= fd_limit)
+            errno = EMFILE;
+        else if((chunk = fd_get_chunk(c))) {
+            fd = (c << FD_CHUNK_SHIFT) + __builtin_ctz(~chunk->used);
+
+            if(fd >= fd_limit) {
+                errno = EMFILE;
+                fd = -1;
+            }
+        }
+    }
+    else {
         errno = EMFILE;
-        return -1;
     }
 
-    fd_table[i] = hnd;
+    if(fd >= 0)
+        fd_set_slot(chunk, fd, hnd);
+
+    mutex_unlock(&fd_mutex);
 
-    return i;
+    if(fd < 0)
+        fs_hnd_unref(hnd);
+
+    return fd;
 }
 
 int fs_fdtbl_destroy(void) {
-    int i;
+    fd_chunk_t *chunk;
+    int c, i;
+
+    mutex_lock(&fd_mutex);
+
+    for(c = 0; c < FD_CHUNKS; c++) {
+        if(!(chunk = fd_chunks[c]))
+            continue;
 
-    for(i = 0; i < FD_SETSIZE; i++) {
-        if(fd_table[i])
-            fs_hnd_unref(fd_table[i]);
+        for(i = 0; i < FD_CHUNK; i++) {
+            if(chunk->hnd[i])
+                fs_hnd_unref(chunk->hnd[i]);
+        }
 
-        fd_table[i] = NULL;
+        fd_chunks[c] = NULL;
+        free(chunk);
     }
 
+    memset(fd_full, 0, sizeof(fd_full));
+
+    mutex_unlock(&fd_mutex);
+
     return 0;
 }
 
+int fs_fdtbl_set_limit(int limit) {
+    if(limit < 1 || limit > FD_LIMIT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd_limit = limit;
+    return 0;
+}
+
+int fs_fdtbl_get_limit(void) {
+    return fd_limit;
+}
+
 /* Attempt to open a file, given a path name. Follows the process described
    in the above comments. */
 file_t fs_open(const char *fn, int mode) {
@@ -254,99 +478,142 @@ file_t fs_open_handle(vfs_handler_t * vfs, void * vhnd) {
     hnd->handler = vfs;
     hnd->hnd = vhnd;
     hnd->refcnt = 0;
+    hnd->pc = NULL;
+    hnd->cached = 0;
+    hnd->dc_path = NULL;
+    hnd->stats = NULL;
 
     /* Ok, that succeeded -- now look for a file descriptor. */
     return fs_hnd_assign(hnd);
 }
 
-vfs_handler_t * fs_get_handler(file_t fd) {
-    /* Make sure it exists */
-    if(!fd_table[fd]) {
+/* Returns a file handle for a given fd, or NULL if the parameters
+   are not valid. */
+static fs_hnd_t * fs_map_hnd(file_t fd) {
+    fd_chunk_t *chunk;
+    fs_hnd_t *hnd = NULL;
+
+    if(fd >= 0 && fd < FD_LIMIT_MAX &&
+       (chunk = fd_chunks[fd >> FD_CHUNK_SHIFT]))
+        hnd = chunk->hnd[fd & (FD_CHUNK - 1)];
+
+    if(!hnd)
         errno = EBADF;
-        return NULL;
-    }
 
-    return fd_table[fd]->handler;
+    return hnd;
+}
+
+vfs_handler_t * fs_get_handler(file_t fd) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+
+    return h ? h->handler : NULL;
 }
 
 void * fs_get_handle(file_t fd) {
-    /* Make sure it exists */
-    if(!fd_table[fd]) {
-        errno = EBADF;
-        return NULL;
+    fs_hnd_t *h = fs_map_hnd(fd);
+
+    return h ? h->hnd : NULL;
+}
+
+int fs_stats_get_fd(file_t fd, fs_stats_t *st) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+
+    if(h == NULL) return -1;
+
+    if(!h->stats) {
+        errno = ENOENT;
+        return -1;
     }
 
-    return fd_table[fd]->hnd;
+    fs_stats_file_get(h->stats, st);
+    return 0;
 }
 
 file_t fs_dup(file_t oldfd) {
+    fs_hnd_t *h = fs_map_hnd(oldfd);
+
     /* Make sure it exists */
-    if(oldfd < 0 || oldfd >= FD_SETSIZE) {
-        errno = EBADF;
-        return -1;
-    }
-    else if(!fd_table[oldfd]) {
-        errno = EBADF;
+    if(!h)
         return -1;
-    }
 
-    return fs_hnd_assign(fd_table[oldfd]);
+    return fs_hnd_assign(h);
 }
 
 file_t fs_dup2(file_t oldfd, file_t newfd) {
+    fd_chunk_t *chunk;
+    fs_hnd_t *h, *old;
+
     /* Make sure the descriptors are valid */
-    if(oldfd < 0 || oldfd >= FD_SETSIZE || newfd < 0 || newfd >= FD_SETSIZE) {
-        errno = EBADF;
+    if(!(h = fs_map_hnd(oldfd)))
         return -1;
-    }
-    else if(!fd_table[oldfd]) {
+
+    if(newfd < 0 || newfd >= fd_limit) {
         errno = EBADF;
         return -1;
     }
 
-    if(fd_table[newfd])
-        fs_close(newfd);
+    if(newfd == oldfd)
+        return newfd;
 
-    fd_table[newfd] = fd_table[oldfd];
-    fs_hnd_ref(fd_table[newfd]);
-
-    return newfd;
-}
+    mutex_lock(&fd_mutex);
 
-/* Returns a file handle for a given fd, or NULL if the parameters
-   are not valid. */
-static fs_hnd_t * fs_map_hnd(file_t fd) {
-    if(fd < 0 || fd >= FD_SETSIZE) {
-        errno = EBADF;
-        return NULL;
+    if(!(chunk = fd_get_chunk(newfd >> FD_CHUNK_SHIFT))) {
+        mutex_unlock(&fd_mutex);
+        return -1;
     }
 
-    if(!fd_table[fd]) {
-        errno = EBADF;
-        return NULL;
-    }
+    fs_hnd_ref(h);
+    old = fd_set_slot(chunk, newfd, h);
 
-    return fd_table[fd];
+    mutex_unlock(&fd_mutex);
+
+    /* Close whatever newfd used to refer to. */
+    if(old)
+        fs_hnd_unref(old);
+
+    return newfd;
 }
 
 /* Close a file and clean up the handle */
 int fs_close(file_t fd) {
     int retval;
-    fs_hnd_t * hnd = fs_map_hnd(fd);
+    fs_hnd_t * hnd;
+
+    mutex_lock(&fd_mutex);
 
-    if(!hnd) {
-      errno = EBADF;
-      return -1;
+    if(!(hnd = fs_map_hnd(fd))) {
+        mutex_unlock(&fd_mutex);
+        return -1;
     }
 
-    /* Deref it and remove it from our table */
+    /* Remove it from our table and deref it */
+    fd_set_slot(fd_chunks[fd >> FD_CHUNK_SHIFT], fd, NULL);
+    mutex_unlock(&fd_mutex);
+
     retval = fs_hnd_unref(hnd);
-    fd_table[fd] = NULL;
     return retval ? -1 : 0;
 }
 
+/* Add an operation on an open file to the I/O statistics. */
+static void fs_hnd_stats(file_t fd, int op, uint64_t start, ssize_t rv) {
+    fs_hnd_t *h;
+    int err;
+
+    if(!start)
+        return;
+
+    err = errno;
+
+    if((h = fs_map_hnd(fd)) && h->handler)
+        fs_stats_record(h->handler, h->stats, op, start, rv);
+
+    errno = err;
+}
+
+static off_t fs_do_seek(file_t fd, off_t offset, int whence);
+
 /* The rest of these pretty much map straight through */
-ssize_t fs_read(file_t fd, void *buffer, size_t cnt) {
+static ssize_t fs_do_read(file_t fd, void *buffer, size_t cnt) {
     fs_hnd_t *h = fs_map_hnd(fd);
 
     if(h == NULL) return -1;
@@ -356,10 +623,27 @@ ssize_t fs_read(file_t fd, void *buffer, size_t cnt) {
         return -1;
     }
 
+    if(h->cached) {
+        ssize_t rv = fs_pcache_read(h->pc, buffer, cnt, h->pos);
+
+        if(rv > 0)
+            h->pos += rv;
+
+        return rv;
+    }
+
     return h->handler->read(h->hnd, buffer, cnt);
 }
 
-ssize_t fs_write(file_t fd, const void *buffer, size_t cnt) {
+ssize_t fs_read(file_t fd, void *buffer, size_t cnt) {
+    uint64_t start = fs_stats_begin();
+    ssize_t rv = fs_do_read(fd, buffer, cnt);
+
+    fs_hnd_stats(fd, FS_STATS_READ, start, rv);
+    return rv;
+}
+
+static ssize_t fs_do_write(file_t fd, const void *buffer, size_t cnt) {
     fs_hnd_t *h;
 
     // XXX This is a hack to make newlib printf work because it
@@ -378,10 +662,307 @@ ssize_t fs_write(file_t fd, const void *buffer, size_t cnt) {
         return -1;
     }
 
+    if(h->dc_path)
+        fs_dentry_written(h->handler, h->dc_path);
+
     return h->handler->write(h->hnd, buffer, cnt);
 }
 
-off_t fs_seek(file_t fd, off_t offset, int whence) {
+ssize_t fs_write(file_t fd, const void *buffer, size_t cnt) {
+    uint64_t start = fs_stats_begin();
+    ssize_t rv = fs_do_write(fd, buffer, cnt);
+
+    fs_hnd_stats(fd, FS_STATS_WRITE, start, rv);
+    return rv;
+}
+
+/* Check an I/O vector. The total length has to fit in an ssize_t. */
+static int fs_iov_check(const struct iovec *iov, int iovcnt) {
+    const size_t max = (size_t)-1 >> 1;
+    size_t total = 0;
+    int i;
+
+    if(iovcnt <= 0 || iovcnt > IOV_MAX || !iov) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(iov[i].iov_len > max - total) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        total += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+static ssize_t fs_do_readv(file_t fd, const struct iovec *iov, int iovcnt) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+    ssize_t rv, total = 0;
+    int i;
+
+    if(h == NULL) return -1;
+
+    if(fs_iov_check(iov, iovcnt) < 0)
+        return -1;
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler->readv && !h->cached)
+        return h->handler->readv(h->hnd, iov, iovcnt);
+
+    if(h->handler->read == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Fill one buffer at a time, stopping at the first short read. */
+    for(i = 0; i < iovcnt; ++i) {
+        if(!iov[i].iov_len)
+            continue;
+
+        if(h->cached) {
+            if((rv = fs_pcache_read(h->pc, iov[i].iov_base, iov[i].iov_len,
+                                    h->pos)) > 0)
+                h->pos += rv;
+        }
+        else {
+            rv = h->handler->read(h->hnd, iov[i].iov_base, iov[i].iov_len);
+        }
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+ssize_t fs_readv(file_t fd, const struct iovec *iov, int iovcnt) {
+    uint64_t start = fs_stats_begin();
+    ssize_t rv = fs_do_readv(fd, iov, iovcnt);
+
+    fs_hnd_stats(fd, FS_STATS_READ, start, rv);
+    return rv;
+}
+
+static ssize_t fs_do_writev(file_t fd, const struct iovec *iov, int iovcnt) {
+    fs_hnd_t *h;
+    ssize_t rv, total = 0;
+    int i;
+
+    if(fs_iov_check(iov, iovcnt) < 0)
+        return -1;
+
+    /* Go through fs_write() for stdout/stderr, like everything else. */
+    if(fd == 1 || fd == 2) {
+        for(i = 0; i < iovcnt; ++i) {
+            if(!iov[i].iov_len)
+                continue;
+
+            rv = fs_write(fd, iov[i].iov_base, iov[i].iov_len);
+
+            if(rv < 0)
+                return total ? total : -1;
+
+            total += rv;
+
+            if((size_t)rv < iov[i].iov_len)
+                break;
+        }
+
+        return total;
+    }
+
+    h = fs_map_hnd(fd);
+
+    if(h == NULL) return -1;
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->dc_path)
+        fs_dentry_written(h->handler, h->dc_path);
+
+    if(h->handler->writev)
+        return h->handler->writev(h->hnd, iov, iovcnt);
+
+    if(h->handler->write == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(!iov[i].iov_len)
+            continue;
+
+        rv = h->handler->write(h->hnd, iov[i].iov_base, iov[i].iov_len);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+ssize_t fs_writev(file_t fd, const struct iovec *iov, int iovcnt) {
+    uint64_t start = fs_stats_begin();
+    ssize_t rv = fs_do_writev(fd, iov, iovcnt);
+
+    fs_hnd_stats(fd, FS_STATS_WRITE, start, rv);
+    return rv;
+}
+
+static ssize_t fs_do_pread(file_t fd, void *buffer, size_t cnt,
+                           off_t offset) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+    off_t old;
+    ssize_t rv;
+    int err;
+
+    if(h == NULL) return -1;
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->cached)
+        return fs_pcache_read(h->pc, buffer, cnt, offset);
+
+    if(h->handler->pread)
+        return h->handler->pread(h->hnd, buffer, cnt, offset);
+
+    if(h->handler->read == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* No native support, so move the file pointer there and back. */
+    if((old = fs_tell(fd)) < 0 || fs_do_seek(fd, offset, SEEK_SET) < 0)
+        return -1;
+
+    rv = h->handler->read(h->hnd, buffer, cnt);
+    err = errno;
+
+    fs_do_seek(fd, old, SEEK_SET);
+    errno = err;
+
+    return rv;
+}
+
+ssize_t fs_pread(file_t fd, void *buffer, size_t cnt, off_t offset) {
+    uint64_t start = fs_stats_begin();
+    ssize_t rv = fs_do_pread(fd, buffer, cnt, offset);
+
+    fs_hnd_stats(fd, FS_STATS_READ, start, rv);
+    return rv;
+}
+
+static ssize_t fs_do_pwrite(file_t fd, const void *buffer, size_t cnt,
+                            off_t offset) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+    off_t old;
+    ssize_t rv;
+    int err;
+
+    if(h == NULL) return -1;
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->dc_path)
+        fs_dentry_written(h->handler, h->dc_path);
+
+    if(h->handler->pwrite)
+        return h->handler->pwrite(h->hnd, buffer, cnt, offset);
+
+    if(h->handler->write == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((old = fs_tell(fd)) < 0 || fs_do_seek(fd, offset, SEEK_SET) < 0)
+        return -1;
+
+    rv = h->handler->write(h->hnd, buffer, cnt);
+    err = errno;
+
+    fs_do_seek(fd, old, SEEK_SET);
+    errno = err;
+
+    return rv;
+}
+
+ssize_t fs_pwrite(file_t fd, const void *buffer, size_t cnt, off_t offset) {
+    uint64_t start = fs_stats_begin();
+    ssize_t rv = fs_do_pwrite(fd, buffer, cnt, offset);
+
+    fs_hnd_stats(fd, FS_STATS_WRITE, start, rv);
+    return rv;
+}
+
+/* Files read through the page cache keep their file pointer here, since the
+   filesystem's own one isn't moved by reads that hit the cache. */
+static off_t fs_cached_seek(fs_hnd_t *h, off_t offset, int whence) {
+    off_t pos;
+
+    switch(whence) {
+        case SEEK_SET:
+            pos = offset;
+            break;
+
+        case SEEK_CUR:
+            pos = h->pos + offset;
+            break;
+
+        case SEEK_END:
+            pos = fs_pcache_size(h->pc) + offset;
+            break;
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if(pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return h->pos = pos;
+}
+
+static off_t fs_do_seek(file_t fd, off_t offset, int whence) {
     fs_hnd_t *h = fs_map_hnd(fd);
 
     if(h == NULL) return -1;
@@ -391,6 +972,9 @@ off_t fs_seek(file_t fd, off_t offset, int whence) {
         return -1;
     }
 
+    if(h->cached)
+        return fs_cached_seek(h, offset, whence);
+
     /* Prefer the 32-bit version, but fall back if needed to the 64-bit one. */
     if(h->handler->seek)
         return h->handler->seek(h->hnd, offset, whence);
@@ -401,7 +985,15 @@ off_t fs_seek(file_t fd, off_t offset, int whence) {
     return -1;
 }
 
-_off64_t fs_seek64(file_t fd, _off64_t offset, int whence) {
+off_t fs_seek(file_t fd, off_t offset, int whence) {
+    uint64_t start = fs_stats_begin();
+    off_t rv = fs_do_seek(fd, offset, whence);
+
+    fs_hnd_stats(fd, FS_STATS_SEEK, start, rv < 0 ? -1 : 0);
+    return rv;
+}
+
+static _off64_t fs_do_seek64(file_t fd, _off64_t offset, int whence) {
     fs_hnd_t *h = fs_map_hnd(fd);
 
     if(h == NULL) return -1;
@@ -411,6 +1003,9 @@ _off64_t fs_seek64(file_t fd, _off64_t offset, int whence) {
         return -1;
     }
 
+    if(h->cached)
+        return (_off64_t)fs_cached_seek(h, (off_t)offset, whence);
+
     /* Prefer the 64-bit version, but fall back if needed to the 32-bit one. */
     if(h->handler->seek64)
         return h->handler->seek64(h->hnd, offset, whence);
@@ -421,6 +1016,14 @@ _off64_t fs_seek64(file_t fd, _off64_t offset, int whence) {
     return -1;
 }
 
+_off64_t fs_seek64(file_t fd, _off64_t offset, int whence) {
+    uint64_t start = fs_stats_begin();
+    _off64_t rv = fs_do_seek64(fd, offset, whence);
+
+    fs_hnd_stats(fd, FS_STATS_SEEK, start, rv < 0 ? -1 : 0);
+    return rv;
+}
+
 off_t fs_tell(file_t fd) {
     fs_hnd_t *h = fs_map_hnd(fd);
 
@@ -431,6 +1034,9 @@ off_t fs_tell(file_t fd) {
         return -1;
     }
 
+    if(h->cached)
+        return h->pos;
+
     /* Prefer the 32-bit version, but fall back if needed to the 64-bit one. */
     if(h->handler->tell)
         return h->handler->tell(h->hnd);
@@ -451,6 +1057,9 @@ _off64_t fs_tell64(file_t fd) {
         return -1;
     }
 
+    if(h->cached)
+        return (_off64_t)h->pos;
+
     /* Prefer the 64-bit version, but fall back if needed to the 32-bit one. */
     if(h->handler->tell64)
         return h->handler->tell64(h->hnd);
@@ -563,6 +1172,7 @@ static vfs_handler_t * fs_verify_handler(const char * fn) {
 int fs_rename(const char *fn1, const char *fn2) {
     vfs_handler_t   *fh1, *fh2;
     char        rfn1[PATH_MAX], rfn2[PATH_MAX];
+    int         rv;
 
     if(!realpath(fn1, rfn1) || !realpath(fn2, rfn2))
         return -1;
@@ -587,9 +1197,21 @@ int fs_rename(const char *fn1, const char *fn2) {
         return -1;
     }
 
-    if(fh1->rename)
-        return fh1->rename(fh1, rfn1 + strlen(fh1->nmmgr.pathname),
-                           rfn2 + strlen(fh1->nmmgr.pathname));
+    if(fh1->cache & VFS_CACHE_PAGES) {
+        fs_pcache_invalidate(fh1, rfn1 + strlen(fh1->nmmgr.pathname));
+        fs_pcache_invalidate(fh1, rfn2 + strlen(fh1->nmmgr.pathname));
+    }
+
+    fs_dentry_forget(fh1, rfn1 + strlen(fh1->nmmgr.pathname), 1);
+    fs_dentry_forget(fh1, rfn2 + strlen(fh1->nmmgr.pathname), 1);
+
+    if(fh1->rename) {
+        rv = fh1->rename(fh1, rfn1 + strlen(fh1->nmmgr.pathname),
+                         rfn2 + strlen(fh1->nmmgr.pathname));
+        fs_dentry_forget(fh1, rfn1 + strlen(fh1->nmmgr.pathname), 1);
+        fs_dentry_forget(fh1, rfn2 + strlen(fh1->nmmgr.pathname), 1);
+        return rv;
+    }
     else {
         errno = EINVAL;
         return -1;
@@ -599,6 +1221,7 @@ int fs_rename(const char *fn1, const char *fn2) {
 int fs_unlink(const char *fn) {
     vfs_handler_t   *cur;
     char        rfn[PATH_MAX];
+    int         rv;
 
     if(!realpath(fn, rfn))
         return -1;
@@ -608,8 +1231,16 @@ int fs_unlink(const char *fn) {
 
     if(cur == NULL) return 1;
 
-    if(cur->unlink)
-        return cur->unlink(cur, rfn + strlen(cur->nmmgr.pathname));
+    if(cur->cache & VFS_CACHE_PAGES)
+        fs_pcache_invalidate(cur, rfn + strlen(cur->nmmgr.pathname));
+
+    fs_dentry_forget(cur, rfn + strlen(cur->nmmgr.pathname), 0);
+
+    if(cur->unlink) {
+        rv = cur->unlink(cur, rfn + strlen(cur->nmmgr.pathname));
+        fs_dentry_forget(cur, rfn + strlen(cur->nmmgr.pathname), 0);
+        return rv;
+    }
     else {
         errno = EINVAL;
         return -1;
@@ -659,6 +1290,7 @@ int fs_complete(file_t fd, ssize_t * rv) {
 int fs_mkdir(const char * fn) {
     vfs_handler_t   *cur;
     char        rfn[PATH_MAX];
+    int         rv;
 
     if(!realpath(fn, rfn))
         return -1;
@@ -668,8 +1300,13 @@ int fs_mkdir(const char * fn) {
 
     if(cur == NULL) return -1;
 
-    if(cur->mkdir)
-        return cur->mkdir(cur, rfn + strlen(cur->nmmgr.pathname));
+    fs_dentry_forget(cur, rfn + strlen(cur->nmmgr.pathname), 0);
+
+    if(cur->mkdir) {
+        rv = cur->mkdir(cur, rfn + strlen(cur->nmmgr.pathname));
+        fs_dentry_forget(cur, rfn + strlen(cur->nmmgr.pathname), 0);
+        return rv;
+    }
     else {
         errno = EINVAL;
         return -1;
@@ -679,6 +1316,7 @@ int fs_mkdir(const char * fn) {
 int fs_rmdir(const char * fn) {
     vfs_handler_t   *cur;
     char        rfn[PATH_MAX];
+    int         rv;
 
     if(!realpath(fn, rfn))
         return -1;
@@ -688,8 +1326,13 @@ int fs_rmdir(const char * fn) {
 
     if(cur == NULL) return -1;
 
-    if(cur->rmdir)
-        return cur->rmdir(cur, rfn + strlen(cur->nmmgr.pathname));
+    fs_dentry_forget(cur, rfn + strlen(cur->nmmgr.pathname), 1);
+
+    if(cur->rmdir) {
+        rv = cur->rmdir(cur, rfn + strlen(cur->nmmgr.pathname));
+        fs_dentry_forget(cur, rfn + strlen(cur->nmmgr.pathname), 1);
+        return rv;
+    }
     else {
         errno = EINVAL;
         return -1;
@@ -728,6 +1371,7 @@ int fs_fcntl(file_t fd, int cmd, ...) {
 int fs_link(const char *path1, const char *path2) {
     vfs_handler_t *fh1, *fh2;
     char rfn1[PATH_MAX], rfn2[PATH_MAX];
+    int rv;
 
     if(!realpath(path1, rfn1) || !realpath(path2, rfn2))
         return -1;
@@ -752,9 +1396,18 @@ int fs_link(const char *path1, const char *path2) {
         return -1;
     }
 
+    /* The link count of every name for the file changes. */
+    if(fh1->cache & VFS_CACHE_DENTRIES)
+        fs_dcache_invalidate(fh1, NULL);
+
     if(fh1->link) {
-        return fh1->link(fh1, rfn1 + strlen(fh1->nmmgr.pathname),
-                         rfn2 + strlen(fh1->nmmgr.pathname));
+        rv = fh1->link(fh1, rfn1 + strlen(fh1->nmmgr.pathname),
+                       rfn2 + strlen(fh1->nmmgr.pathname));
+
+        if(fh1->cache & VFS_CACHE_DENTRIES)
+            fs_dcache_invalidate(fh1, NULL);
+
+        return rv;
     }
     else {
         errno = EMLINK;
@@ -765,6 +1418,7 @@ int fs_link(const char *path1, const char *path2) {
 int fs_symlink(const char *path1, const char *path2) {
     vfs_handler_t *vfs;
     char rfn[PATH_MAX];
+    int rv;
 
     if(!realpath(path2, rfn))
         return -1;
@@ -777,8 +1431,12 @@ int fs_symlink(const char *path1, const char *path2) {
         return -1;
     }
 
+    fs_dentry_forget(vfs, rfn + strlen(vfs->nmmgr.pathname), 1);
+
     if(vfs->symlink) {
-        return vfs->symlink(vfs, path1, rfn + strlen(vfs->nmmgr.pathname));
+        rv = vfs->symlink(vfs, path1, rfn + strlen(vfs->nmmgr.pathname));
+        fs_dentry_forget(vfs, rfn + strlen(vfs->nmmgr.pathname), 1);
+        return rv;
     }
     else {
         errno = ENOSYS;
@@ -821,6 +1479,8 @@ int fs_readlink(const char *path, char *buf, size_t bufsize) {
 int fs_stat(const char *path, struct stat *buf, int flag) {
     vfs_handler_t *vfs;
     char fullpath[PATH_MAX];
+    uint64_t start;
+    int rv;
 
     /* Verify the input... */
     if(!buf || !path) {
@@ -832,15 +1492,10 @@ int fs_stat(const char *path, struct stat *buf, int flag) {
         return -1;
     }
 
-    /* Prepend the current working directory if we have to. */
-    if(path[0] == '/') {
-        strcpy(fullpath, path);
-    }
-    else {
-        strcpy(fullpath, fs_getwd());
-        strcat(fullpath, "/");
-        strcat(fullpath, path);
-    }
+    /* Resolve the path the same way everything else does, so that the name
+       it is cached under is the one that gets dropped when it changes. */
+    if(!realpath(path, fullpath))
+        return -1;
 
     /* Look for the handler */
     vfs = fs_verify_handler(fullpath);
@@ -850,14 +1505,33 @@ int fs_stat(const char *path, struct stat *buf, int flag) {
         return -1;
     }
 
-    if(vfs->stat) {
-        return vfs->stat(vfs, fullpath + strlen(vfs->nmmgr.pathname), buf,
-                         flag);
-    }
-    else {
+    if(!vfs->stat) {
         errno = ENOSYS;
         return -1;
     }
+
+    path = fullpath + strlen(vfs->nmmgr.pathname);
+    start = fs_stats_begin();
+
+    if(!(vfs->cache & VFS_CACHE_DENTRIES) || flag) {
+        rv = vfs->stat(vfs, path, buf, flag);
+    }
+    else if((rv = fs_dcache_stat(vfs, path, buf))) {
+        /* Either a hit, or something we know isn't there. */
+        if(rv < 0)
+            errno = ENOENT;
+        else
+            rv = 0;
+    }
+    else if(!(rv = vfs->stat(vfs, path, buf, flag))) {
+        fs_dcache_put_stat(vfs, path, buf);
+    }
+    else if(errno == ENOENT) {
+        fs_dcache_put_negative(vfs, path, -1);
+    }
+
+    fs_stats_record(vfs, NULL, FS_STATS_STAT, start, rv);
+    return rv;
 }
 
 int fs_rewinddir(file_t fd) {
@@ -881,7 +1555,7 @@ int fs_rewinddir(file_t fd) {
     return h->handler->rewinddir(h->hnd);
 }
 
-int fs_fstat(file_t fd, struct stat *st) {
+static int fs_do_fstat(file_t fd, struct stat *st) {
     fs_hnd_t *h = fs_map_hnd(fd);
 
     if(!h) {
@@ -907,10 +1581,24 @@ int fs_fstat(file_t fd, struct stat *st) {
     return h->handler->fstat(h->hnd, st);
 }
 
+int fs_fstat(file_t fd, struct stat *st) {
+    uint64_t start = fs_stats_begin();
+    int rv = fs_do_fstat(fd, st);
+
+    fs_hnd_stats(fd, FS_STATS_STAT, start, rv);
+    return rv;
+}
+
 /* Initialize FS structures */
 int fs_init(void) {
-    return 0;
+    return fs_stats_init();
 }
 
 void fs_shutdown(void) {
+    /* Stop the asynchronous I/O workers before anything they use goes. This
+       does nothing if they weren't started, or have been stopped already. */
+    fs_aio_shutdown();
+    fs_stats_shutdown();
+    fs_pcache_shutdown();
+    fs_dcache_shutdown();
 }
@@ -0,0 +1,371 @@
+/* KallistiOS ##version##
+
+   fs_aio.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/*
+
+Asynchronous file I/O.
+
+Each request is tied to a completion queue, and is delivered to it once it has
+finished, whether it was handled by the filesystem itself (through its
+aio_submit entry point) or by one of the worker threads here. Completion can
+happen from an interrupt handler, so the completion queue is protected by
+disabling interrupts rather than with a mutex.
+
+The workers do plain blocking fs_pread()/fs_pwrite() calls on the descriptor.
+Filesystems without native positioned I/O get a seek + read/write there, and
+two of those on the same descriptor must not be interleaved, so each worker
+holds a lock picked by hashing the descriptor while it does its I/O.
+
+*/
+
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <kos/fs.h>
+#include <kos/fs_aio.h>
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/sem.h>
+
+#include <arch/irq.h>
+
+#define FD_LOCKS    16
+
+struct fs_aio_queue {
+    TAILQ_HEAD(aio_done, fs_aio_req) done;  /* Completed requests */
+    semaphore_t ready;                      /* Count of completed requests */
+    int outstanding;                        /* Submitted, not yet reaped */
+};
+
+static TAILQ_HEAD(aio_work, fs_aio_req) work = TAILQ_HEAD_INITIALIZER(work);
+static mutex_t work_mutex = MUTEX_INITIALIZER;
+static semaphore_t work_sem = SEM_INITIALIZER(0);
+static mutex_t fd_locks[FD_LOCKS];
+
+static kthread_t **workers;
+static int worker_count;
+static volatile int quitting;
+
+void fs_aio_complete(fs_aio_req_t *req, ssize_t result, int error) {
+    fs_aio_queue_t *q = req->queue;
+    int old;
+
+    old = irq_disable();
+
+    req->result = result;
+    req->error = error;
+    req->state = FS_AIO_DONE;
+    TAILQ_INSERT_TAIL(&q->done, req, ent);
+
+    irq_restore(old);
+
+    sem_signal(&q->ready);
+}
+
+static void aio_do_io(fs_aio_req_t *req) {
+    mutex_t *lock = &fd_locks[req->fd % FD_LOCKS];
+    ssize_t rv;
+
+    mutex_lock(lock);
+
+    if(req->op == FS_AIO_READ)
+        rv = fs_pread(req->fd, req->buf, req->cnt, req->offset);
+    else
+        rv = fs_pwrite(req->fd, req->buf, req->cnt, req->offset);
+
+    mutex_unlock(lock);
+
+    fs_aio_complete(req, rv, rv < 0 ? errno : 0);
+}
+
+static void *aio_worker(void *param) {
+    fs_aio_req_t *req;
+
+    (void)param;
+
+    for(;;) {
+        sem_wait(&work_sem);
+
+        mutex_lock(&work_mutex);
+
+        if((req = TAILQ_FIRST(&work))) {
+            TAILQ_REMOVE(&work, req, ent);
+            req->state = FS_AIO_RUNNING;
+        }
+
+        mutex_unlock(&work_mutex);
+
+        if(req)
+            aio_do_io(req);
+        else if(quitting)
+            break;
+    }
+
+    return NULL;
+}
+
+int fs_aio_init(int workers_wanted) {
+    kthread_attr_t attr = { 0 };
+    int i, rv = 0;
+
+    if(workers_wanted < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&work_mutex);
+
+    if(worker_count)
+        goto out;
+
+    workers = (kthread_t **)calloc(workers_wanted, sizeof(kthread_t *));
+
+    if(!workers) {
+        errno = ENOMEM;
+        rv = -1;
+        goto out;
+    }
+
+    for(i = 0; i < FD_LOCKS; i++)
+        mutex_init(&fd_locks[i], MUTEX_TYPE_NORMAL);
+
+    quitting = 0;
+    attr.label = "fs_aio-worker";
+
+    for(i = 0; i < workers_wanted; i++) {
+        if(!(workers[worker_count] = thd_create_ex(&attr, aio_worker, NULL)))
+            break;
+
+        worker_count++;
+    }
+
+    if(!worker_count) {
+        free(workers);
+        workers = NULL;
+        errno = ENOMEM;
+        rv = -1;
+    }
+
+out:
+    mutex_unlock(&work_mutex);
+    return rv;
+}
+
+void fs_aio_shutdown(void) {
+    fs_aio_req_t *req;
+    int i;
+
+    mutex_lock(&work_mutex);
+
+    if(!worker_count) {
+        mutex_unlock(&work_mutex);
+        return;
+    }
+
+    quitting = 1;
+
+    while((req = TAILQ_FIRST(&work))) {
+        TAILQ_REMOVE(&work, req, ent);
+        fs_aio_complete(req, -1, ECANCELED);
+    }
+
+    mutex_unlock(&work_mutex);
+
+    for(i = 0; i < worker_count; i++)
+        sem_signal(&work_sem);
+
+    for(i = 0; i < worker_count; i++)
+        thd_join(workers[i], NULL);
+
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+fs_aio_queue_t *fs_aio_queue_create(void) {
+    fs_aio_queue_t *q;
+
+    if(!(q = (fs_aio_queue_t *)malloc(sizeof(fs_aio_queue_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    TAILQ_INIT(&q->done);
+    sem_init(&q->ready, 0);
+    q->outstanding = 0;
+
+    return q;
+}
+
+int fs_aio_queue_destroy(fs_aio_queue_t *q) {
+    if(q->outstanding) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sem_destroy(&q->ready);
+    free(q);
+
+    return 0;
+}
+
+static int aio_submit(fs_aio_queue_t *q, fs_aio_req_t *req, file_t fd,
+                      int op, void *buf, size_t cnt, off_t offset,
+                      void *user) {
+    vfs_handler_t *vfs;
+    int old;
+
+    if(!q || !req || offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(req->state == FS_AIO_QUEUED || req->state == FS_AIO_RUNNING) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if(!(vfs = fs_get_handler(fd))) {
+        errno = EBADF;
+        return -1;
+    }
+
+    req->fd = fd;
+    req->op = op;
+    req->buf = buf;
+    req->cnt = cnt;
+    req->offset = offset;
+    req->user = user;
+    req->result = 0;
+    req->error = 0;
+    req->queue = q;
+    req->vfs = vfs;
+    req->hnd = fs_get_handle(fd);
+    req->state = FS_AIO_QUEUED;
+
+    old = irq_disable();
+    q->outstanding++;
+    irq_restore(old);
+
+    /* Let the filesystem have a go at it first. */
+    if(vfs->aio_submit) {
+        req->native = 1;
+
+        if(!vfs->aio_submit(req->hnd, req))
+            return 0;
+
+        if(errno != ENOSYS)
+            goto fail;
+    }
+
+    req->native = 0;
+
+    if(fs_aio_init(FS_AIO_DEFAULT_WORKERS) < 0)
+        goto fail;
+
+    mutex_lock(&work_mutex);
+    TAILQ_INSERT_TAIL(&work, req, ent);
+    mutex_unlock(&work_mutex);
+
+    sem_signal(&work_sem);
+
+    return 0;
+
+fail:
+    old = irq_disable();
+    q->outstanding--;
+    irq_restore(old);
+
+    req->state = FS_AIO_IDLE;
+    return -1;
+}
+
+int fs_aio_read(fs_aio_queue_t *q, fs_aio_req_t *req, file_t fd, void *buf,
+                size_t cnt, off_t offset, void *user) {
+    return aio_submit(q, req, fd, FS_AIO_READ, buf, cnt, offset, user);
+}
+
+int fs_aio_write(fs_aio_queue_t *q, fs_aio_req_t *req, file_t fd,
+                 const void *buf, size_t cnt, off_t offset, void *user) {
+    return aio_submit(q, req, fd, FS_AIO_WRITE, (void *)buf, cnt, offset,
+                      user);
+}
+
+static fs_aio_req_t *aio_reap(fs_aio_queue_t *q) {
+    fs_aio_req_t *req;
+    int old;
+
+    old = irq_disable();
+
+    if((req = TAILQ_FIRST(&q->done))) {
+        TAILQ_REMOVE(&q->done, req, ent);
+        q->outstanding--;
+    }
+
+    irq_restore(old);
+
+    return req;
+}
+
+fs_aio_req_t *fs_aio_poll(fs_aio_queue_t *q) {
+    if(sem_trywait(&q->ready) < 0)
+        return NULL;
+
+    return aio_reap(q);
+}
+
+fs_aio_req_t *fs_aio_wait(fs_aio_queue_t *q, int timeout) {
+    if(timeout) {
+        if(sem_wait_timed(&q->ready, timeout) < 0)
+            return NULL;
+    }
+    else if(sem_wait(&q->ready) < 0) {
+        return NULL;
+    }
+
+    return aio_reap(q);
+}
+
+int fs_aio_cancel(fs_aio_req_t *req) {
+    int queued = 0;
+
+    if(req->state != FS_AIO_QUEUED) {
+        errno = req->state == FS_AIO_RUNNING ? EBUSY : EINVAL;
+        return -1;
+    }
+
+    if(req->native) {
+        if(!req->vfs->aio_cancel) {
+            errno = EBUSY;
+            return -1;
+        }
+
+        if(req->vfs->aio_cancel(req->hnd, req) < 0)
+            return -1;
+    }
+    else {
+        mutex_lock(&work_mutex);
+
+        if(req->state == FS_AIO_QUEUED) {
+            TAILQ_REMOVE(&work, req, ent);
+            queued = 1;
+        }
+
+        mutex_unlock(&work_mutex);
+
+        if(!queued) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    fs_aio_complete(req, -1, ECANCELED);
+
+    return 0;
+}
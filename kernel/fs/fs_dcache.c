@@ -0,0 +1,378 @@
+/* KallistiOS ##version##
+
+   fs_dcache.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/*
+
+Directory entry cache for the VFS.
+
+Each entry is keyed by filesystem and path, and can hold a stat result, the
+filesystem's own values for the path as a file and as a directory, and flags
+saying that the path doesn't exist (as a file, as a directory, or at all).
+Entries are kept in a fixed array, found through a hash table and kept on an
+LRU list, the tail of which is reused when the array is full.
+
+*/
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <kos/fs.h>
+#include <kos/fs_dcache.h>
+#include <kos/mutex.h>
+
+/* Entry flags */
+#define DE_STAT         0x01    /* st is valid */
+#define DE_FILE         0x02    /* value[0] is valid */
+#define DE_DIR          0x04    /* value[1] is valid */
+#define DE_NOFILE       0x08    /* No file by this name */
+#define DE_NODIR        0x10    /* No directory by this name */
+#define DE_NONE         0x20    /* Nothing by this name */
+
+typedef struct dentry {
+    struct dentry *hnext;           /* Hash chain, or free list */
+    TAILQ_ENTRY(dentry) lru;
+    vfs_handler_t *vfs;
+    uint32_t hash;
+    uint32_t flags;
+    char *path;
+    uint64_t value[2];              /* File, directory */
+    struct stat st;
+} dentry_t;
+
+static mutex_t dc_mutex = MUTEX_INITIALIZER;
+static TAILQ_HEAD(dc_lru, dentry) lru = TAILQ_HEAD_INITIALIZER(lru);
+
+static dentry_t *entries;
+static dentry_t **buckets;
+static dentry_t *free_list;
+static size_t size, nbuckets, used;
+static size_t want = FS_DCACHE_DEFAULT_SIZE;
+static int initted;
+static fs_dcache_stats_t stats;
+
+/* FNV-1a, with the filesystem mixed in. */
+static uint32_t dc_hash(const vfs_handler_t *vfs, const char *path) {
+    uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)vfs >> 4);
+
+    while(*path) {
+        h ^= (uint8_t)*path++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void dc_free_table(void) {
+    size_t i;
+
+    for(i = 0; i < size; ++i)
+        free(entries[i].path);
+
+    free(entries);
+    free(buckets);
+    entries = NULL;
+    buckets = NULL;
+    free_list = NULL;
+    size = nbuckets = used = 0;
+    TAILQ_INIT(&lru);
+}
+
+static int dc_alloc_table(void) {
+    size_t i;
+
+    initted = 1;
+
+    if(!want)
+        return -1;
+
+    for(nbuckets = 1; nbuckets < want; nbuckets <<= 1)
+        ;
+
+    entries = (dentry_t *)calloc(want, sizeof(dentry_t));
+    buckets = (dentry_t **)calloc(nbuckets, sizeof(dentry_t *));
+
+    if(!entries || !buckets) {
+        free(entries);
+        free(buckets);
+        entries = NULL;
+        buckets = NULL;
+        nbuckets = 0;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0; i < want; ++i) {
+        entries[i].hnext = free_list;
+        free_list = &entries[i];
+    }
+
+    size = want;
+    return 0;
+}
+
+static void dc_remove(dentry_t *e) {
+    dentry_t **pp = &buckets[e->hash & (nbuckets - 1)];
+
+    while(*pp != e)
+        pp = &(*pp)->hnext;
+
+    *pp = e->hnext;
+    TAILQ_REMOVE(&lru, e, lru);
+
+    free(e->path);
+    e->path = NULL;
+    e->hnext = free_list;
+    free_list = e;
+    --used;
+}
+
+/* Find the entry for a path, optionally making one. Must be called with the
+   mutex held. */
+static dentry_t *dc_find(vfs_handler_t *vfs, const char *path, int create) {
+    uint32_t h;
+    dentry_t *e;
+    char *p;
+
+    if(!initted)
+        dc_alloc_table();
+
+    if(!size)
+        return NULL;
+
+    h = dc_hash(vfs, path);
+
+    for(e = buckets[h & (nbuckets - 1)]; e; e = e->hnext) {
+        if(e->hash == h && e->vfs == vfs && !strcmp(e->path, path)) {
+            TAILQ_REMOVE(&lru, e, lru);
+            TAILQ_INSERT_HEAD(&lru, e, lru);
+            return e;
+        }
+    }
+
+    if(!create || !(p = strdup(path)))
+        return NULL;
+
+    if(!free_list) {
+        ++stats.evictions;
+        dc_remove(TAILQ_LAST(&lru, dc_lru));
+    }
+
+    e = free_list;
+    free_list = e->hnext;
+
+    e->vfs = vfs;
+    e->hash = h;
+    e->flags = 0;
+    e->path = p;
+    e->hnext = buckets[h & (nbuckets - 1)];
+    buckets[h & (nbuckets - 1)] = e;
+    TAILQ_INSERT_HEAD(&lru, e, lru);
+    ++used;
+
+    return e;
+}
+
+int fs_dcache_get(vfs_handler_t *vfs, const char *path, int dir,
+                  uint64_t *value) {
+    int flag = dir ? DE_DIR : DE_FILE;
+    dentry_t *e;
+    int rv = 0;
+
+    mutex_lock(&dc_mutex);
+
+    if((e = dc_find(vfs, path, 0)) && (e->flags & flag)) {
+        *value = e->value[dir ? 1 : 0];
+        ++stats.hits;
+        rv = 1;
+    }
+    else {
+        ++stats.misses;
+    }
+
+    mutex_unlock(&dc_mutex);
+    return rv;
+}
+
+void fs_dcache_put(vfs_handler_t *vfs, const char *path, int dir,
+                   uint64_t value) {
+    dentry_t *e;
+
+    mutex_lock(&dc_mutex);
+
+    if((e = dc_find(vfs, path, 1))) {
+        e->value[dir ? 1 : 0] = value;
+        e->flags |= dir ? DE_DIR : DE_FILE;
+        e->flags &= ~(DE_NONE | (dir ? DE_NODIR : DE_NOFILE));
+    }
+
+    mutex_unlock(&dc_mutex);
+}
+
+int fs_dcache_stat(vfs_handler_t *vfs, const char *path, struct stat *st) {
+    dentry_t *e;
+    int rv = 0;
+
+    mutex_lock(&dc_mutex);
+
+    if((e = dc_find(vfs, path, 0))) {
+        if(e->flags & DE_STAT) {
+            *st = e->st;
+            ++stats.hits;
+            rv = 1;
+        }
+        else if(e->flags & DE_NONE) {
+            ++stats.hits;
+            ++stats.negative_hits;
+            rv = -1;
+        }
+    }
+
+    if(!rv)
+        ++stats.misses;
+
+    mutex_unlock(&dc_mutex);
+    return rv;
+}
+
+void fs_dcache_put_stat(vfs_handler_t *vfs, const char *path,
+                        const struct stat *st) {
+    dentry_t *e;
+
+    mutex_lock(&dc_mutex);
+
+    if((e = dc_find(vfs, path, 1))) {
+        e->st = *st;
+        e->flags |= DE_STAT;
+        e->flags &= ~DE_NONE;
+    }
+
+    mutex_unlock(&dc_mutex);
+}
+
+int fs_dcache_negative(vfs_handler_t *vfs, const char *path, int dir) {
+    int flags = DE_NONE | (dir ? DE_NODIR : DE_NOFILE);
+    dentry_t *e;
+    int rv = 0;
+
+    mutex_lock(&dc_mutex);
+
+    if((e = dc_find(vfs, path, 0)) && (e->flags & flags)) {
+        ++stats.hits;
+        ++stats.negative_hits;
+        rv = 1;
+    }
+
+    mutex_unlock(&dc_mutex);
+    return rv;
+}
+
+void fs_dcache_put_negative(vfs_handler_t *vfs, const char *path, int dir) {
+    dentry_t *e;
+
+    mutex_lock(&dc_mutex);
+
+    if((e = dc_find(vfs, path, 1))) {
+        if(dir < 0)
+            e->flags = DE_NONE;
+        else if(dir)
+            e->flags = (e->flags & ~DE_DIR) | DE_NODIR;
+        else
+            e->flags = (e->flags & ~DE_FILE) | DE_NOFILE;
+    }
+
+    mutex_unlock(&dc_mutex);
+}
+
+void fs_dcache_drop(vfs_handler_t *vfs, const char *path) {
+    dentry_t *e;
+
+    mutex_lock(&dc_mutex);
+
+    if((e = dc_find(vfs, path, 0))) {
+        ++stats.invalidations;
+        dc_remove(e);
+    }
+
+    mutex_unlock(&dc_mutex);
+}
+
+void fs_dcache_invalidate(vfs_handler_t *vfs, const char *path) {
+    size_t len = path ? strlen(path) : 0;
+    dentry_t *e, *n;
+
+    mutex_lock(&dc_mutex);
+
+    /* Drop the path itself and anything below it. */
+    e = TAILQ_FIRST(&lru);
+
+    while(e) {
+        n = TAILQ_NEXT(e, lru);
+
+        if(e->vfs == vfs && (!path || (!strncmp(e->path, path, len) &&
+                                       (e->path[len] == '\0' ||
+                                        e->path[len] == '/')))) {
+            ++stats.invalidations;
+            dc_remove(e);
+        }
+
+        e = n;
+    }
+
+    mutex_unlock(&dc_mutex);
+}
+
+int fs_dcache_set_size(size_t entries_wanted) {
+    int rv = 0;
+
+    mutex_lock(&dc_mutex);
+
+    dc_free_table();
+    want = entries_wanted;
+
+    if(want && dc_alloc_table() < 0) {
+        want = 0;
+        rv = -1;
+    }
+
+    initted = 1;
+
+    mutex_unlock(&dc_mutex);
+    return rv;
+}
+
+size_t fs_dcache_get_size(void) {
+    return initted ? size : want;
+}
+
+void fs_dcache_get_stats(fs_dcache_stats_t *st) {
+    mutex_lock(&dc_mutex);
+
+    *st = stats;
+    st->size = initted ? size : want;
+    st->used = used;
+
+    mutex_unlock(&dc_mutex);
+}
+
+void fs_dcache_reset_stats(void) {
+    mutex_lock(&dc_mutex);
+    memset(&stats, 0, sizeof(stats));
+    mutex_unlock(&dc_mutex);
+}
+
+void fs_dcache_shutdown(void) {
+    mutex_lock(&dc_mutex);
+
+    dc_free_table();
+    want = FS_DCACHE_DEFAULT_SIZE;
+    initted = 0;
+
+    mutex_unlock(&dc_mutex);
+}
@@ -0,0 +1,710 @@
+/* KallistiOS ##version##
+
+   fs_pcache.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/*
+
+Shared page cache for the VFS.
+
+Every file that has been opened through the cache has an object, found by
+filesystem and path, which holds its size and modification time and counts
+the descriptors that have it open. Objects outlive their descriptors for as
+long as they still have pages in the cache, so that reopening a file finds
+its data again, unless the file has changed size or time in the meantime.
+Files whose time can't be found out lose their pages on their last close.
+
+Pages live in one fixed pool, allocated the first time it is needed, and are
+found through a hash table keyed by object and page number. Eviction uses the
+CLOCK algorithm: each page has a reference bit that is set when it is used,
+and the hand clears bits as it sweeps until it finds a page without one.
+
+A miss reads a run of pages with one request to the filesystem (through its
+readv entry point if it has one), covering both what was asked for and the
+readahead window of the descriptor. The window doubles with every read that
+carries on where the previous one stopped, and is closed by any other read.
+
+The pool is protected by the cache mutex, which is never held for I/O. Each
+object has a lock of its own that is held for the whole of a read, so reads
+of different files don't wait for each other's misses. Pages are marked busy
+while they are being filled, and every object has a generation count that is
+bumped whenever its pages are dropped, so that a fill that raced with an
+invalidation doesn't put stale data back.
+
+*/
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <kos/fs.h>
+#include <kos/fs_pcache.h>
+#include <kos/mutex.h>
+#include <kos/thread.h>
+
+#define PGSIZE   FS_PCACHE_PAGE_SIZE
+
+typedef struct pc_obj {
+    LIST_ENTRY(pc_obj) ent;
+    vfs_handler_t *vfs;             /* Filesystem */
+    char *path;                     /* Path within the filesystem */
+    off_t size;                     /* Size when last opened */
+    time_t mtime;                   /* Modification time when last opened */
+    int checked;                    /* Nonzero if mtime is known */
+    int refs;                       /* Open descriptors */
+    int writers;                    /* ... of which can write */
+    size_t npages;                  /* Pages in the cache */
+    uint32_t gen;                   /* Bumped when its pages are dropped */
+    mutex_t lock;                   /* Held while reading through it */
+} pc_obj_t;
+
+typedef struct pc_page {
+    struct pc_page *hnext;          /* Hash chain */
+    pc_obj_t *obj;                  /* Owner, or NULL if free */
+    uint32_t index;                 /* Page number within the file */
+    uint32_t len;                   /* Valid bytes */
+    uint8_t ref;                    /* CLOCK reference bit */
+    uint8_t ra;                     /* Read ahead, not used yet */
+    uint8_t busy;                   /* Being filled */
+    uint8_t *data;
+} pc_page_t;
+
+struct fs_pcache_file {
+    pc_obj_t *obj;
+    vfs_handler_t *vfs;
+    void *hnd;
+    int readonly;
+    off_t ra_next;                  /* Where a sequential read would go */
+    int ra_win;                     /* Readahead window, in pages */
+};
+
+static mutex_t pc_mutex = MUTEX_INITIALIZER;
+static LIST_HEAD(pc_objs, pc_obj) objs = LIST_HEAD_INITIALIZER(objs);
+
+static pc_page_t *pages;
+static pc_page_t **buckets;
+static uint8_t *pool;
+static size_t npages, nbuckets, used, hand, nbusy;
+static size_t want = FS_PCACHE_DEFAULT_PAGES;
+static fs_pcache_stats_t stats;
+
+static inline size_t pc_hash(const pc_obj_t *obj, uint32_t index) {
+    return (((uintptr_t)obj >> 4) ^ (index * 2654435761u)) & (nbuckets - 1);
+}
+
+static pc_page_t *pc_lookup(const pc_obj_t *obj, uint32_t index) {
+    pc_page_t *p;
+
+    for(p = buckets[pc_hash(obj, index)]; p; p = p->hnext) {
+        if(p->obj == obj && p->index == index)
+            return p;
+    }
+
+    return NULL;
+}
+
+static void pc_insert(pc_page_t *p) {
+    size_t b = pc_hash(p->obj, p->index);
+
+    p->hnext = buckets[b];
+    buckets[b] = p;
+    ++p->obj->npages;
+    ++used;
+}
+
+/* Free an object once nothing refers to it any more. */
+static void pc_obj_put(pc_obj_t *obj) {
+    if(obj->refs || obj->npages)
+        return;
+
+    LIST_REMOVE(obj, ent);
+    mutex_destroy(&obj->lock);
+    free(obj->path);
+    free(obj);
+}
+
+static void pc_drop(pc_page_t *p) {
+    pc_page_t **pp = &buckets[pc_hash(p->obj, p->index)];
+    pc_obj_t *obj = p->obj;
+
+    while(*pp != p)
+        pp = &(*pp)->hnext;
+
+    *pp = p->hnext;
+    p->obj = NULL;
+    p->ra = 0;
+    --used;
+
+    --obj->npages;
+    pc_obj_put(obj);
+}
+
+static void pc_drop_obj(pc_obj_t *obj) {
+    size_t i;
+
+    ++obj->gen;
+
+    for(i = 0; i < npages && obj->npages; ++i) {
+        if(pages[i].obj == obj && !pages[i].busy)
+            pc_drop(&pages[i]);
+    }
+}
+
+/* Find a page to reuse, or NULL if they are all being filled. */
+static pc_page_t *pc_victim(void) {
+    pc_page_t *p;
+    size_t i;
+
+    /* Two sweeps clear every reference bit along the way. */
+    for(i = 0; i < npages * 2; ++i) {
+        p = &pages[hand];
+
+        if(++hand == npages)
+            hand = 0;
+
+        if(p->busy)
+            continue;
+
+        if(!p->obj)
+            return p;
+
+        if(p->ref) {
+            p->ref = 0;
+            continue;
+        }
+
+        ++stats.evictions;
+        pc_drop(p);
+        return p;
+    }
+
+    return NULL;
+}
+
+/* Wait for fills in progress to finish, so the pool can be freed. Assumes we
+   hold pc_mutex. */
+static void pc_wait_idle(void) {
+    while(nbusy) {
+        mutex_unlock(&pc_mutex);
+        thd_pass();
+        mutex_lock(&pc_mutex);
+    }
+}
+
+static void pc_free_pool(void) {
+    size_t i;
+
+    for(i = 0; i < npages; ++i) {
+        if(pages[i].obj)
+            pc_drop(&pages[i]);
+    }
+
+    free(pages);
+    free(buckets);
+    free(pool);
+    pages = NULL;
+    buckets = NULL;
+    pool = NULL;
+    npages = nbuckets = used = hand = 0;
+}
+
+static int pc_alloc_pool(void) {
+    size_t i;
+
+    if(pool)
+        return 0;
+
+    if(!want)
+        return -1;
+
+    for(nbuckets = 1; nbuckets < want; nbuckets <<= 1)
+        ;
+
+    pages = (pc_page_t *)calloc(want, sizeof(pc_page_t));
+    buckets = (pc_page_t **)calloc(nbuckets, sizeof(pc_page_t *));
+    pool = (uint8_t *)memalign(32, want * PGSIZE);
+
+    if(!pages || !buckets || !pool) {
+        free(pages);
+        free(buckets);
+        free(pool);
+        pages = NULL;
+        buckets = NULL;
+        pool = NULL;
+        nbuckets = 0;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0; i < want; ++i)
+        pages[i].data = pool + i * PGSIZE;
+
+    npages = want;
+    return 0;
+}
+
+static int pc_seek(struct fs_pcache_file *f, off_t offset) {
+    if(f->vfs->seek)
+        return f->vfs->seek(f->hnd, offset, SEEK_SET) < 0 ? -1 : 0;
+    else if(f->vfs->seek64)
+        return f->vfs->seek64(f->hnd, offset, SEEK_SET) < 0 ? -1 : 0;
+
+    errno = EINVAL;
+    return -1;
+}
+
+/* Read straight from the filesystem, for when the cache can't be used. The
+   descriptor's own file pointer is never used for anything else, so it can
+   be moved freely. */
+static ssize_t pc_direct(struct fs_pcache_file *f, void *buf, size_t cnt,
+                         off_t offset) {
+    if(f->vfs->pread)
+        return f->vfs->pread(f->hnd, buf, cnt, offset);
+
+    if(pc_seek(f, offset) < 0)
+        return -1;
+
+    return f->vfs->read(f->hnd, buf, cnt);
+}
+
+/* Read n pages starting at first, of which the first need were asked for and
+   the rest are readahead. Returns the first page, or NULL on error (errno set
+   to EAGAIN if there were no pages free to read into). Assumes we hold the
+   object's lock and pc_mutex, which is dropped during the I/O. */
+static pc_page_t *pc_fill(struct fs_pcache_file *f, uint32_t first, int n,
+                          int need) {
+    pc_page_t *run[FS_PCACHE_RA_MAX * 2];
+    struct iovec iov[FS_PCACHE_RA_MAX * 2];
+    off_t offset = (off_t)first * PGSIZE;
+    uint32_t gen = f->obj->gen;
+    ssize_t rv = 0, r;
+    size_t left;
+    int i, keep;
+
+    /* Don't reread pages that are already here, or run past the file. */
+    for(i = 1; i < n; ++i) {
+        if((off_t)(first + i) * PGSIZE >= f->obj->size ||
+           pc_lookup(f->obj, first + i))
+            break;
+    }
+
+    n = i;
+
+    if(n > (int)npages / 2)
+        n = npages > 1 ? (int)npages / 2 : 1;
+
+    for(i = 0; i < n; ++i) {
+        if(!(run[i] = pc_victim()))
+            break;
+
+        run[i]->busy = 1;
+        iov[i].iov_base = run[i]->data;
+        iov[i].iov_len = PGSIZE;
+    }
+
+    if(!(n = i)) {
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    nbusy += n;
+    mutex_unlock(&pc_mutex);
+
+    if(f->vfs->readv && n > 1) {
+        if(pc_seek(f, offset) < 0)
+            rv = -1;
+        else
+            rv = f->vfs->readv(f->hnd, iov, n);
+    }
+    else if(f->vfs->pread) {
+        for(i = 0; i < n; ++i) {
+            r = f->vfs->pread(f->hnd, iov[i].iov_base, PGSIZE,
+                              offset + rv);
+
+            if(r < 0) {
+                rv = rv ? rv : -1;
+                break;
+            }
+
+            rv += r;
+
+            if(r < PGSIZE)
+                break;
+        }
+    }
+    else if(pc_seek(f, offset) < 0) {
+        rv = -1;
+    }
+    else {
+        for(i = 0; i < n; ++i) {
+            r = f->vfs->read(f->hnd, iov[i].iov_base, PGSIZE);
+
+            if(r < 0) {
+                rv = rv ? rv : -1;
+                break;
+            }
+
+            rv += r;
+
+            if(r < PGSIZE)
+                break;
+        }
+    }
+
+    mutex_lock(&pc_mutex);
+    nbusy -= n;
+    ++stats.misses;
+
+    /* Keep whatever was read, and give back the rest. If the object's pages
+       were dropped while we were reading, the data is only good for this
+       read, so none of it is kept. */
+    left = rv > 0 ? (size_t)rv : 0;
+    keep = f->obj->gen == gen;
+
+    for(i = 0; i < n; ++i) {
+        run[i]->busy = 0;
+        run[i]->obj = NULL;
+
+        if(!left)
+            continue;
+
+        run[i]->len = left < PGSIZE ? left : PGSIZE;
+        left -= run[i]->len;
+
+        if(!keep)
+            continue;
+
+        run[i]->obj = f->obj;
+        run[i]->index = first + i;
+        run[i]->ref = 1;
+        run[i]->ra = i >= need;
+        pc_insert(run[i]);
+
+        if(i >= need)
+            ++stats.ra_pages;
+    }
+
+    if(rv < 0)
+        return NULL;
+
+    if(rv == 0) {
+        /* The file is shorter than it was when it was opened. */
+        errno = 0;
+        return NULL;
+    }
+
+    return run[0];
+}
+
+struct fs_pcache_file *fs_pcache_open(vfs_handler_t *vfs, void *hnd,
+                                      const char *path, int mode) {
+    struct fs_pcache_file *f;
+    pc_obj_t *obj;
+    struct stat st;
+    off_t size = 0;
+    time_t mtime = 0;
+    int readonly = (mode & O_MODE_MASK) == O_RDONLY, checked = 0;
+
+    if(mode & O_DIR)
+        return NULL;
+
+    if(readonly) {
+        if(vfs->total)
+            size = (off_t)vfs->total(hnd);
+        else if(vfs->total64)
+            size = (off_t)vfs->total64(hnd);
+        else
+            return NULL;
+
+        /* Can't cache what we can't size. */
+        if(size < 0 || !vfs->read)
+            return NULL;
+
+        /* A file can be changed without its size changing, which only its
+           time gives away. */
+        if((vfs->fstat && !vfs->fstat(hnd, &st)) ||
+           (!vfs->fstat && vfs->stat && !vfs->stat(vfs, path, &st, 0))) {
+            mtime = st.st_mtime;
+            checked = 1;
+        }
+    }
+
+    if(!(f = (struct fs_pcache_file *)malloc(sizeof(*f))))
+        return NULL;
+
+    mutex_lock(&pc_mutex);
+
+    if(readonly && pc_alloc_pool() < 0)
+        goto fail;
+
+    LIST_FOREACH(obj, &objs, ent) {
+        if(obj->vfs == vfs && !strcmp(obj->path, path))
+            break;
+    }
+
+    if(!obj) {
+        if(!(obj = (pc_obj_t *)calloc(1, sizeof(pc_obj_t))))
+            goto fail;
+
+        if(!(obj->path = strdup(path))) {
+            free(obj);
+            goto fail;
+        }
+
+        obj->vfs = vfs;
+        obj->size = size;
+        obj->mtime = mtime;
+        mutex_init(&obj->lock, MUTEX_TYPE_NORMAL);
+        LIST_INSERT_HEAD(&objs, obj, ent);
+    }
+
+    ++obj->refs;
+
+    /* Anything cached is stale if the file is about to be written, or has
+       changed size or time since it was last seen. */
+    if(!readonly) {
+        ++obj->writers;
+        pc_drop_obj(obj);
+    }
+    else {
+        if(obj->size != size || (checked && obj->mtime != mtime))
+            pc_drop_obj(obj);
+
+        obj->size = size;
+        obj->mtime = mtime;
+        obj->checked = checked;
+    }
+
+    mutex_unlock(&pc_mutex);
+
+    f->obj = obj;
+    f->vfs = vfs;
+    f->hnd = hnd;
+    f->readonly = readonly;
+    f->ra_next = 0;
+    f->ra_win = 0;
+
+    return f;
+
+fail:
+    mutex_unlock(&pc_mutex);
+    free(f);
+    return NULL;
+}
+
+void fs_pcache_close(struct fs_pcache_file *f) {
+    pc_obj_t *obj = f->obj;
+
+    mutex_lock(&pc_mutex);
+
+    if(!f->readonly)
+        --obj->writers;
+
+    /* Without a time to check against, there's no telling whether the file
+       will have changed by the time it is opened again. */
+    if(!f->readonly || (obj->refs == 1 && !obj->checked))
+        pc_drop_obj(obj);
+
+    --obj->refs;
+    pc_obj_put(obj);
+
+    mutex_unlock(&pc_mutex);
+
+    free(f);
+}
+
+off_t fs_pcache_size(struct fs_pcache_file *f) {
+    return f->obj->size;
+}
+
+ssize_t fs_pcache_read(struct fs_pcache_file *f, void *buf, size_t cnt,
+                       off_t offset) {
+    pc_obj_t *obj = f->obj;
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t idx, last, po;
+    pc_page_t *p;
+    size_t done = 0, len;
+    ssize_t rv;
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&obj->lock);
+    mutex_lock(&pc_mutex);
+
+    if(!pool || obj->writers) {
+        ++stats.bypassed;
+        mutex_unlock(&pc_mutex);
+        rv = pc_direct(f, buf, cnt, offset);
+        mutex_unlock(&obj->lock);
+        return rv;
+    }
+
+    /* Grow the readahead window while reads follow on from each other. */
+    if(offset == f->ra_next) {
+        f->ra_win = f->ra_win ? f->ra_win * 2 : 2;
+
+        if(f->ra_win > FS_PCACHE_RA_MAX)
+            f->ra_win = FS_PCACHE_RA_MAX;
+    }
+    else {
+        f->ra_win = 0;
+    }
+
+    if(offset >= obj->size || !cnt) {
+        mutex_unlock(&pc_mutex);
+        mutex_unlock(&obj->lock);
+        return 0;
+    }
+
+    if(cnt > (size_t)(obj->size - offset))
+        cnt = obj->size - offset;
+
+    last = (offset + cnt - 1) / PGSIZE;
+
+    while(done < cnt) {
+        idx = (offset + done) / PGSIZE;
+        po = (offset + done) % PGSIZE;
+
+        if((p = pc_lookup(obj, idx))) {
+            ++stats.hits;
+
+            if(p->ra) {
+                ++stats.ra_hits;
+                p->ra = 0;
+            }
+        }
+        else {
+            len = last - idx + 1;
+
+            if(len > FS_PCACHE_RA_MAX)
+                len = FS_PCACHE_RA_MAX;
+
+            if(!(p = pc_fill(f, idx, (int)len + f->ra_win, (int)len))) {
+                /* Every page is being filled by someone else, so go around
+                   the cache for the rest. */
+                if(errno == EAGAIN) {
+                    ++stats.bypassed;
+                    mutex_unlock(&pc_mutex);
+                    rv = pc_direct(f, out + done, cnt - done, offset + done);
+
+                    if(rv < 0) {
+                        mutex_unlock(&obj->lock);
+                        return done ? (ssize_t)done : -1;
+                    }
+
+                    done += rv;
+                    f->ra_next = offset + done;
+                    mutex_unlock(&obj->lock);
+                    return done;
+                }
+
+                mutex_unlock(&pc_mutex);
+                mutex_unlock(&obj->lock);
+
+                if(done || !errno)
+                    return done;
+
+                return -1;
+            }
+        }
+
+        p->ref = 1;
+
+        if(po >= p->len)
+            break;
+
+        len = p->len - po;
+
+        if(len > cnt - done)
+            len = cnt - done;
+
+        memcpy(out + done, p->data + po, len);
+        done += len;
+
+        /* A short page is the end of the file. */
+        if(p->len < PGSIZE)
+            break;
+    }
+
+    f->ra_next = offset + done;
+
+    mutex_unlock(&pc_mutex);
+    mutex_unlock(&obj->lock);
+    return done;
+}
+
+int fs_pcache_set_size(size_t count) {
+    int rv = 0;
+
+    mutex_lock(&pc_mutex);
+
+    pc_wait_idle();
+    pc_free_pool();
+    want = count;
+
+    if(count && pc_alloc_pool() < 0) {
+        want = 0;
+        rv = -1;
+    }
+
+    mutex_unlock(&pc_mutex);
+    return rv;
+}
+
+size_t fs_pcache_get_size(void) {
+    return pool ? npages : want;
+}
+
+void fs_pcache_invalidate(vfs_handler_t *vfs, const char *path) {
+    pc_obj_t *obj;
+    size_t i;
+
+    mutex_lock(&pc_mutex);
+
+    /* Keep fills in progress from putting back what they read. */
+    LIST_FOREACH(obj, &objs, ent) {
+        if(obj->vfs == vfs && (!path || !strcmp(obj->path, path)))
+            ++obj->gen;
+    }
+
+    for(i = 0; i < npages; ++i) {
+        if(!pages[i].obj || pages[i].busy || pages[i].obj->vfs != vfs)
+            continue;
+
+        if(!path || !strcmp(pages[i].obj->path, path))
+            pc_drop(&pages[i]);
+    }
+
+    mutex_unlock(&pc_mutex);
+}
+
+void fs_pcache_get_stats(fs_pcache_stats_t *st) {
+    mutex_lock(&pc_mutex);
+
+    *st = stats;
+    st->pages = npages;
+    st->used = used;
+
+    mutex_unlock(&pc_mutex);
+}
+
+void fs_pcache_reset_stats(void) {
+    mutex_lock(&pc_mutex);
+    memset(&stats, 0, sizeof(stats));
+    mutex_unlock(&pc_mutex);
+}
+
+void fs_pcache_shutdown(void) {
+    mutex_lock(&pc_mutex);
+    pc_wait_idle();
+    pc_free_pool();
+    want = FS_PCACHE_DEFAULT_PAGES;
+    mutex_unlock(&pc_mutex);
+}
@@ -29,6 +29,20 @@ in read-only mode. You'd then be safe.
 So at the moment this is mainly useful as a scratch space for temp files or to
 cache data from disk rather than as a general purpose file system.
 
+Once a file grows past RD_EXTENT_SIZE, its data is kept in fixed size extents
+while it is being written, so that growing it never has to copy what is already
+in it or find one block of memory big enough for all of it. Smaller files just
+grow one block. When a file that isn't too big is closed after writing, its
+data is put into one block of exactly the right size, which wastes less memory
+and lets mmap hand that block out directly. Bigger files keep
+their extents until something (mmap, or fs_ramdisk_detach()) needs them to be
+in one piece.
+
+Each directory keeps its files in a list, in the order they were created (which
+is the order readdir returns them in), and in a hash table keyed on the name
+(ignoring case) that doubles in size as the directory fills up, so that finding
+a file doesn't depend on how many others are there.
+
 */
 
 #include <kos/thread.h>
@@ -38,6 +52,7 @@ cache data from disk rather than as a general purpose file system.
 #include <malloc.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -59,18 +74,24 @@ typedef struct rd_file {
     int usage;      /* Usage count (unopened is 0) */
 
     /* For the following two members:
-      - In files, this is a block of allocated memory containing the
-        actual file data. Each time we need to expand it beyond its
-        current capacity, we realloc() with enough to hold the new
-        data plus 4k (to avoid realloc thrashing). All files start
-        out with a 1K block of space.
+      - In files, this is either NULL or a block of allocated memory
+        containing all of the file data, of datasize bytes. Files that
+        are kept in extents instead have a NULL data.
       - In directories, this is just a pointer to an rd_dir struct,
         which is defined below. datasize has no meaning for a
         directory. */
     void    * data;     /* Data block pointer */
     uint32  datasize;   /* Size of data block pointer */
 
-    LIST_ENTRY(rd_file) dirlist;    /* Directory list entry */
+    /* Files that are being written keep their data here, in blocks of
+       RD_EXTENT_SIZE bytes, until they are coalesced into data. */
+    uint8   ** extents; /* Extent table, or NULL */
+    uint32  nextents;   /* Number of extents allocated */
+    uint32  maxextents; /* Size of the extent table */
+
+    TAILQ_ENTRY(rd_file) dirlist;   /* Directory list entry */
+    struct rd_file * hnext;         /* Directory hash chain */
+    uint32  hash;                   /* Hash of the name */
 } rd_file_t;
 
 /* Lock constants */
@@ -78,13 +99,25 @@ typedef struct rd_file {
 #define OPENFOR_READ    1   /* Opened read-only */
 #define OPENFOR_WRITE   2   /* Opened read-write */
 
-/* Directory definition -- just basically a list of files we contain */
-typedef LIST_HEAD(rd_dir, rd_file) rd_dir_t;
+/* Directory definition -- the files we contain, in the order they were
+   created, and a hash table to find them by name */
+typedef struct rd_dir {
+    TAILQ_HEAD(rd_flist, rd_file) files;    /* Files, in creation order */
+    rd_file_t   ** buckets;     /* Hash table, or NULL while empty */
+    uint32      nbuckets;       /* Size of the hash table (a power of two) */
+    uint32      count;          /* Number of files */
+} rd_dir_t;
 
 /* Pointer to the root diretctory */
 static rd_file_t *root = NULL;
 static rd_dir_t  *rootdir = NULL;
 
+/* Size of a file extent */
+#define RD_EXTENT_SIZE  16384
+
+/* Files up to this size are coalesced when they are closed after writing */
+static size_t coalesce_limit = FS_RAMDISK_COALESCE_DEFAULT;
+
 /********************************************************************************/
 /* File primitives */
 
@@ -94,6 +127,7 @@ static struct {
     rd_file_t   *file;      /* ramdisk file struct */
     int         dir;        /* >0 if a directory */
     uint32      ptr;        /* Current read position in bytes */
+    rd_file_t   *dnext;     /* Next entry to read from a directory */
     dirent_t    dirent;     /* A static dirent to pass back to clients */
     int         omode;      /* Open mode */
 } fh[FS_RAMDISK_MAX_FILES];
@@ -101,13 +135,259 @@ static struct {
 /* Mutex for file system structs */
 static mutex_t rd_mutex;
 
+/* Hash a name, ignoring case. */
+static uint32 rd_hash(const char * name, int namelen) {
+    uint32 h = 2166136261U;
+
+    while(namelen--) {
+        h ^= (uint8)tolower((uint8)*name++);
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static void rd_dir_init(rd_dir_t * d) {
+    TAILQ_INIT(&d->files);
+    d->buckets = NULL;
+    d->nbuckets = 0;
+    d->count = 0;
+}
+
+/* Change the size of a directory's hash table. Assumes we hold rd_mutex. */
+static int rd_dir_resize(rd_dir_t * d, uint32 size) {
+    rd_file_t **nb, *e, *n;
+    uint32 i;
+
+    if(!(nb = (rd_file_t **)calloc(size, sizeof(rd_file_t *))))
+        return -1;
+
+    for(i = 0; i < d->nbuckets; ++i) {
+        for(e = d->buckets[i]; e; e = n) {
+            n = e->hnext;
+            e->hnext = nb[e->hash & (size - 1)];
+            nb[e->hash & (size - 1)] = e;
+        }
+    }
+
+    free(d->buckets);
+    d->buckets = nb;
+    d->nbuckets = size;
+
+    return 0;
+}
+
+/* Add a file to a directory. Assumes we hold rd_mutex. */
+static int rd_dir_add(rd_dir_t * d, rd_file_t * f) {
+    /* Keep the chains short by doubling the table as the directory fills
+       up. If there's no memory for that, chains just get longer. */
+    if(d->count >= d->nbuckets * 2 &&
+       rd_dir_resize(d, d->nbuckets ? d->nbuckets * 2 : 16) < 0 &&
+       !d->nbuckets)
+        return -1;
+
+    f->hash = rd_hash(f->name, strlen(f->name));
+    f->hnext = d->buckets[f->hash & (d->nbuckets - 1)];
+    d->buckets[f->hash & (d->nbuckets - 1)] = f;
+    TAILQ_INSERT_TAIL(&d->files, f, dirlist);
+    ++d->count;
+
+    return 0;
+}
+
+/* Take a file out of a directory. Assumes we hold rd_mutex. */
+static void rd_dir_remove(rd_dir_t * d, rd_file_t * f) {
+    rd_file_t **pp = &d->buckets[f->hash & (d->nbuckets - 1)];
+
+    while(*pp != f)
+        pp = &(*pp)->hnext;
+
+    *pp = f->hnext;
+    TAILQ_REMOVE(&d->files, f, dirlist);
+    --d->count;
+
+    /* Give memory back once most of the files are gone. */
+    if(d->nbuckets > 16 && d->count < d->nbuckets / 8)
+        rd_dir_resize(d, d->nbuckets / 4);
+}
+
+/* Free a file's data (or a directory's list head). Assumes we hold
+   rd_mutex. */
+static void rd_free_data(rd_file_t * f) {
+    uint32 i;
+
+    if(f->type == STAT_TYPE_DIR && f->data)
+        free(((rd_dir_t *)f->data)->buckets);
+
+    for(i = 0; i < f->nextents; ++i)
+        free(f->extents[i]);
+
+    free(f->extents);
+    free(f->data);
+
+    f->extents = NULL;
+    f->nextents = f->maxextents = 0;
+    f->data = NULL;
+    f->datasize = 0;
+}
+
+/* Copy between a file and a buffer. The range must be within the space
+   allocated to the file. Assumes we hold rd_mutex. */
+static void rd_copy(rd_file_t * f, uint32 offset, void * buf, size_t bytes,
+                    int write) {
+    uint8 *b = (uint8 *)buf, *e;
+    uint32 n;
+
+    if(!f->extents) {
+        if(write)
+            memcpy((uint8 *)f->data + offset, b, bytes);
+        else
+            memcpy(b, (uint8 *)f->data + offset, bytes);
+
+        return;
+    }
+
+    while(bytes) {
+        e = f->extents[offset / RD_EXTENT_SIZE] + offset % RD_EXTENT_SIZE;
+        n = RD_EXTENT_SIZE - offset % RD_EXTENT_SIZE;
+
+        if(n > bytes)
+            n = bytes;
+
+        if(write)
+            memcpy(e, b, n);
+        else
+            memcpy(b, e, n);
+
+        b += n;
+        offset += n;
+        bytes -= n;
+    }
+}
+
+/* Make room for size bytes in a file, moving it into extents if it doesn't
+   fit in the block it has. Assumes we hold rd_mutex. */
+static int rd_grow(rd_file_t * f, uint32 size) {
+    uint32 need = (size + RD_EXTENT_SIZE - 1) / RD_EXTENT_SIZE, n, max, cnt;
+    uint8 **tbl, *data;
+
+    if(f->data && size <= f->datasize)
+        return 0;
+
+    /* Small files don't need extents; grow their block instead. */
+    if(!f->extents && size <= RD_EXTENT_SIZE) {
+        for(n = f->datasize ? f->datasize : 256; n < size; n <<= 1)
+            ;
+
+        if(n > RD_EXTENT_SIZE)
+            n = RD_EXTENT_SIZE;
+
+        if(!(data = (uint8 *)realloc(f->data, n)))
+            return -1;
+
+        f->data = data;
+        f->datasize = n;
+        return 0;
+    }
+
+    /* Build the table up on the side, so that a file still in a single block
+       doesn't look like it's in extents if we run out of memory part way. */
+    tbl = f->extents;
+    max = f->maxextents;
+
+    if(need > max) {
+        n = max ? max * 2 : 8;
+
+        if(n < need)
+            n = need;
+
+        if(!(tbl = (uint8 **)realloc(f->extents, n * sizeof(uint8 *))))
+            return -1;
+
+        max = n;
+
+        /* The old table is gone now, so hang onto the new one if it was
+           already in use. */
+        if(f->extents) {
+            f->extents = tbl;
+            f->maxextents = max;
+        }
+    }
+
+    for(cnt = f->nextents; cnt < need; ++cnt) {
+        if(!(tbl[cnt] = (uint8 *)malloc(RD_EXTENT_SIZE))) {
+            while(cnt-- > f->nextents)
+                free(tbl[cnt]);
+
+            if(!f->extents)
+                free(tbl);
+
+            return -1;
+        }
+    }
+
+    f->extents = tbl;
+    f->maxextents = max;
+    f->nextents = cnt;
+
+    /* Move anything in a single block over to the extents. */
+    if(f->data) {
+        data = (uint8 *)f->data;
+        f->data = NULL;
+        f->datasize = 0;
+        rd_copy(f, 0, data, f->size, 1);
+        free(data);
+    }
+
+    return 0;
+}
+
+/* Move a file's data into one block that's just big enough for it. Assumes
+   we hold rd_mutex. */
+static int rd_coalesce(rd_file_t * f) {
+    uint8 *data;
+    uint32 size = f->size;
+
+    if(f->data && !f->extents) {
+        /* Give back any space past the end. */
+        if(size && size < f->datasize &&
+           (data = (uint8 *)realloc(f->data, size))) {
+            f->data = data;
+            f->datasize = size;
+        }
+
+        return 0;
+    }
+
+    if(!(data = (uint8 *)malloc(size ? size : 1))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(size)
+        rd_copy(f, 0, data, size, 0);
+
+    rd_free_data(f);
+    f->data = data;
+    f->datasize = size;
+
+    return 0;
+}
+
 /* Search a directory for the named file; return the struct if
    we find it. Assumes we hold rd_mutex. */
 static rd_file_t * ramdisk_find(rd_dir_t * parent, const char * name, int namelen) {
     rd_file_t   *f;
+    uint32      h;
 
-    LIST_FOREACH(f, parent, dirlist) {
-        if(!strncasecmp(name, f->name, namelen))
+    if(!parent->nbuckets)
+        return NULL;
+
+    h = rd_hash(name, namelen);
+
+    for(f = parent->buckets[h & (parent->nbuckets - 1)]; f; f = f->hnext) {
+        if(f->hash == h && !strncasecmp(name, f->name, namelen) &&
+           f->name[namelen] == '\0')
             return f;
     }
 
@@ -216,24 +496,31 @@ static rd_file_t * ramdisk_create_file(rd_dir_t * parent, const char * fn, int d
     f->type = dir ? STAT_TYPE_DIR : STAT_TYPE_FILE;
     f->openfor = OPENFOR_NOTHING;
     f->usage = 0;
+    f->data = NULL;
+    f->datasize = 0;
+    f->extents = NULL;
+    f->nextents = f->maxextents = 0;
 
-    if(!dir) {
-        f->data = malloc(1024);
-        f->datasize = 1024;
-    }
-    else {
+    /* Files start out empty; space is added as they are written. */
+    if(dir) {
         f->data = malloc(sizeof(rd_dir_t));
-        f->datasize = 0;
+
+        if(f->data == NULL) {
+            free(f->name);
+            free(f);
+            return NULL;
+        }
+
+        rd_dir_init((rd_dir_t *)f->data);
     }
 
-    if(f->data == NULL) {
+    if(rd_dir_add(pdir, f) < 0) {
+        free(f->data);
         free(f->name);
         free(f);
         return NULL;
     }
 
-    LIST_INSERT_HEAD(pdir, f, dirlist);
-
     return f;
 }
 
@@ -316,9 +603,7 @@ static void * ramdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
             fh[fd].ptr = f->size;
         /* If we're opening with O_TRUNC, kill the existing contents */
         else if(mode & O_TRUNC) {
-            free(f->data);
-            f->data = malloc(1024);
-            f->datasize = 1024;
+            rd_free_data(f);
             f->size = 0;
             fh[fd].ptr = 0;
         }
@@ -329,10 +614,9 @@ static void * ramdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
         assert_msg(0, "Unknown file mode");
     }
 
-    /* If we opened a dir, then ptr is actually a pointer to the first
-       file entry. */
+    /* If we opened a dir, start reading at its first file. */
     if(mode & O_DIR) {
-        fh[fd].ptr = (uint32)LIST_FIRST((rd_dir_t *)f->data);
+        fh[fd].dnext = TAILQ_FIRST(&((rd_dir_t *)f->data)->files);
     }
 
     /* Increase the usage count */
@@ -363,6 +647,11 @@ static int ramdisk_close(void * h) {
         f = fh[fd].file;
         fh[fd].file = NULL;
 
+        /* Put small files back into one piece once they're written. If
+           there isn't the memory for it, they just stay in extents. */
+        if(f->openfor == OPENFOR_WRITE && f->size <= coalesce_limit)
+            rd_coalesce(f);
+
         /* Decrease the usage count */
         f->usage--;
         assert(f->usage >= 0);
@@ -391,7 +680,7 @@ static ssize_t ramdisk_read(void * h, void *buf, size_t bytes) {
             bytes = fh[fd].file->size - fh[fd].ptr;
 
         /* Copy out the requested amount */
-        memcpy(buf, ((uint8 *)fh[fd].file->data) + fh[fd].ptr, bytes);
+        rd_copy(fh[fd].file, fh[fd].ptr, buf, bytes, 0);
         fh[fd].ptr += bytes;
 
         rv = bytes;
@@ -410,20 +699,14 @@ static ssize_t ramdisk_write(void * h, const void *buf, size_t bytes) {
 
     /* Check that the fd is valid */
     if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir && fh[fd].file->openfor == OPENFOR_WRITE) {
-        /* Is there enough left? */
-        if((fh[fd].ptr + bytes) > fh[fd].file->datasize) {
-            /* We need to realloc the block */
-            void * np = realloc(fh[fd].file->data, (fh[fd].ptr + bytes) + 4096);
-
-            if(np == NULL)
-                goto error_out;
-
-            fh[fd].file->data = np;
-            fh[fd].file->datasize = (fh[fd].ptr + bytes) + 4096;
+        /* Make sure there's room */
+        if(rd_grow(fh[fd].file, fh[fd].ptr + bytes) < 0) {
+            errno = ENOSPC;
+            goto error_out;
         }
 
-        /* Copy out the requested amount */
-        memcpy(((uint8 *)fh[fd].file->data) + fh[fd].ptr, buf, bytes);
+        /* Copy in the requested amount */
+        rd_copy(fh[fd].file, fh[fd].ptr, (void *)buf, bytes, 1);
         fh[fd].ptr += bytes;
 
         if(fh[fd].file->size < fh[fd].ptr) {
@@ -535,10 +818,10 @@ static dirent_t *ramdisk_readdir(void * h) {
 
     mutex_lock(&rd_mutex);
 
-    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && fh[fd].ptr != 0 && fh[fd].dir) {
+    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && fh[fd].dnext != NULL && fh[fd].dir) {
         /* Find the current file and advance to the next */
-        f = (rd_file_t *)fh[fd].ptr;
-        fh[fd].ptr = (uint32)LIST_NEXT(f, dirlist);
+        f = fh[fd].dnext;
+        fh[fd].dnext = TAILQ_NEXT(f, dirlist);
 
         /* Copy out the requested data */
         strcpy(fh[fd].dirent.name, f->name);
@@ -565,30 +848,42 @@ static dirent_t *ramdisk_readdir(void * h) {
 }
 
 static int ramdisk_unlink(vfs_handler_t * vfs, const char *fn) {
-    rd_file_t   * f;
+    rd_file_t   * f = NULL;
+    rd_dir_t    * pdir;
+    const char  * name;
     int     rv = -1;
 
     (void)vfs;
 
+    if(fn[0] == '/')
+        fn++;
+
     mutex_lock(&rd_mutex);
 
-    /* Find the file */
-    f = ramdisk_find_path(rootdir, fn, 0);
+    /* Find the file, and the directory it's in */
+    if(ramdisk_get_parent(rootdir, fn, &pdir, &name) == 0)
+        f = ramdisk_find(pdir, name, strlen(name));
 
-    if(f) {
+    if(f && f->type != STAT_TYPE_DIR) {
         /* Make sure it's not in use */
         if(f->usage == 0) {
+            /* Remove it from the parent directory */
+            rd_dir_remove(pdir, f);
+
             /* Free its data */
             free(f->name);
-            free(f->data);
-
-            /* Remove it from the parent list */
-            LIST_REMOVE(f, dirlist);
+            rd_free_data(f);
 
             /* Free the entry itself */
             free(f);
             rv = 0;
         }
+        else {
+            errno = EBUSY;
+        }
+    }
+    else {
+        errno = ENOENT;
     }
 
     mutex_unlock(&rd_mutex);
@@ -602,7 +897,12 @@ static void * ramdisk_mmap(void * h) {
     mutex_lock(&rd_mutex);
 
     if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir) {
-        rv = fh[fd].file->data;
+        /* Files in extents have to be put in one piece first. */
+        if(rd_coalesce(fh[fd].file) == 0)
+            rv = fh[fd].file->data;
+    }
+    else {
+        errno = EBADF;
     }
 
     mutex_unlock(&rd_mutex);
@@ -635,12 +935,14 @@ static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *buf,
             buf->st_mode |= S_IFREG;
 
         buf->st_nlink = 1;
-        buf->st_size = f->datasize;
+        buf->st_size = f->size;
         buf->st_blksize = 1024;
-        buf->st_blocks = f->datasize >> 10;
+        buf->st_blocks = f->size >> 10;
 
-        if(f->datasize & 0x3ff)
+        if(f->size & 0x3ff)
             ++buf->st_blocks;
+
+        rv = 0;
     }
     else {
         errno = ENOENT;
@@ -696,7 +998,7 @@ static int ramdisk_rewinddir(void * h) {
     }
     else {
         /* Rewind to the first file. */
-        fh[fd].ptr = (uint32)LIST_FIRST((rd_dir_t *)fh[fd].file->data);
+        fh[fd].dnext = TAILQ_FIRST(&((rd_dir_t *)fh[fd].file->data)->files);
     }
 
     mutex_unlock(&rd_mutex);
@@ -730,11 +1032,11 @@ static int ramdisk_fstat(void *h, struct stat *buf) {
         buf->st_mode |= S_IFREG;
 
     buf->st_nlink = 1;
-    buf->st_size = f->datasize;
+    buf->st_size = f->size;
     buf->st_blksize = 1024;
-    buf->st_blocks = f->datasize >> 10;
+    buf->st_blocks = f->size >> 10;
 
-    if(f->datasize & 0x3ff)
+    if(f->size & 0x3ff)
         ++buf->st_blocks;
 
     mutex_unlock(&rd_mutex);
@@ -799,7 +1101,7 @@ int fs_ramdisk_attach(const char * fn, void * obj, size_t size) {
 
     /* Ditch the data block we had and replace it with the user one. */
     f = fh[(int)fd].file;
-    free(f->data);
+    rd_free_data(f);
     f->data = obj;
     f->datasize = size;
     f->size = size;
@@ -827,13 +1129,24 @@ int fs_ramdisk_detach(const char * fn, void ** obj, size_t * size) {
     assert(size != NULL);
 
     f = fh[(int)fd].file;
+
+    /* The caller gets one block, so put the file in one piece. */
+    mutex_lock(&rd_mutex);
+
+    if(rd_coalesce(f) < 0) {
+        mutex_unlock(&rd_mutex);
+        ramdisk_close(fd);
+        return -1;
+    }
+
     *obj = f->data;
     *size = f->size;
 
-    /* Ditch the data block we had and replace it with a fake one. */
-    f->data = malloc(64);
-    f->datasize = 64;
-    f->size = 64;
+    /* The block is the caller's now. */
+    f->data = NULL;
+    f->datasize = 0;
+    f->size = 0;
+    mutex_unlock(&rd_mutex);
 
     /* Close the file */
     ramdisk_close(fd);
@@ -869,8 +1182,10 @@ int fs_ramdisk_init(void) {
     root->usage = 0;
     root->data = rootdir;
     root->datasize = 0;
+    root->extents = NULL;
+    root->nextents = root->maxextents = 0;
 
-    LIST_INIT(rootdir);
+    rd_dir_init(rootdir);
 
     /* Reset fd's */
     memset(fh, 0, sizeof(fh));
@@ -887,19 +1202,25 @@ int fs_ramdisk_shutdown(void) {
     rd_file_t *f1, *f2;
     /* For now assume there's only the root dir, since mkdir and
        rmdir aren't even implemented... */
-    f1 = LIST_FIRST(rootdir);
+    f1 = TAILQ_FIRST(&rootdir->files);
 
     while(f1) {
-        f2 = LIST_NEXT(f1, dirlist);
+        f2 = TAILQ_NEXT(f1, dirlist);
         free(f1->name);
-        free(f1->data);
+        rd_free_data(f1);
         free(f1);
         f1 = f2;
     }
 
+    free(rootdir->buckets);
     free(rootdir);
+    free(root->name);
     free(root);
 
     mutex_destroy(&rd_mutex);
     return nmmgr_handler_remove(&vh.nmmgr);
 }
+
+void fs_ramdisk_set_coalesce_limit(size_t size) {
+    coalesce_limit = size;
+}
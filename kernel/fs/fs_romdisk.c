@@ -14,16 +14,37 @@ To create a romdisk image, you will need the program "genromfs". This program wa
 for Linux but ought to compile under Cygwin. The source for this utility can be found
 on sunsite.unc.edu in /pub/Linux/system/recovery/, or as a package under Debian "genromfs".
 
+The copy of genromfs in utils/genromfs can also compress regular files (-z). A
+compressed file has the length of its compressed data in spec_info, which ROMFS
+otherwise leaves at zero for regular files, and its uncompressed length in size
+as usual. The compressed data starts with the block size and a table of offsets
+(all big-endian), followed by the blocks themselves:
+
+    uint32  block_size          Power of two
+    uint32  offset[n + 1]       From the start of the data; n = size / block_size,
+                                rounded up
+    ...     blocks              LZ4 block format, or stored as is if the block
+                                didn't get any smaller
+
+Reads decompress the blocks they need, keeping the last few in a small cache so
+that reads smaller than a block don't decompress it again each time.
+
+Hard links to regular files (which genromfs -D makes for files that are the same
+as another one) are followed to the file they point at, and read as a copy of
+it under their own name.
+
 */
 
 #include <arch/types.h>
 #include <kos/thread.h>
 #include <kos/mutex.h>
 #include <kos/fs_romdisk.h>
+#include <kos/fs_dcache.h>
 #include <kos/opts.h>
 #include <malloc.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
@@ -56,12 +77,115 @@ static uint32 ntohl_32(const void *data) {
     return (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | (d[3] << 0);
 }
 
+/* Limits on the block size of compressed files */
+#define RD_ZBLOCK_MIN   512
+#define RD_ZBLOCK_MAX   (1024 * 1024)
+
+/* Number of decompressed blocks to keep around */
+#define RD_ZCACHE_BLOCKS    4
+
+/* Decompress an LZ4 block. Returns the number of bytes written to dst, or -1
+   if the data is bad or doesn't fit. */
+static int rd_lz4_decode(const uint8 *src, uint32 slen, uint8 *dst,
+                         uint32 dlen) {
+    const uint8 *send = src + slen, *m;
+    uint8 *d = dst, *dend = dst + dlen;
+    uint32 len, off;
+    uint8 token;
+
+    while(src < send) {
+        token = *src++;
+
+        /* Literals */
+        len = token >> 4;
+
+        if(len == 15) {
+            do {
+                if(src >= send)
+                    return -1;
+
+                len += *src;
+            }
+            while(*src++ == 255);
+        }
+
+        if(len > (uint32)(send - src) || len > (uint32)(dend - d))
+            return -1;
+
+        memcpy(d, src, len);
+        d += len;
+        src += len;
+
+        /* The last sequence has no match. */
+        if(src == send)
+            break;
+
+        /* Match */
+        if(send - src < 2)
+            return -1;
+
+        off = src[0] | (src[1] << 8);
+        src += 2;
+
+        if(!off || off > (uint32)(d - dst))
+            return -1;
+
+        len = token & 15;
+
+        if(len == 15) {
+            do {
+                if(src >= send)
+                    return -1;
+
+                len += *src;
+            }
+            while(*src++ == 255);
+        }
+
+        len += 4;
+
+        if(len > (uint32)(dend - d))
+            return -1;
+
+        m = d - off;
+
+        /* Overlapping matches repeat the last off bytes, so they have to be
+           copied a byte at a time. */
+        if(off >= len) {
+            memcpy(d, m, len);
+            d += len;
+        }
+        else {
+            while(len--)
+                *d++ = *m++;
+        }
+    }
+
+    return d - dst;
+}
+
 /********************************************************************************/
 
 /* A list of the following */
 struct rd_image;
 typedef LIST_HEAD(rdi_list, rd_image) rdi_list_t;
 
+/* An entry in an image's path index. Directories are added to the index the
+   first time something is looked up in them, as long as there is room, and a
+   directory that has been added gets an entry with a hdr of 0 to say so. One
+   that is too big to fit gets an entry with a hdr of RD_INDEX_SKIP instead,
+   so that it is scanned without being counted again every time. */
+typedef struct rd_ient {
+    uint32  dir;        /* Offset of the directory's first entry */
+    uint32  hdr;        /* Offset of this entry's header */
+    uint32  hash;       /* Hash of dir and the lowercased name */
+    int32   next;       /* Next entry in the hash chain, or -1 */
+} rd_ient_t;
+
+/* Header offset marking a directory that isn't indexed (headers are always
+   16-byte aligned, so this can't be a real one). */
+#define RD_INDEX_SKIP   1
+
 /* A single mounted romdisk image; a pointer to one of these will be in our
    VFS struct for each mount. */
 typedef struct rd_image {
@@ -72,11 +196,23 @@ typedef struct rd_image {
     const romdisk_hdr_t * hdr;      /* Pointer to the header */
     uint32          files;      /* Offset in the image to the files area */
     vfs_handler_t       * vfsh;     /* Our VFS mount struct */
+
+    mutex_t         ilock;      /* Path index lock */
+    rd_ient_t       * ients;    /* Path index entries */
+    int32           * ibuckets; /* Path index hash table */
+    size_t          icount;     /* Entries in use */
+    size_t          ialloc;     /* Entries allocated */
+    size_t          imax;       /* Most entries allowed, 0 for no index */
+    size_t          inbuckets;  /* Size of the hash table */
+    int             ifull;      /* Nothing more can be added */
 } rd_image_t;
 
 /* Global list of mounted romdisks */
 static rdi_list_t romdisks;
 
+/* Path index size for new mounts */
+static size_t index_size = FS_ROMDISK_INDEX_DEFAULT;
+
 /********************************************************************************/
 /* File primitives */
 
@@ -89,15 +225,51 @@ static struct {
     uint32      size;       /* Length of file in bytes */
     dirent_t    dirent;     /* A static dirent to pass back to clients */
     rd_image_t  * mnt;      /* Which mount instance are we using? */
+    uint32      zsize;      /* Length of compressed data, 0 if not compressed */
+    uint32      zblock;     /* Block size of compressed data */
+    uint8       * map;      /* Decompressed copy of the file for mmap */
 } fh[FS_ROMDISK_MAX_FILES];
 
 /* Mutex for file handles */
 static mutex_t fh_mutex;
 
+/* Recently decompressed blocks */
+static struct {
+    const rd_image_t * mnt; /* Image the block is from, NULL if unused */
+    uint32      index;      /* Image index of the file's data */
+    uint32      block;      /* Block number within the file */
+    uint32      len;        /* Length of the block */
+    uint32      used;       /* When it was last used */
+    uint8       * buf;      /* Decompressed data */
+    uint32      bufsize;    /* Size of buf */
+} zcache[RD_ZCACHE_BLOCKS];
+
+static mutex_t zc_mutex;
+static uint32 zc_clock;
+
+/* Hard links to regular files are how genromfs stores files that are the same
+   as another one (with -D, or hard linked in the source tree). Returns the
+   header holding the data for a regular file or a link to one, or 0 for
+   anything else. */
+static uint32 rd_file_hdr(const uint8 *image, uint32 i) {
+    const romdisk_file_t *fhdr = (const romdisk_file_t *)(image + i);
+    uint32 type = ntohl_32(&fhdr->next_header) & 3;
+
+    if(type == 0) {
+        if(!(i = ntohl_32(&fhdr->spec_info) & 0xfffffff0))
+            return 0;
+
+        fhdr = (const romdisk_file_t *)(image + i);
+        type = ntohl_32(&fhdr->next_header) & 3;
+    }
+
+    return type == 2 ? i : 0;
+}
+
 /* Given a filename and a starting romdisk directory listing (byte offset),
    search for the entry in the directory and return the byte offset to its
    entry. */
-static uint32 romdisk_find_object(rd_image_t * mnt, const char *fn, size_t fnlen, int dir, uint32 offset) {
+static uint32 romdisk_scan_object(rd_image_t * mnt, const char *fn, size_t fnlen, int dir, uint32 offset) {
     uint32          i, ni, type;
     const romdisk_file_t    *fhdr;
 
@@ -112,7 +284,7 @@ static uint32 romdisk_find_object(rd_image_t * mnt, const char *fn, size_t fnlen
 
         /* Check the type */
         if(!dir) {
-            if((type & 3) != 2) {
+            if(!rd_file_hdr(mnt->image, i)) {
                 i = ni;
 
                 if(!i)
@@ -146,6 +318,365 @@ static uint32 romdisk_find_object(rd_image_t * mnt, const char *fn, size_t fnlen
     return 0;
 }
 
+/* Hash a name (case-insensitively) in the directory starting at dir. */
+static uint32 rd_hash(uint32 dir, const char *fn, size_t fnlen) {
+    uint32 h = 2166136261U ^ dir;
+
+    while(fnlen--) {
+        h ^= (uint8)tolower((uint8)*fn++);
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/* Add an entry to the path index. Must be called with the index locked. */
+static int rd_index_add(rd_image_t * mnt, uint32 dir, uint32 hdr,
+                        uint32 hash) {
+    rd_ient_t *e;
+    size_t n, b;
+
+    if(mnt->icount == mnt->ialloc) {
+        n = mnt->ialloc ? mnt->ialloc * 2 : 64;
+
+        if(n > mnt->imax)
+            n = mnt->imax;
+
+        if(!(e = (rd_ient_t *)realloc(mnt->ients, n * sizeof(rd_ient_t))))
+            return -1;
+
+        mnt->ients = e;
+        mnt->ialloc = n;
+    }
+
+    b = hash & (mnt->inbuckets - 1);
+    e = &mnt->ients[mnt->icount];
+    e->dir = dir;
+    e->hdr = hdr;
+    e->hash = hash;
+    e->next = mnt->ibuckets[b];
+    mnt->ibuckets[b] = mnt->icount++;
+
+    return 0;
+}
+
+/* Add everything in a directory to the path index, if it all fits. Must be
+   called with the index locked. */
+static int rd_index_dir(rd_image_t * mnt, uint32 dir) {
+    const romdisk_file_t *fhdr;
+    uint32 i, ni, type;
+    size_t count = 1, b;
+
+    if(!mnt->ibuckets) {
+        for(b = 16; b < mnt->imax / 2; b <<= 1)
+            ;
+
+        if(!(mnt->ibuckets = (int32 *)malloc(b * sizeof(int32)))) {
+            mnt->ifull = 1;
+            return -1;
+        }
+
+        memset(mnt->ibuckets, 0xff, b * sizeof(int32));
+        mnt->inbuckets = b;
+    }
+
+    /* Count it first, so that a directory is either indexed entirely or not
+       at all. */
+    for(i = dir; i; i = ni & 0xfffffff0) {
+        fhdr = (const romdisk_file_t *)(mnt->image + i);
+        ni = ntohl_32(&fhdr->next_header);
+        type = ni & 3;
+
+        if(type == 1 || rd_file_hdr(mnt->image, i))
+            ++count;
+    }
+
+    /* Leave out just this directory if it doesn't fit, so that smaller ones
+       can still go in. */
+    if(mnt->icount + count > mnt->imax) {
+        if(mnt->icount >= mnt->imax ||
+           rd_index_add(mnt, dir, RD_INDEX_SKIP, rd_hash(dir, "", 0)) < 0 ||
+           mnt->icount == mnt->imax)
+            mnt->ifull = 1;
+
+        return -1;
+    }
+
+    for(i = dir; i; i = ni & 0xfffffff0) {
+        fhdr = (const romdisk_file_t *)(mnt->image + i);
+        ni = ntohl_32(&fhdr->next_header);
+        type = ni & 3;
+
+        if(type != 1 && !rd_file_hdr(mnt->image, i))
+            continue;
+
+        if(rd_index_add(mnt, dir, i, rd_hash(dir, fhdr->filename,
+                                             strlen(fhdr->filename))) < 0)
+            goto fail;
+    }
+
+    if(rd_index_add(mnt, dir, 0, rd_hash(dir, "", 0)) < 0)
+        goto fail;
+
+    if(mnt->icount == mnt->imax)
+        mnt->ifull = 1;
+
+    return 0;
+
+fail:
+    /* Out of memory part way through; take back what was added. */
+    while(mnt->icount && mnt->ients[mnt->icount - 1].dir == dir) {
+        --mnt->icount;
+        b = mnt->ients[mnt->icount].hash & (mnt->inbuckets - 1);
+        mnt->ibuckets[b] = mnt->ients[mnt->icount].next;
+    }
+
+    mnt->ifull = 1;
+    return -1;
+}
+
+/* Look a name up in the path index. Returns 1 if the index could answer,
+   with the header offset (or 0 if it isn't there) in *out, 0 if the directory
+   hasn't been indexed yet, or -1 if it never will be. Must be called with the
+   index locked. */
+static int rd_index_find(rd_image_t * mnt, const char *fn, size_t fnlen,
+                         int dir, uint32 offset, uint32 *out) {
+    const romdisk_file_t *fhdr;
+    uint32 h = rd_hash(offset, fn, fnlen), type;
+    const rd_ient_t *e;
+    int32 i;
+    int indexed = 0;
+
+    if(!mnt->ibuckets)
+        return 0;
+
+    for(i = mnt->ibuckets[h & (mnt->inbuckets - 1)]; i >= 0; i = e->next) {
+        e = &mnt->ients[i];
+
+        if(e->dir != offset)
+            continue;
+
+        if(e->hdr == RD_INDEX_SKIP)
+            return -1;
+
+        if(!e->hdr) {
+            indexed = 1;
+            continue;
+        }
+
+        if(e->hash != h)
+            continue;
+
+        fhdr = (const romdisk_file_t *)(mnt->image + e->hdr);
+        type = ntohl_32(&fhdr->next_header) & 3;
+
+        if((dir ? type == 1 : rd_file_hdr(mnt->image, e->hdr) != 0) &&
+           strlen(fhdr->filename) == fnlen &&
+           !strncasecmp(fhdr->filename, fn, fnlen)) {
+            *out = e->hdr;
+            return 1;
+        }
+    }
+
+    /* The directory's marker might be in another chain. */
+    if(!indexed) {
+        h = rd_hash(offset, "", 0);
+
+        for(i = mnt->ibuckets[h & (mnt->inbuckets - 1)]; i >= 0;
+            i = e->next) {
+            e = &mnt->ients[i];
+
+            if(e->dir == offset && e->hdr == RD_INDEX_SKIP)
+                return -1;
+
+            if(e->dir == offset && !e->hdr) {
+                indexed = 1;
+                break;
+            }
+        }
+    }
+
+    if(indexed)
+        *out = 0;
+
+    return indexed;
+}
+
+/* Find an entry in a directory, through the path index if possible. */
+static uint32 romdisk_find_object(rd_image_t * mnt, const char *fn,
+                                  size_t fnlen, int dir, uint32 offset) {
+    uint32 rv;
+    int found;
+
+    if(!mnt->imax)
+        return romdisk_scan_object(mnt, fn, fnlen, dir, offset);
+
+    mutex_lock(&mnt->ilock);
+
+    found = rd_index_find(mnt, fn, fnlen, dir, offset, &rv);
+
+    if(!found && !mnt->ifull && !rd_index_dir(mnt, offset))
+        found = rd_index_find(mnt, fn, fnlen, dir, offset, &rv);
+
+    mutex_unlock(&mnt->ilock);
+
+    if(found > 0)
+        return rv;
+
+    return romdisk_scan_object(mnt, fn, fnlen, dir, offset);
+}
+
+/* Free an image's path index. */
+static void rd_index_free(rd_image_t * mnt) {
+    free(mnt->ients);
+    free(mnt->ibuckets);
+    mutex_destroy(&mnt->ilock);
+}
+
+/* Decompress one block of a compressed file into dst, which must have room
+   for a whole block. Returns the length of the block, or -1 if the data is
+   bad. */
+static int rd_zblock(file_t fd, uint32 block, uint8 *dst) {
+    const uint8 *z = fh[fd].mnt->image + fh[fd].index;
+    uint32 start, end, len;
+
+    start = ntohl_32(z + 4 + block * 4);
+    end = ntohl_32(z + 8 + block * 4);
+    len = fh[fd].size - block * fh[fd].zblock;
+
+    if(len > fh[fd].zblock)
+        len = fh[fd].zblock;
+
+    if(end < start || end > fh[fd].zsize)
+        return -1;
+
+    if(end - start == len)
+        memcpy(dst, z + start, len);
+    else if(rd_lz4_decode(z + start, end - start, dst, len) != (int)len)
+        return -1;
+
+    return len;
+}
+
+/* Find a block in the cache, decompressing it if it isn't there. Must be
+   called with zc_mutex held. */
+static const uint8 *rd_zcache_get(file_t fd, uint32 block) {
+    int i, victim = 0;
+    int len;
+    uint8 *buf;
+
+    for(i = 0; i < RD_ZCACHE_BLOCKS; ++i) {
+        if(zcache[i].mnt == fh[fd].mnt && zcache[i].index == fh[fd].index &&
+           zcache[i].block == block) {
+            zcache[i].used = ++zc_clock;
+            return zcache[i].buf;
+        }
+
+        if(zcache[victim].mnt && (!zcache[i].mnt ||
+                                  zcache[i].used < zcache[victim].used))
+            victim = i;
+    }
+
+    i = victim;
+    zcache[i].mnt = NULL;
+
+    if(zcache[i].bufsize < fh[fd].zblock) {
+        if(!(buf = (uint8 *)realloc(zcache[i].buf, fh[fd].zblock))) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        zcache[i].buf = buf;
+        zcache[i].bufsize = fh[fd].zblock;
+    }
+
+    if((len = rd_zblock(fd, block, zcache[i].buf)) < 0) {
+        errno = EIO;
+        return NULL;
+    }
+
+    zcache[i].mnt = fh[fd].mnt;
+    zcache[i].index = fh[fd].index;
+    zcache[i].block = block;
+    zcache[i].len = len;
+    zcache[i].used = ++zc_clock;
+
+    return zcache[i].buf;
+}
+
+/* Drop an image's blocks from the cache. */
+static void rd_zcache_drop(const rd_image_t *mnt) {
+    int i;
+
+    mutex_lock(&zc_mutex);
+
+    for(i = 0; i < RD_ZCACHE_BLOCKS; ++i) {
+        if(!mnt || zcache[i].mnt == mnt)
+            zcache[i].mnt = NULL;
+
+        if(!mnt) {
+            free(zcache[i].buf);
+            zcache[i].buf = NULL;
+            zcache[i].bufsize = 0;
+        }
+    }
+
+    mutex_unlock(&zc_mutex);
+}
+
+/* Copy part of a file out, decompressing it if need be. The range must be
+   within the file. */
+static ssize_t romdisk_copy(file_t fd, uint8 *buf, size_t bytes,
+                            uint32 offset) {
+    const uint8 *src;
+    uint32 block, boff, blen, n;
+    size_t left = bytes;
+
+    if(!fh[fd].zsize) {
+        memcpy(buf, fh[fd].mnt->image + fh[fd].index + offset, bytes);
+        return bytes;
+    }
+
+    while(left) {
+        block = offset / fh[fd].zblock;
+        boff = offset % fh[fd].zblock;
+        blen = fh[fd].size - block * fh[fd].zblock;
+
+        if(blen > fh[fd].zblock)
+            blen = fh[fd].zblock;
+
+        n = blen - boff;
+
+        if(n > left)
+            n = left;
+
+        if(n == blen) {
+            /* The whole block is wanted, so skip the cache. */
+            if(rd_zblock(fd, block, buf) < 0) {
+                errno = EIO;
+                return -1;
+            }
+        }
+        else {
+            mutex_lock(&zc_mutex);
+
+            if(!(src = rd_zcache_get(fd, block))) {
+                mutex_unlock(&zc_mutex);
+                return -1;
+            }
+
+            memcpy(buf, src + boff, n);
+            mutex_unlock(&zc_mutex);
+        }
+
+        buf += n;
+        offset += n;
+        left -= n;
+    }
+
+    return bytes;
+}
+
 /* Locate an object anywhere in the image, starting at the root, and
    expecting a fully qualified path name. This is analogous to the
    find_object_path in iso9660.
@@ -176,9 +707,14 @@ static uint32 romdisk_find(rd_image_t * mnt, const char *fn, int dir) {
         fn = cur + 1;
     }
 
-    /* Locate the file in the resulting directory */
+    /* Locate the file in the resulting directory, going to the data if it's
+       a link. */
     if(*fn) {
         i = romdisk_find_object(mnt, fn, strlen(fn), dir, i);
+
+        if(i && !dir)
+            i = rd_file_hdr(mnt->image, i);
+
         return i;
     }
     else {
@@ -193,6 +729,7 @@ static uint32 romdisk_find(rd_image_t * mnt, const char *fn, int dir) {
 static void * romdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
     file_t          fd;
     uint32          filehdr;
+    uint64_t        cached;
     const romdisk_file_t    *fhdr;
     rd_image_t      *mnt = (rd_image_t *)vfs->privdata;
 
@@ -206,12 +743,19 @@ static void * romdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
     if(fn[0] == 0)
         fn = "";
 
-    /* Look for the file */
-    filehdr = romdisk_find(mnt, fn + 1, mode & O_DIR);
+    /* Look for the file, unless we've already found it before. */
+    if(fs_dcache_get(vfs, fn, mode & O_DIR, &cached)) {
+        filehdr = (uint32)cached;
+    }
+    else {
+        filehdr = romdisk_find(mnt, fn + 1, mode & O_DIR);
 
-    if(filehdr == 0) {
-        errno = ENOENT;
-        return NULL;
+        if(filehdr == 0) {
+            errno = ENOENT;
+            return NULL;
+        }
+
+        fs_dcache_put(vfs, fn, mode & O_DIR, filehdr);
     }
 
     /* Find a free file handle */
@@ -237,6 +781,23 @@ static void * romdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
     fh[fd].ptr = 0;
     fh[fd].size = ntohl_32(&fhdr->size);
     fh[fd].mnt = mnt;
+    fh[fd].zsize = 0;
+    fh[fd].map = NULL;
+
+    /* Check the header of a compressed file. */
+    if(!fh[fd].dir && ntohl_32(&fhdr->spec_info)) {
+        fh[fd].zsize = ntohl_32(&fhdr->spec_info);
+        fh[fd].zblock = ntohl_32(mnt->image + fh[fd].index);
+
+        if(fh[fd].zblock < RD_ZBLOCK_MIN || fh[fd].zblock > RD_ZBLOCK_MAX ||
+           (fh[fd].zblock & (fh[fd].zblock - 1)) ||
+           fh[fd].zsize < 8 + ((fh[fd].size + fh[fd].zblock - 1) /
+                               fh[fd].zblock) * 4) {
+            fh[fd].index = 0;
+            errno = EIO;
+            return NULL;
+        }
+    }
 
     return (void *)fd;
 }
@@ -247,6 +808,9 @@ static int romdisk_close(void * h) {
 
     /* Check that the fd is valid */
     if(fd < FS_ROMDISK_MAX_FILES) {
+        free(fh[fd].map);
+        fh[fd].map = NULL;
+
         /* No need to lock the mutex: this is an atomic op */
         fh[fd].index = 0;
     }
@@ -268,12 +832,61 @@ static ssize_t romdisk_read(void * h, void *buf, size_t bytes) {
         bytes = fh[fd].size - fh[fd].ptr;
 
     /* Copy out the requested amount */
-    memcpy(buf, fh[fd].mnt->image + fh[fd].index + fh[fd].ptr, bytes);
+    if(romdisk_copy(fd, (uint8 *)buf, bytes, fh[fd].ptr) < 0)
+        return -1;
+
     fh[fd].ptr += bytes;
 
     return bytes;
 }
 
+/* Read into several buffers */
+static ssize_t romdisk_readv(void * h, const struct iovec *iov, int iovcnt) {
+    file_t fd = (file_t)h;
+    size_t bytes, left;
+    ssize_t total = 0;
+    int i;
+
+    if(fd >= FS_ROMDISK_MAX_FILES || fh[fd].index == 0 || fh[fd].dir) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(!(left = fh[fd].size - fh[fd].ptr))
+            break;
+
+        bytes = iov[i].iov_len < left ? iov[i].iov_len : left;
+
+        if(romdisk_copy(fd, (uint8 *)iov[i].iov_base, bytes,
+                        fh[fd].ptr) < 0)
+            return total ? total : -1;
+
+        fh[fd].ptr += bytes;
+        total += bytes;
+    }
+
+    return total;
+}
+
+/* Read from a given offset, leaving the file pointer alone */
+static ssize_t romdisk_pread(void * h, void *buf, size_t bytes, off_t offset) {
+    file_t fd = (file_t)h;
+
+    if(fd >= FS_ROMDISK_MAX_FILES || fh[fd].index == 0 || fh[fd].dir) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((uint32)offset >= fh[fd].size)
+        return 0;
+
+    if(bytes > fh[fd].size - (uint32)offset)
+        bytes = fh[fd].size - (uint32)offset;
+
+    return romdisk_copy(fd, (uint8 *)buf, bytes, (uint32)offset);
+}
+
 /* Seek elsewhere in a file */
 static off_t romdisk_seek(void * h, off_t offset, int whence) {
     file_t fd = (file_t)h;
@@ -350,7 +963,8 @@ static size_t romdisk_total(void * h) {
 
 /* Read a directory entry */
 static dirent_t *romdisk_readdir(void * h) {
-    romdisk_file_t *fhdr;
+    const romdisk_file_t *fhdr;
+    uint32 hdr;
     int type;
     file_t fd = (file_t)h;
 
@@ -365,7 +979,8 @@ static dirent_t *romdisk_readdir(void * h) {
         return NULL;
 
     /* Get the current file header */
-    fhdr = (romdisk_file_t *)(fh[fd].mnt->image + fh[fd].index + fh[fd].ptr);
+    hdr = fh[fd].index + fh[fd].ptr;
+    fhdr = (const romdisk_file_t *)(fh[fd].mnt->image + hdr);
 
     /* Update the pointer */
     fh[fd].ptr = ntohl_32(&fhdr->next_header);
@@ -386,6 +1001,10 @@ static dirent_t *romdisk_readdir(void * h) {
         fh[fd].dirent.size = -1;
     }
     else {
+        /* A link to a file has the size of the file */
+        if((type & 3) == 0 && (hdr = rd_file_hdr(fh[fd].mnt->image, hdr)))
+            fhdr = (const romdisk_file_t *)(fh[fd].mnt->image + hdr);
+
         fh[fd].dirent.attr = 0;
         fh[fd].dirent.size = ntohl_32(&fhdr->size);
     }
@@ -401,6 +1020,25 @@ static void *romdisk_mmap(void * h) {
         return NULL;
     }
 
+    /* Compressed files have to be decompressed somewhere first. That copy
+       lasts until the file is closed. */
+    if(fh[fd].zsize) {
+        if(!fh[fd].map) {
+            if(!(fh[fd].map = (uint8 *)malloc(fh[fd].size))) {
+                errno = ENOMEM;
+                return NULL;
+            }
+
+            if(romdisk_copy(fd, fh[fd].map, fh[fd].size, 0) < 0) {
+                free(fh[fd].map);
+                fh[fd].map = NULL;
+                return NULL;
+            }
+        }
+
+        return fh[fd].map;
+    }
+
     /* Can't really help the loss of "const" here */
     return (void *)(fh[fd].mnt->image + fh[fd].index);
 }
@@ -491,7 +1129,7 @@ static vfs_handler_t vh = {
         NMMGR_LIST_INIT         /* list */
     },
 
-    0, NULL,                    /* no cacheing, privdata */
+    VFS_CACHE_DENTRIES, NULL,   /* dentry cache, privdata */
 
     romdisk_open,
     romdisk_close,
@@ -518,7 +1156,13 @@ static vfs_handler_t vh = {
     NULL,                       /* total64 */
     NULL,                       /* readlink */
     romdisk_rewinddir,
-    romdisk_fstat
+    romdisk_fstat,
+    NULL,                       /* aio_submit */
+    NULL,                       /* aio_cancel */
+    romdisk_readv,
+    NULL,                       /* writev */
+    romdisk_pread,
+    NULL                        /* pwrite */
 };
 
 /* Are we initialized? */
@@ -540,6 +1184,7 @@ void fs_romdisk_init(void) {
 
     /* Init thread mutexes */
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&zc_mutex, MUTEX_TYPE_NORMAL);
 
     initted = 1;
 }
@@ -569,14 +1214,19 @@ void fs_romdisk_shutdown(void) {
             free((void *)c->image);
 
         nmmgr_handler_remove(&c->vfsh->nmmgr);
+        rd_index_free(c);
         free(c->vfsh);
         free(c);
 
         c = n;
     }
 
+    /* Free the block cache */
+    rd_zcache_drop(NULL);
+
     /* Free mutex */
     mutex_destroy(&fh_mutex);
+    mutex_destroy(&zc_mutex);
 
     initted = 0;
 }
@@ -619,10 +1269,23 @@ int fs_romdisk_mount(const char * mountpoint, const uint8 *img, int own_buffer)
     mnt->files = sizeof(romdisk_hdr_t)
                  + (strlen(hdr->volume_name) / 16) * 16;
 
+    /* Set up the path index, starting with the root directory. Everything
+       else is added as it gets used. */
+    mutex_init(&mnt->ilock, MUTEX_TYPE_NORMAL);
+    mnt->ients = NULL;
+    mnt->ibuckets = NULL;
+    mnt->icount = mnt->ialloc = mnt->inbuckets = 0;
+    mnt->imax = index_size;
+    mnt->ifull = 0;
+
+    if(mnt->imax)
+        rd_index_dir(mnt, mnt->files);
+
     /* Make a VFS struct */
     vfsh = (vfs_handler_t *)malloc(sizeof(vfs_handler_t));
 
     if(vfsh == NULL) {
+        rd_index_free(mnt);
         free(mnt);
         errno=ENOMEM;
         return -3;
@@ -671,12 +1334,15 @@ int fs_romdisk_unmount(const char * mountpoint) {
         /* Unmount it */
         assert((void *)&n->vfsh->nmmgr == (void *)n->vfsh);
         nmmgr_handler_remove(&n->vfsh->nmmgr);
+        fs_dcache_invalidate(n->vfsh, NULL);
+        rd_zcache_drop(n);
 
         /* If we own the buffer, free it */
         if(n->own_buffer)
             free((void *)n->image);
 
         /* Free the structs */
+        rd_index_free(n);
         free(n->vfsh);
         free(n);
     }
@@ -688,3 +1354,37 @@ int fs_romdisk_unmount(const char * mountpoint) {
     mutex_unlock(&fh_mutex);
     return rv;
 }
+
+/* Total up the size of every mounted image */
+size_t fs_romdisk_mem_usage(size_t *owned) {
+    rd_image_t *n;
+    size_t total = 0, own = 0, sz;
+
+    if(!initted) {
+        if(owned)
+            *owned = 0;
+
+        return 0;
+    }
+
+    mutex_lock(&fh_mutex);
+
+    LIST_FOREACH(n, &romdisks, list_ent) {
+        sz = ntohl_32(&n->hdr->full_size);
+        total += sz;
+
+        if(n->own_buffer)
+            own += sz;
+    }
+
+    mutex_unlock(&fh_mutex);
+
+    if(owned)
+        *owned = own;
+
+    return total;
+}
+
+void fs_romdisk_set_index_size(size_t entries) {
+    index_size = entries;
+}
@@ -79,6 +79,152 @@ static ssize_t fs_socket_write(void *hnd, const void *buffer, size_t cnt) {
     return sock->protocol->sendto(sock, buffer, cnt, 0, NULL, 0);
 }
 
+/* Datagrams up to this size are gathered/scattered on the stack. */
+#define IOV_BOUNCE_SIZE     1024
+
+static size_t iov_total(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    int i;
+
+    for(i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+
+    return total;
+}
+
+static ssize_t fs_socket_readv(void *hnd, const struct iovec *iov,
+                               int iovcnt) {
+    net_socket_t *sock = (net_socket_t *)hnd;
+    uint8_t stackbuf[IOV_BOUNCE_SIZE], *buf;
+    ssize_t rv, total = 0;
+    size_t len, cp;
+    int i, flags = 0;
+
+    if(sock->protocol->type != SOCK_DGRAM) {
+        /* A stream: block for the first buffer only, then take whatever else
+           is already there. */
+        for(i = 0; i < iovcnt; ++i) {
+            if(!iov[i].iov_len)
+                continue;
+
+            rv = sock->protocol->recvfrom(sock, iov[i].iov_base,
+                                          iov[i].iov_len, flags, NULL, NULL);
+
+            if(rv < 0) {
+                if(total && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+
+                return total ? total : -1;
+            }
+
+            total += rv;
+
+            if((size_t)rv < iov[i].iov_len)
+                break;
+
+            flags = MSG_DONTWAIT;
+        }
+
+        return total;
+    }
+
+    /* Each read takes one whole datagram, so it has to be read in one go and
+       then split up. */
+    len = iov_total(iov, iovcnt);
+
+    if(len <= sizeof(stackbuf))
+        buf = stackbuf;
+    else if(!(buf = (uint8_t *)malloc(len))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    rv = sock->protocol->recvfrom(sock, buf, len, 0, NULL, NULL);
+
+    for(i = 0; i < iovcnt && total < rv; ++i) {
+        cp = iov[i].iov_len < (size_t)(rv - total) ?
+             iov[i].iov_len : (size_t)(rv - total);
+        memcpy(iov[i].iov_base, buf + total, cp);
+        total += cp;
+    }
+
+    if(buf != stackbuf)
+        free(buf);
+
+    return rv;
+}
+
+static ssize_t fs_socket_writev(void *hnd, const struct iovec *iov,
+                                int iovcnt) {
+    net_socket_t *sock = (net_socket_t *)hnd;
+    uint8_t stackbuf[IOV_BOUNCE_SIZE], *buf;
+    ssize_t rv, total = 0;
+    size_t len;
+    int i;
+
+    if(sock->protocol->type != SOCK_DGRAM) {
+        for(i = 0; i < iovcnt; ++i) {
+            if(!iov[i].iov_len)
+                continue;
+
+            rv = sock->protocol->sendto(sock, iov[i].iov_base,
+                                        iov[i].iov_len, 0, NULL, 0);
+
+            if(rv < 0)
+                return total ? total : -1;
+
+            total += rv;
+
+            if((size_t)rv < iov[i].iov_len)
+                break;
+        }
+
+        return total;
+    }
+
+    /* The buffers make up a single datagram. */
+    len = iov_total(iov, iovcnt);
+
+    if(len <= sizeof(stackbuf))
+        buf = stackbuf;
+    else if(!(buf = (uint8_t *)malloc(len))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; ++i) {
+        memcpy(buf + total, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+
+    rv = sock->protocol->sendto(sock, buf, len, 0, NULL, 0);
+
+    if(buf != stackbuf)
+        free(buf);
+
+    return rv;
+}
+
+static ssize_t fs_socket_pread(void *hnd, void *buffer, size_t cnt,
+                               off_t offset) {
+    (void)hnd;
+    (void)buffer;
+    (void)cnt;
+    (void)offset;
+    errno = ESPIPE;
+    return -1;
+}
+
+static ssize_t fs_socket_pwrite(void *hnd, const void *buffer, size_t cnt,
+                                off_t offset) {
+    (void)hnd;
+    (void)buffer;
+    (void)cnt;
+    (void)offset;
+    errno = ESPIPE;
+    return -1;
+}
+
 static int fs_socket_fcntl(void *hnd, int cmd, va_list ap) {
     net_socket_t *sock = (net_socket_t *)hnd;
     return sock->protocol->fcntl(sock, cmd, ap);
@@ -137,7 +283,13 @@ static vfs_handler_t vh = {
     NULL,            /* total64 */
     NULL,            /* readlink */
     NULL,            /* rewinddir */
-    fs_socket_fstat  /* fstat */
+    fs_socket_fstat, /* fstat */
+    NULL,            /* aio_submit */
+    NULL,            /* aio_cancel */
+    fs_socket_readv, /* readv */
+    fs_socket_writev, /* writev */
+    fs_socket_pread, /* pread */
+    fs_socket_pwrite /* pwrite */
 };
 
 /* Have we been initialized? */
@@ -0,0 +1,613 @@
+/* KallistiOS ##version##
+
+   fs_stats.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+/*
+
+VFS I/O statistics, and the /proc filesystem that shows them.
+
+The VFS brackets each operation with fs_stats_begin() and fs_stats_record(),
+which adds it to the statistics of the filesystem and, if it has any, of the
+open file. Filesystem statistics are kept on a list keyed by the handler and
+created the first time something is recorded for it; the name is copied then,
+so they can still be shown after the filesystem is unmounted.
+
+The files under /proc are generated in full when they are opened, so reading
+one gives a consistent snapshot no matter how small the reads are.
+
+*/
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <kos/fs.h>
+#include <kos/fs_stats.h>
+#include <kos/mutex.h>
+#include <kos/nmmgr.h>
+
+#include <arch/timer.h>
+
+typedef struct vfs_stats {
+    LIST_ENTRY(vfs_stats) entry;
+    vfs_handler_t *vfs;
+    char name[NAME_MAX];
+    fs_stats_t st;
+} vfs_stats_t;
+
+struct fs_stats_file {
+    LIST_ENTRY(fs_stats_file) entry;
+    char *path;
+    fs_stats_t st;
+};
+
+static LIST_HEAD(vfs_stats_list, vfs_stats) vfs_stats =
+    LIST_HEAD_INITIALIZER(vfs_stats);
+static LIST_HEAD(file_stats_list, fs_stats_file) file_stats =
+    LIST_HEAD_INITIALIZER(file_stats);
+static mutex_t stats_mutex = MUTEX_INITIALIZER;
+static volatile int enabled;
+
+static vfs_handler_t vh;
+
+static const char *op_names[FS_STATS_OPS] = {
+    "open", "read", "write", "seek", "stat"
+};
+
+int fs_stats_enable(int enable) {
+    int old = enabled;
+
+    enabled = !!enable;
+    return old;
+}
+
+uint64_t fs_stats_begin(void) {
+    return enabled ? timer_ns_gettime64() : 0;
+}
+
+static void op_add(fs_stats_op_t *o, int op, uint64_t ns, ssize_t rv) {
+    uint32_t us = (uint32_t)(ns / 1000);
+    int b = 0;
+
+    while(us && b < FS_STATS_BUCKETS - 1) {
+        us >>= 1;
+        ++b;
+    }
+
+    ++o->count;
+    ++o->hist[b];
+    o->total_ns += ns;
+
+    if(ns > o->max_ns)
+        o->max_ns = ns;
+
+    if(rv < 0)
+        ++o->errors;
+    else if(op == FS_STATS_READ || op == FS_STATS_WRITE)
+        o->bytes += rv;
+}
+
+static void stats_add(fs_stats_t *to, const fs_stats_t *from) {
+    int i, j;
+
+    for(i = 0; i < FS_STATS_OPS; ++i) {
+        to->ops[i].count += from->ops[i].count;
+        to->ops[i].errors += from->ops[i].errors;
+        to->ops[i].bytes += from->ops[i].bytes;
+        to->ops[i].total_ns += from->ops[i].total_ns;
+
+        if(from->ops[i].max_ns > to->ops[i].max_ns)
+            to->ops[i].max_ns = from->ops[i].max_ns;
+
+        for(j = 0; j < FS_STATS_BUCKETS; ++j)
+            to->ops[i].hist[j] += from->ops[i].hist[j];
+    }
+}
+
+/* Find the statistics for a filesystem. Must be called with the mutex held. */
+static vfs_stats_t *vfs_stats_find(vfs_handler_t *vfs, int create) {
+    vfs_stats_t *v;
+
+    LIST_FOREACH(v, &vfs_stats, entry) {
+        if(v->vfs == vfs)
+            return v;
+    }
+
+    if(!create || !(v = (vfs_stats_t *)calloc(1, sizeof(vfs_stats_t))))
+        return NULL;
+
+    v->vfs = vfs;
+    strncpy(v->name, vfs->nmmgr.pathname, NAME_MAX - 1);
+    LIST_INSERT_HEAD(&vfs_stats, v, entry);
+
+    return v;
+}
+
+void fs_stats_record(vfs_handler_t *vfs, struct fs_stats_file *f, int op,
+                     uint64_t start, ssize_t rv) {
+    vfs_stats_t *v;
+    uint64_t ns;
+
+    /* Reading our own files shouldn't show up in what they say. */
+    if(!start || vfs == &vh)
+        return;
+
+    ns = timer_ns_gettime64() - start;
+
+    mutex_lock(&stats_mutex);
+
+    if((v = vfs_stats_find(vfs, 1)))
+        op_add(&v->st.ops[op], op, ns, rv);
+
+    if(f)
+        op_add(&f->st.ops[op], op, ns, rv);
+
+    mutex_unlock(&stats_mutex);
+}
+
+struct fs_stats_file *fs_stats_file_open(vfs_handler_t *vfs,
+                                         const char *path) {
+    struct fs_stats_file *f;
+
+    if(!enabled || vfs == &vh)
+        return NULL;
+
+    if(!(f = (struct fs_stats_file *)calloc(1, sizeof(*f))))
+        return NULL;
+
+    if(!(f->path = strdup(path))) {
+        free(f);
+        return NULL;
+    }
+
+    mutex_lock(&stats_mutex);
+    LIST_INSERT_HEAD(&file_stats, f, entry);
+    mutex_unlock(&stats_mutex);
+
+    return f;
+}
+
+void fs_stats_file_close(struct fs_stats_file *f) {
+    mutex_lock(&stats_mutex);
+    LIST_REMOVE(f, entry);
+    mutex_unlock(&stats_mutex);
+
+    free(f->path);
+    free(f);
+}
+
+void fs_stats_file_get(struct fs_stats_file *f, fs_stats_t *st) {
+    mutex_lock(&stats_mutex);
+    *st = f->st;
+    mutex_unlock(&stats_mutex);
+}
+
+int fs_stats_get(const char *path, fs_stats_t *st) {
+    nmmgr_handler_t *nm = NULL;
+    vfs_stats_t *v;
+
+    if(path) {
+        nm = nmmgr_lookup(path);
+
+        if(!nm || nm->type != NMMGR_TYPE_VFS) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    memset(st, 0, sizeof(fs_stats_t));
+
+    mutex_lock(&stats_mutex);
+
+    LIST_FOREACH(v, &vfs_stats, entry) {
+        if(!nm || v->vfs == (vfs_handler_t *)nm)
+            stats_add(st, &v->st);
+    }
+
+    mutex_unlock(&stats_mutex);
+
+    return 0;
+}
+
+void fs_stats_reset(void) {
+    struct fs_stats_file *f;
+    vfs_stats_t *v;
+
+    mutex_lock(&stats_mutex);
+
+    LIST_FOREACH(v, &vfs_stats, entry)
+        memset(&v->st, 0, sizeof(fs_stats_t));
+
+    LIST_FOREACH(f, &file_stats, entry)
+        memset(&f->st, 0, sizeof(fs_stats_t));
+
+    mutex_unlock(&stats_mutex);
+}
+
+/********************************************************************/
+/* /proc */
+
+#define PROC_DIR    0
+#define PROC_VFS    1
+#define PROC_FILES  2
+#define PROC_RESET  3
+
+static const char *proc_names[] = { NULL, "vfs", "files", "reset" };
+
+#define PROC_COUNT  (sizeof(proc_names) / sizeof(proc_names[0]))
+
+typedef struct proc_fh {
+    int type;
+    char *data;                 /* Generated contents */
+    size_t size, alloc;
+    size_t pos;                 /* File position, or readdir index */
+    dirent_t dirent;
+} proc_fh_t;
+
+static void proc_printf(proc_fh_t *fh, const char *fmt, ...) {
+    va_list ap;
+    char *n;
+    int len;
+
+    for(;;) {
+        va_start(ap, fmt);
+        len = vsnprintf(fh->data + fh->size, fh->alloc - fh->size, fmt, ap);
+        va_end(ap);
+
+        if(len < 0)
+            return;
+
+        if(fh->size + len < fh->alloc) {
+            fh->size += len;
+            return;
+        }
+
+        /* Out of room; whatever doesn't fit is dropped if we can't grow. */
+        if(!(n = (char *)realloc(fh->data, fh->alloc * 2)))
+            return;
+
+        fh->data = n;
+        fh->alloc *= 2;
+    }
+}
+
+static void proc_stats(proc_fh_t *fh, const fs_stats_t *st) {
+    const fs_stats_op_t *o;
+    int i, j;
+
+    proc_printf(fh, "  %-5s %8s %7s %12s %9s %9s\n", "op", "count",
+                "errors", "bytes", "avg us", "max us");
+
+    for(i = 0; i < FS_STATS_OPS; ++i) {
+        o = &st->ops[i];
+
+        if(!o->count)
+            continue;
+
+        proc_printf(fh, "  %-5s %8lu %7lu %12llu %9lu %9lu\n", op_names[i],
+                    (unsigned long)o->count, (unsigned long)o->errors,
+                    (unsigned long long)o->bytes,
+                    (unsigned long)(o->total_ns / o->count / 1000),
+                    (unsigned long)(o->max_ns / 1000));
+    }
+
+    /* Histograms, as "upper bound in us: count" for each bucket used. */
+    for(i = 0; i < FS_STATS_OPS; ++i) {
+        o = &st->ops[i];
+
+        if(!o->count)
+            continue;
+
+        proc_printf(fh, "  %-5s us:", op_names[i]);
+
+        for(j = 0; j < FS_STATS_BUCKETS; ++j) {
+            if(!o->hist[j])
+                continue;
+
+            if(j == FS_STATS_BUCKETS - 1)
+                proc_printf(fh, " >=%lu:%lu", 1UL << (j - 1),
+                            (unsigned long)o->hist[j]);
+            else
+                proc_printf(fh, " <%lu:%lu", 1UL << j,
+                            (unsigned long)o->hist[j]);
+        }
+
+        proc_printf(fh, "\n");
+    }
+}
+
+static void proc_generate(proc_fh_t *fh) {
+    struct fs_stats_file *f;
+    vfs_stats_t *v;
+
+    if(!(fh->data = (char *)malloc(1024)))
+        return;
+
+    fh->alloc = 1024;
+
+    mutex_lock(&stats_mutex);
+
+    if(!enabled)
+        proc_printf(fh, "# statistics are off, see fs_stats_enable()\n");
+
+    if(fh->type == PROC_VFS) {
+        LIST_FOREACH(v, &vfs_stats, entry) {
+            proc_printf(fh, "%s\n", v->name);
+            proc_stats(fh, &v->st);
+        }
+    }
+    else {
+        LIST_FOREACH(f, &file_stats, entry) {
+            proc_printf(fh, "%s\n", f->path);
+            proc_stats(fh, &f->st);
+        }
+    }
+
+    mutex_unlock(&stats_mutex);
+}
+
+static int proc_lookup(const char *fn) {
+    size_t i;
+
+    if(*fn == '/')
+        ++fn;
+
+    if(!*fn)
+        return PROC_DIR;
+
+    for(i = 1; i < PROC_COUNT; ++i) {
+        if(!strcmp(fn, proc_names[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+static void *proc_open(vfs_handler_t *vfs, const char *fn, int mode) {
+    proc_fh_t *fh;
+    int type;
+
+    (void)vfs;
+
+    if((type = proc_lookup(fn)) < 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    if((type == PROC_DIR) != !!(mode & O_DIR)) {
+        errno = type == PROC_DIR ? EISDIR : ENOTDIR;
+        return NULL;
+    }
+
+    /* Only the reset file can be written. */
+    if((mode & O_MODE_MASK) != O_RDONLY && type != PROC_RESET) {
+        errno = EACCES;
+        return NULL;
+    }
+
+    if(!(fh = (proc_fh_t *)calloc(1, sizeof(proc_fh_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    fh->type = type;
+
+    if(type == PROC_VFS || type == PROC_FILES)
+        proc_generate(fh);
+
+    return fh;
+}
+
+static int proc_close(void *h) {
+    proc_fh_t *fh = (proc_fh_t *)h;
+
+    free(fh->data);
+    free(fh);
+
+    return 0;
+}
+
+static ssize_t proc_read(void *h, void *buf, size_t cnt) {
+    proc_fh_t *fh = (proc_fh_t *)h;
+
+    if(fh->type == PROC_DIR) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if(fh->pos >= fh->size)
+        return 0;
+
+    if(cnt > fh->size - fh->pos)
+        cnt = fh->size - fh->pos;
+
+    memcpy(buf, fh->data + fh->pos, cnt);
+    fh->pos += cnt;
+
+    return cnt;
+}
+
+static ssize_t proc_write(void *h, const void *buf, size_t cnt) {
+    proc_fh_t *fh = (proc_fh_t *)h;
+
+    (void)buf;
+
+    if(fh->type != PROC_RESET) {
+        errno = EBADF;
+        return -1;
+    }
+
+    fs_stats_reset();
+
+    return cnt;
+}
+
+static off_t proc_seek(void *h, off_t offset, int whence) {
+    proc_fh_t *fh = (proc_fh_t *)h;
+
+    switch(whence) {
+        case SEEK_CUR:
+            offset += fh->pos;
+            break;
+
+        case SEEK_END:
+            offset += fh->size;
+            break;
+
+        case SEEK_SET:
+            break;
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fh->pos = offset;
+    return offset;
+}
+
+static off_t proc_tell(void *h) {
+    return ((proc_fh_t *)h)->pos;
+}
+
+static size_t proc_total(void *h) {
+    return ((proc_fh_t *)h)->size;
+}
+
+static dirent_t *proc_readdir(void *h) {
+    proc_fh_t *fh = (proc_fh_t *)h;
+
+    if(fh->type != PROC_DIR) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    if(++fh->pos >= PROC_COUNT)
+        return NULL;
+
+    strcpy(fh->dirent.name, proc_names[fh->pos]);
+    fh->dirent.size = 0;
+    fh->dirent.time = 0;
+    fh->dirent.attr = 0;
+
+    return &fh->dirent;
+}
+
+static int proc_rewinddir(void *h) {
+    proc_fh_t *fh = (proc_fh_t *)h;
+
+    if(fh->type != PROC_DIR) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    fh->pos = 0;
+    return 0;
+}
+
+static void proc_fill_stat(int type, size_t size, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = (dev_t)('p' | ('r' << 8) | ('o' << 16) | ('c' << 24));
+    st->st_ino = type;
+    st->st_nlink = 1;
+    st->st_size = size;
+
+    if(type == PROC_DIR)
+        st->st_mode = S_IFDIR | S_IRUSR | S_IXUSR;
+    else if(type == PROC_RESET)
+        st->st_mode = S_IFREG | S_IWUSR;
+    else
+        st->st_mode = S_IFREG | S_IRUSR;
+}
+
+static int proc_stat(vfs_handler_t *vfs, const char *fn, struct stat *st,
+                     int flag) {
+    int type;
+
+    (void)vfs;
+    (void)flag;
+
+    if((type = proc_lookup(fn)) < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    proc_fill_stat(type, 0, st);
+    return 0;
+}
+
+static int proc_fstat(void *h, struct stat *st) {
+    proc_fh_t *fh = (proc_fh_t *)h;
+
+    proc_fill_stat(fh->type, fh->size, st);
+    return 0;
+}
+
+static vfs_handler_t vh = {
+    /* Name handler */
+    {
+        "/proc",        /* name */
+        0,              /* tbfi */
+        0x00010000,     /* Version 1.0 */
+        0,              /* flags */
+        NMMGR_TYPE_VFS, /* VFS handler */
+        NMMGR_LIST_INIT
+    },
+    0, NULL,            /* In-kernel, privdata */
+
+    proc_open,
+    proc_close,
+    proc_read,
+    proc_write,
+    proc_seek,
+    proc_tell,
+    proc_total,
+    proc_readdir,
+    NULL,               /* ioctl */
+    NULL,               /* rename/move */
+    NULL,               /* unlink */
+    NULL,               /* mmap */
+    NULL,               /* complete */
+    proc_stat,
+    NULL,               /* mkdir */
+    NULL,               /* rmdir */
+    NULL,               /* fcntl */
+    NULL,               /* poll */
+    NULL,               /* link */
+    NULL,               /* symlink */
+    NULL,               /* seek64 */
+    NULL,               /* tell64 */
+    NULL,               /* total64 */
+    NULL,               /* readlink */
+    proc_rewinddir,
+    proc_fstat
+};
+
+int fs_stats_init(void) {
+    return nmmgr_handler_add(&vh.nmmgr);
+}
+
+int fs_stats_shutdown(void) {
+    vfs_stats_t *v;
+
+    enabled = 0;
+
+    /* The statistics of open files are freed when they are closed. */
+    while((v = LIST_FIRST(&vfs_stats))) {
+        LIST_REMOVE(v, entry);
+        free(v);
+    }
+
+    return nmmgr_handler_remove(&vh.nmmgr);
+}
@@ -20,10 +20,162 @@ XXX This probably belongs in something like libc...
 #include <string.h>
 #include <errno.h>
 
+/* Largest bounce buffer used when copying between files that can't be
+   mapped into memory. */
+#define COPY_BUFSIZE    65536
+
+/* Write all of a buffer, coping with short writes (from sockets, mostly). */
+static ssize_t copy_out(file_t fd, off_t *off, const uint8 *buf, size_t cnt) {
+    size_t done = 0;
+    ssize_t w;
+
+    while(done < cnt) {
+        if(off)
+            w = fs_pwrite(fd, buf + done, cnt - done, *off + done);
+        else
+            w = fs_write(fd, buf + done, cnt - done);
+
+        if(w <= 0) {
+            if(!done)
+                return w;
+
+            break;
+        }
+
+        done += w;
+    }
+
+    return done;
+}
+
+/* Copy straight out of a file that the filesystem has mapped into memory. */
+static ssize_t copy_mapped(file_t fd_in, const uint8 *map, off_t *off_in,
+                           file_t fd_out, off_t *off_out, size_t len) {
+    off_t pos, size;
+    ssize_t rv;
+
+    if((size = fs_total(fd_in)) < 0)
+        return -1;
+
+    if(off_in)
+        pos = *off_in;
+    else if((pos = fs_tell(fd_in)) < 0)
+        return -1;
+
+    if(pos >= size)
+        return 0;
+
+    if(len > (size_t)(size - pos))
+        len = size - pos;
+
+    if((rv = copy_out(fd_out, off_out, map + pos, len)) <= 0)
+        return rv;
+
+    if(off_in)
+        *off_in += rv;
+    else
+        fs_seek(fd_in, pos + rv, SEEK_SET);
+
+    if(off_out)
+        *off_out += rv;
+
+    return rv;
+}
+
+ssize_t fs_copy_range(file_t fd_in, off_t *off_in, file_t fd_out,
+                      off_t *off_out, size_t len) {
+    size_t bufsize;
+    ssize_t r, w, total = 0;
+    uint8 *buf, *map;
+    int err = errno;
+
+    if((off_in && *off_in < 0) || (off_out && *off_out < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!fs_get_handler(fd_in) || !fs_get_handler(fd_out)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(!len)
+        return 0;
+
+    /* Filesystems that keep the whole file in memory (romdisk, ramdisk) can
+       hand it to us directly, so the destination (a socket's send buffer,
+       for instance) gets filled straight from there. */
+    if((map = (uint8 *)fs_mmap(fd_in)))
+        return copy_mapped(fd_in, map, off_in, fd_out, off_out, len);
+
+    errno = err;
+
+    /* Otherwise go through a bounce buffer, as big as we can get. */
+    bufsize = len < COPY_BUFSIZE ? len : COPY_BUFSIZE;
+
+    while(!(buf = (uint8 *)malloc(bufsize))) {
+        if(bufsize <= 512) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        bufsize >>= 1;
+    }
+
+    while((size_t)total < len) {
+        r = len - total < bufsize ? len - total : bufsize;
+
+        if(off_in)
+            r = fs_pread(fd_in, buf, r, *off_in);
+        else
+            r = fs_read(fd_in, buf, r);
+
+        if(r <= 0) {
+            if(r < 0 && !total)
+                total = -1;
+
+            break;
+        }
+
+        if(off_in)
+            *off_in += r;
+
+        w = copy_out(fd_out, off_out, buf, r);
+
+        if(w > 0) {
+            total += w;
+
+            if(off_out)
+                *off_out += w;
+        }
+
+        if(w < r) {
+            /* Put back whatever we read but didn't manage to write. */
+            if(off_in)
+                *off_in -= r - (w > 0 ? w : 0);
+            else
+                fs_seek(fd_in, -(off_t)(r - (w > 0 ? w : 0)), SEEK_CUR);
+
+            if(w < 0 && !total)
+                total = -1;
+
+            break;
+        }
+    }
+
+    free(buf);
+
+    return total;
+}
+
+ssize_t fs_sendfile(file_t fd_out, file_t fd_in, off_t *offset,
+                    size_t count) {
+    return fs_copy_range(fd_in, offset, fd_out, NULL, count);
+}
+
 /* Copies a file from 'src' to 'dst'. The amount of the file
    actually copied without error is returned. */
 ssize_t fs_copy(const char * src, const char * dst) {
-    char    *buff;
     ssize_t left, total, r;
     file_t  fs, fd;
 
@@ -45,24 +197,17 @@ ssize_t fs_copy(const char * src, const char * dst) {
     left = fs_total(fs);
     total = 0;
 
-    /* Allocate a buffer */
-    buff = malloc(65536);
-
     /* Do the copy */
     while(left > 0) {
-        r = fs_read(fs, buff, 65536);
+        r = fs_copy_range(fs, NULL, fd, NULL, left);
 
         if(r <= 0)
             break;
 
-        fs_write(fd, buff, r);
         left -= r;
         total += r;
     }
 
-    /* Free the buffer */
-    free(buff);
-
     /* Close both files */
     fs_close(fs);
     fs_close(fd);
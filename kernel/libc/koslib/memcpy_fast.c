@@ -0,0 +1,184 @@
+/* KallistiOS ##version##
+
+   memcpy_fast.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <kos/string.h>
+#include <arch/cache.h>
+#include <dc/sq.h>
+
+/*
+
+Cache-aware block copies for the SH4.
+
+The bulk of the copy is done a cache line (32 bytes) at a time. The source
+line after the one being copied is prefetched with pref, so that its fill
+overlaps the copy of the current line. When the destination is in the cached
+P1 area, the first store to each destination line is done with movca.l, which
+allocates the line without reading it from memory first; since the rest of
+the line is written right after, the fill would be wasted work.
+
+Destinations in the uncached P2 area (registers, PVR RAM mapped through P2,
+etc.) can't use movca.l; large copies there go through the store queues
+instead, which burst a full line at a time.
+
+*/
+
+/* Below this many bytes, the setup work isn't worth it. */
+#define SMALL_COPY      64
+
+/* Copies to uncached memory of at least this size use the store queues. */
+#define SQ_THRESHOLD    1024
+
+#define LINE            CPU_CACHE_BLOCK_SIZE
+
+static inline int in_p1(uintptr_t addr) {
+    return (addr & 0xe0000000) == 0x80000000;
+}
+
+static inline int in_p2(uintptr_t addr) {
+    return (addr & 0xe0000000) == 0xa0000000;
+}
+
+/* Copy whole lines with a 4-byte aligned source. */
+static void copy_lines_aligned(uint32_t *d, const uint32_t *s, size_t lines,
+                               int alloc) {
+    while(lines--) {
+        if(lines)
+            dcache_pref_block(s + 8);
+
+        if(alloc)
+            dcache_alloc_block(d, s[0]);
+        else
+            d[0] = s[0];
+
+        d[1] = s[1];
+        d[2] = s[2];
+        d[3] = s[3];
+        d[4] = s[4];
+        d[5] = s[5];
+        d[6] = s[6];
+        d[7] = s[7];
+        d += 8;
+        s += 8;
+    }
+}
+
+/* Copy whole lines with a 2-byte aligned source, merging halfwords. */
+static void copy_lines_half(uint32_t *d, const uint16_t *s, size_t lines,
+                            int alloc) {
+    uint32_t w[8];
+    int i;
+
+    while(lines--) {
+        if(lines)
+            dcache_pref_block(s + 16);
+
+        for(i = 0; i < 8; ++i)
+            w[i] = s[i * 2] | ((uint32_t)s[i * 2 + 1] << 16);
+
+        if(alloc)
+            dcache_alloc_block(d, w[0]);
+        else
+            d[0] = w[0];
+
+        for(i = 1; i < 8; ++i)
+            d[i] = w[i];
+
+        d += 8;
+        s += 16;
+    }
+}
+
+/* Copy whole lines with a byte aligned source. */
+static void copy_lines_byte(uint32_t *d, const uint8_t *s, size_t lines,
+                            int alloc) {
+    uint32_t w[8];
+    int i;
+
+    while(lines--) {
+        if(lines)
+            dcache_pref_block(s + LINE);
+
+        for(i = 0; i < 8; ++i)
+            w[i] = s[i * 4] | ((uint32_t)s[i * 4 + 1] << 8) |
+                   ((uint32_t)s[i * 4 + 2] << 16) |
+                   ((uint32_t)s[i * 4 + 3] << 24);
+
+        if(alloc)
+            dcache_alloc_block(d, w[0]);
+        else
+            d[0] = w[0];
+
+        for(i = 1; i < 8; ++i)
+            d[i] = w[i];
+
+        d += 8;
+        s += LINE;
+    }
+}
+
+void * memcpy_fast(void *dest, const void *src, size_t count) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    size_t head, lines;
+    int alloc;
+
+    if(count < SMALL_COPY)
+        return memcpy(dest, src, count);
+
+    /* Bring the destination up to a cache line boundary. */
+    head = (-(uintptr_t)d) & (LINE - 1);
+
+    if(head) {
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        count -= head;
+    }
+
+    lines = count / LINE;
+
+    if(in_p2((uintptr_t)d) && !((uintptr_t)s & 3) &&
+       count >= SQ_THRESHOLD) {
+        sq_cpy(d, s, lines * LINE);
+    }
+    else {
+        alloc = in_p1((uintptr_t)d);
+
+        if(!((uintptr_t)s & 3))
+            copy_lines_aligned((uint32_t *)d, (const uint32_t *)s, lines,
+                               alloc);
+        else if(!((uintptr_t)s & 1))
+            copy_lines_half((uint32_t *)d, (const uint16_t *)s, lines, alloc);
+        else
+            copy_lines_byte((uint32_t *)d, s, lines, alloc);
+    }
+
+    d += lines * LINE;
+    s += lines * LINE;
+    count -= lines * LINE;
+
+    if(count)
+        memcpy(d, s, count);
+
+    return dest;
+}
+
+void * memmove_fast(void *dest, const void *src, size_t count) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+
+    /* A forward copy is safe if the destination doesn't start inside the
+       source. When the destination is below the source, it also has to be at
+       least a full line below it, or movca.l could allocate a destination
+       line that still holds unread source bytes. */
+    if(d >= s + count || s >= d + count || s >= d + LINE)
+        return memcpy_fast(dest, src, count);
+
+    return memmove(dest, src, count);
+}
@@ -0,0 +1,12 @@
+/* KallistiOS ##version##
+
+   readv.c
+   Copyright (C) 2024 KallistiOS Contributors
+*/
+
+#include <sys/uio.h>
+#include <kos/fs.h>
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    return fs_readv(fd, iov, iovcnt);
+}
@@ -0,0 +1,12 @@
+/* KallistiOS ##version##
+
+   sendfile.c
+   Copyright (C) 2024 KallistiOS Contributors
+*/
+
+#include <sys/sendfile.h>
+#include <kos/fs.h>
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    return fs_sendfile(out_fd, in_fd, offset, count);
+}
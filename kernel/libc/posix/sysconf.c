@@ -21,7 +21,7 @@ long sysconf(int name) {
             return HZ;
         
         case _SC_OPEN_MAX:
-            return FD_SETSIZE;
+            return fs_fdtbl_get_limit();
 
         case _SC_PAGESIZE:
             return PAGESIZE;
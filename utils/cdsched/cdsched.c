@@ -0,0 +1,633 @@
+/* KallistiOS ##version##
+
+   cdsched.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+   Simulate the GD-ROM read scheduler. The code that picks the next read and
+   merges requests is a copy of the one in hardware/cdrom.c; around it, a few
+   threads loading files and a stream playing from the disc are simulated,
+   along with a drive that charges for each command, each sector and each
+   seek (more for seeking further). The same workload is run with plain
+   first come first served reads, with the elevator and merging alone, and
+   with all of the scheduler: priorities, deadlines, and holding the drive
+   for a moment after each read.
+
+   Threads don't ask for their next read the instant the last one is done,
+   since they have to be woken up first; the simulation lets the stream take
+   STREAM_WAKE us to do it, and the loaders LOADER_THINK us.
+
+*/
+
+/****************************** LINUX SPECIFIC CODE ***********************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/queue.h>
+
+typedef uint8_t uint8;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+
+/* Thread prims */
+typedef int semaphore_t;
+
+/* cdrom.h defines */
+#define CDROM_PRIO_LOW      0
+#define CDROM_PRIO_NORMAL   1
+#define CDROM_PRIO_HIGH     2
+#define CDROM_SCHED_MAX_WAIT    500
+
+typedef struct cdrom_sched_stats {
+    uint32  requests;
+    uint32  commands;
+    uint32  merged;
+    uint32  sectors;
+    uint32  seeks;
+    uint32  late;
+    uint64  total_us;
+    uint64  max_us;
+} cdrom_sched_stats_t;
+
+/****************************** END LINUX SPECIFIC CODE ***********************************/
+
+/* Cut here to insert into KallistiOS cdrom.c */
+
+/* Most sectors read in one merged command */
+#define SCHED_MERGE_MAX 64
+
+/* How long to hold the drive after a read, in milliseconds */
+#define SCHED_ANTICIPATE    2
+
+typedef struct cdrom_req {
+    TAILQ_ENTRY(cdrom_req) ent;
+    uint32      sector;     /* First sector */
+    uint32      cnt;        /* Number of sectors */
+    void        *buffer;
+    int         mode;       /* CDROM_READ_DMA or CDROM_READ_PIO */
+    int         prio;       /* CDROM_PRIO_* */
+    int         has_deadline;   /* Set if the caller gave a deadline */
+    uint64      submitted;  /* When it was queued, in us */
+    uint64      deadline;   /* When it must be started by, in us */
+    int         rv;
+    semaphore_t done;
+} cdrom_req_t;
+
+TAILQ_HEAD(cdrom_req_list, cdrom_req);
+
+static struct cdrom_req_list sched_queue = TAILQ_HEAD_INITIALIZER(sched_queue);
+static uint32 sched_head;   /* Sector after the last one read */
+static int sched_last_prio; /* Priority of the last read */
+static uint64 sched_last_done;  /* When it finished, in us */
+static cdrom_sched_stats_t sched_stats;
+
+/* A request's priority, counting the time it has waited */
+static int sched_prio(const cdrom_req_t *r, uint64 now) {
+    if(r->prio == CDROM_PRIO_LOW &&
+       now - r->submitted >= CDROM_SCHED_MAX_WAIT * 1000ULL)
+        return CDROM_PRIO_NORMAL;
+
+    return r->prio;
+}
+
+/* Whether to keep the drive where it is for now, in case the last read's
+   thread goes on with the sectors after it. Must be called with the mutex
+   held. */
+static int sched_anticipate(uint64 now) {
+    cdrom_req_t *r;
+
+    if(now >= sched_last_done + SCHED_ANTICIPATE * 1000)
+        return 0;
+
+    TAILQ_FOREACH(r, &sched_queue, ent) {
+        if(r->sector == sched_head || sched_prio(r, now) > sched_last_prio ||
+           (r->has_deadline && r->deadline <= now))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Pick the next request to read, and move it and the requests that can be
+   read with it from the queue to run. Returns the number of sectors to read,
+   starting at the first request's sector. Must be called with the mutex
+   held, and with something in the queue. */
+static uint32 sched_take(struct cdrom_req_list *run, uint64 now) {
+    cdrom_req_t *r, *next, *pick = NULL, *wrap = NULL;
+    uint32 start, end, rend;
+    int top = CDROM_PRIO_LOW, prio, found;
+
+    /* Anything late goes first */
+    TAILQ_FOREACH(r, &sched_queue, ent) {
+        if(r->has_deadline && r->deadline <= now &&
+           (!pick || r->deadline < pick->deadline))
+            pick = r;
+
+        if((prio = sched_prio(r, now)) > top)
+            top = prio;
+    }
+
+    /* If nothing is, go up the disc */
+    if(!pick) {
+        TAILQ_FOREACH(r, &sched_queue, ent) {
+            if(sched_prio(r, now) != top)
+                continue;
+
+            if(r->sector >= sched_head && (!pick || r->sector < pick->sector))
+                pick = r;
+
+            if(!wrap || r->sector < wrap->sector)
+                wrap = r;
+        }
+
+        if(!pick)
+            pick = wrap;
+    }
+
+    TAILQ_REMOVE(&sched_queue, pick, ent);
+    TAILQ_INSERT_TAIL(run, pick, ent);
+    sched_last_prio = sched_prio(pick, now);
+    start = pick->sector;
+    end = start + pick->cnt;
+
+    /* Bring along whatever overlaps it or carries on from it. Each one that
+       joins can let others in, so go round until nothing does. */
+    do {
+        found = 0;
+
+        for(r = TAILQ_FIRST(&sched_queue); r; r = next) {
+            next = TAILQ_NEXT(r, ent);
+            rend = r->sector + r->cnt;
+
+            if(r->sector < start || r->sector > end)
+                continue;
+
+            if(rend > end && rend - start > SCHED_MERGE_MAX)
+                continue;
+
+            TAILQ_REMOVE(&sched_queue, r, ent);
+            TAILQ_INSERT_TAIL(run, r, ent);
+            found = 1;
+
+            if(rend > end)
+                end = rend;
+        }
+    } while(found);
+
+    return end - start;
+}
+
+/* End of the part from cdrom.c */
+
+/********************************************************************************/
+/* The drive */
+
+static uint32 disc_sectors = 330000;
+static uint32 cost_cmd = 500, cost_sector = 1100;
+static uint32 cost_seek_min = 60000, cost_seek_max = 200000;
+
+/* How long a read takes, coming from the sector after the last one read */
+static uint64 drive_cost(uint32 head, uint32 sector, uint32 cnt) {
+    uint64 us = cost_cmd + (uint64)cnt * cost_sector;
+    uint32 dist;
+
+    if(sector != head) {
+        dist = sector > head ? sector - head : head - sector;
+        us += cost_seek_min + (uint64)(cost_seek_max - cost_seek_min) * dist /
+              disc_sectors;
+    }
+
+    return us;
+}
+
+/********************************************************************************/
+/* The workload
+
+   Loaders each read a file at a time, 16 sectors per read as fs_iso9660
+   does with readahead, with a little work in between. The files are either
+   anywhere on the disc, or a level's worth of small files packed together
+   that the loaders take from a shared list in order, as a loader pool
+   would with a disc laid out by genromfs -o.
+   The stream reads a file of its own into a ring of buffers, the way
+   cdrom_stream_open() does, for a consumer that takes one buffer every
+   stream_period us. */
+
+#define POLICY_FIFO     0   /* In the order asked, no merging */
+#define POLICY_ELEVATOR 1   /* C-LOOK and merging, no priorities */
+#define POLICY_SCHED    2   /* Everything */
+
+#define WORK_RANDOM     0   /* Files anywhere on the disc */
+#define WORK_LEVEL      1   /* Small files packed together */
+
+#define LOADER_READ     16
+#define LOADER_THINK    5000
+#define STREAM_SECTORS  32
+
+/* Time from a read finishing to its thread asking for the next one */
+#define STREAM_WAKE     300
+
+#define LEVEL_SECTORS   20000
+
+static int nloaders = 3;
+static int workload;
+static int stream_bufs = 4;
+static uint64 stream_period = 400000;
+static uint64 sim_us = 60000000;
+
+typedef struct {
+    cdrom_req_t req;
+    int     busy;           /* Has a request in the queue or the drive */
+    uint64  ready;          /* When it will ask for the next read */
+    uint32  pos, left;      /* Rest of the file being loaded */
+    uint64  bytes;          /* Loaded so far */
+    uint64  wait_us, max_us;
+    uint32  reads;
+} loader_t;
+
+static loader_t *loaders;
+
+static struct {
+    cdrom_req_t req;
+    int     busy;
+    uint32  pos;
+    int     full;           /* Buffers filled, not yet consumed */
+    uint64  next_take;      /* When the consumer wants the next one */
+    uint64  ready;          /* When it will ask for the next buffer */
+    int     starving;       /* Set while the consumer waits */
+    uint64  starve_start;
+    uint32  underruns;
+    uint64  underrun_us, max_underrun_us;
+    uint32  urgent;
+} stream;
+
+/* The request currently in the drive, if any */
+static struct cdrom_req_list in_drive;
+static uint64 drive_done;
+
+/* Where the next file of the level is, and where the level ends */
+static uint32 level_pos, level_end;
+
+static uint32 rnd(uint32 n) {
+    return (uint32)(((uint64)rand() << 16 ^ rand()) % n);
+}
+
+static void submit(cdrom_req_t *r, uint32 sector, uint32 cnt, int prio,
+                   int deadline, uint64 now, int policy) {
+    r->sector = sector;
+    r->cnt = cnt;
+    r->submitted = now;
+
+    /* Everything at the top priority leaves just the elevator */
+    if(policy == POLICY_SCHED) {
+        r->prio = prio;
+        r->has_deadline = deadline > 0;
+        r->deadline = deadline > 0 ? now + (uint64)deadline * 1000 : 0;
+    }
+    else {
+        r->prio = CDROM_PRIO_HIGH;
+        r->has_deadline = 0;
+    }
+
+    TAILQ_INSERT_TAIL(&sched_queue, r, ent);
+    sched_stats.requests++;
+}
+
+/* Ask for the stream's next buffer, at the priority stream_read() would */
+static void stream_submit(uint64 now, int policy) {
+    int prio = CDROM_PRIO_NORMAL, deadline = 0;
+
+    if(!stream.full) {
+        prio = CDROM_PRIO_HIGH;
+        deadline = 1;
+        stream.urgent++;
+    }
+    else if(stream.full < stream_bufs / 2) {
+        prio = CDROM_PRIO_HIGH;
+    }
+
+    /* The stream's file is near the end of the disc, and loops */
+    if(stream.pos + STREAM_SECTORS > disc_sectors)
+        stream.pos = disc_sectors * 3 / 4;
+
+    submit(&stream.req, stream.pos, STREAM_SECTORS, prio, deadline, now,
+           policy);
+    stream.pos += STREAM_SECTORS;
+    stream.busy = 1;
+}
+
+/* Start the next read, if the drive is free */
+static void start_read(uint64 now, int policy) {
+    cdrom_req_t *r;
+    uint32 cnt;
+
+    if(!TAILQ_EMPTY(&in_drive) || TAILQ_EMPTY(&sched_queue))
+        return;
+
+    if(policy == POLICY_SCHED && sched_anticipate(now))
+        return;
+
+    if(policy == POLICY_FIFO) {
+        r = TAILQ_FIRST(&sched_queue);
+        TAILQ_REMOVE(&sched_queue, r, ent);
+        TAILQ_INSERT_TAIL(&in_drive, r, ent);
+        cnt = r->cnt;
+    }
+    else {
+        cnt = sched_take(&in_drive, now);
+    }
+
+    r = TAILQ_FIRST(&in_drive);
+    sched_stats.commands++;
+    sched_stats.sectors += cnt;
+
+    if(r->sector != sched_head)
+        sched_stats.seeks++;
+
+    drive_done = now + drive_cost(sched_head, r->sector, cnt);
+    sched_head = r->sector + cnt;
+}
+
+/* The drive has finished: hand the data out */
+static void finish_read(uint64 now) {
+    cdrom_req_t *r, *first = TAILQ_FIRST(&in_drive);
+    uint64 wait;
+    int i;
+
+    sched_last_done = now;
+
+    while((r = TAILQ_FIRST(&in_drive))) {
+        TAILQ_REMOVE(&in_drive, r, ent);
+        wait = now - r->submitted;
+
+        if(r != first)
+            sched_stats.merged++;
+
+        if(r->has_deadline && now > r->deadline)
+            sched_stats.late++;
+
+        sched_stats.total_us += wait;
+
+        if(wait > sched_stats.max_us)
+            sched_stats.max_us = wait;
+
+        if(r == &stream.req) {
+            stream.busy = 0;
+            stream.ready = now + STREAM_WAKE;
+            stream.full++;
+            continue;
+        }
+
+        for(i = 0; i < nloaders; ++i) {
+            if(r == &loaders[i].req) {
+                loaders[i].busy = 0;
+                loaders[i].ready = now + LOADER_THINK;
+                loaders[i].bytes += r->cnt * 2048;
+                loaders[i].wait_us += wait;
+                loaders[i].reads++;
+
+                if(wait > loaders[i].max_us)
+                    loaders[i].max_us = wait;
+            }
+        }
+    }
+}
+
+static void run(int policy) {
+    uint64 now = 0, next, bytes = 0, wait = 0, max = 0;
+    uint32 reads = 0;
+    loader_t *l;
+    int i;
+
+    srand(1);
+    TAILQ_INIT(&sched_queue);
+    TAILQ_INIT(&in_drive);
+    sched_head = 0;
+    sched_last_prio = 0;
+    sched_last_done = 0;
+    level_pos = level_end = 0;
+    memset(&sched_stats, 0, sizeof(sched_stats));
+    memset(&stream, 0, sizeof(stream));
+    memset(loaders, 0, nloaders * sizeof(loader_t));
+    stream.pos = disc_sectors * 3 / 4;
+    stream.next_take = stream_period;
+
+    while(now < sim_us) {
+        /* Loaders ask for their next read */
+        for(i = 0; i < nloaders; ++i) {
+            l = &loaders[i];
+
+            if(l->busy || l->ready > now)
+                continue;
+
+            if(!l->left && workload == WORK_RANDOM) {
+                l->pos = rnd(disc_sectors * 3 / 4);
+                l->left = 4 + rnd(400);
+            }
+            else if(!l->left) {
+                if(level_pos >= level_end) {
+                    level_pos = rnd(disc_sectors * 3 / 4 - LEVEL_SECTORS);
+                    level_end = level_pos + LEVEL_SECTORS;
+                }
+
+                l->pos = level_pos;
+                l->left = 1 + rnd(48);
+                level_pos += l->left;
+            }
+
+            submit(&l->req, l->pos, l->left < LOADER_READ ? l->left :
+                   LOADER_READ, CDROM_PRIO_NORMAL, 0, now, policy);
+            l->pos += l->req.cnt;
+            l->left -= l->req.cnt;
+            l->busy = 1;
+        }
+
+        /* The consumer takes a buffer, or waits for one */
+        if(stream_period && now >= stream.next_take && !stream.starving) {
+            if(stream.full) {
+                stream.full--;
+                stream.next_take += stream_period;
+            }
+            else {
+                stream.starving = 1;
+                stream.starve_start = now;
+                stream.underruns++;
+            }
+        }
+
+        if(stream.starving && stream.full) {
+            stream.full--;
+            stream.starving = 0;
+            wait = now - stream.starve_start;
+            stream.underrun_us += wait;
+
+            if(wait > stream.max_underrun_us)
+                stream.max_underrun_us = wait;
+
+            stream.next_take = now + stream_period;
+        }
+
+        /* The stream's reader fills the next free buffer */
+        if(stream_period && !stream.busy && stream.full < stream_bufs &&
+           stream.ready <= now)
+            stream_submit(now, policy);
+
+        start_read(now, policy);
+
+        /* Go on to whatever happens next */
+        next = sim_us;
+
+        if(!TAILQ_EMPTY(&in_drive) && drive_done < next)
+            next = drive_done;
+
+        for(i = 0; i < nloaders; ++i) {
+            if(!loaders[i].busy && loaders[i].ready < next)
+                next = loaders[i].ready;
+        }
+
+        if(stream_period && !stream.busy && stream.full < stream_bufs &&
+           stream.ready > now && stream.ready < next)
+            next = stream.ready;
+
+        if(stream_period && !stream.starving && stream.next_take < next)
+            next = stream.next_take;
+
+        if(TAILQ_EMPTY(&in_drive) && !TAILQ_EMPTY(&sched_queue) &&
+           sched_last_done + SCHED_ANTICIPATE * 1000 < next)
+            next = sched_last_done + SCHED_ANTICIPATE * 1000;
+
+        if(next < now)
+            next = now;
+
+        now = next;
+
+        if(!TAILQ_EMPTY(&in_drive) && drive_done <= now)
+            finish_read(now);
+    }
+
+    for(i = 0; i < nloaders; ++i) {
+        bytes += loaders[i].bytes;
+        reads += loaders[i].reads;
+        wait += loaders[i].wait_us;
+
+        if(loaders[i].max_us > max)
+            max = loaders[i].max_us;
+    }
+
+    printf("%-9s %8.1f %7.1f %7.0f %8lu %7lu %7lu %6lu %8.0f %6lu\n",
+           policy == POLICY_FIFO ? "fifo" :
+           policy == POLICY_ELEVATOR ? "elevator" : "sched",
+           (double)bytes / 1024 / (sim_us / 1000000.0),
+           reads ? wait / 1000.0 / reads : 0.0, max / 1000.0,
+           (unsigned long)sched_stats.commands,
+           (unsigned long)sched_stats.seeks,
+           (unsigned long)sched_stats.merged,
+           (unsigned long)stream.underruns, stream.underrun_us / 1000.0,
+           (unsigned long)stream.urgent);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: cdsched [-w random|level] [-l loaders] [-b buffers]\n"
+            "               [-p period] [-s seconds] [-t costs]\n"
+            "\n"
+            "  -w random   load files from anywhere on the disc\n"
+            "  -w level    load small files packed together, in order\n"
+            "              (default both, one after the other)\n"
+            "  -l loaders  threads loading files (default 3)\n"
+            "  -b buffers  stream buffers of 32 sectors (default 4)\n"
+            "  -p period   ms the stream's consumer takes to use a buffer, or\n"
+            "              0 for no stream (default 400, about CD audio)\n"
+            "  -s seconds  time to simulate (default 60)\n"
+            "  -t costs    microseconds the drive takes per command, per\n"
+            "              sector, and to seek the shortest and the longest\n"
+            "              way (default 500,1100,60000,200000)\n");
+}
+
+static void workload_run(int w) {
+    workload = w;
+
+    printf("\n%s\n\n", w == WORK_RANDOM ? "Files anywhere on the disc:" :
+           "A level of small files packed together:");
+    printf("%-9s %8s %7s %7s %8s %7s %7s %6s %8s %6s\n", "", "loaded",
+           "wait", "longest", "drive", "", "", "stream", "starved", "urgent");
+    printf("%-9s %8s %7s %7s %8s %7s %7s %6s %8s %6s\n", "", "KB/s", "ms",
+           "ms", "reads", "seeks", "merged", "under", "ms", "");
+
+    run(POLICY_FIFO);
+    run(POLICY_ELEVATOR);
+    run(POLICY_SCHED);
+}
+
+int main(int argc, char **argv) {
+    int opt, i, only = -1;
+
+    while((opt = getopt(argc, argv, "w:l:b:p:s:t:h")) != -1) {
+        switch(opt) {
+            case 'w':
+                if(!strcmp(optarg, "random"))
+                    only = WORK_RANDOM;
+                else if(!strcmp(optarg, "level"))
+                    only = WORK_LEVEL;
+                else {
+                    usage();
+                    return 1;
+                }
+
+                break;
+            case 'l':
+                nloaders = atoi(optarg);
+                break;
+            case 'b':
+                stream_bufs = atoi(optarg);
+                break;
+            case 'p':
+                stream_period = (uint64)atoi(optarg) * 1000;
+                break;
+            case 's':
+                sim_us = (uint64)atoi(optarg) * 1000000;
+                break;
+            case 't':
+                if(sscanf(optarg, "%u,%u,%u,%u", &cost_cmd, &cost_sector,
+                          &cost_seek_min, &cost_seek_max) != 4 ||
+                   cost_seek_max < cost_seek_min) {
+                    usage();
+                    return 1;
+                }
+
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(nloaders < 0 || stream_bufs < 2 || !sim_us) {
+        usage();
+        return 1;
+    }
+
+    if(!(loaders = calloc(nloaders + 1, sizeof(loader_t)))) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    if(stream_period)
+        printf("%d loaders and a stream of %d buffers, each used for %lu ms, "
+               "for %lu s\n", nloaders, stream_bufs,
+               (unsigned long)(stream_period / 1000),
+               (unsigned long)(sim_us / 1000000));
+    else
+        printf("%d loaders and no stream, for %lu s\n", nloaders,
+               (unsigned long)(sim_us / 1000000));
+
+    for(i = WORK_RANDOM; i <= WORK_LEVEL; ++i) {
+        if(only < 0 || only == i)
+            workload_run(i);
+    }
+
+    free(loaders);
+
+    return 0;
+}
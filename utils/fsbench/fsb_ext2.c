@@ -0,0 +1,237 @@
+/* KallistiOS ##version##
+
+   fsb_ext2.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+   libkosext2fs for fsbench, on an image of an SD card.
+
+   As with fsb_fat.c, fs_ext2.c can't be built here, so the way it reads
+   files and lists directories is done again below with the same calls into
+   libkosext2fs.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ext2fs.h"
+#include "inode.h"
+#include "directory.h"
+
+#include "fsbench.h"
+
+#define EXT2_MAX_FILES  16
+
+#define IS_DIR(inode)   (((inode)->i_mode & 0xF000) == EXT2_S_IFDIR)
+
+static struct {
+    ext2_inode_t    *inode;     /* NULL if not open */
+    uint32_t        ptr;
+} fh[EXT2_MAX_FILES];
+
+static ext2_fs_t *fs;
+static char name_buf[256];
+
+static int bd_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int bd_read_blocks(kos_blockdev_t *d, uint32_t block, size_t count,
+                          void *buf) {
+    (void)d;
+    return fsb_dev_read(block, count, buf);
+}
+
+static int bd_write_blocks(kos_blockdev_t *d, uint32_t block, size_t count,
+                           const void *buf) {
+    (void)d;
+    (void)block;
+    (void)count;
+    (void)buf;
+    errno = EROFS;
+    return -1;
+}
+
+static uint32_t bd_count_blocks(kos_blockdev_t *d) {
+    (void)d;
+    return (uint32_t)fsb_dev_blocks();
+}
+
+static kos_blockdev_t bd = {
+    NULL,
+    9,
+    bd_init,
+    bd_init,
+    bd_read_blocks,
+    bd_write_blocks,
+    bd_count_blocks
+};
+
+static int fsb_ext2_mount(const char *image, size_t cache_kb) {
+    int blocks = 0;
+
+    /* The cache is in filesystem blocks, so find out how big they are */
+    if(cache_kb) {
+        if(fsb_dev_open(image, 512) < 0)
+            return -1;
+
+        if(!(fs = ext2_fs_init(&bd, EXT2FS_MNT_FLAG_RO))) {
+            fsb_dev_close();
+            return -1;
+        }
+
+        if((blocks = cache_kb * 1024 / ext2_block_size(fs)) < 1)
+            blocks = 1;
+
+        ext2_fs_shutdown(fs);
+        fsb_dev_close();
+    }
+
+    if(fsb_dev_open(image, 512) < 0)
+        return -1;
+
+    fs = blocks ? ext2_fs_init_ex(&bd, EXT2FS_MNT_FLAG_RO, blocks) :
+         ext2_fs_init(&bd, EXT2FS_MNT_FLAG_RO);
+
+    if(!fs) {
+        fsb_dev_close();
+        return -1;
+    }
+
+    memset(fh, 0, sizeof(fh));
+    return 0;
+}
+
+static void fsb_ext2_unmount(void) {
+    ext2_fs_shutdown(fs);
+    fsb_dev_close();
+}
+
+static int fsb_ext2_open(const char *path, int dir) {
+    ext2_inode_t *inode;
+    uint32_t inode_num;
+    int fd;
+
+    for(fd = 0; fd < EXT2_MAX_FILES && fh[fd].inode; ++fd)
+        ;
+
+    if(fd == EXT2_MAX_FILES ||
+       ext2_inode_by_path(fs, path, &inode, &inode_num, 1, NULL))
+        return -1;
+
+    if(!IS_DIR(inode) != !dir) {
+        ext2_inode_put(inode);
+        return -1;
+    }
+
+    fh[fd].inode = inode;
+    fh[fd].ptr = 0;
+
+    return fd;
+}
+
+static void fsb_ext2_close(int fd) {
+    ext2_inode_put(fh[fd].inode);
+    fh[fd].inode = NULL;
+}
+
+static ssize_t fsb_ext2_read(int fd, void *buf, size_t cnt) {
+    uint32_t bs = ext2_block_size(fs), lbs = ext2_log_block_size(fs), bo, n;
+    uint64_t sz = ext2_inode_size(fh[fd].inode);
+    uint8_t *block, *bbuf = (uint8_t *)buf;
+    ssize_t rv;
+
+    if(fh[fd].ptr >= sz)
+        return 0;
+
+    if(fh[fd].ptr + cnt > sz)
+        cnt = sz - fh[fd].ptr;
+
+    rv = (ssize_t)cnt;
+
+    while(cnt) {
+        if(!(block = ext2_inode_read_block(fs, fh[fd].inode,
+                                           fh[fd].ptr >> lbs, NULL, &errno)))
+            return -1;
+
+        bo = fh[fd].ptr & (bs - 1);
+        n = cnt < bs - bo ? cnt : bs - bo;
+        memcpy(bbuf, block + bo, n);
+        fh[fd].ptr += n;
+        bbuf += n;
+        cnt -= n;
+    }
+
+    return rv;
+}
+
+static off_t fsb_ext2_seek(int fd, off_t offset) {
+    if(offset < 0 || (uint64_t)offset > ext2_inode_size(fh[fd].inode)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fh[fd].ptr = offset;
+    return offset;
+}
+
+static const char *fsb_ext2_readdir(int fd, int *size) {
+    uint32_t bs = ext2_block_size(fs), lbs = ext2_log_block_size(fs);
+    ext2_dirent_t *dent;
+    ext2_inode_t *inode;
+    uint8_t *block;
+    int err;
+
+    for(;;) {
+        if(fh[fd].ptr >= fh[fd].inode->i_size)
+            return NULL;
+
+        if(!(block = ext2_inode_read_block(fs, fh[fd].inode,
+                                           fh[fd].ptr >> lbs, NULL, &err)))
+            return NULL;
+
+        dent = (ext2_dirent_t *)(block + (fh[fd].ptr & (bs - 1)));
+
+        if(!dent->rec_len)
+            return NULL;
+
+        fh[fd].ptr += dent->rec_len;
+
+        if(dent->inode)
+            break;
+    }
+
+    memcpy(name_buf, dent->name, dent->name_len);
+    name_buf[dent->name_len] = 0;
+
+    /* The size is in the entry's inode */
+    if(!(inode = ext2_inode_get(fs, dent->inode, &err)))
+        return NULL;
+
+    *size = IS_DIR(inode) ? -1 : (int)inode->i_size;
+    ext2_inode_put(inode);
+
+    return name_buf;
+}
+
+static void fsb_ext2_io(fsb_io_t *io) {
+    fsb_dev_io(io);
+}
+
+const fsb_backend_t fsb_ext2 = {
+    "ext2",
+    "an SD card",
+    512,
+    { 100, 700, 0 },
+    fsb_ext2_mount,
+    fsb_ext2_unmount,
+    fsb_ext2_open,
+    fsb_ext2_read,
+    fsb_ext2_seek,
+    fsb_ext2_close,
+    fsb_ext2_readdir,
+    fsb_ext2_io
+};
@@ -0,0 +1,352 @@
+/* KallistiOS ##version##
+
+   fsb_fat.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+   libkosfat for fsbench, on an image of an SD card.
+
+   fs_fat.c needs too much of the KOS VFS to build here, so what it does to
+   read files and list directories is done again below, on top of the same
+   libkosfat calls and in the same order, so the device sees the same reads.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fatfs.h"
+#include "directory.h"
+#include "ucs.h"
+
+#include "fsbench.h"
+
+#define FAT_MAX_FILES   16
+
+static struct {
+    int             opened;
+    int             dir;
+    int             root;       /* The FAT12/FAT16 root directory */
+    int             seeked;     /* cluster has to be found again */
+    fat_dentry_t    dentry;
+    uint32_t        cluster;    /* Cluster ptr is in */
+    uint32_t        order;      /* Which of the file's clusters that is */
+    uint32_t        ptr;
+} fh[FAT_MAX_FILES];
+
+static fat_fs_t *fs;
+static uint16_t longname_buf[256];
+static char name_buf[256 * 3];
+
+static int bd_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int bd_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                          void *buf) {
+    (void)d;
+    return fsb_dev_read(block, count, buf);
+}
+
+static int bd_write_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                           const void *buf) {
+    (void)d;
+    (void)block;
+    (void)count;
+    (void)buf;
+    errno = EROFS;
+    return -1;
+}
+
+static uint32_t bd_count_blocks(kos_blockdev_t *d) {
+    (void)d;
+    return (uint32_t)fsb_dev_blocks();
+}
+
+static kos_blockdev_t bd = {
+    NULL,
+    9,
+    bd_init,
+    bd_init,
+    bd_read_blocks,
+    bd_write_blocks,
+    bd_count_blocks
+};
+
+static int fsb_fat_mount(const char *image, size_t cache_kb) {
+    size_t bytes = cache_kb * 1024, csize;
+    int clusters = FAT_CACHE_BLOCKS, fblocks = FAT_FCACHE_BLOCKS;
+
+    /* The cache is in clusters, so find out how big they are first. Three
+       quarters go to data, and the rest to the FAT. */
+    if(cache_kb) {
+        if(fsb_dev_open(image, 512) < 0)
+            return -1;
+
+        if(!(fs = fat_fs_init(&bd, FAT_MNT_FLAG_RO))) {
+            fsb_dev_close();
+            return -1;
+        }
+
+        csize = fat_cluster_size(fs);
+        fat_fs_shutdown(fs);
+        fsb_dev_close();
+
+        if((clusters = bytes * 3 / 4 / csize) < 1)
+            clusters = 1;
+
+        if((fblocks = (bytes - clusters * csize) / 512) < 2)
+            fblocks = 2;
+    }
+
+    if(fsb_dev_open(image, 512) < 0)
+        return -1;
+
+    if(!(fs = fat_fs_init_ex(&bd, FAT_MNT_FLAG_RO, clusters, fblocks))) {
+        fsb_dev_close();
+        return -1;
+    }
+
+    memset(fh, 0, sizeof(fh));
+    return 0;
+}
+
+static void fsb_fat_unmount(void) {
+    fat_fs_shutdown(fs);
+    fsb_dev_close();
+}
+
+static int fsb_fat_open(const char *path, int dir) {
+    uint32_t cl, off, lcl, loff;
+    fat_dentry_t dent;
+    int fd;
+
+    if(fat_find_dentry(fs, path, &dent, &cl, &off, &lcl, &loff) < 0)
+        return -1;
+
+    if(!(dent.attr & FAT_ATTR_DIRECTORY) != !dir)
+        return -1;
+
+    for(fd = 0; fd < FAT_MAX_FILES && fh[fd].opened; ++fd)
+        ;
+
+    if(fd == FAT_MAX_FILES)
+        return -1;
+
+    fh[fd].opened = 1;
+    fh[fd].dir = dir;
+    fh[fd].root = dir && !cl && fat_fs_type(fs) != FAT_FS_FAT32;
+    fh[fd].seeked = 0;
+    fh[fd].dentry = dent;
+    fh[fd].cluster = dent.cluster_low | ((uint32_t)dent.cluster_high << 16);
+    fh[fd].order = 0;
+    fh[fd].ptr = 0;
+
+    return fd;
+}
+
+static void fsb_fat_close(int fd) {
+    fh[fd].opened = 0;
+}
+
+/* Walk the chain to the order'th cluster of the file, from where the handle
+   is if that's on the way, as advance_cluster() does */
+static int advance(int fd, uint32_t order) {
+    uint32_t cl;
+    int err;
+
+    if(fh[fd].order > order) {
+        fh[fd].cluster = fh[fd].dentry.cluster_low |
+                         ((uint32_t)fh[fd].dentry.cluster_high << 16);
+        fh[fd].order = 0;
+    }
+
+    while(fh[fd].order < order) {
+        if((cl = fat_read_fat(fs, fh[fd].cluster, &err)) ==
+           FAT_INVALID_CLUSTER) {
+            errno = err;
+            return -1;
+        }
+
+        fh[fd].cluster = cl;
+
+        if(fat_is_eof(fs, cl))
+            break;
+
+        ++fh[fd].order;
+    }
+
+    fh[fd].seeked = 0;
+    return 0;
+}
+
+static ssize_t fsb_fat_read(int fd, void *buf, size_t cnt) {
+    uint32_t bs = fat_cluster_size(fs), bo, n, cl;
+    uint8_t *block, *bbuf = (uint8_t *)buf;
+    ssize_t rv;
+
+    if(fh[fd].seeked && advance(fd, fh[fd].ptr / bs) < 0)
+        return -1;
+
+    if(fat_is_eof(fs, fh[fd].cluster) || fh[fd].ptr >= fh[fd].dentry.size)
+        return 0;
+
+    if(fh[fd].ptr + cnt > fh[fd].dentry.size)
+        cnt = fh[fd].dentry.size - fh[fd].ptr;
+
+    rv = (ssize_t)cnt;
+
+    while(cnt) {
+        if(!(block = fat_cluster_read(fs, fh[fd].cluster, &errno)))
+            return -1;
+
+        bo = fh[fd].ptr & (bs - 1);
+        n = cnt < bs - bo ? cnt : bs - bo;
+        memcpy(bbuf, block + bo, n);
+        fh[fd].ptr += n;
+        bbuf += n;
+        cnt -= n;
+
+        /* On to the next cluster at the end of this one */
+        if(bo + n == bs) {
+            if((cl = fat_read_fat(fs, fh[fd].cluster, &errno)) ==
+               FAT_INVALID_CLUSTER)
+                return -1;
+
+            if(cnt && fat_is_eof(fs, cl)) {
+                errno = EIO;
+                return -1;
+            }
+
+            fh[fd].cluster = cl;
+            ++fh[fd].order;
+        }
+    }
+
+    return rv;
+}
+
+static off_t fsb_fat_seek(int fd, off_t offset) {
+    if(offset < 0 || offset > (off_t)fh[fd].dentry.size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fh[fd].ptr = offset;
+    fh[fd].seeked = 1;
+    return offset;
+}
+
+static void copy_shortname(const fat_dentry_t *dent, char *fn) {
+    int i, j = 0;
+
+    for(i = 0; i < 8 && dent->name[i] != ' '; ++i)
+        fn[i] = dent->name[i];
+
+    if(dent->name[8] != ' ') {
+        fn[i++] = '.';
+
+        for(; j < 3 && dent->name[8 + j] != ' '; ++j)
+            fn[i + j] = dent->name[8 + j];
+    }
+
+    fn[i + j] = '\0';
+}
+
+static void copy_longname(const fat_dentry_t *dent) {
+    const fat_longname_t *lent = (const fat_longname_t *)dent;
+    int fnlen = ((lent->order - 1) & 0x3F) * 13;
+
+    memcpy(&longname_buf[fnlen], lent->name1, 10);
+    memcpy(&longname_buf[fnlen + 5], lent->name2, 12);
+    memcpy(&longname_buf[fnlen + 11], lent->name3, 4);
+}
+
+static const char *fsb_fat_readdir(int fd, int *size) {
+    uint32_t bs, cl;
+    uint8_t *block;
+    fat_dentry_t *dent;
+    int err, has_longname = 0;
+
+    /* The FAT12/FAT16 root directory is read a block at a time, and all the
+       others a cluster at a time */
+    bs = fh[fd].root ? fat_block_size(fs) : fat_cluster_size(fs);
+    memset(longname_buf, 0, sizeof(longname_buf));
+
+    for(;;) {
+        if(fat_is_eof(fs, fh[fd].cluster))
+            return NULL;
+
+        if(!(block = fat_cluster_read(fs, fh[fd].cluster, &err)))
+            return NULL;
+
+        dent = (fat_dentry_t *)(block + (fh[fd].ptr & (bs - 1)));
+        fh[fd].ptr += 32;
+
+        if(dent->name[0] == FAT_ENTRY_EOD) {
+            fh[fd].cluster = 0x0FFFFFF8;
+            return NULL;
+        }
+
+        if(FAT_IS_LONG_NAME(dent)) {
+            has_longname = 1;
+            copy_longname(dent);
+        }
+
+        /* At the end of the block or cluster, move on to the next */
+        if(!(fh[fd].ptr & (bs - 1))) {
+            if(!fh[fd].root) {
+                if((cl = fat_read_fat(fs, fh[fd].cluster, &err)) ==
+                   FAT_INVALID_CLUSTER)
+                    return NULL;
+
+                fh[fd].cluster = cl;
+            }
+            else if((fh[fd].ptr >> 5) >= fat_rootdir_length(fs)) {
+                fh[fd].cluster = 0x0FFFFFFF;
+            }
+            else {
+                ++fh[fd].cluster;
+            }
+
+            ++fh[fd].order;
+        }
+
+        if(dent->name[0] != FAT_ENTRY_FREE && !FAT_IS_LONG_NAME(dent) &&
+           !(dent->attr & FAT_ATTR_VOLUME_ID))
+            break;
+
+        if(!FAT_IS_LONG_NAME(dent))
+            has_longname = 0;
+    }
+
+    if(!has_longname)
+        copy_shortname(dent, name_buf);
+    else
+        fat_ucs2_to_utf8((uint8_t *)name_buf, longname_buf, sizeof(name_buf),
+                         fat_strlen_ucs2(longname_buf));
+
+    *size = (dent->attr & FAT_ATTR_DIRECTORY) ? -1 : (int)dent->size;
+    return name_buf;
+}
+
+static void fsb_fat_io(fsb_io_t *io) {
+    fsb_dev_io(io);
+}
+
+const fsb_backend_t fsb_fat = {
+    "fat",
+    "an SD card",
+    512,
+    { 100, 700, 0 },
+    fsb_fat_mount,
+    fsb_fat_unmount,
+    fsb_fat_open,
+    fsb_fat_read,
+    fsb_fat_seek,
+    fsb_fat_close,
+    fsb_fat_readdir,
+    fsb_fat_io
+};
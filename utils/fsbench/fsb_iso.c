@@ -0,0 +1,96 @@
+/* KallistiOS ##version##
+
+   fsb_iso.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+   fs_iso9660 for fsbench, by way of the copy of it in isotest, which reads
+   a disc image and charges for each read as the GD-ROM drive would.
+
+*/
+
+#define main isotest_main
+#include "../isotest/isotest.c"
+#undef main
+
+#include "fsbench.h"
+
+static int fsb_iso_mount(const char *image, size_t cache_kb) {
+    size_t bytes = cache_kb ? cache_kb * 1024 :
+                   FS_ISO9660_CACHE_DEFAULT * 2048;
+
+    if(!(disc = fopen(image, "rb")))
+        return -1;
+
+    /* Both caches get the size, as with isotest -s */
+    fs_iso9660_set_cache_size(bytes, bytes);
+
+    cost_cmd = fsb_costs.cmd;
+    cost_sector = fsb_costs.block;
+    cost_seek = fsb_costs.seek;
+    cd_cmds = cd_sectors = cd_seeks = 0;
+    cd_next = 0;
+    cd_time_us = 0;
+
+    if(fs_iso9660_init() < 0) {
+        fclose(disc);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void fsb_iso_unmount(void) {
+    fs_iso9660_shutdown();
+    fclose(disc);
+}
+
+static int fsb_iso_open(const char *path, int dir) {
+    file_t fd = iso_open(path, O_RDONLY | (dir ? O_DIR : 0));
+
+    return fd ? fd : -1;
+}
+
+static ssize_t fsb_iso_read(int fd, void *buf, size_t bytes) {
+    return iso_read(fd, buf, bytes);
+}
+
+static off_t fsb_iso_seek(int fd, off_t offset) {
+    return iso_seek(fd, offset);
+}
+
+static void fsb_iso_close(int fd) {
+    iso_close(fd);
+}
+
+static const char *fsb_iso_readdir(int fd, int *size) {
+    dirent_t *d = iso_readdir(fd);
+
+    if(!d)
+        return NULL;
+
+    *size = d->size;
+    return d->name;
+}
+
+static void fsb_iso_io(fsb_io_t *io) {
+    io->cmds = cd_cmds;
+    io->blocks = cd_sectors;
+    io->seeks = cd_seeks;
+    io->bytes = (uint64_t)cd_sectors * 2048;
+    io->time_us = cd_time_us;
+}
+
+const fsb_backend_t fsb_iso9660 = {
+    "iso",
+    "a GD-ROM",
+    2048,
+    { 500, 1100, 80000 },
+    fsb_iso_mount,
+    fsb_iso_unmount,
+    fsb_iso_open,
+    fsb_iso_read,
+    fsb_iso_seek,
+    fsb_iso_close,
+    fsb_iso_readdir,
+    fsb_iso_io
+};
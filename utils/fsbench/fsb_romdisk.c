@@ -0,0 +1,139 @@
+/* KallistiOS ##version##
+
+   fsb_romdisk.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+   fs_romdisk for fsbench, by way of the copy of it in rdtest. A romdisk is
+   in memory, so nothing is ever asked of a device; only the time taken on
+   the host means anything here.
+
+*/
+
+#define main rdtest_main
+#include "../rdtest/rdtest.c"
+#undef main
+
+#include "fsbench.h"
+
+static char *rd_img;
+static rd_image_t *rd_mnt;
+
+/* Directories being listed: the header of the next entry, or 0 */
+static uint32 rd_dirs[MAX_RD_FILES];
+static char rd_name[256];
+
+static int fsb_rd_mount(const char *image, size_t cache_kb) {
+    size_t size;
+
+    if(read_file_contents(image, &rd_img, &size))
+        return -1;
+
+    /* The path index is the only cache a romdisk has */
+    index_size = cache_kb ? cache_kb * 1024 / sizeof(rd_ient_t) :
+                 FS_ROMDISK_INDEX_DEFAULT;
+
+    if(!(rd_mnt = fs_romdisk_mount((const uint8 *)rd_img))) {
+        free(rd_img);
+        return -1;
+    }
+
+    memset(rd_dirs, 0, sizeof(rd_dirs));
+    return 0;
+}
+
+static void fsb_rd_unmount(void) {
+    fs_romdisk_unmount(rd_mnt);
+    free(rd_img);
+}
+
+/* Directories are opened and listed as fs_romdisk.c does it; rdtest leaves
+   that out. Their handles are MAX_RD_FILES up. */
+static int fsb_rd_open(const char *path, int dir) {
+    const romdisk_file_t *fhdr;
+    uint32 hdr;
+    int fd;
+
+    if(!dir)
+        return (fd = romdisk_open(rd_mnt, path, O_RDONLY)) ? fd : -1;
+
+    if(!(hdr = romdisk_find(rd_mnt, path + 1, 1)))
+        return -1;
+
+    /* The root's first entry, or a subdirectory's */
+    if(hdr != rd_mnt->files) {
+        fhdr = (const romdisk_file_t *)(rd_mnt->image + hdr);
+        hdr = ntohl_32(&fhdr->spec_info) & 0xfffffff0;
+    }
+
+    for(fd = 0; fd < MAX_RD_FILES; ++fd) {
+        if(!rd_dirs[fd]) {
+            rd_dirs[fd] = hdr;
+            return MAX_RD_FILES + fd;
+        }
+    }
+
+    return -1;
+}
+
+static ssize_t fsb_rd_read(int fd, void *buf, size_t bytes) {
+    return romdisk_read(fd, buf, bytes);
+}
+
+static off_t fsb_rd_seek(int fd, off_t offset) {
+    return romdisk_seek(fd, offset);
+}
+
+static void fsb_rd_close(int fd) {
+    if(fd >= MAX_RD_FILES)
+        rd_dirs[fd - MAX_RD_FILES] = 0;
+    else
+        romdisk_close(fd);
+}
+
+static const char *fsb_rd_readdir(int fd, int *size) {
+    const romdisk_file_t *fhdr;
+    uint32 hdr, next, data;
+
+    if(fd < MAX_RD_FILES || !(hdr = rd_dirs[fd - MAX_RD_FILES]) ||
+       hdr == (uint32)-1)
+        return NULL;
+
+    fhdr = (const romdisk_file_t *)(rd_mnt->image + hdr);
+    next = ntohl_32(&fhdr->next_header);
+    rd_dirs[fd - MAX_RD_FILES] = (next & 0xfffffff0) ? next & 0xfffffff0 :
+                                 (uint32)-1;
+
+    if((next & 3) == 1) {
+        *size = -1;
+    }
+    else {
+        /* A link to a file has the size of the file */
+        if((next & 3) == 0 && (data = rd_file_hdr(rd_mnt->image, hdr)))
+            fhdr = (const romdisk_file_t *)(rd_mnt->image + data);
+
+        *size = ntohl_32(&fhdr->size);
+        fhdr = (const romdisk_file_t *)(rd_mnt->image + hdr);
+    }
+
+    snprintf(rd_name, sizeof(rd_name), "%s", fhdr->filename);
+    return rd_name;
+}
+
+static void fsb_rd_io(fsb_io_t *io) {
+    memset(io, 0, sizeof(*io));
+}
+
+const fsb_backend_t fsb_romdisk = {
+    "romdisk",
+    "memory",
+    16,
+    { 0, 0, 0 },
+    fsb_rd_mount,
+    fsb_rd_unmount,
+    fsb_rd_open,
+    fsb_rd_read,
+    fsb_rd_seek,
+    fsb_rd_close,
+    fsb_rd_readdir,
+    fsb_rd_io
+};
@@ -0,0 +1,838 @@
+/* KallistiOS ##version##
+
+   fsbench.c
+   Copyright (C) 2024 KallistiOS Contributors
+
+   Benchmark the KOS filesystems on a PC. fs_iso9660 and fs_romdisk are
+   built from the copies of them in isotest and rdtest, and libkosfat and
+   libkosext2fs from their sources, each reading an image file. The same
+   access patterns are replayed against any of them, and both the time taken
+   on the host and what was asked of the (simulated) device are reported, so
+   that changes to their caches can be measured without a Dreamcast.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fsbench.h"
+
+/********************************************************************************/
+/* The block device */
+
+fsb_costs_t fsb_costs;
+
+static int dev_fd = -1;
+static size_t dev_bsize;
+static uint64_t dev_nblocks, dev_next;
+static fsb_io_t dev_io;
+
+int fsb_dev_open(const char *image, size_t block_size) {
+    off_t size;
+
+    if((dev_fd = open(image, O_RDONLY)) < 0)
+        return -1;
+
+    if((size = lseek(dev_fd, 0, SEEK_END)) < 0) {
+        close(dev_fd);
+        dev_fd = -1;
+        return -1;
+    }
+
+    dev_bsize = block_size;
+    dev_nblocks = size / block_size;
+    dev_next = (uint64_t)-1;
+    memset(&dev_io, 0, sizeof(dev_io));
+
+    return 0;
+}
+
+void fsb_dev_close(void) {
+    if(dev_fd >= 0)
+        close(dev_fd);
+
+    dev_fd = -1;
+}
+
+uint64_t fsb_dev_blocks(void) {
+    return dev_nblocks;
+}
+
+int fsb_dev_read(uint64_t block, size_t count, void *buf) {
+    size_t bytes = count * dev_bsize;
+
+    if(block + count > dev_nblocks) {
+        errno = EIO;
+        return -1;
+    }
+
+    if(pread(dev_fd, buf, bytes, (off_t)(block * dev_bsize)) !=
+       (ssize_t)bytes) {
+        errno = EIO;
+        return -1;
+    }
+
+    ++dev_io.cmds;
+    dev_io.blocks += count;
+    dev_io.bytes += bytes;
+    dev_io.time_us += fsb_costs.cmd + (uint64_t)count * fsb_costs.block;
+
+    if(block != dev_next) {
+        ++dev_io.seeks;
+        dev_io.time_us += fsb_costs.seek;
+    }
+
+    dev_next = block + count;
+
+    return 0;
+}
+
+void fsb_dev_io(fsb_io_t *io) {
+    *io = dev_io;
+}
+
+/********************************************************************************/
+/* Traces
+
+   The same format as isotest's, one operation per line:
+
+     open n path    Open the file path as handle n (0 to MAX_HANDLES - 1)
+     read n bytes   Read from handle n
+     seek n offset  Move handle n to offset bytes from the start
+     close n        Close handle n
+     list path      Read every entry of the directory path */
+
+#define MAX_HANDLES 64
+
+#define OP_OPEN     0
+#define OP_READ     1
+#define OP_SEEK     2
+#define OP_CLOSE    3
+#define OP_LIST     4
+
+typedef struct {
+    int     op;
+    int     n;
+    uint64_t arg;
+    char    *path;
+} fsb_op_t;
+
+typedef struct {
+    fsb_op_t *ops;
+    size_t  nops, maxops;
+} fsb_trace_t;
+
+static int trace_add(fsb_trace_t *t, int op, int n, uint64_t arg,
+                     const char *path) {
+    fsb_op_t *no;
+
+    if(t->nops == t->maxops) {
+        t->maxops = t->maxops ? t->maxops * 2 : 256;
+
+        if(!(no = realloc(t->ops, t->maxops * sizeof(fsb_op_t))))
+            return -1;
+
+        t->ops = no;
+    }
+
+    t->ops[t->nops].op = op;
+    t->ops[t->nops].n = n;
+    t->ops[t->nops].arg = arg;
+    t->ops[t->nops].path = NULL;
+
+    if(path && !(t->ops[t->nops].path = strdup(path)))
+        return -1;
+
+    ++t->nops;
+    return 0;
+}
+
+static void trace_free(fsb_trace_t *t) {
+    size_t i;
+
+    for(i = 0; i < t->nops; ++i)
+        free(t->ops[i].path);
+
+    free(t->ops);
+    memset(t, 0, sizeof(*t));
+}
+
+static int trace_load(fsb_trace_t *t, const char *fn) {
+    char line[1024], cmd[16], path[1024];
+    unsigned long long arg;
+    int n, line_no = 0, rv = 0;
+    FILE *f;
+
+    if(!(f = fopen(fn, "r"))) {
+        fprintf(stderr, "Cannot read %s\n", fn);
+        return -1;
+    }
+
+    while(!rv && fgets(line, sizeof(line), f)) {
+        ++line_no;
+
+        if(sscanf(line, "%15s", cmd) != 1 || cmd[0] == '#')
+            continue;
+
+        if(!strcmp(cmd, "open") &&
+           sscanf(line, "%*s %d %1023s", &n, path) == 2)
+            rv = trace_add(t, OP_OPEN, n, 0, path);
+        else if(!strcmp(cmd, "read") &&
+                sscanf(line, "%*s %d %llu", &n, &arg) == 2)
+            rv = trace_add(t, OP_READ, n, arg, NULL);
+        else if(!strcmp(cmd, "seek") &&
+                sscanf(line, "%*s %d %llu", &n, &arg) == 2)
+            rv = trace_add(t, OP_SEEK, n, arg, NULL);
+        else if(!strcmp(cmd, "close") && sscanf(line, "%*s %d", &n) == 1)
+            rv = trace_add(t, OP_CLOSE, n, 0, NULL);
+        else if(!strcmp(cmd, "list") &&
+                sscanf(line, "%*s %1023s", path) == 1)
+            rv = trace_add(t, OP_LIST, 0, 0, path);
+        else {
+            fprintf(stderr, "%s:%d: bad line\n", fn, line_no);
+            rv = -1;
+            break;
+        }
+
+        if(t->ops[t->nops - 1].op != OP_LIST &&
+           (n < 0 || n >= MAX_HANDLES)) {
+            fprintf(stderr, "%s:%d: bad handle\n", fn, line_no);
+            rv = -1;
+        }
+    }
+
+    fclose(f);
+    return rv;
+}
+
+static void trace_print(const fsb_trace_t *t, FILE *f) {
+    static const char *names[] = { "open", "read", "seek", "close", "list" };
+    const fsb_op_t *o;
+    size_t i;
+
+    for(i = 0; i < t->nops; ++i) {
+        o = &t->ops[i];
+
+        if(o->op == OP_LIST)
+            fprintf(f, "list %s\n", o->path);
+        else if(o->op == OP_OPEN)
+            fprintf(f, "open %d %s\n", o->n, o->path);
+        else if(o->op == OP_CLOSE)
+            fprintf(f, "close %d\n", o->n);
+        else
+            fprintf(f, "%s %d %llu\n", names[o->op], o->n,
+                    (unsigned long long)o->arg);
+    }
+}
+
+/********************************************************************************/
+/* What's in the image */
+
+typedef struct {
+    char        *path;
+    uint64_t    size;
+} fsb_file_t;
+
+static fsb_file_t *files;
+static size_t nfiles, maxfiles;
+static char **dirs;
+static size_t ndirs;
+
+static int add_file(const char *path, uint64_t size) {
+    fsb_file_t *nf;
+
+    if(nfiles == maxfiles) {
+        maxfiles = maxfiles ? maxfiles * 2 : 256;
+
+        if(!(nf = realloc(files, maxfiles * sizeof(fsb_file_t))))
+            return -1;
+
+        files = nf;
+    }
+
+    if(!(files[nfiles].path = strdup(path)))
+        return -1;
+
+    files[nfiles++].size = size;
+    return 0;
+}
+
+static int cmp_path(const void *a, const void *b) {
+    return strcmp(((const fsb_file_t *)a)->path, ((const fsb_file_t *)b)->path);
+}
+
+/* List every directory, breadth first, so that only one directory is open at
+   a time (some of the filesystems have few handles). */
+static int collect(const fsb_backend_t *be) {
+    char path[1024], **nd;
+    const char *name;
+    size_t i;
+    int fd, size, rv = 0;
+
+    if(!(dirs = malloc(sizeof(char *))) || !(dirs[0] = strdup("")))
+        return -1;
+
+    ndirs = 1;
+
+    for(i = 0; i < ndirs && !rv; ++i) {
+        if((fd = be->open(*dirs[i] ? dirs[i] : "/", 1)) < 0) {
+            fprintf(stderr, "Cannot list %s/\n", dirs[i]);
+            return -1;
+        }
+
+        while((name = be->readdir(fd, &size))) {
+            if(!strcmp(name, ".") || !strcmp(name, ".."))
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s", dirs[i], name);
+
+            if(size >= 0) {
+                if(add_file(path, size) < 0)
+                    rv = -1;
+            }
+            else if(!(nd = realloc(dirs, (ndirs + 1) * sizeof(char *))) ||
+                    !(dirs = nd, dirs[ndirs] = strdup(path))) {
+                rv = -1;
+            }
+            else {
+                ++ndirs;
+            }
+        }
+
+        be->close(fd);
+    }
+
+    /* Each filesystem lists things in its own order; sort them so that the
+       workloads are the same on all of them */
+    qsort(files, nfiles, sizeof(fsb_file_t), cmp_path);
+
+    return rv;
+}
+
+static void free_files(void) {
+    size_t i;
+
+    for(i = 0; i < nfiles; ++i)
+        free(files[i].path);
+
+    for(i = 0; i < ndirs; ++i)
+        free(dirs[i]);
+
+    free(files);
+    free(dirs);
+    files = NULL;
+    dirs = NULL;
+    nfiles = maxfiles = ndirs = 0;
+}
+
+/********************************************************************************/
+/* Made-up workloads */
+
+#define WL_SEQ      0
+#define WL_RANDOM   1
+#define WL_SMALL    2
+#define WL_DIRS     3
+#define WL_TRACE    4
+
+static const char *wl_names[] = { "seq", "random", "small", "dirs", "trace" };
+
+/* Sizes of the pieces things are read in */
+#define SEQ_PIECE   32768
+#define RANDOM_READ 4096
+#define SMALL_MAX   65536
+#define SMALL_PIECE 16384
+
+/* Files kept open at once by the random workload; fs_iso9660 and fs_romdisk
+   only have 7 handles to give out */
+#define RANDOM_FILES    4
+
+static size_t nops = 2000;
+static uint64_t seq_max = 64 * 1024 * 1024;
+static int dir_passes = 4;
+
+static uint32_t rnd(uint32_t n) {
+    return n ? (uint32_t)(((uint64_t)rand() << 16 ^ rand()) % n) : 0;
+}
+
+static int cmp_size(const void *a, const void *b) {
+    const fsb_file_t *fa = (const fsb_file_t *)a, *fb = (const fsb_file_t *)b;
+
+    return fa->size < fb->size ? 1 : fa->size > fb->size ? -1 : 0;
+}
+
+/* Read every file from start to end, in the order they were listed */
+static int gen_seq(fsb_trace_t *t) {
+    uint64_t total = 0, pos;
+    size_t i;
+    int rv = 0;
+
+    for(i = 0; i < nfiles && total < seq_max && !rv; ++i) {
+        rv |= trace_add(t, OP_OPEN, 0, 0, files[i].path);
+
+        for(pos = 0; pos < files[i].size; pos += SEQ_PIECE)
+            rv |= trace_add(t, OP_READ, 0, SEQ_PIECE, NULL);
+
+        rv |= trace_add(t, OP_CLOSE, 0, 0, NULL);
+        total += files[i].size;
+    }
+
+    return rv;
+}
+
+/* Read small pieces from all over the biggest files, as from a pack file or
+   a database */
+static int gen_random(fsb_trace_t *t) {
+    fsb_file_t *big;
+    size_t i, n;
+    uint32_t f, blocks;
+    int rv = 0;
+
+    if(!(big = malloc(nfiles * sizeof(fsb_file_t))))
+        return -1;
+
+    memcpy(big, files, nfiles * sizeof(fsb_file_t));
+    qsort(big, nfiles, sizeof(fsb_file_t), cmp_size);
+
+    for(n = 0; n < nfiles && n < RANDOM_FILES && big[n].size >= RANDOM_READ;
+        ++n)
+        rv |= trace_add(t, OP_OPEN, n, 0, big[n].path);
+
+    for(i = 0; n && i < nops && !rv; ++i) {
+        f = rnd(n);
+        blocks = (uint32_t)(big[f].size / RANDOM_READ);
+        rv |= trace_add(t, OP_SEEK, f, (uint64_t)rnd(blocks) * RANDOM_READ,
+                        NULL);
+        rv |= trace_add(t, OP_READ, f, RANDOM_READ, NULL);
+    }
+
+    for(i = 0; i < n; ++i)
+        rv |= trace_add(t, OP_CLOSE, i, 0, NULL);
+
+    free(big);
+    return rv;
+}
+
+/* Open, read and close small files picked at random, some of them more than
+   once, as a game loading assets would */
+static int gen_small(fsb_trace_t *t) {
+    size_t *small, nsmall = 0, i;
+    uint64_t pos;
+    fsb_file_t *f;
+    int rv = 0;
+
+    if(!(small = malloc((nfiles + 1) * sizeof(size_t))))
+        return -1;
+
+    for(i = 0; i < nfiles; ++i) {
+        if(files[i].size <= SMALL_MAX)
+            small[nsmall++] = i;
+    }
+
+    for(i = 0; nsmall && i < nops && !rv; ++i) {
+        /* Half of the time, one of the first eighth of them */
+        f = &files[small[rnd(2) ? rnd(nsmall / 8 + 1) : rnd(nsmall)]];
+        rv |= trace_add(t, OP_OPEN, 0, 0, f->path);
+
+        for(pos = 0; pos < f->size || !pos; pos += SMALL_PIECE)
+            rv |= trace_add(t, OP_READ, 0, SMALL_PIECE, NULL);
+
+        rv |= trace_add(t, OP_CLOSE, 0, 0, NULL);
+    }
+
+    free(small);
+    return rv;
+}
+
+/* List every directory, a few times over */
+static int gen_dirs(fsb_trace_t *t) {
+    size_t i;
+    int p, rv = 0;
+
+    for(p = 0; p < dir_passes; ++p) {
+        for(i = 0; i < ndirs; ++i)
+            rv |= trace_add(t, OP_LIST, 0, 0, *dirs[i] ? dirs[i] : "/");
+    }
+
+    return rv;
+}
+
+static int generate(fsb_trace_t *t, int wl) {
+    switch(wl) {
+        case WL_SEQ:
+            return gen_seq(t);
+        case WL_RANDOM:
+            return gen_random(t);
+        case WL_SMALL:
+            return gen_small(t);
+        case WL_DIRS:
+            return gen_dirs(t);
+    }
+
+    return -1;
+}
+
+/********************************************************************************/
+/* Running them */
+
+typedef struct {
+    uint64_t    ops;
+    uint64_t    failed;
+    uint64_t    bytes;      /* Bytes read from files */
+    uint64_t    entries;    /* Directory entries read */
+    uint64_t    ns;         /* Host time */
+    fsb_io_t    io;
+} fsb_result_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void replay(const fsb_backend_t *be, const fsb_trace_t *t,
+                   uint8_t *buf, size_t bufsize, fsb_result_t *res) {
+    int fds[MAX_HANDLES], fd, size;
+    const fsb_op_t *o;
+    fsb_io_t before;
+    uint64_t start;
+    ssize_t r;
+    size_t i;
+
+    for(i = 0; i < MAX_HANDLES; ++i)
+        fds[i] = -1;
+
+    memset(res, 0, sizeof(*res));
+    be->io(&before);
+    start = now_ns();
+
+    for(i = 0; i < t->nops; ++i) {
+        o = &t->ops[i];
+        ++res->ops;
+
+        switch(o->op) {
+            case OP_OPEN:
+                if(fds[o->n] >= 0)
+                    be->close(fds[o->n]);
+
+                if((fds[o->n] = be->open(o->path, 0)) < 0)
+                    ++res->failed;
+
+                break;
+
+            case OP_READ:
+                if(fds[o->n] < 0 || o->arg > bufsize ||
+                   (r = be->read(fds[o->n], buf, o->arg)) < 0)
+                    ++res->failed;
+                else
+                    res->bytes += r;
+
+                break;
+
+            case OP_SEEK:
+                if(fds[o->n] < 0 || be->seek(fds[o->n], o->arg) < 0)
+                    ++res->failed;
+
+                break;
+
+            case OP_CLOSE:
+                if(fds[o->n] >= 0)
+                    be->close(fds[o->n]);
+                else
+                    ++res->failed;
+
+                fds[o->n] = -1;
+                break;
+
+            case OP_LIST:
+                if((fd = be->open(o->path, 1)) < 0) {
+                    ++res->failed;
+                    break;
+                }
+
+                while(be->readdir(fd, &size))
+                    ++res->entries;
+
+                be->close(fd);
+                break;
+        }
+    }
+
+    for(i = 0; i < MAX_HANDLES; ++i) {
+        if(fds[i] >= 0)
+            be->close(fds[i]);
+    }
+
+    res->ns = now_ns() - start;
+    be->io(&res->io);
+    res->io.cmds -= before.cmds;
+    res->io.blocks -= before.blocks;
+    res->io.seeks -= before.seeks;
+    res->io.bytes -= before.bytes;
+    res->io.time_us -= before.time_us;
+}
+
+static void print_header(const fsb_backend_t *be) {
+    printf("%s, on %s: each read command costs %u us, each %u byte block %u "
+           "us,\nand each seek %u us\n\n", be->name, be->device, fsb_costs.cmd,
+           (unsigned int)be->block_size, fsb_costs.block, fsb_costs.seek);
+    printf("%-7s %6s %8s %9s %8s %8s %9s %7s %9s %8s\n", "", "cache", "ops",
+           "ops/s", "MB/s", "read", "device", "", "device", "device");
+    printf("%-7s %6s %8s %9s %8s %8s %9s %7s %9s %8s\n", "", "KB", "", "",
+           "host", "MB", "cmds", "seeks", "ms", "MB/s");
+}
+
+static void print_result(const char *name, size_t cache_kb,
+                         const fsb_result_t *res) {
+    double secs = res->ns / 1e9, dev_secs = res->io.time_us / 1e6;
+    char cache[16];
+
+    if(cache_kb)
+        snprintf(cache, sizeof(cache), "%u", (unsigned int)cache_kb);
+    else
+        strcpy(cache, "-");
+
+    printf("%-7s %6s %8llu %9.0f %8.1f %8.1f %9llu %7llu %9.0f %8.2f\n",
+           name, cache, (unsigned long long)res->ops,
+           secs > 0 ? res->ops / secs : 0.0,
+           secs > 0 ? res->bytes / secs / 1048576.0 : 0.0,
+           res->io.bytes / 1048576.0, (unsigned long long)res->io.cmds,
+           (unsigned long long)res->io.seeks, res->io.time_us / 1000.0,
+           dev_secs > 0 ? res->bytes / dev_secs / 1048576.0 : 0.0);
+
+    if(res->failed)
+        printf("        %llu of those failed\n",
+               (unsigned long long)res->failed);
+}
+
+/********************************************************************************/
+
+static const fsb_backend_t *backends[] = {
+    &fsb_iso9660, &fsb_romdisk, &fsb_fat, &fsb_ext2
+};
+
+#define NBACKENDS   (sizeof(backends) / sizeof(backends[0]))
+
+static void usage(void) {
+    size_t i;
+
+    fprintf(stderr,
+            "usage: fsbench [-w workloads] [-f trace] [-c sizes] [-n ops]\n"
+            "               [-m MB] [-p passes] [-t costs] [-s seed] [-d]\n"
+            "               type image\n"
+            "\n"
+            "  type          the filesystem in image:");
+
+    for(i = 0; i < NBACKENDS; ++i)
+        fprintf(stderr, " %s", backends[i]->name);
+
+    fprintf(stderr, "\n"
+            "  -w workloads  any of seq,random,small,dirs (default all)\n"
+            "  -f trace      replay a trace file instead\n"
+            "  -c sizes      cache sizes to try, in KB (default the\n"
+            "                filesystem's own)\n"
+            "  -n ops        reads for random and files for small (2000)\n"
+            "  -m MB         most to read with seq (64)\n"
+            "  -p passes     times to list each directory with dirs (4)\n"
+            "  -t costs      device costs in us: cmd,block,seek\n"
+            "  -s seed       random seed (1)\n"
+            "  -d            print the workloads' traces instead\n");
+}
+
+static int next_size(const char **s, size_t *out) {
+    char *end;
+
+    if(!**s)
+        return 0;
+
+    *out = strtoul(*s, &end, 10);
+
+    if(end == *s || (*end && *end != ','))
+        return -1;
+
+    *s = *end ? end + 1 : end;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    const char *wls = "seq,random,small,dirs", *tracefn = NULL;
+    const char *sizes = "0", *image, *s;
+    const fsb_backend_t *be = NULL;
+    fsb_trace_t traces[WL_TRACE + 1];
+    fsb_result_t res;
+    int opt, dump = 0, wl, rv = 0, costs_set = 0, want[WL_TRACE + 1] = { 0 };
+    size_t cache_kb, i, bufsize = SEQ_PIECE;
+    unsigned int seed = 1;
+    uint8_t *buf;
+
+    while((opt = getopt(argc, argv, "w:f:c:n:m:p:t:s:dh")) != -1) {
+        switch(opt) {
+            case 'w':
+                wls = optarg;
+                break;
+            case 'f':
+                tracefn = optarg;
+                break;
+            case 'c':
+                sizes = optarg;
+                break;
+            case 'n':
+                nops = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                seq_max = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'p':
+                dir_passes = atoi(optarg);
+                break;
+            case 't':
+                if(sscanf(optarg, "%u,%u,%u", &fsb_costs.cmd, &fsb_costs.block,
+                          &fsb_costs.seek) != 3) {
+                    usage();
+                    return 1;
+                }
+
+                costs_set = 1;
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                dump = 1;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(argc - optind != 2) {
+        usage();
+        return 1;
+    }
+
+    for(i = 0; i < NBACKENDS; ++i) {
+        if(!strcmp(argv[optind], backends[i]->name))
+            be = backends[i];
+    }
+
+    image = argv[optind + 1];
+
+    if(!be) {
+        usage();
+        return 1;
+    }
+
+    for(s = sizes; (opt = next_size(&s, &cache_kb)) > 0;)
+        ;
+
+    if(opt < 0) {
+        usage();
+        return 1;
+    }
+
+    if(tracefn) {
+        want[WL_TRACE] = 1;
+    }
+    else {
+        for(wl = 0; wl < WL_TRACE; ++wl) {
+            for(s = wls; (s = strstr(s, wl_names[wl])); s += strlen(wl_names[wl])) {
+                if((s == wls || s[-1] == ',') &&
+                   (!s[strlen(wl_names[wl])] || s[strlen(wl_names[wl])] == ','))
+                    want[wl] = 1;
+            }
+        }
+    }
+
+    if(!costs_set)
+        fsb_costs = be->costs;
+
+    /* Make up the workloads from what's in the image */
+    memset(traces, 0, sizeof(traces));
+    srand(seed);
+
+    if(be->mount(image, 0) < 0) {
+        fprintf(stderr, "Cannot mount %s as %s\n", image, be->name);
+        return 1;
+    }
+
+    if(tracefn) {
+        rv = trace_load(&traces[WL_TRACE], tracefn);
+    }
+    else if(!(rv = collect(be))) {
+        for(wl = 0; wl < WL_TRACE && !rv; ++wl) {
+            if(want[wl])
+                rv = generate(&traces[wl], wl);
+        }
+    }
+
+    be->unmount();
+
+    if(rv < 0) {
+        fprintf(stderr, "Cannot set up the workloads\n");
+        free_files();
+        return 1;
+    }
+
+    if(dump) {
+        for(wl = 0; wl <= WL_TRACE; ++wl) {
+            if(want[wl]) {
+                printf("# %s\n", wl_names[wl]);
+                trace_print(&traces[wl], stdout);
+            }
+        }
+
+        goto out;
+    }
+
+    for(i = 0; i < traces[WL_TRACE].nops; ++i) {
+        if(traces[WL_TRACE].ops[i].op == OP_READ &&
+           traces[WL_TRACE].ops[i].arg > bufsize)
+            bufsize = traces[WL_TRACE].ops[i].arg;
+    }
+
+    if(!(buf = malloc(bufsize))) {
+        fprintf(stderr, "Out of memory\n");
+        rv = 1;
+        goto out;
+    }
+
+    print_header(be);
+
+    /* Each workload with each cache size, mounting afresh each time so that
+       they all start out with empty caches */
+    for(wl = 0; wl <= WL_TRACE; ++wl) {
+        if(!want[wl])
+            continue;
+
+        for(s = sizes; next_size(&s, &cache_kb) > 0;) {
+            if(be->mount(image, cache_kb) < 0) {
+                fprintf(stderr, "Cannot mount %s\n", image);
+                rv = 1;
+                break;
+            }
+
+            replay(be, &traces[wl], buf, bufsize, &res);
+            be->unmount();
+            print_result(wl_names[wl], cache_kb, &res);
+
+            if(res.failed)
+                rv = 1;
+        }
+    }
+
+    free(buf);
+
+out:
+    for(wl = 0; wl <= WL_TRACE; ++wl)
+        trace_free(&traces[wl]);
+
+    free_files();
+
+    return rv;
+}
@@ -0,0 +1,75 @@
+/* KallistiOS ##version##
+
+   fsbench.h
+   Copyright (C) 2024 KallistiOS Contributors
+
+   What fsbench.c needs from each filesystem, and what the filesystems need
+   from it. Each fsb_*.c file builds one KOS filesystem on the host and fills
+   in an fsb_backend_t for it.
+
+*/
+
+#ifndef __FSBENCH_H
+#define __FSBENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* What has been asked of the device under a filesystem. Reads are charged a
+   cost for each command, for each block, and for each command that doesn't
+   start where the last one stopped. */
+typedef struct fsb_io {
+    uint64_t    cmds;       /* Read commands */
+    uint64_t    blocks;     /* Blocks read */
+    uint64_t    seeks;      /* Commands that didn't carry on from the last */
+    uint64_t    bytes;      /* Bytes read */
+    uint64_t    time_us;    /* How long the device would have taken */
+} fsb_io_t;
+
+/* The device's costs, in microseconds */
+typedef struct fsb_costs {
+    unsigned int    cmd;
+    unsigned int    block;
+    unsigned int    seek;
+} fsb_costs_t;
+
+typedef struct fsb_backend {
+    const char  *name;
+    const char  *device;        /* What the image stands for */
+    size_t      block_size;     /* Device block size, in bytes */
+    fsb_costs_t costs;          /* Default device costs */
+
+    /* Mount image, with a cache of about cache_kb KB, or the filesystem's
+       default if 0. Returns 0 on success. */
+    int (*mount)(const char *image, size_t cache_kb);
+    void (*unmount)(void);
+
+    /* Open a file, or a directory with dir set. Returns a handle, or -1. */
+    int (*open)(const char *path, int dir);
+    ssize_t (*read)(int fd, void *buf, size_t bytes);
+    off_t (*seek)(int fd, off_t offset);
+    void (*close)(int fd);
+
+    /* The next entry of a directory, or NULL at its end. size is set to -1
+       for directories. */
+    const char *(*readdir)(int fd, int *size);
+
+    /* Total device I/O since mounting */
+    void (*io)(fsb_io_t *io);
+} fsb_backend_t;
+
+extern const fsb_backend_t fsb_iso9660, fsb_romdisk, fsb_fat, fsb_ext2;
+
+/* The device costs in use, set from the backend's or with -t */
+extern fsb_costs_t fsb_costs;
+
+/* A block device backed by an image file, for the filesystems that read
+   through a kos_blockdev_t */
+int fsb_dev_open(const char *image, size_t block_size);
+void fsb_dev_close(void);
+uint64_t fsb_dev_blocks(void);
+int fsb_dev_read(uint64_t block, size_t count, void *buf);
+void fsb_dev_io(fsb_io_t *io);
+
+#endif /* __FSBENCH_H */
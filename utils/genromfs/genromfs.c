@@ -56,6 +56,22 @@
  * -A N,/name force named file(s) (shell globbing applied against the filenames)
  *       to be aligned on N bytes boundary
  * In both cases, N must be a power of two.
+ * -z    compress regular files, for the KallistiOS romdisk only
+ * -Z N  compress regular files in blocks of N bytes (a power of two)
+ * -N /name don't compress the named file(s)
+ *
+ * A compressed file has the length of its compressed data in the spec.info
+ * field of its header (which is otherwise zero for regular files) and its
+ * real length in the size field. The data is the block size and a table of
+ * block offsets, as big-endian 32 bit words, followed by the blocks:
+ *
+ *   block size
+ *   offset of block 0 ... offset of block n-1, end of block n-1
+ *   block data
+ *
+ * Offsets are from the start of the file data. Each block is compressed in
+ * the LZ4 block format, unless that doesn't make it smaller, in which case it
+ * is stored as is. Images with compressed files can't be mounted by Linux.
  */
 
 /*
@@ -138,6 +154,9 @@ struct filenode {
     unsigned int offset;
     unsigned int size;
     unsigned int pad;
+    unsigned char *zdata;
+    unsigned int zsize;
+    int order;
 };
 
 struct aligns {
@@ -151,6 +170,20 @@ struct excludes {
     char pattern[0];
 };
 
+struct orders {
+    struct orders *next;
+    int matched;
+    char pattern[0];
+};
+
+struct dupent {
+    struct dupent *next;
+    struct filenode *node;
+    uint32_t hash;
+};
+
+#define DUP_BUCKETS 1024
+
 void initlist(struct filehdr *fh, struct filenode *owner) {
     fh->head = (struct filenode *)&fh->tail;
     fh->tail = NULL;
@@ -198,8 +231,15 @@ static char bigbuf[4096];
 static char fixbuf[512];
 static int atoffs = 0;
 static int align = 16;
+static int zblock = 0;
 struct aligns *alignlist = NULL;
 struct excludes *excludelist = NULL;
+struct excludes *nozlist = NULL;
+struct orders *orderlist = NULL;
+static int dedup = 0;
+static struct dupent *duptab[DUP_BUCKETS];
+static struct filenode **layout;
+static int nlayout;
 int realbase;
 
 /* helper function to match an exclusion or align pattern */
@@ -221,7 +261,8 @@ int findalign(struct filenode *node) {
     struct aligns *pa;
     int i;
 
-    if(S_ISREG(node->modes)) i = align;
+    /* Links have no data of their own to align */
+    if(S_ISREG(node->modes) && !node->orig_link) i = align;
     else i = 16;
 
     for(pa = alignlist; pa; pa = pa->next) {
@@ -330,7 +371,6 @@ void dumpri(struct romfh *ri, struct filenode *n, FILE *f) {
 
 int dumpnode(struct filenode *node, FILE *f) {
     struct romfh ri;
-    struct filenode *p;
 
     ri.nextfh = 0;
     ri.spec = 0;
@@ -377,6 +417,12 @@ int dumpnode(struct filenode *node, FILE *f) {
         dumpdataa(bigbuf, node->size, f);
     }
 #endif
+    else if(S_ISREG(node->modes) && node->zdata) {
+        ri.nextfh |= htonl(ROMFH_REG);
+        ri.spec = htonl(node->zsize);
+        dumpri(&ri, node, f);
+        dumpdataa(node->zdata, node->zsize, f);
+    }
     else if(S_ISREG(node->modes)) {
         int offset, len, fd, max, avail;
         ri.nextfh |= htonl(ROMFH_REG);
@@ -435,34 +481,24 @@ int dumpnode(struct filenode *node, FILE *f) {
     }
 #endif
 
-    p = node->dirlist.head;
-
-    while(p->next) {
-        if(dumpnode(p, f)) {
-            return 1;
-        }
-        p = p->next;
-    }
-
     return 0;
 }
 
 int dumpall(struct filenode *node, int lastoff, FILE *f) {
     struct romfh ri;
-    struct filenode *p;
+    int i;
 
     ri.nextfh = htonl(0x2d726f6d);
     ri.spec = htonl(0x3166732d);
     ri.size = htonl(lastoff);
     ri.checksum = htonl(0x55555555);
     dumpri(&ri, node, f);
-    p = node->dirlist.head;
 
-    while(p->next) {
-        if(dumpnode(p, f)) {
+    /* The nodes have to go out in the order of their offsets */
+    for(i = 0; i < nlayout; i++) {
+        if(dumpnode(layout[i], f)) {
             return 1;
         }
-        p = p->next;
     }
 
     /* Align the whole bunch to ROMBSIZE boundary */
@@ -542,6 +578,9 @@ struct filenode *newnode(const char *base, const char *name, int curroffset) {
     node->orig_link = NULL;
     node->offset = curroffset;
     node->pad = 0;
+    node->zdata = NULL;
+    node->zsize = 0;
+    node->order = 0;
 
     return node;
 }
@@ -573,8 +612,292 @@ struct filenode *findnode(struct filenode *node, dev_t dev, ino_t ino) {
 
 #define ALIGNUP16(x) (((x)+15)&~15)
 
+int hdrspace(struct filenode *node) {
+    return 16 + ALIGNUP16(strlen(node->name) + 1);
+}
+
 int spaceneeded(struct filenode *node) {
-    return 16 + ALIGNUP16(strlen(node->name) + 1) + ALIGNUP16(node->size);
+    return hdrspace(node) + ALIGNUP16(node->zdata ? node->zsize : node->size);
+}
+
+/* Read a regular file in whole. Returns NULL if it can't be read. */
+unsigned char *readnode(struct filenode *node) {
+    unsigned char *data;
+    unsigned int pos;
+    int fd, len;
+
+    data = malloc(node->size ? node->size : 1);
+
+    if(!data) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    fd = open(node->realname, O_RDONLY
+#ifdef O_BINARY
+              | O_BINARY
+#endif
+             );
+
+    if(fd < 0) {
+        free(data);
+        return NULL;
+    }
+
+    for(pos = 0; pos < node->size; pos += len) {
+        if((len = read(fd, data + pos, node->size - pos)) <= 0)
+            break;
+    }
+
+    close(fd);
+
+    if(pos != node->size) {
+        fprintf(stderr, "'%s' changed size while reading it\n",
+                node->realname);
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+/* Deduplication */
+
+/* Find a file seen earlier with the same contents as this one, if -D was
+   given. Files that don't match anything are remembered for later ones. */
+struct filenode *finddup(struct filenode *node) {
+    unsigned char *data, *other;
+    struct dupent *pd;
+    uint32_t hash = 2166136261U;
+    unsigned int i;
+    int same;
+
+    if(!dedup || !node->size)
+        return NULL;
+
+    if(!(data = readnode(node)))
+        return NULL;
+
+    for(i = 0; i < node->size; i++) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+
+    for(pd = duptab[hash % DUP_BUCKETS]; pd; pd = pd->next) {
+        if(pd->hash != hash || pd->node->size != node->size)
+            continue;
+
+        if(!(other = readnode(pd->node)))
+            continue;
+
+        same = !memcmp(data, other, node->size);
+        free(other);
+
+        if(same) {
+            free(data);
+            return pd->node;
+        }
+    }
+
+    free(data);
+
+    pd = malloc(sizeof(*pd));
+
+    if(!pd) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    pd->node = node;
+    pd->hash = hash;
+    pd->next = duptab[hash % DUP_BUCKETS];
+    duptab[hash % DUP_BUCKETS] = pd;
+
+    return NULL;
+}
+
+/* Compression */
+
+#define LZ4_HASHLOG     14
+#define LZ4_MINMATCH    4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT     12
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Write an LZ4 length continuation. */
+static unsigned char *lz4_putlen(unsigned char *op, unsigned int len) {
+    while(len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = len;
+    return op;
+}
+
+/* Compress src into the LZ4 block format. Returns the compressed length, or
+   -1 if it wouldn't fit in cap bytes. */
+int lz4_compress(const unsigned char *src, int len, unsigned char *dst,
+                 int cap) {
+    static int table[1 << LZ4_HASHLOG];
+    const unsigned char *ip = src, *anchor = src, *ref;
+    const unsigned char *end = src + len;
+    const unsigned char *mflimit = end - LZ4_MFLIMIT;
+    const unsigned char *matchlimit = end - LZ4_LASTLITERALS;
+    unsigned char *op = dst, *token;
+    unsigned int h, lit, mlen;
+
+    memset(table, 0xff, sizeof(table));
+
+    if(len > LZ4_MFLIMIT) {
+        while(ip < mflimit) {
+            h = (read32(ip) * 2654435761U) >> (32 - LZ4_HASHLOG);
+            ref = table[h] < 0 ? NULL : src + table[h];
+            table[h] = ip - src;
+
+            if(!ref || ip - ref > 65535 || read32(ref) != read32(ip)) {
+                ++ip;
+                continue;
+            }
+
+            mlen = LZ4_MINMATCH;
+
+            while(ip + mlen < matchlimit && ip[mlen] == ref[mlen])
+                ++mlen;
+
+            lit = ip - anchor;
+
+            /* Worst case for this sequence: token, lengths, literals and
+               offset. */
+            if(op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 >
+               dst + cap)
+                return -1;
+
+            token = op++;
+
+            if(lit >= 15) {
+                *token = 15 << 4;
+                op = lz4_putlen(op, lit - 15);
+            }
+            else {
+                *token = lit << 4;
+            }
+
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+
+            if(mlen - LZ4_MINMATCH >= 15) {
+                *token |= 15;
+                op = lz4_putlen(op, mlen - LZ4_MINMATCH - 15);
+            }
+            else {
+                *token |= mlen - LZ4_MINMATCH;
+            }
+
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+
+    /* The rest goes out as literals. */
+    lit = end - anchor;
+
+    if(op + 1 + lit / 255 + 1 + lit > dst + cap)
+        return -1;
+
+    token = op++;
+
+    if(lit >= 15) {
+        *token = 15 << 4;
+        op = lz4_putlen(op, lit - 15);
+    }
+    else {
+        *token = lit << 4;
+    }
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+/* Compress a regular file, if compression is on and it helps. */
+int compressnode(struct filenode *node) {
+    unsigned char *data, *z;
+    unsigned int nblocks, i, pos, blen, hdr;
+    struct excludes *pe;
+    int c;
+
+    if(!zblock || !node->size)
+        return 0;
+
+    for(pe = nozlist; pe; pe = pe->next) {
+        if(!nodematch(pe->pattern, node))
+            return 0;
+    }
+
+    nblocks = (node->size + zblock - 1) / zblock;
+    hdr = 4 + (nblocks + 1) * 4;
+
+    if(!(data = readnode(node)))
+        return 0;
+
+    z = malloc(hdr + node->size);
+
+    if(!z) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    put32(z, zblock);
+    pos = hdr;
+
+    for(i = 0; i < nblocks; ++i) {
+        put32(z + 4 + i * 4, pos);
+        blen = node->size - i * zblock;
+
+        if(blen > (unsigned int)zblock)
+            blen = zblock;
+
+        /* Keep the block as is unless it gets smaller. */
+        c = lz4_compress(data + i * zblock, blen, z + pos, blen - 1);
+
+        if(c < 0) {
+            memcpy(z + pos, data + i * zblock, blen);
+            c = blen;
+        }
+
+        pos += c;
+    }
+
+    put32(z + 4 + nblocks * 4, pos);
+    free(data);
+
+    if(ALIGNUP16(pos) >= ALIGNUP16(node->size)) {
+        free(z);
+        return 0;
+    }
+
+    node->zdata = z;
+    node->zsize = pos;
+
+    return 1;
 }
 
 int alignnode(struct filenode *node, int curroffset, int extraspace) {
@@ -736,14 +1059,28 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
         }
 
         if(link) {
+            /* Point straight at the data of files that share it */
+            if(link->orig_link && S_ISREG(link->modes))
+                link = link->orig_link;
+
             n->orig_link = link;
             curroffset = alignnode(n, curroffset, 0) + spaceneeded(n);
             continue;
         }
 
         if(S_ISREG(sb->st_mode)) {
-            curroffset = alignnode(n, curroffset, spaceneeded(n));
             n->size = sb->st_size;
+
+            /* Share the data of an identical file, if there is one */
+            if((link = finddup(n))) {
+                n->size = 0;
+                n->orig_link = link;
+                curroffset = alignnode(n, curroffset, 0) + spaceneeded(n);
+                continue;
+            }
+
+            curroffset = alignnode(n, curroffset, hdrspace(n));
+            compressnode(n);
         }
         else
             curroffset = alignnode(n, curroffset, 0);
@@ -779,6 +1116,275 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
     return curroffset;
 }
 
+/* Layout */
+
+void addlayout(struct filenode *node) {
+    static int maxlayout = 0;
+
+    if(nlayout == maxlayout) {
+        maxlayout = maxlayout ? maxlayout * 2 : 256;
+        layout = realloc(layout, maxlayout * sizeof(*layout));
+
+        if(!layout) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    layout[nlayout++] = node;
+}
+
+/* Every node under this one, in the order processdir() laid them out */
+void treeorder(struct filenode *node, struct filenode **out, int *count) {
+    struct filenode *p = node->dirlist.head;
+
+    while(p->next) {
+        out[(*count)++] = p;
+        treeorder(p, out, count);
+        p = p->next;
+    }
+}
+
+int countnodes(struct filenode *node) {
+    struct filenode *p = node->dirlist.head;
+    int count = 0;
+
+    while(p->next) {
+        count += 1 + countnodes(p);
+        p = p->next;
+    }
+
+    return count;
+}
+
+int hasdata(struct filenode *node) {
+    return S_ISREG(node->modes) && !node->orig_link;
+}
+
+/* Put the nodes in the order they're written out in. Without an access order
+   list, that's the order processdir() gave them offsets in. With one, the
+   directories, links and other small nodes come first, then the regular files
+   in the order of the list, then the rest of the regular files, so that
+   reading the listed files one after the other goes straight through the
+   image. Returns the new size of the image. */
+int orderlayout(struct filenode *root, int lastoff) {
+    struct filenode **tree, *node;
+    struct orders *po;
+    int count = 0, i, n = 0, curroffset;
+
+    tree = malloc((countnodes(root) + 1) * sizeof(*tree));
+
+    if(!tree) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    treeorder(root, tree, &count);
+
+    if(!orderlist) {
+        for(i = 0; i < count; i++)
+            addlayout(tree[i]);
+
+        free(tree);
+        return lastoff;
+    }
+
+    for(i = 0; i < count; i++) {
+        if(!hasdata(tree[i]))
+            addlayout(tree[i]);
+    }
+
+    for(po = orderlist; po; po = po->next) {
+        for(i = 0; i < count; i++) {
+            node = tree[i];
+
+            /* Reading a copy of a file reads the data it shares */
+            if(node->orig_link && S_ISREG(node->modes))
+                node = node->orig_link;
+
+            if(!hasdata(node) || nodematch(po->pattern, tree[i]))
+                continue;
+
+            po->matched++;
+
+            if(!node->order) {
+                node->order = ++n;
+                addlayout(node);
+            }
+        }
+
+        if(!po->matched)
+            fprintf(stderr, "order list: '%s' matches no files\n",
+                    po->pattern);
+    }
+
+    for(i = 0; i < count; i++) {
+        if(hasdata(tree[i]) && !tree[i]->order)
+            addlayout(tree[i]);
+    }
+
+    free(tree);
+
+    /* Hand out the offsets again */
+    curroffset = spaceneeded(root);
+
+    for(i = 0; i < nlayout; i++) {
+        layout[i]->offset = curroffset;
+        layout[i]->pad = 0;
+        curroffset = alignnode(layout[i], curroffset,
+                               hasdata(layout[i]) ? hdrspace(layout[i]) : 0);
+        curroffset += spaceneeded(layout[i]);
+    }
+
+    return curroffset;
+}
+
+const char *nodepath(struct filenode *node) {
+    return node->realname + realbase;
+}
+
+char nodetype(struct filenode *node) {
+    if(node->orig_link) return 'h';
+    if(S_ISDIR(node->modes)) return 'd';
+    if(S_ISREG(node->modes)) return 'f';
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    if(S_ISLNK(node->modes)) return 'l';
+#endif
+    return 's';
+}
+
+/* Write out where everything went */
+void showlayout(struct filenode *root, int lastoff, FILE *f) {
+    struct filenode *node;
+    struct orders *po;
+    unsigned int stored, data, dupfiles = 0, dupbytes = 0, padbytes = 0;
+    unsigned int listed = 0, listbytes = 0, first = 0, last = 0, back = 0;
+    unsigned int prev = 0;
+    int i, dalign;
+
+    fprintf(f, "# romfs image '%s', %d bytes\n", root->name, lastoff);
+    fprintf(f, "# type: d directory, f file, h hard link, l symlink, "
+            "s special\n");
+    fprintf(f, "#%-9s %c %-10s %9s %9s %5s %5s %6s  %s\n", "header", 't', "data",
+            "size", "stored", "pad", "align", "order", "path");
+
+    for(i = 0; i < nlayout; i++) {
+        node = layout[i];
+        data = node->offset + hdrspace(node);
+        stored = node->zdata ? node->zsize : node->size;
+        padbytes += node->pad;
+
+        /* The largest power of two the data is aligned to, up to 4KB */
+        for(dalign = 16; dalign < 4096 && !(data & dalign); dalign <<= 1)
+            ;
+
+        fprintf(f, "0x%08x %c ", node->offset, nodetype(node));
+
+        if(hasdata(node))
+            fprintf(f, "0x%08x %9u %9u %5u %5d", data, node->size, stored,
+                    node->pad, dalign);
+        else
+            fprintf(f, "%-10s %9u %9s %5u %5s", "", node->size, "", node->pad,
+                    "");
+
+        if(node->order)
+            fprintf(f, " %6d", node->order);
+        else
+            fprintf(f, " %6s", "-");
+
+        fprintf(f, "  %s", nodepath(node));
+
+        if(node->orig_link) {
+            fprintf(f, " -> %s", nodepath(node->orig_link));
+
+            if(S_ISREG(node->modes) && hasdata(node->orig_link)) {
+                dupfiles++;
+                dupbytes += ALIGNUP16(node->orig_link->zdata ?
+                                      node->orig_link->zsize :
+                                      node->orig_link->size);
+            }
+        }
+
+        fprintf(f, "\n");
+
+        if(node->order) {
+            listed++;
+            listbytes += ALIGNUP16(stored);
+
+            if(!first)
+                first = data;
+            else if(data < prev)
+                back++;
+
+            prev = data;
+            last = data + ALIGNUP16(stored);
+        }
+    }
+
+    fprintf(f, "# %u bytes of padding\n", padbytes);
+
+    if(dedup)
+        fprintf(f, "# %u files share data with an identical file, "
+                "saving %u bytes\n", dupfiles, dupbytes);
+
+    if(orderlist) {
+        fprintf(f, "# %u files from the order list hold %u bytes in "
+                "0x%08x-0x%08x with %u bytes of other data in between, "
+                "%u backward seeks\n",
+                listed, listbytes, first, last,
+                listed ? last - first - listbytes : 0, back);
+
+        for(po = orderlist; po; po = po->next) {
+            if(!po->matched)
+                fprintf(f, "# '%s' in the order list matches no files\n",
+                        po->pattern);
+        }
+    }
+}
+
+/* Read the access order list: one pattern per line, like -A and -x take */
+void readorder(const char *fn) {
+    struct orders *po, **tail = &orderlist;
+    char line[1024];
+    char *p;
+    FILE *f;
+    int len;
+
+    if(!(f = fopen(fn, "r"))) {
+        perror(fn);
+        exit(1);
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        for(p = line; *p == ' ' || *p == '\t'; p++)
+            ;
+
+        len = strlen(p);
+
+        while(len && (p[len - 1] == '\n' || p[len - 1] == '\r' ||
+                      p[len - 1] == ' ' || p[len - 1] == '\t'))
+            p[--len] = 0;
+
+        if(!len || p[0] == '#')
+            continue;
+
+        po = (struct orders *)malloc(sizeof(*po) + len + 1);
+
+        if(!po) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        po->next = NULL;
+        po->matched = 0;
+        strcpy(po->pattern, p);
+        *tail = po;
+        tail = &po->next;
+    }
+
+    fclose(f);
+}
+
 void showhelp(const char *argv0) {
     printf("genromfs %s\n", VERSION);
     printf("Usage: %s [OPTIONS] -f IMAGE\n", argv0);
@@ -791,6 +1397,12 @@ void showhelp(const char *argv0) {
     printf("  -a ALIGN               Align regular file data to ALIGN bytes\n");
     printf("  -A ALIGN,PATTERN       Align all objects matching pattern to at least ALIGN bytes\n");
     printf("  -x PATTERN             Exclude all objects matching pattern\n");
+    printf("  -z                     Compress regular files (KallistiOS only)\n");
+    printf("  -Z BLOCKSIZE           Compress regular files in BLOCKSIZE blocks\n");
+    printf("  -N PATTERN             Don't compress objects matching pattern\n");
+    printf("  -O FILE                Lay out file data in the order listed in FILE\n");
+    printf("  -D                     Store identical files only once\n");
+    printf("  -R FILE                Write a report of the image layout to FILE\n");
     printf("  -h                     Show this help\n");
     printf("\n");
     printf("Report bugs to chexum@shadow.banki.hu\n");
@@ -800,6 +1412,7 @@ int main(int argc, char *argv[]) {
     int c;
     char *dir = ".";
     char *outf = NULL;
+    char *reportf = NULL;
     char *volname = NULL;
     int verbose = 0;
     char buf[256];
@@ -810,9 +1423,9 @@ int main(int argc, char *argv[]) {
     char *p;
     struct aligns *pa, *pa2;
     struct excludes *pe, *pe2;
-    FILE *f;
+    FILE *f, *rf;
 
-    while((c = getopt(argc, argv, "V:vd:f:ha:A:x:")) != EOF) {
+    while((c = getopt(argc, argv, "V:vd:f:ha:A:x:zZ:N:O:DR:")) != EOF) {
         switch(c) {
             case 'd':
                 dir = optarg;
@@ -881,6 +1494,36 @@ int main(int argc, char *argv[]) {
                     pe2->next = pe;
                 }
 
+                break;
+            case 'z':
+                if(!zblock)
+                    zblock = 32768;
+
+                break;
+            case 'Z':
+                zblock = strtoul(optarg, NULL, 0);
+
+                if(zblock < 512 || zblock > 1048576 ||
+                   (zblock & (zblock - 1))) {
+                    fprintf(stderr, "Block size has to be a power of two from 512 to 1048576 bytes\n");
+                    exit(1);
+                }
+
+                break;
+            case 'N':
+                pe = (struct excludes *)malloc(sizeof(*pe) + strlen(optarg) + 1);
+                pe->next = nozlist;
+                strcpy(pe->pattern, optarg);
+                nozlist = pe;
+                break;
+            case 'O':
+                readorder(optarg);
+                break;
+            case 'D':
+                dedup = 1;
+                break;
+            case 'R':
+                reportf = optarg;
                 break;
             default:
                 exit(1);
@@ -918,6 +1561,8 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    lastoff = orderlayout(root, lastoff);
+
     if(verbose)
         shownode(0, root, stderr);
 
@@ -926,5 +1571,22 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if(reportf) {
+        if(strcmp(reportf, "-") == 0)
+            rf = stdout;
+        else
+            rf = fopen(reportf, "w");
+
+        if(!rf) {
+            perror(reportf);
+            exit(1);
+        }
+
+        showlayout(root, lastoff, rf);
+
+        if(rf != stdout)
+            fclose(rf);
+    }
+
 		return 0;
 }
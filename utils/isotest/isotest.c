@@ -4,107 +4,267 @@
    (c)2000 Megan Potter
 
    Test ISO filesystem reader. This is a functional duplicate of fs_iso9660, but
-   designed to run on a PC for testing.
-
-*/
-
-/*
-Various notes
-
-In Linux, accessing the /dev device on a single-session CD puts the
-"bootstrap" zone at offset 0x8000, and the begin of the CD data itself at
-0x8800.
+   designed to run on a PC for testing. It reads an ISO image file instead of
+   the drive, and can replay traces of the file accesses a program makes to
+   see how well the sector caches do with them.
 
 */
 
 /****************************** LINUX SPECIFIC CODE ***********************************/
 
 #include <stdio.h>
-#include <ctype.h>
-
-typedef unsigned char uint8;
-typedef unsigned short uint16;
-typedef unsigned long uint32;
-typedef signed char int8;
-typedef signed short int16;
-typedef signed long int32;
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
+
+/* The disc image, and what has been asked of the "drive". Reads are charged
+   a cost for each command, for each sector, and for seeking when a command
+   doesn't start where the last one stopped, which is roughly how the GD-ROM
+   drive behaves. */
+static FILE *disc;
+static uint32 cd_cmds, cd_sectors, cd_seeks, cd_next;
+static uint64_t cd_time_us;
+static uint32 cost_cmd = 500, cost_sector = 1100, cost_seek = 80000;
+
+/* Low-level sector read (for Linux to emulate hardware/cdrom.c) */
+#define ERR_OK          0
+#define ERR_NO_DISC     1
+#define ERR_DISC_CHG    2
+#define ERR_SYS         3
+
+#define CDROM_READ_PIO  0
+#define CDROM_READ_DMA  1
+
+static int cdrom_read_sectors_ex(void *buffer, uint32 sector, uint32 cnt,
+                                 int mode) {
+    (void)mode;
+
+    ++cd_cmds;
+    cd_sectors += cnt;
+    cd_time_us += cost_cmd + (uint64_t)cnt * cost_sector;
+
+    if(sector != cd_next) {
+        ++cd_seeks;
+        cd_time_us += cost_seek;
+    }
 
-/* Low-level sector read (for Linux to emulate hardware/cd.c) */
-static int cdrom_read_sectors(void *buffer, uint32 sector, uint32 cnt) {
-    FILE *f;
+    cd_next = sector + cnt;
 
     /* Subtract out DC's LBA offset */
     sector -= 150;
 
-    f = fopen("/dev/scd0", "r");
+    if(fseeko(disc, (off_t)sector * 2048, SEEK_SET) ||
+       fread(buffer, 2048, cnt, disc) != cnt)
+        return ERR_SYS;
 
-    if(!f) return -1;
+    return ERR_OK;
+}
 
-    fseek(f, sector * 2048, SEEK_SET);
-    if(fread(buffer, cnt * 2048, 1, f) != 1) {
-        fclose(f);
-        return 1;
-    }
+static int cdrom_read_sectors(void *buffer, uint32 sector, uint32 cnt) {
+    return cdrom_read_sectors_ex(buffer, sector, cnt, CDROM_READ_PIO);
+}
 
-    fclose(f);
-    return 0;
+static void dcache_inval_range(uintptr_t start, size_t count) {
+    (void)start;
+    (void)count;
 }
 
 /* Linux emulation of various other KOS CD prims */
 typedef int CDROM_TOC;
 
-static int cdrom_reinit() {
+static int cdrom_reinit(void) {
     return 0;
 }
 
 static int cdrom_read_toc(CDROM_TOC *toc, int session) {
+    (void)toc;
+    (void)session;
     return 0;
 }
 
 static uint32 cdrom_locate_data_track(CDROM_TOC *toc) {
+    (void)toc;
     return 150;
 }
 
+/* KOS prims */
+#define DBG_ERROR   3
+#define DBG_NOTICE  5
+
+static int verbose;
+
+static void dbglog(int level, const char *fmt, ...) {
+    va_list ap;
+
+    if(level > DBG_ERROR && !verbose)
+        return;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
 /* KOS VFS prims */
+typedef int file_t;
 #define O_RDONLY 0
 #define O_MODE_MASK 0xfff
 #define O_DIR 0x1000
-#define MAX_FN_LEN 256
 typedef struct {
     int     size;
-    char    name[MAX_FN_LEN];
-    uint32  time;
+    char    name[NAME_MAX + 1];
+    time_t  time;
     uint32  attr;
 } dirent_t;
 
-typedef void *vfs_handler[];
-
-static int fs_handler_add(char *fn, void *p) {
-    return 0;
-}
-
-static int fs_handler_remove(void *p) {
-    return 0;
-}
-
 /* Thread prims */
-typedef int thd_mutex_t;
-
-static void thd_mutex_reset(int *p) { }
-static void thd_mutex_lock(int *p) { }
-static void thd_mutex_unlock(int *p) { }
+typedef int mutex_t;
+#define MUTEX_INITIALIZER 0
+static void mutex_init(mutex_t *p) { *p = 0; }
+static void mutex_destroy(mutex_t *p) { (void)p; }
+static void mutex_lock(mutex_t *p) { (void)p; }
+static void mutex_unlock(mutex_t *p) { (void)p; }
 
 /* iso9660 defines */
-#define MAX_ISO_FILES 8
+#define FS_CD_MAX_FILES 8
+#define FS_ISO9660_CACHE_DEFAULT 16
+#define FS_ISO9660_READAHEAD_DEFAULT 32
+#define FS_ISO9660_DIR_TABLE_DEFAULT (64 * 1024)
+
+typedef struct fs_iso9660_cache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t readahead;
+    size_t size;
+    size_t used;
+} fs_iso9660_cache_stats_t;
 
 /****************************** END LINUX SPECIFIC CODE ***********************************/
 
 /* Cut here to insert into KallistiOS fs_iso9660.c */
 
 
-/* #include <kallisti/stdtypes.h> */
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+static int init_percd(void);
+static int percd_done;
+int iso_reset(void);
+
+/********************************************************************************/
+/* Low-level Joliet utils */
+
+/* Joliet UCS is big endian */
+static void utf2ucs(uint8 * ucs, const uint8 * utf) {
+    int c;
+
+    do {
+        c = *utf++;
+
+        if(c <= 0x7f) {
+        }
+        else if(c < 0xc0) {
+            c = (c & 0x1f) << 6;
+            c |= (*utf++) & 0x3f;
+        }
+        else {
+            c = (c & 0x0f) << 12;
+            c |= ((*utf++) & 0x3f) << 6;
+            c |= (*utf++) & 0x3f;
+        }
+
+        *ucs++ = c >> 8;
+        *ucs++ = c & 0xff;
+    }
+    while(c);
+}
+
+static void ucs2utfn(uint8 * utf, const uint8 * ucs, size_t len) {
+    int c;
+
+    len = len / 2;
+
+    while(len) {
+        len--;
+        c = (*ucs++) << 8;
+        c |= *ucs++;
+
+        if(c == ';') break;
+
+        if(c <= 0x7f) {
+            *utf++ = c;
+        }
+        else if(c <= 0x7ff) {
+            *utf++ = 0xc0 | (c >> 6);
+            *utf++ = 0x80 | (c & 0x3f);
+        }
+        else {
+            *utf++ = 0xe0 | (c >> 12);
+            *utf++ = 0x80 | ((c >> 6) & 0x3f);
+            *utf++ = 0x80 | (c & 0x3f);
+        }
+    }
+
+    *utf = 0;
+}
+
+static int ucscompare(const uint8 * isofn, const uint8 * normalfn, int isosize) {
+    int i, c0, c1 = 0;
+
+    /* Compare ISO name */
+    for(i = 0; i < isosize; i += 2) {
+        c0 = ((int)isofn[i] << 8) | ((int)isofn[i + 1]);
+        c1 = ((int)normalfn[i] << 8) | ((int)normalfn[i + 1]);
+
+        if(c0 == ';') break;
+
+        /* Otherwise, compare the chars normally */
+        if(tolower(c0) != tolower(c1))
+            return -1;
+    }
+
+    c1 = ((int)normalfn[i] << 8) | (normalfn[i + 1]);
+
+    /* Catch ISO name shorter than normal name */
+    if(c1 != '/' && c1 != '\0')
+        return -1;
+    else
+        return 0;
+}
+
+static int isjoliet(char * p) {
+    if(p[0] == '%' && p[1] == '/') {
+        switch(p[2]) {
+            case '@':
+                return 1;
+            case 'C':
+                return 2;
+            case 'E':
+                return 3;
+        }
+    }
+
+    return 0;
+}
+
+static int joliet;
 
 /********************************************************************************/
 /* Low-level ISO utils */
@@ -124,139 +284,392 @@ typedef struct {
     char    name[1];
 } iso_dirent_t;
 
-#if 0
-/* Util function to reverse the byte order of a uint32 */
-static uint32 ntohl_32(void *data) {
-    uint8 *d = (uint8*)data;
-    return (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | (d[3] << 0);
-}
-#endif
-
 /* This seems kinda silly, but it's important since it allows us
    to do unaligned accesses on a buffer */
-static uint32 htohl_32(void *data) {
-    uint8 *d = (uint8*)data;
-    return (d[0] << 0) | (d[1] << 8) | (d[2] << 16) | (d[3] << 24);
+static uint32 htohl_32(const void *data) {
+    const uint8 *d = (const uint8*)data;
+    return (d[0] << 0) | (d[1] << 8) | (d[2] << 16) | ((uint32)d[3] << 24);
 }
 
-#if 0
-/* Read red-book section 7.1.1 number (8 bit) */
-static uint8 iso_711(uint8 *from) {
-    return (*from & 0xff);
-}
-#endif
-
 /* Read red-book section 7.3.3 number (32 bit LE / 32 bit BE) */
-static uint32 iso_733(uint8 *from) {
+static uint32 iso_733(const uint8 *from) {
     return htohl_32(from);
 }
 
 
 /********************************************************************************/
-/* Low-level block cacheing routines. This implements a simple queue-based
-   LRU/MRU cacheing system. Whenever a block is requested, it will be placed
-   on the MRU end of the queue. As more blocks are loaded than can fit in
-   the cache, blocks are deleted from the LRU end. */
-
-/* Holds the data for one cache block, and a pointer to the next one.
-   As sectors are read from the disc, they are added to the front of
-   this cache. As the cache fills up, sectors are removed from the end
-   of it. */
-typedef struct {
-    int32   sector;         /* CD sector */
-    uint8   data[2048];     /* Sector data */
+/* Low-level block cacheing routines. There are two caches, one for directory
+   (inode) sectors and one for file data, so that streaming a file doesn't
+   push the directories out. Each one is a fixed set of blocks, found through
+   a hash table on the sector number and kept on an LRU list: the most
+   recently used block is at the head, and the one at the tail is reused when
+   a sector that isn't in the cache is read.
+
+   A miss in the data cache can read several sectors with one command: the
+   rest of the sectors the caller asked for, and more when a file is being
+   read sequentially. They go into a staging buffer and are copied into
+   blocks from there, since the blocks at the end of the LRU list aren't next
+   to each other. */
+
+/* Holds the data for one cache block. The data itself lives in one 32-byte
+   aligned allocation for the whole cache. */
+typedef struct cache_block {
+    TAILQ_ENTRY(cache_block) lru;   /* LRU list */
+    struct cache_block *hnext;      /* Hash chain */
+    uint32  sector;                 /* CD sector, or -1 if unused */
+    uint8   *data;                  /* Sector data */
 } cache_block_t;
 
-/* List of cache blocks (ordered least recently used to most recently) */
-#define NUM_CACHE_BLOCKS 8
-static cache_block_t *cache[NUM_CACHE_BLOCKS];
+typedef struct {
+    TAILQ_HEAD(iso_lru, cache_block) lru;
+    cache_block_t   *blocks;        /* All of the blocks */
+    cache_block_t   **buckets;      /* Hash table */
+    uint8           *data;          /* Data for all of the blocks */
+    size_t          nblocks;        /* Number of blocks */
+    size_t          nbuckets;       /* Number of buckets, a power of two */
+    size_t          want;           /* Size to use, in blocks */
+    uint8           *rabuf;         /* Staging buffer for multi-sector reads */
+    size_t          ramax;          /* Most sectors read with one command */
+    size_t          rawant;         /* Readahead to use, in sectors */
+    fs_iso9660_cache_stats_t stats;
+} iso_cache_t;
+
+static iso_cache_t icache = { .want = FS_ISO9660_CACHE_DEFAULT };   /* inode cache */
+static iso_cache_t dcache = { .want = FS_ISO9660_CACHE_DEFAULT,     /* data cache */
+                              .rawant = FS_ISO9660_READAHEAD_DEFAULT };
+
+/* Smallest readahead window, in sectors, once a file is read sequentially.
+   It doubles with every sequential read after that. */
+#define ISO_RA_MIN      4
+
+/* Fewest whole sectors read straight into the caller's buffer */
+#define ISO_DIRECT_MIN  2
 
 /* Cache modification mutex */
-static thd_mutex_t cache_mutex;
+static mutex_t cache_mutex = MUTEX_INITIALIZER;
 
-/* Clears all cache blocks */
-static void bclear() {
-    int i;
+static size_t bhash(const iso_cache_t *cache, uint32 sector) {
+    return (sector ^ (sector >> 7)) & (cache->nbuckets - 1);
+}
 
-    thd_mutex_lock(&cache_mutex);
+static cache_block_t *bfind(const iso_cache_t *cache, uint32 sector) {
+    cache_block_t *b;
 
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        cache[i]->sector = -1;
+    for(b = cache->buckets[bhash(cache, sector)]; b; b = b->hnext) {
+        if(b->sector == sector)
+            break;
+    }
 
-    thd_mutex_unlock(&cache_mutex);
+    return b;
 }
 
-/* Graduate a block from its current position to the MRU end of the cache */
-static void bgrad(int block) {
-    int     i;
-    cache_block_t   *tmp;
+/* Take a block out of its hash chain. */
+static void bunhash(iso_cache_t *cache, cache_block_t *b) {
+    cache_block_t **pp = &cache->buckets[bhash(cache, b->sector)];
+
+    while(*pp != b)
+        pp = &(*pp)->hnext;
+
+    *pp = b->hnext;
+}
+
+/* Marks all of the blocks unused. Must be called with the mutex held. */
+static void breset_cache(iso_cache_t *cache) {
+    size_t i;
+
+    TAILQ_INIT(&cache->lru);
+
+    for(i = 0; i < cache->nbuckets; i++)
+        cache->buckets[i] = NULL;
+
+    for(i = 0; i < cache->nblocks; i++) {
+        cache->blocks[i].sector = (uint32)-1;
+        cache->blocks[i].hnext = NULL;
+        TAILQ_INSERT_TAIL(&cache->lru, &cache->blocks[i], lru);
+    }
+
+    cache->stats.used = 0;
+}
 
-    /* Don't try it with the end block */
-    if(block < 0 || block >= (NUM_CACHE_BLOCKS - 1)) return;
+/* Clears all cache blocks */
+static void bclear_cache(iso_cache_t *cache) {
+    mutex_lock(&cache_mutex);
+    breset_cache(cache);
+    mutex_unlock(&cache_mutex);
+}
+
+static void bfree_cache(iso_cache_t *cache) {
+    free(cache->blocks);
+    free(cache->buckets);
+    free(cache->data);
+    free(cache->rabuf);
+    cache->blocks = NULL;
+    cache->buckets = NULL;
+    cache->data = NULL;
+    cache->rabuf = NULL;
+    cache->nblocks = cache->nbuckets = 0;
+    cache->ramax = 1;
+    cache->stats.size = cache->stats.used = 0;
+    TAILQ_INIT(&cache->lru);
+}
+
+/* Set up a cache with cache->want blocks, and a staging buffer for up to
+   cache->rawant sectors of readahead. A single read can't fill more than
+   half of the cache. Everything in it is dropped. */
+static int balloc_cache(iso_cache_t *cache) {
+    cache_block_t *blocks, **buckets;
+    uint8 *data, *rabuf = NULL;
+    size_t i, nbuckets, ramax;
+
+    for(nbuckets = 1; nbuckets < cache->want; nbuckets <<= 1)
+        ;
+
+    ramax = cache->rawant < cache->want / 2 ? cache->rawant : cache->want / 2;
+
+    if(ramax < 2)
+        ramax = 1;
+
+    blocks = (cache_block_t *)malloc(cache->want * sizeof(cache_block_t));
+    buckets = (cache_block_t **)malloc(nbuckets * sizeof(cache_block_t *));
+    data = (uint8 *)memalign(32, cache->want * 2048);
+
+    if(ramax > 1)
+        rabuf = (uint8 *)memalign(32, ramax * 2048);
+
+    if(!blocks || !buckets || !data || (ramax > 1 && !rabuf)) {
+        free(blocks);
+        free(buckets);
+        free(data);
+        free(rabuf);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mutex_lock(&cache_mutex);
+
+    bfree_cache(cache);
+    cache->blocks = blocks;
+    cache->buckets = buckets;
+    cache->data = data;
+    cache->rabuf = rabuf;
+    cache->ramax = ramax;
+    cache->nblocks = cache->stats.size = cache->want;
+    cache->nbuckets = nbuckets;
+
+    for(i = 0; i < cache->nblocks; i++)
+        blocks[i].data = data + i * 2048;
 
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+    breset_cache(cache);
 
-    for(i = block; i < (NUM_CACHE_BLOCKS - 1); i++)
-        cache[i] = cache[i + 1];
+    mutex_unlock(&cache_mutex);
 
-    cache[NUM_CACHE_BLOCKS - 1] = tmp;
+    return 0;
+}
+
+/* Take the least recently used block to put a new sector in. Unused blocks
+   are kept at the end, so they go first. The block is left unused until it
+   is passed to binsert(). Must be called with the mutex held. */
+static cache_block_t *btake(iso_cache_t *cache) {
+    cache_block_t *b = TAILQ_LAST(&cache->lru, iso_lru);
+
+    if(b->sector != (uint32)-1) {
+        cache->stats.evictions++;
+        cache->stats.used--;
+        bunhash(cache, b);
+        b->sector = (uint32)-1;
+    }
+
+    return b;
+}
+
+/* Put a block that has been filled in into the hash table, as the most
+   recently used one. Must be called with the mutex held. */
+static void binsert(iso_cache_t *cache, cache_block_t *b, uint32 sector) {
+    cache->stats.used++;
+    b->sector = sector;
+    b->hnext = cache->buckets[bhash(cache, sector)];
+    cache->buckets[bhash(cache, sector)] = b;
+
+    TAILQ_REMOVE(&cache->lru, b, lru);
+    TAILQ_INSERT_HEAD(&cache->lru, b, lru);
 }
 
-/* Pulls the requested sector into a cache block and returns the cache
-   block index. Note that the sector in question may already be in the
-   cache, in which case it just returns the containing block. */
-static int bread(int32 sector) {
-    int i, rv = -1;
+/* Pulls the requested sector into a cache block and returns the block. Note
+   that the sector in question may already be in the cache, in which case it
+   just returns the containing block. Otherwise, up to count sectors starting
+   with it are read with one command, stopping before the first one that is
+   in the cache already. */
+static void iso_break_all(void);
+static cache_block_t *bread_cache(iso_cache_t *cache, uint32 sector,
+                                  size_t count) {
+    cache_block_t *b;
+    size_t i, n;
+    int j;
 
-    thd_mutex_lock(&cache_mutex);
+    mutex_lock(&cache_mutex);
 
     /* Look for a pre-existing cache block */
-    for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
-        if(cache[i]->sector == sector) {
-            bgrad(i);
-            rv = NUM_CACHE_BLOCKS - 1;
+    if((b = bfind(cache, sector))) {
+        cache->stats.hits++;
+        TAILQ_REMOVE(&cache->lru, b, lru);
+        TAILQ_INSERT_HEAD(&cache->lru, b, lru);
+        goto bread_exit;
+    }
+
+    cache->stats.misses++;
+
+    if(count > cache->ramax)
+        count = cache->ramax;
+
+    for(n = 1; n < count && !bfind(cache, sector + n); n++)
+        ;
+
+    if(n == 1) {
+        /* Load the requested block */
+        b = btake(cache);
+        j = cdrom_read_sectors(b->data, sector + 150, 1);
+
+        /* If it failed, the block stays at the end of the list, unused. */
+    }
+    else {
+        /* Load all of them, then fill in blocks last to first so that the
+           requested one ends up most recently used. */
+        dcache_inval_range((uintptr_t)cache->rabuf, n * 2048);
+        j = cdrom_read_sectors_ex(cache->rabuf, sector + 150, n,
+                                  CDROM_READ_DMA);
+
+        if(j == ERR_OK) {
+            for(i = n; i-- > 0;) {
+                b = btake(cache);
+                memcpy(b->data, cache->rabuf + i * 2048, 2048);
+                binsert(cache, b, sector + i);
+            }
+
+            cache->stats.readahead += n - 1;
             goto bread_exit;
         }
     }
 
-    /* If not, look for an open cache slot; if we find one, use it */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        if(cache[i]->sector == -1) break;
+    if(j != ERR_OK) {
+        //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors for %d: %d\n",
+        //  sector+150, j);
+        mutex_unlock(&cache_mutex);
+
+        /* This clears the caches, so it can't be done with the mutex held. */
+        if(j == ERR_DISC_CHG || j == ERR_NO_DISC) {
+            init_percd();
+        }
+
+        return NULL;
     }
 
-    /* If we didn't find one, kick an LRU block out of cache */
-    if(i >= NUM_CACHE_BLOCKS) {
-        i = 0;
+    binsert(cache, b, sector);
+
+    /* Return the new cache block */
+bread_exit:
+    mutex_unlock(&cache_mutex);
+    return b;
+}
+
+/* Tell whether a sector is in a cache, without reading it */
+static int bcached(iso_cache_t *cache, uint32 sector) {
+    int rv;
+
+    mutex_lock(&cache_mutex);
+    rv = bfind(cache, sector) != NULL;
+    mutex_unlock(&cache_mutex);
+
+    return rv;
+}
+
+/* read data block, and up to count - 1 more after it on a miss */
+static cache_block_t *bdread(uint32 sector, size_t count) {
+    return bread_cache(&dcache, sector, count);
+}
+
+/* read inode block */
+static cache_block_t *biread(uint32 sector) {
+    return bread_cache(&icache, sector, 1);
+}
+
+/* Clear both caches */
+static void bclear(void) {
+    bclear_cache(&dcache);
+    bclear_cache(&icache);
+}
+
+int fs_iso9660_set_cache_size(size_t dir_bytes, size_t data_bytes) {
+    size_t dir_blocks = (dir_bytes + 2047) / 2048;
+    size_t data_blocks = (data_bytes + 2047) / 2048;
+    int rv = 0;
+
+    if(!dir_blocks || !data_blocks) {
+        errno = EINVAL;
+        return -1;
     }
 
-    /* Load the requested block */
-    if(cdrom_read_sectors(cache[i]->data, sector + 150, 1) < 0) {
+    icache.want = dir_blocks;
+    dcache.want = data_blocks;
+
+    /* If we haven't been initialized yet, this is used when we are. */
+    if(!icache.blocks)
+        return 0;
+
+    if(icache.nblocks != dir_blocks && balloc_cache(&icache) < 0)
         rv = -1;
-        goto bread_exit;
+
+    if(dcache.nblocks != data_blocks && balloc_cache(&dcache) < 0)
+        rv = -1;
+
+    return rv;
+}
+
+int fs_iso9660_set_readahead(size_t bytes) {
+    size_t old = dcache.rawant;
+
+    dcache.rawant = bytes / 2048;
+
+    /* If we haven't been initialized yet, this is used when we are. */
+    if(!dcache.blocks)
+        return 0;
+
+    if(balloc_cache(&dcache) < 0) {
+        dcache.rawant = old;
+        return -1;
     }
 
-    cache[i]->sector = sector;
+    return 0;
+}
+
+void fs_iso9660_get_cache_stats(fs_iso9660_cache_stats_t *dir,
+                                fs_iso9660_cache_stats_t *data) {
+    mutex_lock(&cache_mutex);
 
-    /* Move it to the most-recently-used position */
-    bgrad(i);
-    rv = NUM_CACHE_BLOCKS - 1;
+    if(dir)
+        *dir = icache.stats;
 
-    /* Return the new cache block index */
-bread_exit:
-    thd_mutex_unlock(&cache_mutex);
-    return rv;
+    if(data)
+        *data = dcache.stats;
+
+    mutex_unlock(&cache_mutex);
 }
 
+void fs_iso9660_reset_cache_stats(void) {
+    mutex_lock(&cache_mutex);
+    icache.stats.hits = icache.stats.misses = icache.stats.evictions = 0;
+    dcache.stats.hits = dcache.stats.misses = dcache.stats.evictions = 0;
+    icache.stats.readahead = dcache.stats.readahead = 0;
+    mutex_unlock(&cache_mutex);
+}
 
 /********************************************************************************/
 /* Higher-level ISO9660 primitives */
 
 /* Root FS session location (in sectors) */
-static int32 session_base = 0;
+static uint32 session_base = 0;
 
 /* Root directory extent and size in bytes */
-static int32 root_extent = 0, root_size = 0;
+static uint32 root_extent = 0, root_size = 0;
 
 /* Root dirent */
 static iso_dirent_t root_dirent;
@@ -264,16 +677,21 @@ static iso_dirent_t root_dirent;
 
 /* Per-disc initialization; this is done every time it's discovered that
    a new CD has been inserted. */
-static int init_percd() {
+static int init_percd(void) {
     int     i;
+    cache_block_t *blk;
     CDROM_TOC   toc;
 
-    /* Start off with no cached blocks */
-    bclear();
+    dbglog(DBG_NOTICE, "fs_iso9660: disc change detected\n");
+
+    /* Start off with no cached blocks and no open files*/
+    iso_reset();
 
     /* Locate the root session */
-    if((i = cdrom_reinit()) != 0)
-        return i;
+    if((i = cdrom_reinit()) != 0) {
+        dbglog(DBG_ERROR, "fs_iso9660:init_percd: cdrom_reinit returned %d\n", i);
+        return -1;
+    }
 
     if((i = cdrom_read_toc(&toc, 0)) != 0)
         return i;
@@ -281,18 +699,37 @@ static int init_percd() {
     if(!(session_base = cdrom_locate_data_track(&toc)))
         return -1;
 
-    /* Grab and check the volume descriptor */
-    i = bread(session_base + 16 - 150);
+    /* Check for joliet extensions */
+    joliet = 0;
 
-    if(i < 0) return i;
+    for(i = 1; i <= 3; i++) {
+        blk = biread(session_base + i + 16 - 150);
 
-    if(memcmp((char*)cache[i]->data, "\01CD001", 6)) {
-        printf("fs_iso9660: disc is not iso9660\r\n");
-        return -1;
+        if(!blk) return -1;
+
+        if(memcmp((char *)blk->data, "\02CD001", 6) == 0) {
+            joliet = isjoliet((char *)blk->data + 88);
+            dbglog(DBG_NOTICE, "  (joliet level %d extensions detected)\n", joliet);
+
+            if(joliet) break;
+        }
+    }
+
+    /* If that failed, go after standard/RockRidge ISO */
+    if(!joliet) {
+        /* Grab and check the volume descriptor */
+        blk = biread(session_base + 16 - 150);
+
+        if(!blk) return -1;
+
+        if(memcmp((char*)blk->data, "\01CD001", 6)) {
+            dbglog(DBG_ERROR, "fs_iso9660: disc is not iso9660\r\n");
+            return -1;
+        }
     }
 
     /* Locate the root directory */
-    memcpy(&root_dirent, cache[i]->data + 156, sizeof(iso_dirent_t));
+    memcpy(&root_dirent, blk->data + 156, sizeof(iso_dirent_t));
     root_extent = iso_733(root_dirent.extent);
     root_size = iso_733(root_dirent.size);
 
@@ -300,18 +737,32 @@ static int init_percd() {
 }
 
 /* Compare an ISO9660 filename against a normal filename. This takes into
-   account the version code on the end and is not case sensitive. */
+   account the version code on the end and is not case sensitive. Also
+   takes into account the trailing period that some CD burning software
+   adds. */
 static int fncompare(const char *isofn, int isosize, const char *normalfn) {
     int i;
 
+    /* Compare ISO name */
     for(i = 0; i < isosize; i++) {
-        if(isofn[i] == ';') return 0;
+        /* Weed out version codes */
+        if(isofn[i] == ';') break;
+
+        /* Deal with crap '.' at end of filenames */
+        if(isofn[i] == '.' &&
+                (i == (isosize - 1) || isofn[i + 1] == ';'))
+            break;
 
-        if(tolower(isofn[i]) != tolower(normalfn[i]))
+        /* Otherwise, compare the chars normally */
+        if(tolower((int)isofn[i]) != tolower((int)normalfn[i]))
             return -1;
     }
 
-    return 0;
+    /* Catch ISO name shorter than normal name */
+    if(normalfn[i] != '/' && normalfn[i] != '\0')
+        return -1;
+    else
+        return 0;
 }
 
 /* Locate an ISO9660 object in the given directory; this can be a directory or
@@ -326,252 +777,742 @@ static int fncompare(const char *isofn, int isosize, const char *normalfn) {
    expect this buffer to stay around much longer than the call itself).
  */
 static iso_dirent_t *find_object(const char *fn, int dir,
-                                 int32 dir_extent, int32 dir_size) {
-    int32         i;
-    iso_dirent_t * de;
+                                 uint32 dir_extent, uint32 dir_size) {
+    int     i;
+    cache_block_t *c;
+    iso_dirent_t    *de;
+
+    /* RockRidge */
+    int     len;
+    uint8       *pnt;
+    char        rrname[NAME_MAX];
+    int     rrnamelen;
+    int     size_left;
+
+    /* We need this to be signed for our while loop to end properly */
+    size_left = (int)dir_size;
+
+    /* Joliet */
+    uint8       * ucsname = (uint8 *)rrname;
 
-    while(dir_size > 0) {
-        int c = bread(dir_extent);
+    /* If this is a Joliet CD, then UCSify the name */
+    if(joliet)
+        utf2ucs(ucsname, (uint8 *)fn);
 
-        if(c < 0) return NULL;
+    while(size_left > 0) {
+        c = biread(dir_extent);
 
-        for(i = 0; i < 2048 && i < dir_size;) {
+        if(!c) return NULL;
+
+        for(i = 0; i < 2048 && i < size_left;) {
             /* Locate the current dirent */
-            de = (iso_dirent_t *)(cache[c]->data + i);
+            de = (iso_dirent_t *)(c->data + i);
 
             if(!de->length) break;
 
-            /* Check the filename against the requested one */
-            if(!fncompare(de->name, de->name_len, fn)) {
-                if(!((dir << 1) ^ de->flags))
-                    return de;
+            /* Try the Joliet filename if the CD is a Joliet disc */
+            if(joliet) {
+                if(!ucscompare((uint8 *)de->name, ucsname, de->name_len)) {
+                    if(!((dir << 1) ^ de->flags))
+                        return de;
+                }
+            }
+            else {
+                /* Assume no Rock Ridge name */
+                rrnamelen = 0;
+
+                /* Check for Rock Ridge NM extension */
+                len = de->length - sizeof(iso_dirent_t)
+                      + sizeof(de->name) - de->name_len;
+                pnt = (uint8*)de + sizeof(iso_dirent_t)
+                      - sizeof(de->name) + de->name_len;
+
+                if((de->name_len & 1) == 0) {
+                    pnt++;
+                    len--;
+                }
+
+                while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
+                    if(strncmp((char *)pnt, "NM", 2) == 0) {
+                        rrnamelen = pnt[2] - 5;
+                        strncpy(rrname, (char *)(pnt + 5), rrnamelen);
+                        rrname[rrnamelen] = 0;
+                    }
+
+                    len -= pnt[2];
+                    pnt += pnt[2];
+                }
+
+                /* Check the filename against the requested one */
+                if(rrnamelen > 0) {
+                    char *p = strchr(fn, '/');
+                    int fnlen;
+
+                    if(p)
+                        fnlen = p - fn;
+                    else
+                        fnlen = strlen(fn);
+
+                    if(!strncasecmp(rrname, fn, fnlen) && ! *(rrname + fnlen)) {
+                        if(!((dir << 1) ^ de->flags))
+                            return de;
+                    }
+                }
+                else {
+                    if(!fncompare(de->name, de->name_len, fn)) {
+                        if(!((dir << 1) ^ de->flags))
+                            return de;
+                    }
+                }
             }
 
             i += de->length;
         }
 
         dir_extent++;
-        dir_size -= 2048;
+        size_left -= 2048;
     }
 
     return NULL;
 }
 
-/* Locate an ISO9660 object anywhere on the disc, starting at the root,
-   and expecting a fully qualified path name. This is analogous to find_object
-   but it searches with the path in mind.
+/* Helper function for readdir: post-processes an ISO filename to make
+   it a bit prettier. */
+static void fn_postprocess(char *fnin) {
+    char    * fn = fnin;
 
-   fn:      object filename (relative to the passed directory)
-   dir:     0 if looking for a file, 1 if looking for a dir
-   dir_extent:  directory extent to start with
-   dir_size:    directory size (in bytes)
+    while(*fn && *fn != ';') {
+        *fn = tolower((int) * fn);
+        fn++;
+    }
 
-   It will return a pointer to a transient dirent buffer (i.e., don't
-   expect this buffer to stay around much longer than the call itself).
- */
-static iso_dirent_t *find_object_path(const char *fn, int dir, iso_dirent_t *start) {
-    char        *cur;
+    *fn = 0;
 
-    /* If the object is in a sub-tree, traverse the trees looking
-       for the right directory */
-    while((cur = strchr(fn, '/'))) {
-        if(cur != fn) {
-            /* Note: trailing path parts don't matter since find_object
-               only compares based on the FN length on the disc. */
-            start = find_object(fn, 1, iso_733(start->extent), iso_733(start->size));
+    /* Strip trailing dots */
+    if(fn > fnin && fn[-1] == '.') {
+        fn[-1] = 0;
+    }
+}
 
-            if(start == NULL) return NULL;
-        }
+/* Get the name of a directory entry the way readdir shows it: the Joliet
+   name in UTF-8, the Rock Ridge name, or the ISO9660 name made prettier. */
+static void iso_dirent_name(const iso_dirent_t *de, char *name) {
+    /* RockRidge */
+    int     len;
+    const uint8 *pnt;
 
-        fn = cur + 1;
+    if(joliet) {
+        ucs2utfn((uint8 *)name, (const uint8 *)de->name, de->name_len);
+        return;
     }
 
-    /* Locate the file in the resulting directory */
-    if(*fn) {
-        start = find_object(fn, dir, iso_733(start->extent), iso_733(start->size));
-        return start;
+    strncpy(name, de->name, de->name_len);
+    name[de->name_len] = 0;
+    fn_postprocess(name);
+
+    /* Check for Rock Ridge NM extension */
+    len = de->length - sizeof(iso_dirent_t) + sizeof(de->name) - de->name_len;
+    pnt = (const uint8 *)de + sizeof(iso_dirent_t) - sizeof(de->name) +
+          de->name_len;
+
+    if((de->name_len & 1) == 0) {
+        pnt++;
+        len--;
     }
-    else {
-        if(!dir)
-            return NULL;
-        else
-            return start;
+
+    while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
+        if(strncmp((const char *)pnt, "NM", 2) == 0) {
+            strncpy(name, (const char *)(pnt + 5), pnt[2] - 5);
+            name[pnt[2] - 5] = 0;
+        }
+
+        len -= pnt[2];
+        pnt += pnt[2];
     }
 }
 
 /********************************************************************************/
-/* File primitives */
+/* Directory tables. The first time a directory is searched, all of its
+   entries are read into a table with a hash on their names, so that looking
+   something else up in it later doesn't read and scan its sectors again.
+   Tables are kept on an LRU list up to a total size, and all of them are
+   dropped when the disc changes. */
 
-/* File handles.. I could probably do this with a linked list, but I'm just
-   too lazy right now. =) */
-static struct {
-    int32      first_extent;   /* First sector */
-    int     dir;        /* >0 if a directory */
-    int32      ptr;        /* Current read position in bytes */
-    int32      size;       /* Length of file in bytes */
-    dirent_t    dirent;     /* A static dirent to pass back to clients */
-} fh[MAX_ISO_FILES];
+/* One entry of a directory table */
+typedef struct {
+    uint32  extent;         /* First sector */
+    uint32  size;           /* Size in bytes */
+    uint32  name;           /* Offset of the name in the name pool */
+    uint32  next;           /* Next entry in the hash chain, or -1 */
+    uint8   flags;          /* ISO9660 file flags */
+} iso_dent_t;
+
+typedef struct iso_dirtab {
+    TAILQ_ENTRY(iso_dirtab) lru;    /* LRU list */
+    struct iso_dirtab *hnext;       /* Hash chain */
+    uint32      extent;     /* First sector of the directory */
+    uint32      count;      /* Number of entries */
+    uint32      nbuckets;   /* Number of name hash buckets, a power of two */
+    uint32      *buckets;   /* First entry in each hash chain, or -1 */
+    iso_dent_t  *ents;      /* Entries, in directory order */
+    char        *names;     /* Name pool */
+    size_t      bytes;      /* Memory used by all of the above */
+} iso_dirtab_t;
+
+/* Tables by the extent of their directory */
+#define DIRTAB_BUCKETS  64
+
+static TAILQ_HEAD(iso_dirtab_list, iso_dirtab) dirtabs =
+    TAILQ_HEAD_INITIALIZER(dirtabs);
+static iso_dirtab_t *dirtab_buckets[DIRTAB_BUCKETS];
+static size_t dirtab_bytes, dirtab_max = FS_ISO9660_DIR_TABLE_DEFAULT;
+static uint32 dirtab_gen;
+static mutex_t dirtab_mutex = MUTEX_INITIALIZER;
+
+/* Hash a name without regard to case */
+static uint32 dirtab_hash(const char *name, size_t len) {
+    uint32 h = 2166136261U;
+
+    while(len--)
+        h = (h ^ (uint8)tolower((int)(uint8)*name++)) * 16777619U;
+
+    return h;
+}
 
-/* Mutex for file handles */
-static thd_mutex_t fh_mutex;
+static void dirtab_free(iso_dirtab_t *d) {
+    free(d->buckets);
+    free(d->ents);
+    free(d->names);
+    free(d);
+}
 
-/* Open a file or directory */
-static int32 iso_open(const char *fn, int mode) {
-    int32      fd;
-    iso_dirent_t    *de;
+/* Find the table of a directory. Must be called with the mutex held. */
+static iso_dirtab_t *dirtab_find(uint32 extent) {
+    iso_dirtab_t *d;
 
-    /* Make sure they don't want to open things as writeable */
-    if((mode & O_MODE_MASK) != O_RDONLY)
-        return 0;
+    for(d = dirtab_buckets[extent % DIRTAB_BUCKETS]; d; d = d->hnext) {
+        if(d->extent == extent)
+            break;
+    }
 
-    /* Find a free file handle */
-    thd_mutex_lock(&fh_mutex);
+    return d;
+}
 
-    for(fd = 0; fd < MAX_ISO_FILES; fd++)
-        if(fh[fd].first_extent == 0) {
-            fh[fd].first_extent = -1;
-            break;
+/* Drop a table. Must be called with the mutex held. */
+static void dirtab_drop(iso_dirtab_t *d) {
+    iso_dirtab_t **pp = &dirtab_buckets[d->extent % DIRTAB_BUCKETS];
+
+    while(*pp != d)
+        pp = &(*pp)->hnext;
+
+    *pp = d->hnext;
+    TAILQ_REMOVE(&dirtabs, d, lru);
+    dirtab_bytes -= d->bytes;
+    dirtab_free(d);
+}
+
+/* Drop tables until they fit in max bytes. Must be called with the mutex
+   held. */
+static void dirtab_trim(size_t max) {
+    while(dirtab_bytes > max)
+        dirtab_drop(TAILQ_LAST(&dirtabs, iso_dirtab_list));
+}
+
+/* Drop all of the tables */
+static void dirtab_clear(void) {
+    mutex_lock(&dirtab_mutex);
+    dirtab_trim(0);
+    dirtab_gen++;
+    mutex_unlock(&dirtab_mutex);
+}
+
+/* Read a directory into a new table. Returns NULL if it can't be read or
+   there isn't enough memory. */
+static iso_dirtab_t *dirtab_load(uint32 extent, uint32 size) {
+    iso_dirtab_t *d;
+    cache_block_t *c;
+    iso_dirent_t *de;
+    iso_dent_t *ents;
+    char name[NAME_MAX * 2], *names;   /* Joliet names can be 381 bytes */
+    uint32 ecap = 0, ncap = 0, nlen = 0, h;
+    int i, size_left = (int)size;
+    size_t len;
+
+    if(!(d = (iso_dirtab_t *)calloc(1, sizeof(iso_dirtab_t))))
+        return NULL;
+
+    d->extent = extent;
+
+    while(size_left > 0) {
+        if(!(c = biread(extent)))
+            goto fail;
+
+        for(i = 0; i < 2048 && i < size_left;) {
+            de = (iso_dirent_t *)(c->data + i);
+
+            if(!de->length) break;
+
+            i += de->length;
+
+            /* Skip . and .. */
+            if(de->name_len == 1 && (uint8)de->name[0] <= 1)
+                continue;
+
+            iso_dirent_name(de, name);
+            len = strlen(name) + 1;
+
+            if(d->count == ecap) {
+                ecap = ecap ? ecap * 2 : 16;
+
+                if(!(ents = (iso_dent_t *)realloc(d->ents,
+                                                  ecap * sizeof(iso_dent_t))))
+                    goto fail;
+
+                d->ents = ents;
+            }
+
+            if(nlen + len > ncap) {
+                while(nlen + len > ncap)
+                    ncap = ncap ? ncap * 2 : 256;
+
+                if(!(names = (char *)realloc(d->names, ncap)))
+                    goto fail;
+
+                d->names = names;
+            }
+
+            memcpy(d->names + nlen, name, len);
+            d->ents[d->count].extent = iso_733(de->extent);
+            d->ents[d->count].size = iso_733(de->size);
+            d->ents[d->count].flags = de->flags;
+            d->ents[d->count].name = nlen;
+            d->count++;
+            nlen += len;
         }
 
-    thd_mutex_unlock(&fh_mutex);
+        extent++;
+        size_left -= 2048;
+    }
+
+    for(d->nbuckets = 1; d->nbuckets < d->count; d->nbuckets <<= 1)
+        ;
+
+    if(!(d->buckets = (uint32 *)malloc(d->nbuckets * sizeof(uint32))))
+        goto fail;
+
+    memset(d->buckets, 0xff, d->nbuckets * sizeof(uint32));
+
+    /* Chains are built from the end so that they're in directory order, and
+       the first match is the same one a scan would find. */
+    for(h = d->count; h-- > 0;) {
+        i = dirtab_hash(d->names + d->ents[h].name,
+                        strlen(d->names + d->ents[h].name)) &
+            (d->nbuckets - 1);
+        d->ents[h].next = d->buckets[i];
+        d->buckets[i] = h;
+    }
 
-    if(fd >= MAX_ISO_FILES)
+    d->bytes = sizeof(iso_dirtab_t) + ecap * sizeof(iso_dent_t) + ncap +
+               d->nbuckets * sizeof(uint32);
+
+    return d;
+
+fail:
+    dirtab_free(d);
+    return NULL;
+}
+
+/* Look a name up in a table, the same way find_object does. */
+static int dirtab_search(const iso_dirtab_t *d, const char *fn, size_t len,
+                         int dir, uint32 *extent, uint32 *size) {
+    const iso_dent_t *e;
+    uint32 i;
+
+    for(i = d->buckets[dirtab_hash(fn, len) & (d->nbuckets - 1)];
+        i != (uint32)-1; i = e->next) {
+        e = &d->ents[i];
+
+        if(!strncasecmp(d->names + e->name, fn, len) &&
+           !d->names[e->name + len] && !((dir << 1) ^ e->flags)) {
+            *extent = e->extent;
+            *size = e->size;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Keep a new table, unless another thread beat us to it, the disc changed
+   while it was being read, or it's too big. */
+static void dirtab_add(iso_dirtab_t *d, uint32 gen) {
+    mutex_lock(&dirtab_mutex);
+
+    if(gen != dirtab_gen || d->bytes > dirtab_max || dirtab_find(d->extent)) {
+        mutex_unlock(&dirtab_mutex);
+        dirtab_free(d);
+        return;
+    }
+
+    dirtab_trim(dirtab_max - d->bytes);
+
+    d->hnext = dirtab_buckets[d->extent % DIRTAB_BUCKETS];
+    dirtab_buckets[d->extent % DIRTAB_BUCKETS] = d;
+    TAILQ_INSERT_HEAD(&dirtabs, d, lru);
+    dirtab_bytes += d->bytes;
+
+    mutex_unlock(&dirtab_mutex);
+}
+
+void fs_iso9660_set_dir_table_size(size_t bytes) {
+    mutex_lock(&dirtab_mutex);
+    dirtab_max = bytes;
+    dirtab_trim(bytes);
+    mutex_unlock(&dirtab_mutex);
+}
+
+/* Look up one part of a path in a directory, given by its extent and size.
+   On success, they are replaced by those of what was found. */
+static int find_entry(const char *fn, int dir, uint32 *extent, uint32 *size) {
+    iso_dirtab_t *d;
+    iso_dirent_t *de;
+    size_t len = strcspn(fn, "/");
+    uint32 gen;
+    int rv;
+
+    mutex_lock(&dirtab_mutex);
+
+    if((d = dirtab_find(*extent))) {
+        TAILQ_REMOVE(&dirtabs, d, lru);
+        TAILQ_INSERT_HEAD(&dirtabs, d, lru);
+        rv = dirtab_search(d, fn, len, dir, extent, size);
+        mutex_unlock(&dirtab_mutex);
+        return rv;
+    }
+
+    gen = dirtab_gen;
+    mutex_unlock(&dirtab_mutex);
+
+    /* The directory is read without the mutex held, since a read error can
+       reset everything. */
+    if(dirtab_max && (d = dirtab_load(*extent, *size))) {
+        rv = dirtab_search(d, fn, len, dir, extent, size);
+        dirtab_add(d, gen);
+        return rv;
+    }
+
+    /* If there's no table, scan the directory instead */
+    if(!(de = find_object(fn, dir, *extent, *size)))
+        return -1;
+
+    *extent = iso_733(de->extent);
+    *size = iso_733(de->size);
+    return 0;
+}
+
+/* Locate an ISO9660 object anywhere on the disc, starting at the root,
+   and expecting a fully qualified path name. This is analogous to find_object
+   but it searches with the path in mind.
+
+   fn:      object filename (relative to the root directory)
+   dir:     0 if looking for a file, 1 if looking for a dir
+   extent:  where to store the object's extent
+   size:    where to store the object's size (in bytes)
+
+   It will return 0 if the object was found, or -1 if not.
+ */
+static int find_object_path(const char *fn, int dir, uint32 *extent,
+                            uint32 *size) {
+    char        *cur;
+
+    *extent = root_extent;
+    *size = root_size;
+
+    /* If the object is in a sub-tree, traverse the trees looking
+       for the right directory */
+    while((cur = strchr(fn, '/'))) {
+        if(cur != fn) {
+            /* Note: trailing path parts don't matter since find_entry
+               only compares the first part of the name. */
+            if(find_entry(fn, 1, extent, size) < 0)
+                return -1;
+        }
+
+        fn = cur + 1;
+    }
+
+    /* Locate the file in the resulting directory */
+    if(*fn)
+        return find_entry(fn, dir, extent, size);
+    else
+        return dir ? 0 : -1;
+}
+
+/********************************************************************************/
+/* File primitives */
+
+/* File handles.. I could probably do this with a linked list, but I'm just
+   too lazy right now. =) */
+static struct {
+    uint32      first_extent;   /* First sector */
+    int     dir;        /* >0 if a directory */
+    uint32      ptr;        /* Current read position in bytes */
+    uint32      size;       /* Length of file in bytes */
+    dirent_t    dirent;     /* A static dirent to pass back to clients */
+    int     broken;     /* >0 if the CD has been swapped out since open */
+    uint32      ra_next;    /* Sector after the end of the last read */
+    uint32      ra_win;     /* Readahead window, in sectors */
+} fh[FS_CD_MAX_FILES];
+
+/* Mutex for file handles */
+static mutex_t fh_mutex;
+
+/* Break all of our open file descriptor. This is necessary when the disc
+   is changed so that we don't accidentally try to keep on doing stuff
+   with the old info. As files are closed and re-opened, the broken flag
+   will be cleared. */
+static void iso_break_all(void) {
+    int i;
+
+    mutex_lock(&fh_mutex);
+
+    for(i = 0; i < FS_CD_MAX_FILES; i++)
+        fh[i].broken = 1;
+
+    mutex_unlock(&fh_mutex);
+}
+
+/* Open a file or directory */
+static file_t iso_open(const char *fn, int mode) {
+    file_t      fd;
+    uint32      extent, size;
+    int         dir = (mode & O_DIR) ? 1 : 0;
+
+    /* Make sure they don't want to open things as writeable */
+    if((mode & O_MODE_MASK) != O_RDONLY)
         return 0;
 
-    /* For now we always do this, but it should eventually be set
-       up to detect the CD tray having been opened. */
-    if(init_percd() < 0)
+    /* Do this only when we need to (this is still imperfect) */
+    if(!percd_done && init_percd() < 0)
         return 0;
 
+    percd_done = 1;
+
     /* Find the file we want */
-    de = find_object_path(fn, (mode & O_DIR) ? 1 : 0, &root_dirent);
+    if(find_object_path(fn, dir, &extent, &size) < 0)
+        return 0;
+
+    /* Find a free file handle */
+    mutex_lock(&fh_mutex);
+
+    for(fd = 0; fd < FS_CD_MAX_FILES; fd++)
+        if(fh[fd].first_extent == 0) {
+            fh[fd].first_extent = -1;
+            break;
+        }
+
+    mutex_unlock(&fh_mutex);
 
-    if(!de) return 0;
+    if(fd >= FS_CD_MAX_FILES)
+        return 0;
 
     /* Fill in the file handle and return the fd */
-    fh[fd].first_extent = iso_733(de->extent);
-    fh[fd].dir = (mode & O_DIR) ? 1 : 0;
+    fh[fd].first_extent = extent;
+    fh[fd].dir = dir;
     fh[fd].ptr = 0;
-    fh[fd].size = iso_733(de->size);
+    fh[fd].size = size;
+    fh[fd].broken = 0;
+    fh[fd].ra_next = 0;
+    fh[fd].ra_win = 0;
 
     return fd;
 }
 
 /* Close a file or directory */
-static void iso_close(uint32 fd) {
+static int iso_close(file_t fd) {
     /* Check that the fd is valid */
-    if(fd < MAX_ISO_FILES) {
+    if(fd < FS_CD_MAX_FILES) {
         /* No need to lock the mutex: this is an atomic op */
         fh[fd].first_extent = 0;
     }
+    return 0;
 }
 
-/* Read from a file */
-static ssize_t iso_read(uint32 fd, char *buf, size_t bytes) {
-    int rv = 0, c;
-    size_t toread, thissect;
+/* Read from a file at the given position. Runs of whole sectors at least as
+   long as the readahead window are read straight into the caller's buffer
+   with a single command, and so is any whole sector if direct is set. The
+   rest goes through the cache, where a miss reads the rest of the sectors
+   this call needs and the readahead window with one command.
+
+   The window opens when a read starts where the last one stopped, doubles
+   with each read that does so (up to what the cache allows), and closes
+   when one doesn't. */
+static ssize_t iso_read_at(file_t fd, void *buf, size_t bytes, uint32 pos,
+                           int direct) {
+    int rv, toread, thissect, c;
+    uint32 sector, want, left;
+    cache_block_t *b;
+    uint8 * outbuf;
 
     /* Check that the fd is valid */
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0)
+    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken) {
+        errno = EBADF;
         return -1;
+    }
 
-    /* Read zero or more sectors into the buffer from the current pos */
-    while(bytes > 0) {
-        /* Figure out how much we still need to read */
-        toread = (bytes > (size_t)(fh[fd].size - fh[fd].ptr)) ?
-                 (size_t)(fh[fd].size - fh[fd].ptr) : bytes;
+    rv = 0;
+    outbuf = (uint8 *)buf;
 
-        if(toread == 0) break;
+    /* Adjust the readahead window */
+    if(pos / 2048 != fh[fd].ra_next && pos / 2048 + 1 != fh[fd].ra_next)
+        fh[fd].ra_win = 0;
+    else if(!fh[fd].ra_win)
+        fh[fd].ra_win = ISO_RA_MIN;
+    else if(fh[fd].ra_win < dcache.ramax)
+        fh[fd].ra_win <<= 1;
+
+    if(fh[fd].ra_win > dcache.ramax)
+        fh[fd].ra_win = dcache.ramax;
+
+    /* Read zero or more sectors into the buffer from the given pos */
+    while(bytes > 0 && pos < fh[fd].size) {
+        /* Figure out how much we still need to read */
+        toread = (bytes > (fh[fd].size - pos)) ? fh[fd].size - pos : bytes;
 
         /* How much more can we read in the current sector? */
-        thissect = 2048 - (fh[fd].ptr % 2048);
-        toread = (toread > thissect) ? thissect : toread;
+        thissect = 2048 - (pos % 2048);
+        sector = fh[fd].first_extent + pos / 2048;
+
+        if(thissect == 2048 && toread >= 2048 && !((uintptr_t)outbuf & 1) &&
+           (direct || (toread / 2048 >= ISO_DIRECT_MIN &&
+                       (uint32)toread / 2048 >= fh[fd].ra_win &&
+                       !bcached(&dcache, sector)))) {
+            /* Round it off to an even sector count */
+            thissect = toread / 2048;
+            toread = thissect * 2048;
+
+            /* DMA needs a 32-byte aligned buffer; anything else is read
+               with PIO. */
+            if(!((uintptr_t)outbuf & 31)) {
+                dcache_inval_range((uintptr_t)outbuf, toread);
+                c = cdrom_read_sectors_ex(outbuf, sector + 150, thissect,
+                                          CDROM_READ_DMA);
+            }
+            else {
+                c = cdrom_read_sectors(outbuf, sector + 150, thissect);
+            }
+
+            if(c != ERR_OK) {
+                if(c == ERR_DISC_CHG || c == ERR_NO_DISC)
+                    init_percd();
+
+                errno = EIO;
+                return -1;
+            }
+        }
+        else {
+            /* Sectors the rest of this read covers, and sectors left in the
+               file */
+            want = (pos % 2048 + toread + 2047) / 2048;
+            left = (fh[fd].size + 2047) / 2048 - pos / 2048;
 
-        /* Do the read */
-        c = bread(fh[fd].first_extent + fh[fd].ptr / 2048);
+            if(want < fh[fd].ra_win)
+                want = fh[fd].ra_win < left ? fh[fd].ra_win : left;
 
-        if(c < 0) return -1;
+            toread = (toread > thissect) ? thissect : toread;
 
-        memcpy(buf, cache[c]->data + (fh[fd].ptr % 2048), toread);
+            /* Do the read */
+            b = bdread(sector, want);
+
+            if(!b) {
+                errno = EIO;
+                return -1;
+            }
+
+            memcpy(outbuf, b->data + (pos % 2048), toread);
+        }
 
         /* Adjust pointers */
-        buf += toread;
-        fh[fd].ptr += toread;
+        outbuf += toread;
+        pos += toread;
         bytes -= toread;
         rv += toread;
     }
 
+    fh[fd].ra_next = (pos + 2047) / 2048;
+
     return rv;
 }
 
-/* Seek elsewhere in a file */
-static off_t iso_seek(uint32 fd, off_t offset, int whence) {
-    /* Check that the fd is valid */
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0)
-        return -1;
+/* Read from a file */
+static ssize_t iso_read(file_t fd, void *buf, size_t bytes) {
+    ssize_t rv;
 
-    /* Update current position according to arguments */
-    switch(whence) {
-        case SEEK_SET:
-            fh[fd].ptr = offset;
-        case SEEK_CUR:
-            fh[fd].ptr += offset;
-        case SEEK_END:
-            fh[fd].ptr = fh[fd].size + offset;
-        default:
-            return -1;
+    if(fd >= FS_CD_MAX_FILES) {
+        errno = EBADF;
+        return -1;
     }
 
-    /* Check bounds */
-    if(fh[fd].ptr > fh[fd].size) fh[fd].ptr = fh[fd].size;
+    rv = iso_read_at(fd, buf, bytes, fh[fd].ptr, 0);
 
-    return fh[fd].ptr;
+    if(rv > 0)
+        fh[fd].ptr += rv;
+
+    return rv;
 }
 
-/* Tell where in the file we are */
-static off_t iso_tell(uint32 fd) {
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0)
+/* Seek elsewhere in a file (SEEK_SET only) */
+static off_t iso_seek(file_t fd, off_t offset) {
+    /* Check that the fd is valid */
+    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken) {
+        errno = EBADF;
         return -1;
+    }
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fh[fd].ptr = offset;
+
+    /* Check bounds */
+    if(fh[fd].ptr > fh[fd].size) fh[fd].ptr = fh[fd].size;
 
     return fh[fd].ptr;
 }
 
 /* Tell how big the file is */
-static size_t iso_total(uint32 fd) {
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0)
+static size_t iso_total(file_t fd) {
+    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken)
         return -1;
 
     return fh[fd].size;
 }
 
-/* Helper function for readdir: post-processes an ISO filename to make
-   it a bit prettier. */
-static void fn_postprocess(char *fn) {
-    while(*fn && *fn != ';') {
-        *fn = tolower(*fn);
-        fn++;
-    }
-
-    *fn = 0;
-}
-
 /* Read a directory entry */
-static dirent_t *iso_readdir(uint32 fd) {
-    int     c;
+static dirent_t *iso_readdir(file_t fd) {
+    cache_block_t *c;
     iso_dirent_t    *de;
 
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0 || !fh[fd].dir)
+    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || !fh[fd].dir ||
+       fh[fd].broken) {
+        errno = EBADF;
         return NULL;
+    }
 
     /* Scan forwards until we find the next valid entry, an
        end-of-entry mark, or run out of dir size. */
+    c = NULL;
+    de = NULL;
+
     while(fh[fd].ptr < fh[fd].size) {
         /* Get the current dirent block */
-        c = bread(fh[fd].first_extent + fh[fd].ptr / 2048);
+        c = biread(fh[fd].first_extent + fh[fd].ptr / 2048);
 
-        if(c < 0) return NULL;
+        if(!c) return NULL;
 
-        de = (iso_dirent_t *)(cache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
 
         if(de->length) break;
 
@@ -582,49 +1523,42 @@ static dirent_t *iso_readdir(uint32 fd) {
     if(fh[fd].ptr >= fh[fd].size) return NULL;
 
     /* If we're at the first, skip the two blank entries */
-    if(!de->name[0]) {
+    if(!de->name[0] && de->name_len == 1) {
         fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(cache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
         fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(cache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
 
         if(!de->length) return NULL;
     }
 
     /* Fill out the VFS dirent */
-    strncpy(fh[fd].dirent.name, de->name, de->name_len);
-    fh[fd].dirent.name[de->name_len] = 0;
-    fn_postprocess(fh[fd].dirent.name);
+    iso_dirent_name(de, fh[fd].dirent.name);
 
-    if(de->flags & 2)
+    if(de->flags & 2) {
         fh[fd].dirent.size = -1;
-    else
+        fh[fd].dirent.attr = O_DIR;
+    }
+    else {
         fh[fd].dirent.size = iso_733(de->size);
+        fh[fd].dirent.attr = 0;
+    }
 
     fh[fd].ptr += de->length;
 
     return &fh[fd].dirent;
 }
 
-/* Put everything together */
-static vfs_handler vh = {
-    0, 0,       /* In-kernel, no cacheing */
-    iso_open,
-    iso_close,
-    iso_read,
-    NULL,
-    iso_seek,
-    iso_tell,
-    iso_total,
-    iso_readdir,
-    NULL,
-    NULL
-};
+int iso_reset(void) {
+    iso_break_all();
+    bclear();
+    dirtab_clear();
+    percd_done = 0;
+    return 0;
+}
 
 /* Initialize the file system */
-static int fs_iso9660_init() {
-    int i;
-
+static int fs_iso9660_init(void) {
     /* Reset fd's */
     memset(fh, 0, sizeof(fh));
 
@@ -632,28 +1566,32 @@ static int fs_iso9660_init() {
     fh[0].first_extent = -1;
 
     /* Init thread mutexes */
-    thd_mutex_reset(&cache_mutex);
-    thd_mutex_reset(&fh_mutex);
+    mutex_init(&cache_mutex);
+    mutex_init(&fh_mutex);
 
     /* Allocate cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        cache[i] = malloc(sizeof(cache_block_t));
-        cache[i]->sector = -1;
+    if(balloc_cache(&icache) < 0 || balloc_cache(&dcache) < 0) {
+        bfree_cache(&icache);
+        return -1;
     }
 
-    /* Register with VFS */
-    return fs_handler_add("/cd", &vh);
+    percd_done = 0;
+
+    return 0;
 }
 
 /* De-init the file system */
-static int fs_iso9660_shutdown() {
-    int i;
-
+static int fs_iso9660_shutdown(void) {
     /* Dealloc cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        free(cache[i]);
+    bfree_cache(&icache);
+    bfree_cache(&dcache);
+    dirtab_clear();
+
+    /* Free muteces */
+    mutex_destroy(&cache_mutex);
+    mutex_destroy(&fh_mutex);
 
-    return fs_handler_remove(&vh);
+    return 0;
 }
 
 
@@ -661,101 +1599,819 @@ static int fs_iso9660_shutdown() {
 /* Cut here to insert into KallistiOS fs_iso9660.c */
 
 /********************************************************************************/
+/* Listing and printing */
 
-#if 0
-static void read_dir(uint32 extent, uint32 size) {
-    int     i;
-    iso_dirent_t    *de;
-    char        fn[32];
+static int list_dir(const char *path) {
+    dirent_t *de;
+    file_t fd;
 
-    while(size > 0) {
-        int c = bread(extent);
+    if(!(fd = iso_open(path, O_RDONLY | O_DIR)))
+        return -1;
 
-        if(c < 0) return;
+    while((de = iso_readdir(fd))) {
+        if(de->size < 0)
+            printf("%-40s <DIR>\n", de->name);
+        else
+            printf("%-40s %d\n", de->name, de->size);
+    }
 
-        for(i = 0; i < 2048 && i < size;) {
-            de = (iso_dirent_t*)(cache[c]->data + i);
+    iso_close(fd);
+    return 0;
+}
 
-            if(!de->length) break;
+static int cat_file(const char *path) {
+    char buf[667];
+    ssize_t r;
+    file_t fd;
 
-            strncpy(fn, de->name, de->name_len);
-            fn[de->name_len] = 0;
+    if(!(fd = iso_open(path, O_RDONLY))) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return 1;
+    }
 
-            if(de->flags & 2)
-                printf("%s\t\t<DIR>\n", fn);
-            else
-                printf("%s\t\t%d\n", fn, iso_733(de->size));
+    while((r = iso_read(fd, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, r, stdout);
 
-            i += de->length;
+    iso_close(fd);
+
+    if(r < 0) {
+        fprintf(stderr, "Read error\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/********************************************************************************/
+/* Collecting the files on the disc */
+
+static char **paths;
+static uint32 *psizes;
+static size_t npaths, maxpaths;
+
+static int add_path(const char *path, uint32 size) {
+    char **np;
+    uint32 *ns;
+
+    if(npaths == maxpaths) {
+        maxpaths = maxpaths ? maxpaths * 2 : 64;
+        np = realloc(paths, maxpaths * sizeof(char *));
+        ns = np ? realloc(psizes, maxpaths * sizeof(uint32)) : NULL;
+
+        if(!np || !ns)
+            return -1;
+
+        paths = np;
+        psizes = ns;
+    }
+
+    if(!(paths[npaths] = strdup(path)))
+        return -1;
+
+    psizes[npaths++] = size;
+    return 0;
+}
+
+/* Add every file under a directory of the disc to the list. Only one
+   directory is kept open at a time, since there are few file handles. */
+static int collect(const char *dir) {
+    char **subs = NULL, **ns, path[1024];
+    size_t nsubs = 0, i;
+    dirent_t *de;
+    file_t fd;
+    int rv = 0;
+
+    if(!(fd = iso_open(*dir ? dir : "/", O_RDONLY | O_DIR)))
+        return -1;
+
+    while((de = iso_readdir(fd))) {
+        snprintf(path, sizeof(path), "%s/%s", dir, de->name);
+
+        if(de->size >= 0) {
+            if(add_path(path, de->size) < 0)
+                rv = -1;
         }
+        else if((ns = realloc(subs, (nsubs + 1) * sizeof(char *)))) {
+            subs = ns;
 
-        extent++;
-        size -= 2048;
+            if(!(subs[nsubs++] = strdup(path)))
+                rv = -1;
+        }
+        else {
+            rv = -1;
+        }
+    }
+
+    iso_close(fd);
+
+    for(i = 0; i < nsubs; ++i) {
+        if(!rv && collect(subs[i]) < 0)
+            rv = -1;
+
+        free(subs[i]);
     }
+
+    free(subs);
+    return rv;
+}
+
+static void free_paths(void) {
+    size_t i;
+
+    for(i = 0; i < npaths; ++i)
+        free(paths[i]);
+
+    free(paths);
+    free(psizes);
+    paths = NULL;
+    psizes = NULL;
+    npaths = maxpaths = 0;
 }
-#endif
 
+/********************************************************************************/
+/* Checking file contents */
+
+static uint8 *read_host_file(const char *path, size_t *size) {
+    struct stat st;
+    uint8 *data;
+    FILE *f;
+
+    if(!(f = fopen(path, "rb")))
+        return NULL;
+
+    if(fstat(fileno(f), &st) < 0 ||
+       !(data = malloc(st.st_size ? st.st_size : 1))) {
+        fclose(f);
+        return NULL;
+    }
 
-int main() {
-    fs_iso9660_init();
+    if(fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+        free(data);
+        fclose(f);
+        return NULL;
+    }
 
-    /*
-    {
-    uint32  fd, size, t;
-    char    buf[667];
+    fclose(f);
+    *size = st.st_size;
+    return data;
+}
 
-    printf("Opening file /escape.txt\n");
-    fd = iso_open("/escape.txt", O_RDONLY);
-    if (fd == 0) {
-        printf("Couldn't open file\n");
+/* Compare one file on the disc with the original: read it from start to end
+   in pieces, then at random offsets, through the cache and directly. */
+static int check_file(const char *path, const uint8 *orig, size_t size) {
+    static const size_t pieces[] = { 1, 100, 2048, 5000, 65536 };
+    uint8 *buf;
+    size_t i, pos, len;
+    ssize_t r;
+    file_t fd;
+    int bad = 0, n;
+
+    if(!(fd = iso_open(path, O_RDONLY))) {
+        printf("MISSING: %s\n", path);
         return 1;
     }
-    size = iso_total(fd);
-    printf("fd is %d, size is %08lx\n", fd, size);
 
-    while (size > 0) {
-        int r;
-        r = iso_read(fd, buf, 666);
-        if (r < 0) {
-            printf("Read error\n");
-            return 1;
+    if(iso_total(fd) != size) {
+        printf("SIZE: %s (%lu, should be %lu)\n", path,
+               (unsigned long)iso_total(fd), (unsigned long)size);
+        iso_close(fd);
+        return 1;
+    }
+
+    if(!(buf = malloc(size + 65536))) {
+        iso_close(fd);
+        return 1;
+    }
+
+    for(i = 0; !bad && i < sizeof(pieces) / sizeof(pieces[0]); ++i) {
+        iso_seek(fd, 0);
+
+        for(pos = 0; pos < size; pos += r) {
+            if((r = iso_read(fd, buf, pieces[i])) <= 0 ||
+               memcmp(buf, orig + pos, r)) {
+                printf("BAD: %s (%lu byte pieces, at %lu)\n", path,
+                       (unsigned long)pieces[i], (unsigned long)pos);
+                bad = 1;
+                break;
+            }
+        }
+    }
+
+    for(n = 0; !bad && size && n < 32; ++n) {
+        pos = (size_t)rand() % size;
+        len = 1 + (size_t)rand() % (size - pos);
+
+        if(n & 1)
+            pos &= ~(size_t)2047;
+
+        r = iso_read_at(fd, buf + (n & 2), len, pos, n & 1);
+
+        if(r != (ssize_t)len || memcmp(buf + (n & 2), orig + pos, len)) {
+            printf("BAD: %s (%s read of %lu at %lu)\n", path,
+                   (n & 1) ? "direct" : "cached", (unsigned long)len,
+                   (unsigned long)pos);
+            bad = 1;
+        }
+    }
+
+    free(buf);
+    iso_close(fd);
+
+    return bad;
+}
+
+static int check(const char *srcdir) {
+    char path[2048];
+    size_t i, size, bad = 0;
+    uint8 *orig;
+
+    if(collect("") < 0 || !npaths) {
+        fprintf(stderr, "No files found on the disc\n");
+        return 1;
+    }
+
+    for(i = 0; i < npaths; ++i) {
+        snprintf(path, sizeof(path), "%s%s", srcdir, paths[i]);
+
+        if(!(orig = read_host_file(path, &size))) {
+            printf("Can't read %s\n", path);
+            ++bad;
+            continue;
+        }
+
+        bad += check_file(paths[i], orig, size);
+        free(orig);
+    }
+
+    printf("%lu files checked, %lu bad\n", (unsigned long)npaths,
+           (unsigned long)bad);
+
+    free_paths();
+
+    return bad ? 1 : 0;
+}
+
+/********************************************************************************/
+/* Access traces
+
+   A trace is a text file with one operation per line:
+
+     open N PATH     open a file as handle N
+     read N BYTES    read from handle N
+     seek N OFFSET   move handle N to an offset from the start
+     close N         close handle N
+     list PATH       read every entry of a directory
+
+   Blank lines and lines starting with # are skipped. */
+
+#define TRACE_OPEN  0
+#define TRACE_READ  1
+#define TRACE_SEEK  2
+#define TRACE_CLOSE 3
+#define TRACE_LIST  4
+
+#define TRACE_FDS   64
+
+typedef struct {
+    int     op;
+    int     n;
+    uint32  arg;
+    char    *path;
+} trace_op_t;
+
+static trace_op_t *trace;
+static size_t ntrace;
+
+static int load_trace(const char *fn) {
+    static const char *names[] = { "open", "read", "seek", "close", "list" };
+    char line[1200], name[16], arg[1024];
+    trace_op_t *nt, *t;
+    size_t max = 0;
+    int lineno = 0, op, n;
+    FILE *f;
+
+    if(!(f = fopen(fn, "r"))) {
+        fprintf(stderr, "Cannot read %s\n", fn);
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        ++lineno;
+
+        if(sscanf(line, "%15s", name) != 1 || name[0] == '#')
+            continue;
+
+        for(op = 0; op < 5 && strcmp(name, names[op]); ++op)
+            ;
+
+        n = -1;
+
+        if(op == TRACE_LIST) {
+            if(sscanf(line, "%*s %1023s", arg) == 1)
+                n = 0;
+        }
+        else if(op == TRACE_CLOSE) {
+            sscanf(line, "%*s %d", &n);
+        }
+        else if(op < 5 && sscanf(line, "%*s %d %1023s", &n, arg) != 2) {
+            n = -1;
+        }
+
+        if(op == 5 || n < 0 || n >= TRACE_FDS) {
+            fprintf(stderr, "%s:%d: bad line\n", fn, lineno);
+            fclose(f);
+            return -1;
+        }
+
+        if(ntrace == max) {
+            max = max ? max * 2 : 1024;
+
+            if(!(nt = realloc(trace, max * sizeof(trace_op_t)))) {
+                fclose(f);
+                return -1;
+            }
+
+            trace = nt;
+        }
+
+        t = &trace[ntrace++];
+        t->op = op;
+        t->n = n;
+        t->arg = (op == TRACE_READ || op == TRACE_SEEK) ?
+                 strtoul(arg, NULL, 0) : 0;
+        t->path = (op == TRACE_OPEN || op == TRACE_LIST) ? strdup(arg) : NULL;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static void free_trace(void) {
+    size_t i;
+
+    for(i = 0; i < ntrace; ++i)
+        free(trace[i].path);
+
+    free(trace);
+    trace = NULL;
+    ntrace = 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Run the trace once, adding up the bytes read. Returns the number of
+   operations that failed. */
+static size_t replay(uint8 *buf, uint64_t *bytes) {
+    file_t fds[TRACE_FDS] = { 0 };
+    dirent_t *de;
+    size_t i, bad = 0;
+    ssize_t r;
+    file_t fd;
+
+    for(i = 0; i < ntrace; ++i) {
+        const trace_op_t *t = &trace[i];
+
+        switch(t->op) {
+            case TRACE_OPEN:
+                if(fds[t->n])
+                    iso_close(fds[t->n]);
+
+                if(!(fds[t->n] = iso_open(t->path, O_RDONLY)))
+                    ++bad;
+
+                break;
+
+            case TRACE_READ:
+                if(!fds[t->n])
+                    break;
+
+                if((r = iso_read(fds[t->n], buf, t->arg)) < 0)
+                    ++bad;
+                else
+                    *bytes += r;
+
+                break;
+
+            case TRACE_SEEK:
+                if(fds[t->n])
+                    iso_seek(fds[t->n], t->arg);
+
+                break;
+
+            case TRACE_CLOSE:
+                if(fds[t->n])
+                    iso_close(fds[t->n]);
+
+                fds[t->n] = 0;
+                break;
+
+            case TRACE_LIST:
+                if(!(fd = iso_open(t->path, O_RDONLY | O_DIR))) {
+                    ++bad;
+                    break;
+                }
+
+                while((de = iso_readdir(fd)))
+                    ;
+
+                iso_close(fd);
+                break;
         }
-        buf[r] = 0;
-        printf("%s", buf);
-        if (strstr(buf, "Let the party")) {
-            t = 0;
+    }
+
+    for(i = 0; i < TRACE_FDS; ++i) {
+        if(fds[i])
+            iso_close(fds[i]);
+    }
+
+    return bad;
+}
+
+/* Time looking up sectors that are in the data cache, in ns per lookup. */
+static double time_hits(void) {
+    uint32 *sectors;
+    size_t i, n = 0;
+    uint64_t t;
+
+    if(!(sectors = malloc(dcache.nblocks * sizeof(uint32))))
+        return 0.0;
+
+    for(i = 0; i < dcache.nblocks; ++i) {
+        if(dcache.blocks[i].sector != (uint32)-1)
+            sectors[n++] = dcache.blocks[i].sector;
+    }
+
+    if(!n) {
+        free(sectors);
+        return 0.0;
+    }
+
+    t = now_ns();
+
+    for(i = 0; i < 1000000; ++i)
+        bdread(sectors[(i * 7919) % n], 1);
+
+    t = now_ns() - t;
+    free(sectors);
+
+    return (double)t / 1000000;
+}
+
+static double rate(const fs_iso9660_cache_stats_t *st) {
+    uint32 total = st->hits + st->misses;
+
+    return total ? 100.0 * st->hits / total : 0.0;
+}
+
+/* Parse the next number of a comma separated list. Returns 0 at the end of
+   the list and -1 if it's malformed. */
+static int next_size(const char **s, size_t *out) {
+    char *end;
+
+    if(!**s)
+        return 0;
+
+    *out = strtoul(*s, &end, 0);
+
+    if(end == *s || (*end && *end != ','))
+        return -1;
+
+    *s = *end ? end + 1 : end;
+    return 1;
+}
+
+static int bad_sizes(const char *s) {
+    size_t n;
+    int rv;
+
+    while((rv = next_size(&s, &n)) > 0)
+        ;
+
+    return rv < 0;
+}
+
+/* Replay a trace with each of a list of cache sizes and readahead sizes (in
+   KB, comma separated) and print how the caches did, and how long the drive
+   would have taken. */
+static int bench(const char *tracefn, const char *sizes, const char *ras) {
+    fs_iso9660_cache_stats_t dir, data;
+    uint32 maxread = 2048;
+    size_t i, kb, ra, bad = 0;
+    uint64_t bytes;
+    const char *s, *r;
+    uint8 *buf;
+
+    if(bad_sizes(sizes) || bad_sizes(ras)) {
+        fprintf(stderr, "Bad list of sizes\n");
+        return 1;
+    }
+
+    if(load_trace(tracefn) < 0)
+        return 1;
+
+    for(i = 0; i < ntrace; ++i) {
+        if(trace[i].op == TRACE_READ && trace[i].arg > maxread)
+            maxread = trace[i].arg;
+    }
+
+    if(!(buf = malloc(maxread))) {
+        free_trace();
+        return 1;
+    }
+
+    printf("%lu operations; a command costs %lu us, a sector %lu us and a "
+           "seek %lu us\n\n", (unsigned long)ntrace, (unsigned long)cost_cmd,
+           (unsigned long)cost_sector, (unsigned long)cost_seek);
+    printf("%7s %7s %7s %7s %9s %8s %7s %8s %7s %7s\n", "cache", "ahead",
+           "dir", "data", "read", "disc", "", "disc", "", "host");
+    printf("%7s %7s %7s %7s %9s %8s %7s %8s %7s %7s\n", "KB", "KB", "hit %",
+           "hit %", "ahead", "reads", "seeks", "s", "MB/s", "ns/hit");
+
+    for(s = sizes; next_size(&s, &kb) > 0;) {
+        for(r = ras; next_size(&r, &ra) > 0;) {
+            if(fs_iso9660_set_cache_size(kb * 1024, kb * 1024) < 0 ||
+               fs_iso9660_set_readahead(ra * 1024) < 0) {
+                fprintf(stderr, "Can't use a %lu KB cache with %lu KB of "
+                        "readahead\n", (unsigned long)kb, (unsigned long)ra);
+                bad = 1;
+                goto out;
+            }
+
+            /* Start with empty caches, as after a disc change */
+            iso_reset();
+            fs_iso9660_reset_cache_stats();
+            cd_cmds = cd_sectors = cd_seeks = cd_next = 0;
+            cd_time_us = 0;
+            bytes = 0;
+
+            bad += replay(buf, &bytes);
+
+            fs_iso9660_get_cache_stats(&dir, &data);
+
+            printf("%7lu %7lu %7.1f %7.1f %9lu %8lu %7lu %8.1f %7.2f "
+                   "%7.1f\n", (unsigned long)kb,
+                   (unsigned long)(dcache.ramax > 1 ? dcache.ramax * 2 : 0),
+                   rate(&dir), rate(&data), (unsigned long)data.readahead,
+                   (unsigned long)cd_cmds, (unsigned long)cd_seeks,
+                   cd_time_us / 1000000.0,
+                   cd_time_us ? (double)bytes / cd_time_us : 0.0,
+                   time_hits());
         }
-        size -= r;
     }
-    printf("\nFile read is done\n");
-    iso_close(fd); */
 
-    {
-        uint32      fd;
-        dirent_t    *de;
+out:
+    if(bad)
+        printf("\n%lu operations failed\n", (unsigned long)bad);
 
-        printf("Opening /demos");
-        fd = iso_open("/music/mc2/entries/rookie", O_RDONLY | O_DIR);
+    free(buf);
+    free_trace();
 
-        if(fd == 0) {
-            printf("Couldn't open file\n");
-            return 1;
+    return bad ? 1 : 0;
+}
+
+/* Open every file on the disc a number of times, in a scattered order,
+   first scanning the directories for each open and then with directory
+   tables, and print what the lookups cost. */
+static int lookups(int passes) {
+    static const size_t tables[] = { 0, FS_ISO9660_DIR_TABLE_DEFAULT };
+    uint32 *extents;
+    size_t i, f, t, bad = 0;
+    uint64_t ns;
+    file_t fd;
+    int p;
+
+    if(collect("") < 0 || !npaths) {
+        fprintf(stderr, "No files found on the disc\n");
+        return 1;
+    }
+
+    if(!(extents = calloc(npaths, sizeof(uint32)))) {
+        free_paths();
+        return 1;
+    }
+
+    printf("%lu files, %d passes\n\n", (unsigned long)npaths, passes);
+    printf("%9s %8s %8s %8s %9s\n", "tables", "disc", "", "disc", "host");
+    printf("%9s %8s %8s %8s %9s\n", "KB", "reads", "sectors", "s", "ns/open");
+
+    for(t = 0; t < sizeof(tables) / sizeof(tables[0]); ++t) {
+        fs_iso9660_set_dir_table_size(tables[t]);
+        iso_reset();
+        cd_cmds = cd_sectors = cd_seeks = cd_next = 0;
+        cd_time_us = 0;
+        ns = now_ns();
+
+        for(p = 0; p < passes; ++p) {
+            for(i = 0; i < npaths; ++i) {
+                f = (i * 7919 + p) % npaths;
+
+                if(!(fd = iso_open(paths[f], O_RDONLY))) {
+                    printf("MISSING: %s\n", paths[f]);
+                    ++bad;
+                    continue;
+                }
+
+                /* Both ways of looking must find the same thing */
+                if(!extents[f]) {
+                    extents[f] = fh[fd].first_extent;
+                }
+                else if(extents[f] != fh[fd].first_extent) {
+                    printf("WRONG: %s\n", paths[f]);
+                    ++bad;
+                }
+
+                iso_close(fd);
+            }
         }
 
-        printf("Scanning dir:\n");
+        ns = now_ns() - ns;
+
+        printf("%9lu %8lu %8lu %8.2f %9.0f\n",
+               (unsigned long)(tables[t] / 1024), (unsigned long)cd_cmds,
+               (unsigned long)cd_sectors, cd_time_us / 1000000.0,
+               (double)ns / (npaths * passes));
+    }
 
-        while((de = iso_readdir(fd))) {
-            printf("%s\t%d\n", de->name, de->size);
+    fs_iso9660_set_dir_table_size(FS_ISO9660_DIR_TABLE_DEFAULT);
+    free(extents);
+    free_paths();
 
-            if(!strcmp(de->name, "R_WAR.ZIP")) {
-                /* what's this test for? */
+    return bad ? 1 : 0;
+}
+
+/* Write a trace of the sort of thing a game does to stdout: load a set of
+   files for each level, in small reads with the odd seek back to a header,
+   keep going back to a few files used all the time, and list a directory now
+   and then. */
+static int generate(unsigned int levels) {
+    static const uint32 reads[] = { 16, 512, 2048, 4096, 16384, 65536 };
+    size_t i, f, common, pernext;
+    char dir[1024], *p;
+    uint32 pos, len;
+    unsigned int l;
+
+    if(collect("") < 0 || !npaths) {
+        fprintf(stderr, "No files found on the disc\n");
+        return 1;
+    }
+
+    common = npaths < 8 ? 1 : npaths / 8;
+    pernext = npaths < 4 ? npaths : npaths / 4;
+
+    printf("# isotest -g %u\n", levels);
+
+    for(l = 0; l < levels; ++l) {
+        strncpy(dir, paths[(size_t)rand() % npaths], sizeof(dir) - 1);
+        dir[sizeof(dir) - 1] = 0;
+
+        if((p = strrchr(dir, '/')) && p != dir)
+            *p = 0;
+        else
+            strcpy(dir, "/");
+
+        printf("list %s\n", dir);
+
+        for(i = 0; i < pernext; ++i) {
+            /* A quarter of the time it's one of the files used everywhere */
+            f = (rand() & 3) ? (size_t)rand() % npaths :
+                (size_t)rand() % common;
+
+            printf("open 1 %s\n", paths[f]);
+            printf("read 1 64\n");
+            printf("seek 1 0\n");
+
+            for(pos = 0; pos < psizes[f]; pos += len) {
+                len = reads[(size_t)rand() % (sizeof(reads) / sizeof(reads[0]))];
+                printf("read 1 %lu\n", (unsigned long)len);
             }
+
+            printf("close 1\n");
+        }
+    }
+
+    free_paths();
+
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: isotest [-v] image [path]\n"
+            "       isotest -c directory image\n"
+            "       isotest -b trace [-s sizes] [-r sizes] [-t costs] image\n"
+            "       isotest -g levels image > trace\n"
+            "       isotest -l passes image\n"
+            "\n"
+            "  -v          print notices from the filesystem\n"
+            "  -c dir      check every file on the disc against the directory\n"
+            "              the image was made from\n"
+            "  -b trace    replay an access trace with each cache size and\n"
+            "              report how the caches did\n"
+            "  -s sizes    cache sizes in KB, comma separated (default\n"
+            "              32,64,256,1024,4096)\n"
+            "  -r sizes    most readahead in KB, comma separated (default\n"
+            "              0,64)\n"
+            "  -t costs    microseconds the drive takes per command, per\n"
+            "              sector and per seek (default 500,1100,80000)\n"
+            "  -g levels   write a made-up trace of a game loading this many\n"
+            "              levels from the disc\n"
+            "  -l passes   open every file on the disc this many times, with\n"
+            "              and without directory tables\n");
+}
+
+int main(int argc, char **argv) {
+    const char *image, *path = "/", *srcdir = NULL, *tracefn = NULL;
+    const char *sizes = "32,64,256,1024,4096", *ras = "0,64";
+    int opt, levels = 0, passes = 0, rv;
+    file_t fd;
+
+    while((opt = getopt(argc, argv, "vc:b:s:r:t:g:l:h")) != -1) {
+        switch(opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'c':
+                srcdir = optarg;
+                break;
+            case 'b':
+                tracefn = optarg;
+                break;
+            case 's':
+                sizes = optarg;
+                break;
+            case 'r':
+                ras = optarg;
+                break;
+            case 't':
+                if(sscanf(optarg, "%u,%u,%u", &cost_cmd, &cost_sector,
+                          &cost_seek) != 3) {
+                    usage();
+                    return 1;
+                }
+
+                break;
+            case 'g':
+                levels = atoi(optarg);
+                break;
+            case 'l':
+                passes = atoi(optarg);
+                break;
+            default:
+                usage();
+                return 1;
         }
+    }
 
+    if(optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    image = argv[optind++];
+
+    if(optind < argc)
+        path = argv[optind++];
+
+    if(!(disc = fopen(image, "rb"))) {
+        fprintf(stderr, "Cannot read %s.\n", image);
+        return 1;
+    }
+
+    if(fs_iso9660_init() < 0) {
+        fprintf(stderr, "Out of memory\n");
+        fclose(disc);
+        return 1;
+    }
+
+    srand(1);
+
+    if(tracefn) {
+        rv = bench(tracefn, sizes, ras);
+    }
+    else if(levels > 0) {
+        rv = generate(levels);
+    }
+    else if(passes > 0) {
+        rv = lookups(passes);
+    }
+    else if(srcdir) {
+        rv = check(srcdir);
+    }
+    else if((fd = iso_open(path, O_RDONLY | O_DIR))) {
         iso_close(fd);
+        rv = list_dir(path) < 0;
+    }
+    else {
+        rv = cat_file(path);
     }
 
     fs_iso9660_shutdown();
+    fclose(disc);
 
-    return 0;
+    return rv;
 }
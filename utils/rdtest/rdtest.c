@@ -11,51 +11,46 @@
 /****************************** LINUX SPECIFIC CODE ***********************************/
 
 #include <stdio.h>
-
-typedef unsigned char uint8;
-typedef unsigned short uint16;
-typedef unsigned long uint32;
-typedef signed char int8;
-typedef signed short int16;
-typedef signed long int32;
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <time.h>
+#include <fnmatch.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
 
 /* KOS VFS prims */
+typedef int file_t;
 #define O_RDONLY 0
 #define O_MODE_MASK 0xfff
 #define O_DIR 0x1000
-#define MAX_FN_LEN 256
-typedef struct {
-    int     size;
-    char    name[MAX_FN_LEN];
-    uint32  time;
-    uint32  attr;
-} dirent_t;
-
-typedef void *vfs_handler[];
-static int fs_handler_add(char *fn, void *p) {
-    return 0;
-}
-static int fs_handler_remove(void *p) {
-    return 0;
-}
 
 /* Thread prims */
-typedef int thd_mutex_t;
-static void thd_mutex_reset(int *p) { }
-static void thd_mutex_lock(int *p) { }
-static void thd_mutex_unlock(int *p) { }
+typedef int mutex_t;
+static void mutex_init(mutex_t *p) { *p = 0; }
+static void mutex_destroy(mutex_t *p) { (void)p; }
+static void mutex_lock(mutex_t *p) { (void)p; }
+static void mutex_unlock(mutex_t *p) { (void)p; }
 
 /* romdisk defines */
 #define MAX_RD_FILES 8
+#define FS_ROMDISK_INDEX_DEFAULT 2048
 
 /****************************** END LINUX SPECIFIC CODE ***********************************/
 
 /* Cut here to insert into KallistiOS fs_romdisk.c */
 
 
-/* #include <kallisti/stdtypes.h> */
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 
 /* Header definitions from Linux ROMFS documentation; all integer quantities are
    expressed in big-endian notation. Unfortunately the ROMFS guys were being
@@ -82,15 +77,126 @@ typedef struct {
 /* Util function to reverse the byte order of a uint32 */
 static uint32 ntohl_32(const void *data) {
     const uint8 *d = (const uint8*)data;
-    return (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | (d[3] << 0);
+    return ((uint32)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | (d[3] << 0);
+}
+
+/* Limits on the block size of compressed files */
+#define RD_ZBLOCK_MIN   512
+#define RD_ZBLOCK_MAX   (1024 * 1024)
+
+/* Number of decompressed blocks to keep around */
+#define RD_ZCACHE_BLOCKS    4
+
+/* Decompress an LZ4 block. Returns the number of bytes written to dst, or -1
+   if the data is bad or doesn't fit. */
+static int rd_lz4_decode(const uint8 *src, uint32 slen, uint8 *dst,
+                         uint32 dlen) {
+    const uint8 *send = src + slen, *m;
+    uint8 *d = dst, *dend = dst + dlen;
+    uint32 len, off;
+    uint8 token;
+
+    while(src < send) {
+        token = *src++;
+
+        /* Literals */
+        len = token >> 4;
+
+        if(len == 15) {
+            do {
+                if(src >= send)
+                    return -1;
+
+                len += *src;
+            }
+            while(*src++ == 255);
+        }
+
+        if(len > (uint32)(send - src) || len > (uint32)(dend - d))
+            return -1;
+
+        memcpy(d, src, len);
+        d += len;
+        src += len;
+
+        /* The last sequence has no match. */
+        if(src == send)
+            break;
+
+        /* Match */
+        if(send - src < 2)
+            return -1;
+
+        off = src[0] | (src[1] << 8);
+        src += 2;
+
+        if(!off || off > (uint32)(d - dst))
+            return -1;
+
+        len = token & 15;
+
+        if(len == 15) {
+            do {
+                if(src >= send)
+                    return -1;
+
+                len += *src;
+            }
+            while(*src++ == 255);
+        }
+
+        len += 4;
+
+        if(len > (uint32)(dend - d))
+            return -1;
+
+        m = d - off;
+
+        /* Overlapping matches repeat the last off bytes, so they have to be
+           copied a byte at a time. */
+        if(off >= len) {
+            memcpy(d, m, len);
+            d += len;
+        }
+        else {
+            while(len--)
+                *d++ = *m++;
+        }
+    }
+
+    return d - dst;
 }
 
-/* Pointer to the ROMFS image created by the host PC */
-static uint8 *romdisk_image = NULL;
+/********************************************************************************/
 
-/* Some convienence pointers */
-static romdisk_hdr_t *romdisk_hdr = NULL;
-static uint32 romdisk_files = 0;
+/* An entry in an image's path index. Directories are added to the index the
+   first time something is looked up in them, as long as there is room, and a
+   directory that has been added gets an entry with a hdr of 0 to say so. */
+typedef struct rd_ient {
+    uint32  dir;        /* Offset of the directory's first entry */
+    uint32  hdr;        /* Offset of this entry's header */
+    uint32  hash;       /* Hash of dir and the lowercased name */
+    int32   next;       /* Next entry in the hash chain, or -1 */
+} rd_ient_t;
+
+/* A single mounted romdisk image */
+typedef struct rd_image {
+    const uint8     * image;    /* The actual image */
+    const romdisk_hdr_t * hdr;      /* Pointer to the header */
+    uint32          files;      /* Offset in the image to the files area */
+
+    mutex_t         ilock;      /* Path index lock */
+    rd_ient_t       * ients;    /* Path index entries */
+    int32           * ibuckets; /* Path index hash table */
+    size_t          icount;     /* Entries in use */
+    size_t          ialloc;     /* Entries allocated */
+    size_t          imax;       /* Most entries allowed, 0 for no index */
+    size_t          inbuckets;  /* Size of the hash table */
+    int             ifull;      /* Nothing more will fit */
+} rd_image_t;
+
+/* Path index size for new mounts */
+static size_t index_size = FS_ROMDISK_INDEX_DEFAULT;
 
 /********************************************************************************/
 /* File primitives */
@@ -102,52 +208,73 @@ static struct {
     int     dir;        /* >0 if a directory */
     uint32      ptr;        /* Current read position in bytes */
     uint32      size;       /* Length of file in bytes */
-    /* dirent_t dirent; */  /* A static dirent to pass back to clients */
+    rd_image_t  * mnt;      /* Which mount instance are we using? */
+    uint32      zsize;      /* Length of compressed data, 0 if not compressed */
+    uint32      zblock;     /* Block size of compressed data */
+    uint8       * map;      /* Decompressed copy of the file for mmap */
 } fh[MAX_RD_FILES];
 
 /* Mutex for file handles */
-static thd_mutex_t fh_mutex;
+static mutex_t fh_mutex;
+
+/* Recently decompressed blocks */
+static struct {
+    const rd_image_t * mnt; /* Image the block is from, NULL if unused */
+    uint32      index;      /* Image index of the file's data */
+    uint32      block;      /* Block number within the file */
+    uint32      len;        /* Length of the block */
+    uint32      used;       /* When it was last used */
+    uint8       * buf;      /* Decompressed data */
+    uint32      bufsize;    /* Size of buf */
+} zcache[RD_ZCACHE_BLOCKS];
+
+static mutex_t zc_mutex;
+static uint32 zc_clock;
+
+
+/* Hard links to regular files are how genromfs stores files that are the same
+   as another one (with -D, or hard linked in the source tree). Returns the
+   header holding the data for a regular file or a link to one, or 0 for
+   anything else. */
+static uint32 rd_file_hdr(const uint8 *image, uint32 i) {
+    const romdisk_file_t *fhdr = (const romdisk_file_t *)(image + i);
+    uint32 type = ntohl_32(&fhdr->next_header) & 3;
+
+    if(type == 0) {
+        if(!(i = ntohl_32(&fhdr->spec_info) & 0xfffffff0))
+            return 0;
+
+        fhdr = (const romdisk_file_t *)(image + i);
+        type = ntohl_32(&fhdr->next_header) & 3;
+    }
+
+    return type == 2 ? i : 0;
+}
 
 /* Given a filename and a starting romdisk directory listing (byte offset),
    search for the entry in the directory and return the byte offset to its
    entry. */
-static uint32 romdisk_find_object(const char *fn, int fnlen, int dir, uint32 offset) {
-    uint32      i, ni, type;
-    romdisk_file_t  *fhdr;
+static uint32 romdisk_scan_object(rd_image_t * mnt, const char *fn, size_t fnlen, int dir, uint32 offset) {
+    uint32          i, ni, type;
+    const romdisk_file_t    *fhdr;
 
     i = offset;
 
     do {
         /* Locate the entry, next pointer, and type info */
-        fhdr = (romdisk_file_t *)(romdisk_image + i);
+        fhdr = (const romdisk_file_t *)(mnt->image + i);
         ni = ntohl_32(&fhdr->next_header);
         type = ni & 0x0f;
         ni = ni & 0xfffffff0;
 
         /* Check the type */
-        if(!dir) {
-            if((type & 3) != 2) {
-                i = ni;
-
-                if(!i)
-                    break;
-                else
-                    continue;
-            }
-        }
-        else {
-            if((type & 3) != 1) {
-                i = ni;
-
-                if(!i)
-                    break;
-                else
-                    continue;
-            }
+        if(dir ? (type & 3) != 1 : !rd_file_hdr(mnt->image, i)) {
+            i = ni;
+            continue;
         }
 
         /* Check filename */
-        if(!strncmp(fhdr->filename, fn, fnlen)) {
+        if((strlen(fhdr->filename) == fnlen) && (!strncasecmp(fhdr->filename, fn, fnlen))) {
             /* Match: return this index */
             return i;
         }
@@ -160,6 +287,349 @@ static uint32 romdisk_find_object(const char *fn, int fnlen, int dir, uint32 off
     return 0;
 }
 
+/* Hash a name (case-insensitively) in the directory starting at dir. */
+static uint32 rd_hash(uint32 dir, const char *fn, size_t fnlen) {
+    uint32 h = 2166136261U ^ dir;
+
+    while(fnlen--) {
+        h ^= (uint8)tolower((uint8)*fn++);
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/* Add an entry to the path index. Must be called with the index locked. */
+static int rd_index_add(rd_image_t * mnt, uint32 dir, uint32 hdr,
+                        uint32 hash) {
+    rd_ient_t *e;
+    size_t n, b;
+
+    if(mnt->icount == mnt->ialloc) {
+        n = mnt->ialloc ? mnt->ialloc * 2 : 64;
+
+        if(n > mnt->imax)
+            n = mnt->imax;
+
+        if(!(e = (rd_ient_t *)realloc(mnt->ients, n * sizeof(rd_ient_t))))
+            return -1;
+
+        mnt->ients = e;
+        mnt->ialloc = n;
+    }
+
+    b = hash & (mnt->inbuckets - 1);
+    e = &mnt->ients[mnt->icount];
+    e->dir = dir;
+    e->hdr = hdr;
+    e->hash = hash;
+    e->next = mnt->ibuckets[b];
+    mnt->ibuckets[b] = mnt->icount++;
+
+    return 0;
+}
+
+/* Add everything in a directory to the path index, if it all fits. Must be
+   called with the index locked. */
+static int rd_index_dir(rd_image_t * mnt, uint32 dir) {
+    const romdisk_file_t *fhdr;
+    uint32 i, ni, type;
+    size_t count = 1, b;
+
+    if(!mnt->ibuckets) {
+        for(b = 16; b < mnt->imax / 2; b <<= 1)
+            ;
+
+        if(!(mnt->ibuckets = (int32 *)malloc(b * sizeof(int32)))) {
+            mnt->ifull = 1;
+            return -1;
+        }
+
+        memset(mnt->ibuckets, 0xff, b * sizeof(int32));
+        mnt->inbuckets = b;
+    }
+
+    /* Count it first, so that a directory is either indexed entirely or not
+       at all. */
+    for(i = dir; i; i = ni & 0xfffffff0) {
+        fhdr = (const romdisk_file_t *)(mnt->image + i);
+        ni = ntohl_32(&fhdr->next_header);
+        type = ni & 3;
+
+        if(type == 1 || rd_file_hdr(mnt->image, i))
+            ++count;
+    }
+
+    if(mnt->icount + count > mnt->imax) {
+        mnt->ifull = 1;
+        return -1;
+    }
+
+    for(i = dir; i; i = ni & 0xfffffff0) {
+        fhdr = (const romdisk_file_t *)(mnt->image + i);
+        ni = ntohl_32(&fhdr->next_header);
+        type = ni & 3;
+
+        if(type != 1 && !rd_file_hdr(mnt->image, i))
+            continue;
+
+        if(rd_index_add(mnt, dir, i, rd_hash(dir, fhdr->filename,
+                                             strlen(fhdr->filename))) < 0)
+            goto fail;
+    }
+
+    if(rd_index_add(mnt, dir, 0, rd_hash(dir, "", 0)) < 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    /* Out of memory part way through; take back what was added. */
+    while(mnt->icount && mnt->ients[mnt->icount - 1].dir == dir) {
+        --mnt->icount;
+        b = mnt->ients[mnt->icount].hash & (mnt->inbuckets - 1);
+        mnt->ibuckets[b] = mnt->ients[mnt->icount].next;
+    }
+
+    mnt->ifull = 1;
+    return -1;
+}
+
+/* Look a name up in the path index. Returns nonzero if the index could
+   answer, with the header offset (or 0 if it isn't there) in *out. Must be
+   called with the index locked. */
+static int rd_index_find(rd_image_t * mnt, const char *fn, size_t fnlen,
+                         int dir, uint32 offset, uint32 *out) {
+    const romdisk_file_t *fhdr;
+    uint32 h = rd_hash(offset, fn, fnlen), type;
+    const rd_ient_t *e;
+    int32 i;
+    int indexed = 0;
+
+    if(!mnt->ibuckets)
+        return 0;
+
+    for(i = mnt->ibuckets[h & (mnt->inbuckets - 1)]; i >= 0; i = e->next) {
+        e = &mnt->ients[i];
+
+        if(e->dir != offset)
+            continue;
+
+        if(!e->hdr) {
+            indexed = 1;
+            continue;
+        }
+
+        if(e->hash != h)
+            continue;
+
+        fhdr = (const romdisk_file_t *)(mnt->image + e->hdr);
+        type = ntohl_32(&fhdr->next_header) & 3;
+
+        if((dir ? type == 1 : rd_file_hdr(mnt->image, e->hdr) != 0) &&
+           strlen(fhdr->filename) == fnlen &&
+           !strncasecmp(fhdr->filename, fn, fnlen)) {
+            *out = e->hdr;
+            return 1;
+        }
+    }
+
+    /* The directory's marker might be in another chain. */
+    if(!indexed) {
+        h = rd_hash(offset, "", 0);
+
+        for(i = mnt->ibuckets[h & (mnt->inbuckets - 1)]; i >= 0;
+            i = e->next) {
+            e = &mnt->ients[i];
+
+            if(e->dir == offset && !e->hdr) {
+                indexed = 1;
+                break;
+            }
+        }
+    }
+
+    if(indexed)
+        *out = 0;
+
+    return indexed;
+}
+
+/* Find an entry in a directory, through the path index if possible. */
+static uint32 romdisk_find_object(rd_image_t * mnt, const char *fn,
+                                  size_t fnlen, int dir, uint32 offset) {
+    uint32 rv;
+    int found;
+
+    if(!mnt->imax)
+        return romdisk_scan_object(mnt, fn, fnlen, dir, offset);
+
+    mutex_lock(&mnt->ilock);
+
+    found = rd_index_find(mnt, fn, fnlen, dir, offset, &rv);
+
+    if(!found && !mnt->ifull && !rd_index_dir(mnt, offset))
+        found = rd_index_find(mnt, fn, fnlen, dir, offset, &rv);
+
+    mutex_unlock(&mnt->ilock);
+
+    if(found)
+        return rv;
+
+    return romdisk_scan_object(mnt, fn, fnlen, dir, offset);
+}
+
+/* Free an image's path index. */
+static void rd_index_free(rd_image_t * mnt) {
+    free(mnt->ients);
+    free(mnt->ibuckets);
+    mutex_destroy(&mnt->ilock);
+}
+
+/* Decompress one block of a compressed file into dst, which must have room
+   for a whole block. Returns the length of the block, or -1 if the data is
+   bad. */
+static int rd_zblock(file_t fd, uint32 block, uint8 *dst) {
+    const uint8 *z = fh[fd].mnt->image + fh[fd].index;
+    uint32 start, end, len;
+
+    start = ntohl_32(z + 4 + block * 4);
+    end = ntohl_32(z + 8 + block * 4);
+    len = fh[fd].size - block * fh[fd].zblock;
+
+    if(len > fh[fd].zblock)
+        len = fh[fd].zblock;
+
+    if(end < start || end > fh[fd].zsize)
+        return -1;
+
+    if(end - start == len)
+        memcpy(dst, z + start, len);
+    else if(rd_lz4_decode(z + start, end - start, dst, len) != (int)len)
+        return -1;
+
+    return len;
+}
+
+/* Find a block in the cache, decompressing it if it isn't there. Must be
+   called with zc_mutex held. */
+static const uint8 *rd_zcache_get(file_t fd, uint32 block) {
+    int i, victim = 0;
+    int len;
+    uint8 *buf;
+
+    for(i = 0; i < RD_ZCACHE_BLOCKS; ++i) {
+        if(zcache[i].mnt == fh[fd].mnt && zcache[i].index == fh[fd].index &&
+           zcache[i].block == block) {
+            zcache[i].used = ++zc_clock;
+            return zcache[i].buf;
+        }
+
+        if(zcache[victim].mnt && (!zcache[i].mnt ||
+                                  zcache[i].used < zcache[victim].used))
+            victim = i;
+    }
+
+    i = victim;
+    zcache[i].mnt = NULL;
+
+    if(zcache[i].bufsize < fh[fd].zblock) {
+        if(!(buf = (uint8 *)realloc(zcache[i].buf, fh[fd].zblock))) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        zcache[i].buf = buf;
+        zcache[i].bufsize = fh[fd].zblock;
+    }
+
+    if((len = rd_zblock(fd, block, zcache[i].buf)) < 0) {
+        errno = EIO;
+        return NULL;
+    }
+
+    zcache[i].mnt = fh[fd].mnt;
+    zcache[i].index = fh[fd].index;
+    zcache[i].block = block;
+    zcache[i].len = len;
+    zcache[i].used = ++zc_clock;
+
+    return zcache[i].buf;
+}
+
+/* Drop an image's blocks from the cache. */
+static void rd_zcache_drop(const rd_image_t *mnt) {
+    int i;
+
+    mutex_lock(&zc_mutex);
+
+    for(i = 0; i < RD_ZCACHE_BLOCKS; ++i) {
+        if(!mnt || zcache[i].mnt == mnt)
+            zcache[i].mnt = NULL;
+
+        if(!mnt) {
+            free(zcache[i].buf);
+            zcache[i].buf = NULL;
+            zcache[i].bufsize = 0;
+        }
+    }
+
+    mutex_unlock(&zc_mutex);
+}
+
+/* Copy part of a file out, decompressing it if need be. The range must be
+   within the file. */
+static ssize_t romdisk_copy(file_t fd, uint8 *buf, size_t bytes,
+                            uint32 offset) {
+    const uint8 *src;
+    uint32 block, boff, blen, n;
+    size_t left = bytes;
+
+    if(!fh[fd].zsize) {
+        memcpy(buf, fh[fd].mnt->image + fh[fd].index + offset, bytes);
+        return bytes;
+    }
+
+    while(left) {
+        block = offset / fh[fd].zblock;
+        boff = offset % fh[fd].zblock;
+        blen = fh[fd].size - block * fh[fd].zblock;
+
+        if(blen > fh[fd].zblock)
+            blen = fh[fd].zblock;
+
+        n = blen - boff;
+
+        if(n > left)
+            n = left;
+
+        if(n == blen) {
+            /* The whole block is wanted, so skip the cache. */
+            if(rd_zblock(fd, block, buf) < 0) {
+                errno = EIO;
+                return -1;
+            }
+        }
+        else {
+            mutex_lock(&zc_mutex);
+
+            if(!(src = rd_zcache_get(fd, block))) {
+                mutex_unlock(&zc_mutex);
+                return -1;
+            }
+
+            memcpy(buf, src + boff, n);
+            mutex_unlock(&zc_mutex);
+        }
+
+        buf += n;
+        offset += n;
+        left -= n;
+    }
+
+    return bytes;
+}
+
 /* Locate an object anywhere in the image, starting at the root, and
    expecting a fully qualified path name. This is analogous to the
    find_object_path in iso9660.
@@ -168,31 +638,36 @@ static uint32 romdisk_find_object(const char *fn, int fnlen, int dir, uint32 off
    dir:     0 if looking for a file, 1 if looking for a dir
 
    It will return an offset in the romdisk image for the object. */
-static uint32 romdisk_find(const char *fn, int dir) {
-    const char  *cur;
-    uint32      i;
-    romdisk_file_t  *fhdr;
+static uint32 romdisk_find(rd_image_t * mnt, const char *fn, int dir) {
+    const char      *cur;
+    uint32          i;
+    const romdisk_file_t    *fhdr;
 
     /* If the object is in a sub-tree, traverse the trees looking
        for the right directory. */
-    i = romdisk_files;
+    i = mnt->files;
 
     while((cur = strchr(fn, '/'))) {
         if(cur != fn) {
-            i = romdisk_find_object(fn, cur - fn, 1, i);
+            i = romdisk_find_object(mnt, fn, cur - fn, 1, i);
 
             if(i == 0) return 0;
 
-            fhdr = (romdisk_file_t *)(romdisk_image + i);
+            fhdr = (const romdisk_file_t *)(mnt->image + i);
             i = ntohl_32(&fhdr->spec_info);
         }
 
         fn = cur + 1;
     }
 
-    /* Locate the file in the resulting directory */
+    /* Locate the file in the resulting directory, going to the data if it's
+       a link. */
     if(*fn) {
-        i = romdisk_find_object(fn, strlen(fn), dir, i);
+        i = romdisk_find_object(mnt, fn, strlen(fn), dir, i);
+
+        if(i && !dir)
+            i = rd_file_hdr(mnt->image, i);
+
         return i;
     }
     else {
@@ -203,101 +678,84 @@ static uint32 romdisk_find(const char *fn, int dir) {
     }
 }
 
-
-#if 0
-/* Find a filename in the root of the romdisk image */
-static uint32 romdisk_find(const char *fn) {
-    uint32      i, ni, type;
-    romdisk_file_t  *fhdr;
-
-    i = romdisk_files;
-
-    do {
-        /* Locate the file, next pointer, and type info */
-        fhdr = (romdisk_file_t*)(romdisk_image + i);
-        ni = ntohl_32(&fhdr->next_header);
-        type = ni & 0x0f;
-        ni = ni & 0xfffffff0;
-
-        /* Ignore non-files */
-        if(type != 2) {
-            i = ni;
-            continue;
-        }
-
-        /* Check filename */
-        if(!strcmp(fhdr->filename, fn)) {
-            /* Match: return this index */
-            return i;
-        }
-
-        /* Nope, continue on */
-        i = ni;
-    }
-    while(i != 0);
-
-    /* Didn't find it */
-    return 0;
-}
-#endif
-
-/* Open a file or directory */
-static uint32 romdisk_open(const char *fn, int mode) {
-    uint32      fd;
+/* Open a file */
+static int romdisk_open(rd_image_t * mnt, const char *fn, int mode) {
+    int         fd;
     uint32      filehdr;
-    romdisk_file_t  *fhdr;
+    const romdisk_file_t    *fhdr;
 
     /* Make sure they don't want to open things as writeable */
     if((mode & O_MODE_MASK) != O_RDONLY)
         return 0;
 
-    /* Make sure we're not trying to open a directory (not supported yet) */
+    /* Make sure we're not trying to open a directory (not tested here) */
     if(mode & O_DIR)
         return 0;
 
     /* Look for the file */
-    filehdr = romdisk_find(fn + 1, 0);
+    filehdr = romdisk_find(mnt, fn + 1, 0);
 
     if(filehdr == 0)
         return 0;
 
     /* Find a free file handle */
-    thd_mutex_lock(&fh_mutex);
+    mutex_lock(&fh_mutex);
 
-    for(fd = 0; fd < MAX_RD_FILES; fd++)
+    for(fd = 1; fd < MAX_RD_FILES; fd++)
         if(fh[fd].index == 0) {
             fh[fd].index = -1;
             break;
         }
 
-    thd_mutex_unlock(&fh_mutex);
+    mutex_unlock(&fh_mutex);
 
     if(fd >= MAX_RD_FILES)
         return 0;
 
     /* Fill the fd structure */
-    fhdr = (romdisk_file_t *)(romdisk_image + filehdr);
+    fhdr = (const romdisk_file_t *)(mnt->image + filehdr);
+    fh[fd].mnt = mnt;
     fh[fd].index = filehdr + sizeof(romdisk_file_t) + (strlen(fhdr->filename) / 16) * 16;
     fh[fd].dir = 0;
     fh[fd].ptr = 0;
     fh[fd].size = ntohl_32(&fhdr->size);
+    fh[fd].zsize = 0;
+    fh[fd].map = NULL;
+
+    /* Check the header of a compressed file. */
+    if(!fh[fd].dir && ntohl_32(&fhdr->spec_info)) {
+        fh[fd].zsize = ntohl_32(&fhdr->spec_info);
+        fh[fd].zblock = ntohl_32(mnt->image + fh[fd].index);
+
+        if(fh[fd].zblock < RD_ZBLOCK_MIN || fh[fd].zblock > RD_ZBLOCK_MAX ||
+           (fh[fd].zblock & (fh[fd].zblock - 1)) ||
+           fh[fd].zsize < 8 + ((fh[fd].size + fh[fd].zblock - 1) /
+                               fh[fd].zblock) * 4) {
+            fh[fd].index = 0;
+            errno = EIO;
+            return 0;
+        }
+    }
 
     return fd;
 }
 
-/* Close a file or directory */
-static void romdisk_close(uint32 fd) {
+/* Close a file */
+static void romdisk_close(int fd) {
     /* Check that the fd is valid */
-    if(fd < MAX_RD_FILES) {
+    if(fd > 0 && fd < MAX_RD_FILES) {
+        free(fh[fd].map);
+        fh[fd].map = NULL;
+
         /* No need to lock the mutex: this is an atomic op */
         fh[fd].index = 0;
     }
 }
 
 /* Read from a file */
-static ssize_t romdisk_read(uint32 fd, void *buf, size_t bytes) {
+static ssize_t romdisk_read(int fd, void *buf, size_t bytes) {
     /* Check that the fd is valid */
-    if(fd >= MAX_RD_FILES || fh[fd].index == 0)
+    if(fd <= 0 || fd >= MAX_RD_FILES || fh[fd].index == 0)
         return -1;
 
     /* Is there enough left? */
@@ -305,29 +763,20 @@ static ssize_t romdisk_read(uint32 fd, void *buf, size_t bytes) {
         bytes = fh[fd].size - fh[fd].ptr;
 
     /* Copy out the requested amount */
-    memcpy(buf, romdisk_image + fh[fd].index + fh[fd].ptr, bytes);
+    if(romdisk_copy(fd, (uint8 *)buf, bytes, fh[fd].ptr) < 0)
+        return -1;
+
     fh[fd].ptr += bytes;
 
     return bytes;
 }
 
 /* Seek elsewhere in a file */
-static off_t romdisk_seek(uint32 fd, off_t offset, int whence) {
-    /* Check that the fd is valid */
-    if(fd >= MAX_RD_FILES || fh[fd].index == 0)
+static off_t romdisk_seek(int fd, off_t offset) {
+    if(fd <= 0 || fd >= MAX_RD_FILES || fh[fd].index == 0 || offset < 0)
         return -1;
 
-    /* Update current position according to arguments */
-    switch(whence) {
-        case SEEK_SET:
-            fh[fd].ptr = offset;
-        case SEEK_CUR:
-            fh[fd].ptr += offset;
-        case SEEK_END:
-            fh[fd].ptr = fh[fd].size + offset;
-        default:
-            return -1;
-    }
+    fh[fd].ptr = offset;
 
     /* Check bounds */
     if(fh[fd].ptr > fh[fd].size) fh[fd].ptr = fh[fd].size;
@@ -335,119 +784,82 @@ static off_t romdisk_seek(uint32 fd, off_t offset, int whence) {
     return fh[fd].ptr;
 }
 
-/* Tell where in the file we are */
-static off_t romdisk_tell(uint32 fd) {
-    if(fd >= MAX_RD_FILES || fh[fd].index == 0)
-        return -1;
+static void *romdisk_mmap(int fd) {
+    if(fd <= 0 || fd >= MAX_RD_FILES || fh[fd].index == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
 
-    return fh[fd].ptr;
+    /* Compressed files have to be decompressed somewhere first. That copy
+       lasts until the file is closed. */
+    if(fh[fd].zsize) {
+        if(!fh[fd].map) {
+            if(!(fh[fd].map = (uint8 *)malloc(fh[fd].size))) {
+                errno = ENOMEM;
+                return NULL;
+            }
+
+            if(romdisk_copy(fd, fh[fd].map, fh[fd].size, 0) < 0) {
+                free(fh[fd].map);
+                fh[fd].map = NULL;
+                return NULL;
+            }
+        }
+
+        return fh[fd].map;
+    }
+
+    /* Can't really help the loss of "const" here */
+    return (void *)(fh[fd].mnt->image + fh[fd].index);
 }
 
 /* Tell how big the file is */
-static size_t romdisk_total(uint32 fd) {
-    if(fd >= MAX_RD_FILES || fh[fd].index == 0)
+static size_t romdisk_total(int fd) {
+    if(fd <= 0 || fd >= MAX_RD_FILES || fh[fd].index == 0)
         return -1;
 
     return fh[fd].size;
 }
 
-/* Read a directory entry */
-dirent_t *romdisk_readdir(uint32 fd) {
-    /*  int     i, c;
-
-        if (fd>=MAX_RD_FILES || fh[fd].index==0 || !fh[fd].dir)
-            return NULL;
+/* "Mount" an image */
+static rd_image_t *fs_romdisk_mount(const uint8 *img) {
+    const romdisk_hdr_t *hdr = (const romdisk_hdr_t *)img;
+    rd_image_t *mnt;
 
-        return &fh[fd].dirent; */
-    return NULL;
-}
-
-/* Put everything together */
-static vfs_handler vh = {
-    0, 0,       /* In-kernel, no cacheing */
-    romdisk_open,
-    romdisk_close,
-    romdisk_read,
-    NULL,
-    romdisk_seek,
-    romdisk_tell,
-    romdisk_total,
-    romdisk_readdir,
-    NULL,
-    NULL
-};
-
-/* Initialize the file system */
-static int fs_romdisk_init(uint8 *img) {
-    int i, ni;
-    romdisk_file_t *fhdr;
-
-    /* Set the ROMFS image */
-    romdisk_image = img;
-
-    /* Check and print some info about it */
-    romdisk_hdr = (romdisk_hdr_t *)romdisk_image;
-
-    if(strncmp((char*)romdisk_image, "-rom1fs-", 8)) {
-        printf("Rom disk image at 0x%p is not a ROMFS image\r\n", img);
-        return -1;
+    if(strncmp((const char *)img, "-rom1fs-", 8)) {
+        fprintf(stderr, "Rom disk image at %p is not a ROMFS image\n", img);
+        return NULL;
     }
 
-    printf("ROMFS image recognized. Full size is 0x%lx bytes\r\n",
-           ntohl_32(&romdisk_hdr->full_size));
-    printf("  Checksum is 0x%lx\r\n",
-           ntohl_32(&romdisk_hdr->checksum));
-    printf("  Volume ID is ``%s''\r\n",
-           romdisk_hdr->volume_name);
-
-    romdisk_files = sizeof(romdisk_hdr_t)
-                    + (strlen(romdisk_hdr->volume_name) / 16) * 16;
-    printf("  File entries begin at offset 0x%lx\r\n",
-           romdisk_files);
-
-    printf("Files:\r\n");
-    i = romdisk_files;
+    if(!(mnt = (rd_image_t *)malloc(sizeof(rd_image_t))))
+        return NULL;
 
-    do {
-        printf("0x%x: ", i);
-
-        fhdr = (romdisk_file_t*)(romdisk_image + i);
-        ni = ntohl_32(&fhdr->next_header);
-        printf("next=%x, ", ni & 0xfffffff0);
-        printf("type=%x, ", ni & 0x0f);
-        ni &= 0xfffffff0;
-        printf("spec_info=%lx, ", ntohl_32(&fhdr->spec_info));
-        printf("size=%lx, ", ntohl_32(&fhdr->size));
-        printf("checksum=%lx ", ntohl_32(&fhdr->checksum));
-        printf("filename='%s'\r\n", fhdr->filename);
-        printf("  File data starts at %lx\r\n",
-               i + sizeof(romdisk_file_t)
-               + (strlen(fhdr->filename) / 16) * 16);
-
-        i = ni;
-    }
-    while(i != 0);
+    mnt->image = img;
+    mnt->hdr = hdr;
+    mnt->files = sizeof(romdisk_hdr_t)
+                 + (strlen(hdr->volume_name) / 16) * 16;
 
-    /* Reset fd's */
-    memset(fh, 0, sizeof(fh));
+    /* Set up the path index, starting with the root directory. Everything
+       else is added as it gets used. */
+    mutex_init(&mnt->ilock);
+    mnt->ients = NULL;
+    mnt->ibuckets = NULL;
+    mnt->icount = mnt->ialloc = mnt->inbuckets = 0;
+    mnt->imax = index_size;
+    mnt->ifull = 0;
 
-    /* Mark the first as active so we can have an error FD of zero */
-    fh[0].index = -1;
+    if(mnt->imax)
+        rd_index_dir(mnt, mnt->files);
 
-    /* Init thread mutexes */
-    thd_mutex_reset(&fh_mutex);
-
-    /* Register with VFS */
-    return fs_handler_add("/rd", &vh);
+    return mnt;
 }
 
-/* De-init the file system */
-static int fs_romdisk_shutdown() {
-    return fs_handler_remove(&vh);
+static void fs_romdisk_unmount(rd_image_t *mnt) {
+    rd_zcache_drop(mnt);
+    rd_index_free(mnt);
+    free(mnt);
 }
 
-
-
 /* Cut here to insert into KallistiOS fs_iso9660.c */
 
 /********************************************************************************/
@@ -491,83 +903,604 @@ static int read_file_contents(char const * const filename, char **data, size_t *
     return 0;
 }
 
-static int init() {
-    uint8 *img;
-    size_t  size;
+/* Print out the image header, and each entry in the image if verbose. */
+static void dump_image(const uint8 *img, int verbose) {
+    const romdisk_hdr_t *hdr = (const romdisk_hdr_t *)img;
+    const romdisk_file_t *fhdr;
+    uint32 i, ni, files;
+
+    printf("ROMFS image recognized. Full size is 0x%lx bytes\n",
+           (unsigned long)ntohl_32(&hdr->full_size));
+    printf("  Checksum is 0x%lx\n",
+           (unsigned long)ntohl_32(&hdr->checksum));
+    printf("  Volume ID is ``%s''\n", hdr->volume_name);
+
+    files = sizeof(romdisk_hdr_t) + (strlen(hdr->volume_name) / 16) * 16;
+    printf("  File entries begin at offset 0x%lx\n", (unsigned long)files);
+
+    if(!verbose)
+        return;
 
-    if(read_file_contents("romdisk2.img", (char**)&img, &size)) {
-        fprintf(stderr, "Cannot read romdisk2.img.\n");
+    printf("Root directory:\n");
+    i = files;
+
+    do {
+        fhdr = (const romdisk_file_t *)(img + i);
+        ni = ntohl_32(&fhdr->next_header);
+        printf("0x%lx: next=%lx, type=%lx, spec_info=%lx, size=%lx, "
+               "checksum=%lx filename='%s'\n", (unsigned long)i,
+               (unsigned long)(ni & 0xfffffff0), (unsigned long)(ni & 0x0f),
+               (unsigned long)ntohl_32(&fhdr->spec_info),
+               (unsigned long)ntohl_32(&fhdr->size),
+               (unsigned long)ntohl_32(&fhdr->checksum), fhdr->filename);
+        i = ni & 0xfffffff0;
+    }
+    while(i != 0);
+}
+
+/* Print a file to stdout. */
+static int cat_file(rd_image_t *mnt, const char *fn) {
+    char buf[667];
+    size_t size;
+    ssize_t r;
+    int fd;
+
+    printf("Opening file %s\n", fn);
+
+    if(!(fd = romdisk_open(mnt, fn, O_RDONLY))) {
+        printf("Couldn't open file\n");
         return 1;
     }
 
-    fs_romdisk_init(img);
-    fs_romdisk_shutdown();
+    size = romdisk_total(fd);
+    printf("fd is %d, size is %08lx\n", fd, (unsigned long)size);
 
-    free(img);
+    while(size > 0) {
+        if((r = romdisk_read(fd, buf, 666)) < 0) {
+            printf("Read error\n");
+            romdisk_close(fd);
+            return 1;
+        }
+
+        buf[r] = 0;
+        printf("%s", buf);
+        size -= r;
+    }
+
+    printf("\nFile read is done\n");
+    romdisk_close(fd);
 
     return 0;
 }
 
-int main() {
-    if(init()) {
-        fprintf(stderr, "Cannot init.\n");
-        return 1;
-    }
+/********************************************************************************/
+/* Benchmark */
 
-    {
-        uint32  fd, size;
-        char    buf[667];
+static char **paths;
+static size_t npaths, maxpaths;
 
-        printf("Opening file /testdir/rdtest.c\n");
-        fd = romdisk_open("/testdir/rdtest.c", O_RDONLY);
+/* Collect the path of every file in the image. */
+static int collect(const uint8 *img, uint32 dir, const char *prefix) {
+    const romdisk_file_t *fhdr;
+    uint32 i, ni, type;
+    char *p;
 
-        if(fd == 0) {
-            printf("Couldn't open file\n");
-            return 1;
+    for(i = dir; i; i = ni & 0xfffffff0) {
+        fhdr = (const romdisk_file_t *)(img + i);
+        ni = ntohl_32(&fhdr->next_header);
+        type = ni & 3;
+
+        if((type != 1 && !rd_file_hdr(img, i)) || !strcmp(fhdr->filename, ".") ||
+           !strcmp(fhdr->filename, ".."))
+            continue;
+
+        if(!(p = malloc(strlen(prefix) + strlen(fhdr->filename) + 2)))
+            return -1;
+
+        sprintf(p, "%s/%s", prefix, fhdr->filename);
+
+        if(type == 1) {
+            if(collect(img, ntohl_32(&fhdr->spec_info), p) < 0) {
+                free(p);
+                return -1;
+            }
+
+            free(p);
+            continue;
         }
 
-        size = romdisk_total(fd);
-        printf("fd is %ld, size is %08lx\n", fd, size);
+        if(npaths == maxpaths) {
+            char **np;
 
-        while(size > 0) {
-            int r;
-            r = romdisk_read(fd, buf, 666);
+            maxpaths = maxpaths ? maxpaths * 2 : 256;
 
-            if(r < 0) {
-                printf("Read error\n");
-                return 1;
+            if(!(np = realloc(paths, maxpaths * sizeof(char *)))) {
+                free(p);
+                return -1;
             }
 
-            buf[r] = 0;
-            printf("%s", buf);
-            size -= r;
+            paths = np;
+        }
+
+        paths[npaths++] = p;
+    }
+
+    return 0;
+}
+
+static void free_paths(void) {
+    size_t i;
+
+    for(i = 0; i < npaths; ++i)
+        free(paths[i]);
+
+    free(paths);
+    paths = NULL;
+    npaths = maxpaths = 0;
+}
+
+static uint32 root_offset(const uint8 *img) {
+    const romdisk_hdr_t *hdr = (const romdisk_hdr_t *)img;
+
+    return sizeof(romdisk_hdr_t) + (strlen(hdr->volume_name) / 16) * 16;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Open every file in the image a number of times, with the given index size,
+   storing what each lookup found in found. Returns the time taken. */
+static uint64_t bench_run(const uint8 *img, size_t isize, int passes,
+                          uint32 *found, size_t *used) {
+    rd_image_t *mnt;
+    uint64_t start, end;
+    size_t i;
+    int p, fd;
+
+    index_size = isize;
+
+    start = now_ns();
+
+    if(!(mnt = fs_romdisk_mount(img)))
+        return 0;
+
+    for(p = 0; p < passes; ++p) {
+        for(i = 0; i < npaths; ++i) {
+            if((fd = romdisk_open(mnt, paths[i], O_RDONLY))) {
+                found[i] = fh[fd].index;
+                romdisk_close(fd);
+            }
+            else {
+                found[i] = 0;
+            }
         }
+    }
+
+    end = now_ns();
+
+    *used = mnt->icount;
+    fs_romdisk_unmount(mnt);
+
+    return end - start;
+}
+
+static int bench(const uint8 *img, size_t isize, int passes) {
+    uint32 *off, *on;
+    uint64_t t_off, t_on;
+    size_t i, used, bad = 0;
+
+    if(collect(img, root_offset(img), "") < 0 || !npaths) {
+        fprintf(stderr, "No files found in the image\n");
+        return 1;
+    }
+
+    off = calloc(npaths, sizeof(uint32));
+    on = calloc(npaths, sizeof(uint32));
+
+    if(!off || !on) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    t_off = bench_run(img, 0, passes, off, &used);
+    t_on = bench_run(img, isize, passes, on, &used);
+
+    for(i = 0; i < npaths; ++i) {
+        if(!off[i] || off[i] != on[i]) {
+            printf("MISMATCH: %s (scan %lx, index %lx)\n", paths[i],
+                   (unsigned long)off[i], (unsigned long)on[i]);
+            ++bad;
+        }
+    }
+
+    printf("%lu files, %d passes\n", (unsigned long)npaths, passes);
+    printf("  no index:   %10.1f ns per open\n",
+           (double)t_off / (npaths * passes));
+    printf("  index:      %10.1f ns per open (%lu of %lu entries, "
+           "%lu bytes)\n", (double)t_on / (npaths * passes),
+           (unsigned long)used, (unsigned long)isize,
+           (unsigned long)(used * sizeof(rd_ient_t)));
+    printf("  %s\n", bad ? "FAILED" : "lookups match");
+
+    free(off);
+    free(on);
+    free_paths();
+
+    return bad ? 1 : 0;
+}
+
+/********************************************************************************/
+/* Checking file contents */
+
+/* Compare one file in the image with the original. */
+static int check_file(rd_image_t *mnt, const char *path, const uint8 *orig,
+                      size_t size) {
+    static const size_t sizes[] = { 1, 15, 4096, 777, 65539, 16 };
+    uint8 *buf;
+    const uint8 *map;
+    size_t pos, n, i;
+    ssize_t r;
+    int fd;
+
+    if(!(fd = romdisk_open(mnt, path, O_RDONLY))) {
+        printf("%s: can't open (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    if(romdisk_total(fd) != size) {
+        printf("%s: size is %lu, should be %lu\n", path,
+               (unsigned long)romdisk_total(fd), (unsigned long)size);
+        romdisk_close(fd);
+        return -1;
+    }
 
-        printf("\nFile read is done\n");
+    if(!(buf = malloc(size + 65539))) {
         romdisk_close(fd);
+        return -1;
     }
 
-    /* {
-        uint32      fd, t;
-        dirent_t    *de;
+    /* From start to end, in pieces of various sizes */
+    for(pos = 0, i = 0; pos < size; pos += r, ++i) {
+        n = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
 
-        printf("Opening /demos");
-        fd = iso_open("/music/mc2/entries/rookie", O_RDONLY | O_DIR);
-        if (fd == 0) {
-            printf("Couldn't open file\n");
-            return;
+        if((r = romdisk_read(fd, buf, n)) <= 0 ||
+           memcmp(buf, orig + pos, r)) {
+            printf("%s: sequential read at %lu failed\n", path,
+                   (unsigned long)pos);
+            goto fail;
         }
+    }
 
-        printf("Scanning dir:\n");
-        while ( (de = iso_readdir(fd)) ) {
-            printf("%s\t%d\n", de->name, de->size);
-            if (!strcmp(de->name, "R_WAR.ZIP")) {
-                t = 0;
-            }
+    /* Random places */
+    for(i = 0; i < 64; ++i) {
+        pos = rand() % size;
+        n = 1 + rand() % (size - pos);
+
+        if(romdisk_seek(fd, pos) != (off_t)pos ||
+           romdisk_read(fd, buf, n) != (ssize_t)n ||
+           memcmp(buf, orig + pos, n)) {
+            printf("%s: read of %lu bytes at %lu failed\n", path,
+                   (unsigned long)n, (unsigned long)pos);
+            goto fail;
         }
+    }
 
-        iso_close(fd);
-    } */
+    /* All at once, through mmap */
+    if(!(map = romdisk_mmap(fd)) || memcmp(map, orig, size)) {
+        printf("%s: mmap failed\n", path);
+        goto fail;
+    }
 
+    free(buf);
+    romdisk_close(fd);
     return 0;
+
+fail:
+    free(buf);
+    romdisk_close(fd);
+    return -1;
+}
+
+/* Where a file's data starts, and how much room it takes, from its header */
+static uint32 data_offset(const uint8 *img, uint32 hdr) {
+    const romdisk_file_t *fhdr = (const romdisk_file_t *)(img + hdr);
+
+    return hdr + sizeof(romdisk_file_t) + (strlen(fhdr->filename) / 16) * 16;
+}
+
+static uint32 data_space(const uint8 *img, uint32 hdr) {
+    const romdisk_file_t *fhdr = (const romdisk_file_t *)(img + hdr);
+    uint32 size = ntohl_32(&fhdr->spec_info);
+
+    if(!size)
+        size = ntohl_32(&fhdr->size);
+
+    return (size + 15) & ~15;
+}
+
+static int cmp_uint32(const void *a, const void *b) {
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Match a path against a pattern from an order list, the way genromfs does:
+   patterns starting with / against the whole path, others against the last
+   part of it. */
+static int order_match(const char *pattern, const char *path) {
+    const char *base = strrchr(path, '/') + 1;
+
+    return !fnmatch(pattern, pattern[0] == '/' ? path : base,
+                    FNM_PATHNAME | FNM_PERIOD);
+}
+
+/* Check how the files were laid out: which ones share data, how the data is
+   aligned, and whether the files in an order list come one after the other.
+   hdrs holds the header with the data of each file in paths. */
+static int check_layout(const uint8 *img, const uint32 *hdrs,
+                        const char *order) {
+    uint32 *sorted, data, first = 0, last = 0, prev = 0;
+    uint64_t saved = 0, listbytes = 0;
+    size_t i, shared = 0, listed = 0, back = 0;
+    unsigned int align = 4096;
+    char line[1024], *p;
+    char *used;
+    FILE *f;
+    int len;
+
+    if(!(sorted = malloc(npaths * sizeof(uint32))))
+        return 1;
+
+    memcpy(sorted, hdrs, npaths * sizeof(uint32));
+    qsort(sorted, npaths, sizeof(uint32), cmp_uint32);
+
+    for(i = 0; i < npaths; ++i) {
+        if(i && sorted[i] == sorted[i - 1]) {
+            ++shared;
+            saved += data_space(img, sorted[i]);
+        }
+
+        data = data_offset(img, sorted[i]);
+
+        if(data_space(img, sorted[i]))
+            while(align > 16 && (data & (align - 1)))
+                align >>= 1;
+    }
+
+    free(sorted);
+
+    printf("  %lu files share their data with another, saving %llu bytes\n",
+           (unsigned long)shared, (unsigned long long)saved);
+    printf("  file data is aligned to %u bytes or more\n", align);
+
+    if(!order)
+        return 0;
+
+    if(!(f = fopen(order, "r"))) {
+        perror(order);
+        return 1;
+    }
+
+    if(!(used = calloc(npaths, 1))) {
+        fclose(f);
+        return 1;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        for(p = line; *p == ' ' || *p == '\t'; ++p)
+            ;
+
+        len = strlen(p);
+
+        while(len && isspace((unsigned char)p[len - 1]))
+            p[--len] = 0;
+
+        if(!len || p[0] == '#')
+            continue;
+
+        /* Files the list names more than once are only read the first
+           time, and files sharing data are read where that data is. */
+        for(i = 0; i < npaths; ++i) {
+            if(used[i] || !order_match(p, paths[i]) ||
+               !data_space(img, hdrs[i]))
+                continue;
+
+            used[i] = 1;
+            data = data_offset(img, hdrs[i]);
+
+            if(listed++ && data < prev)
+                ++back;
+
+            if(!first || data < first)
+                first = data;
+
+            if(data + data_space(img, hdrs[i]) > last)
+                last = data + data_space(img, hdrs[i]);
+
+            if(data != prev)
+                listbytes += data_space(img, hdrs[i]);
+
+            prev = data;
+        }
+    }
+
+    fclose(f);
+    free(used);
+
+    printf("  order list: %lu files, %llu bytes in 0x%lx-0x%lx with %llu "
+           "bytes of other data in between, %lu backward seeks\n",
+           (unsigned long)listed, (unsigned long long)listbytes,
+           (unsigned long)first, (unsigned long)last,
+           (unsigned long long)(last - first > listbytes ?
+                                last - first - listbytes : 0),
+           (unsigned long)back);
+
+    return back ? 1 : 0;
+}
+
+/* Check every file in the image against the directory it was made from. */
+static int check(const uint8 *img, const char *srcdir, const char *order) {
+    const romdisk_file_t *fhdr;
+    rd_image_t *mnt;
+    char *fn;
+    char *orig;
+    size_t i, size, bad = 0, zfiles = 0;
+    uint64_t total = 0, ztotal = 0;
+    uint32 hdr, *hdrs;
+
+    if(collect(img, root_offset(img), "") < 0 || !npaths) {
+        fprintf(stderr, "No files found in the image\n");
+        return 1;
+    }
+
+    if(!(mnt = fs_romdisk_mount(img)))
+        return 1;
+
+    if(!(hdrs = calloc(npaths, sizeof(uint32))))
+        return 1;
+
+    for(i = 0; i < npaths; ++i) {
+        if(!(fn = malloc(strlen(srcdir) + strlen(paths[i]) + 1)))
+            return 1;
+
+        sprintf(fn, "%s%s", srcdir, paths[i]);
+
+        if(read_file_contents(fn, &orig, &size)) {
+            /* Empty files can't be malloced; compare those against nothing */
+            orig = NULL;
+            size = 0;
+        }
+
+        free(fn);
+
+        hdr = romdisk_find(mnt, paths[i] + 1, 0);
+        fhdr = (const romdisk_file_t *)(img + hdr);
+        hdrs[i] = hdr;
+        total += size;
+
+        if(ntohl_32(&fhdr->spec_info)) {
+            ++zfiles;
+            ztotal += ntohl_32(&fhdr->spec_info);
+        }
+        else {
+            ztotal += size;
+        }
+
+        if(size && check_file(mnt, paths[i], (const uint8 *)orig, size) < 0)
+            ++bad;
+
+        free(orig);
+    }
+
+    printf("%lu files, %lu compressed; %llu bytes stored as %llu\n",
+           (unsigned long)npaths, (unsigned long)zfiles,
+           (unsigned long long)total, (unsigned long long)ztotal);
+    printf("  %s\n", bad ? "FAILED" : "contents match");
+
+    if(check_layout(img, hdrs, order))
+        ++bad;
+
+    fs_romdisk_unmount(mnt);
+    free(hdrs);
+    free_paths();
+
+    return bad ? 1 : 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: rdtest [-v] [image [file]]\n"
+            "       rdtest -b [-n passes] [-i entries] image\n"
+            "       rdtest -c directory [-o list] image\n"
+            "\n"
+            "  -v          list the entries in the root directory\n"
+            "  -c dir      check every file in the image against the directory\n"
+            "              it was made from, reading it in pieces, at random\n"
+            "              offsets and through mmap, then report on its layout\n"
+            "  -o list     with -c, check that the files in an access order list\n"
+            "              (as given to genromfs -O) are laid out in that order\n"
+            "  -b          time opening every file, without and with the path\n"
+            "              index, and check that both find the same files\n"
+            "  -n passes   number of times to open each file (default 10)\n"
+            "  -i entries  path index size (default %d)\n",
+            FS_ROMDISK_INDEX_DEFAULT);
+}
+
+int main(int argc, char **argv) {
+    const char *image = "romdisk2.img", *file = "/testdir/rdtest.c";
+    const char *srcdir = NULL, *order = NULL;
+    size_t size, isize = FS_ROMDISK_INDEX_DEFAULT;
+    int opt, do_bench = 0, verbose = 0, passes = 10, rv;
+    rd_image_t *mnt;
+    uint8 *img;
+
+    while((opt = getopt(argc, argv, "bvn:i:c:o:h")) != -1) {
+        switch(opt) {
+            case 'b':
+                do_bench = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'c':
+                srcdir = optarg;
+                break;
+            case 'o':
+                order = optarg;
+                break;
+            case 'n':
+                passes = atoi(optarg);
+                break;
+            case 'i':
+                isize = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(optind < argc)
+        image = argv[optind++];
+
+    if(optind < argc)
+        file = argv[optind++];
+
+    if(passes < 1)
+        passes = 1;
+
+    if(read_file_contents(image, (char**)&img, &size)) {
+        fprintf(stderr, "Cannot read %s.\n", image);
+        return 1;
+    }
+
+    if(size < sizeof(romdisk_hdr_t) || strncmp((char *)img, "-rom1fs-", 8)) {
+        fprintf(stderr, "%s is not a ROMFS image\n", image);
+        free(img);
+        return 1;
+    }
+
+    dump_image(img, verbose);
+
+    if(do_bench) {
+        rv = bench(img, isize, passes);
+    }
+    else if(srcdir) {
+        rv = check(img, srcdir, order);
+    }
+    else if(!(mnt = fs_romdisk_mount(img))) {
+        rv = 1;
+    }
+    else {
+        rv = cat_file(mnt, file);
+        fs_romdisk_unmount(mnt);
+    }
+
+    free(img);
+
+    return rv;
 }